@@ -0,0 +1,605 @@
+/*
+ * Ahead-of-time recompiler
+ *
+ * The emitter takes the blocks cfg_build finds from the entry point and cuts
+ * them further after every instruction that has to leave compiled code: BR,
+ * JMP, JSR/JSRR and TRAP, and a load whose constant address is M_KBSR. Each
+ * piece becomes a C function that loads the guest registers it touches into
+ * locals, runs the instructions on them and, at its single exit, subtracts
+ * the instructions it retired from vm->remaining and writes back the
+ * registers it changed. A block that branches back to its own start loops
+ * inside the function while the budget lasts.
+ *
+ * Anything with side effects goes through the same code as the interpreters:
+ * a load that turns out to hit M_KBSR and every TRAP write back the state,
+ * call the op_* function for the instruction with the PC already advanced,
+ * and return; stores go through aot_store, which is write_to_memory plus a
+ * check that the store did not overwrite compiled code. Those words are
+ * marked for the code tracking in smc.h, so a store into them drops the block
+ * from the dispatch table and, if the running block was hit, returns from it
+ * at once; the dropped code is interpreted from then on.
+ */
+
+#include <stdlib.h>
+
+#include "aot.h"
+#include "cfg.h"
+#include "decode.h"
+#include "disasm.h"
+#include "opcode.h"
+#include "output.h"
+#include "smc.h"
+
+#define SEGMENT_GAP 8             /* zero words merged into a segment */
+
+struct aot
+{
+  aot_block blocks[UINT16_MAX + 1];
+  uint16_t len[UINT16_MAX + 1];
+  uint32_t owner[UINT16_MAX + 1]; /* start + 1 of the block holding each
+                                     word, or 0 */
+  int overwritten;                /* set by aot_invalidate */
+};
+
+/*
+* Emitter
+-----------------------------
+*/
+
+/* what a block needs in locals */
+struct block_use
+{
+  uint8_t regs;             /* R0-R7 read or written */
+  uint8_t written;
+  int flags;                /* cc read or written */
+  int flags_written;
+  int address;              /* needs the a temporary */
+};
+
+static uint16_t pc_offset9(uint16_t bits, uint16_t next)
+{
+  return next + get_sign_extension(bits & 0x1FF, 9);
+}
+
+static int ends_block(const uint16_t *memory, uint16_t address)
+/*
+ Instructions after which the generated code always returns to the
+ dispatcher, taken branch or not.
+*/
+{
+  uint16_t bits = memory[address];
+  switch (bits >> 12) {
+    case OP_BR:
+      return ((bits >> 9) & 0x7) != 0;
+    case OP_JMP:
+    case OP_JSR:
+    case OP_TRAP:
+      return 1;
+    case OP_LD:
+    case OP_LDI:
+    case OP_STI:
+      // a constant address of M_KBSR always takes the slow path
+      return pc_offset9(bits, address + 1) == M_KBSR;
+  }
+  return 0;
+}
+
+static void note_use(struct block_use *use, uint16_t bits)
+{
+  uint8_t dr = 1 << ((bits >> 9) & 0x7);
+  uint8_t sr1 = 1 << ((bits >> 6) & 0x7);
+  switch (bits >> 12) {
+    case OP_ADD:
+    case OP_AND:
+      use->regs |= dr | sr1 | (bits & 0x20 ? 0 : 1 << (bits & 0x7));
+      use->written |= dr;
+      use->flags = use->flags_written = 1;
+      break;
+    case OP_NOT:
+    case OP_LDR:
+      use->regs |= dr | sr1;
+      use->written |= dr;
+      use->flags = use->flags_written = 1;
+      use->address |= (bits >> 12) == OP_LDR;
+      break;
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+      use->regs |= dr;
+      use->written |= dr;
+      use->flags = use->flags_written = 1;
+      use->address |= (bits >> 12) == OP_LDI;
+      break;
+    case OP_ST:
+    case OP_STI:
+      use->regs |= dr;
+      break;
+    case OP_STR:
+      use->regs |= dr | sr1;
+      use->address = 1;
+      break;
+    case OP_BR:
+      // BRnzp and the never-taken BR do not look at them
+      use->flags |= ((bits >> 9) & 0x7) != 0 && ((bits >> 9) & 0x7) != 0x7;
+      break;
+    case OP_JMP:
+      use->regs |= sr1;
+      break;
+    case OP_JSR:
+      use->regs |= 1 << R_7 | (bits & 0x0800 ? 0 : sr1);
+      use->written |= 1 << R_7;
+      break;
+  }
+}
+
+static void emit_spill(FILE *out, const struct block_use *use, const char *indent)
+{
+  for (int r = 0; r < R_PC; r++) {
+    if (use->written & (1 << r)) {
+      fprintf(out, "%svm->reg[%d] = r%d;\n", indent, r, r);
+    }
+  }
+  if (use->flags_written) {
+    fprintf(out, "%svm->flag_result = cc;\n", indent);
+  }
+}
+
+static void emit_slow(FILE *out, const struct block_use *use, const char *indent, int count,
+                      uint16_t next, const char *op, uint16_t bits)
+/*
+ Retire the instructions so far, write the state back and let the
+ interpreter's op function run this one.
+*/
+{
+  fprintf(out, "%svm->remaining -= %d;\n", indent, count);
+  emit_spill(out, use, indent);
+  fprintf(out, "%svm->reg[R_PC] = 0x%04X;\n", indent, next);
+  fprintf(out, "%s%s(vm, 0x%04X);\n", indent, op, bits);
+  fprintf(out, "%sreturn 0x%04X;\n", indent, next);
+}
+
+static void emit_store(FILE *out, const char *address, int src, int count, uint16_t next)
+{
+  fprintf(out, "  if (aot_store(vm, %s, r%d)) {\n", address, src);
+  fprintf(out, "    n = %d;\n    next = 0x%04X;\n    goto leave;\n  }\n", count, next);
+}
+
+static void emit_instruction(FILE *out, const struct block_use *use, uint16_t start,
+                             uint16_t len, uint16_t pc, uint16_t bits)
+{
+  uint16_t next = pc + 1;
+  int count = (uint16_t)(next - start);
+  int dr = (bits >> 9) & 0x7;
+  int sr1 = (bits >> 6) & 0x7;
+  char text[64];
+  disassemble(pc, bits, text, sizeof(text));
+  fprintf(out, "  // x%04X  %s\n", pc, text);
+
+  switch (bits >> 12) {
+    case OP_ADD:
+    case OP_AND: {
+      const char *op = (bits >> 12) == OP_ADD ? "+" : "&";
+      if (bits & 0x20) {
+        fprintf(out, "  r%d = r%d %s 0x%04X;\n", dr, sr1, op, get_sign_extension(bits & 0x1F, 5));
+      }
+      else {
+        fprintf(out, "  r%d = r%d %s r%d;\n", dr, sr1, op, bits & 0x7);
+      }
+      fprintf(out, "  cc = r%d;\n", dr);
+      break;
+    }
+    case OP_NOT:
+      fprintf(out, "  r%d = ~r%d;\n  cc = r%d;\n", dr, sr1, dr);
+      break;
+    case OP_LEA:
+      fprintf(out, "  r%d = 0x%04X;\n  cc = r%d;\n", dr, pc_offset9(bits, next), dr);
+      break;
+    case OP_LD:
+      if (pc_offset9(bits, next) == M_KBSR) {
+        emit_slow(out, use, "  ", count, next, "op_ld", bits);
+        return;
+      }
+      fprintf(out, "  r%d = vm->memory[0x%04X];\n  cc = r%d;\n", dr, pc_offset9(bits, next), dr);
+      break;
+    case OP_LDI:
+    case OP_LDR:
+      if ((bits >> 12) == OP_LDI) {
+        if (pc_offset9(bits, next) == M_KBSR) {
+          emit_slow(out, use, "  ", count, next, "op_ldi", bits);
+          return;
+        }
+        fprintf(out, "  a = vm->memory[0x%04X];\n", pc_offset9(bits, next));
+      }
+      else {
+        fprintf(out, "  a = r%d + 0x%04X;\n", sr1, get_sign_extension(bits & 0x3F, 6));
+      }
+      fprintf(out, "  if (a == M_KBSR) {\n");
+      emit_slow(out, use, "    ", count, next, (bits >> 12) == OP_LDI ? "op_ldi" : "op_ldr", bits);
+      fprintf(out, "  }\n  r%d = vm->memory[a];\n  cc = r%d;\n", dr, dr);
+      break;
+    case OP_ST: {
+      char address[16];
+      snprintf(address, sizeof(address), "0x%04X", pc_offset9(bits, next));
+      emit_store(out, address, dr, count, next);
+      break;
+    }
+    case OP_STI: {
+      if (pc_offset9(bits, next) == M_KBSR) {
+        emit_slow(out, use, "  ", count, next, "op_sti", bits);
+        return;
+      }
+      char address[32];
+      snprintf(address, sizeof(address), "vm->memory[0x%04X]", pc_offset9(bits, next));
+      emit_store(out, address, dr, count, next);
+      break;
+    }
+    case OP_STR:
+      fprintf(out, "  a = r%d + 0x%04X;\n", sr1, get_sign_extension(bits & 0x3F, 6));
+      emit_store(out, "a", dr, count, next);
+      break;
+    case OP_BR: {
+      int nzp = (bits >> 9) & 0x7;
+      uint16_t target = pc_offset9(bits, next);
+      if (!nzp) {
+        break;
+      }
+      const char *indent = "  ";
+      if (nzp != (F_N | F_Z | F_P)) {
+        fprintf(out, "  if (cond_flag_of(cc) & 0x%X) {\n", nzp);
+        indent = "    ";
+      }
+      if (target == start) {
+        // a loop on itself: stay in the function while the budget lasts
+        fprintf(out, "%svm->remaining -= %d;\n", indent, len);
+        fprintf(out, "%sif (vm->remaining >= %d) {\n%s  goto top;\n%s}\n", indent, len, indent,
+                indent);
+        fprintf(out, "%sn = 0;\n", indent);
+      }
+      else {
+        fprintf(out, "%sn = %d;\n", indent, count);
+      }
+      fprintf(out, "%snext = 0x%04X;\n%sgoto leave;\n", indent, target, indent);
+      if (nzp != (F_N | F_Z | F_P)) {
+        fprintf(out, "  }\n");
+      }
+      break;
+    }
+    case OP_JMP:
+      fprintf(out, "  n = %d;\n  next = r%d;\n  goto leave;\n", count, sr1);
+      break;
+    case OP_JSR:
+      if (bits & 0x0800) {
+        fprintf(out, "  next = 0x%04X;\n", (uint16_t)(next + get_sign_extension(bits & 0x7FF, 11)));
+      }
+      else {
+        fprintf(out, "  next = r%d;\n", sr1);
+      }
+      fprintf(out, "  r7 = 0x%04X;\n  n = %d;\n  goto leave;\n", next, count);
+      break;
+    case OP_TRAP:
+      emit_slow(out, use, "  ", count, next, "op_trap", bits);
+      break;
+    default:
+      // RTI and the reserved opcode do nothing, as in every engine
+      break;
+  }
+}
+
+static int jumps_to_leave(const uint16_t *memory, uint16_t address)
+/*
+ Instructions that may leave through the block's common exit rather than
+ a slow path of their own.
+*/
+{
+  uint16_t bits = memory[address];
+  switch (bits >> 12) {
+    case OP_BR:
+      return ((bits >> 9) & 0x7) != 0;
+    case OP_JMP:
+    case OP_JSR:
+    case OP_ST:
+    case OP_STR:
+      return 1;
+    case OP_STI:
+      return pc_offset9(bits, address + 1) != M_KBSR;
+  }
+  return 0;
+}
+
+static void emit_block(FILE *out, const uint16_t *memory, uint16_t start, uint16_t len)
+{
+  struct block_use use = {0};
+  int loops = 0, jumps = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    uint16_t pc = start + i;
+    uint16_t bits = memory[pc];
+    note_use(&use, bits);
+    loops |= (bits >> 12) == OP_BR && ((bits >> 9) & 0x7) && pc_offset9(bits, pc + 1) == start;
+    jumps |= jumps_to_leave(memory, pc);
+  }
+  // the slow paths and unconditional exits leave no way to fall off the end
+  uint16_t end = start + len - 1;
+  uint16_t last = memory[end];
+  int falls_off = !ends_block(memory, end)
+                  || ((last >> 12) == OP_BR && ((last >> 9) & 0x7) != 0x7);
+  int leaves = jumps || falls_off;
+
+  fprintf(out, "\nstatic uint16_t block_%04X(struct vm *vm)\n{\n", start);
+  for (int r = 0; r < R_PC; r++) {
+    if (use.regs & (1 << r)) {
+      fprintf(out, "  uint16_t r%d = vm->reg[%d];\n", r, r);
+    }
+  }
+  if (use.flags) {
+    fprintf(out, "  uint32_t cc = vm->flag_result;\n");
+  }
+  if (use.address) {
+    fprintf(out, "  uint16_t a;\n");
+  }
+  if (leaves) {
+    fprintf(out, "  int n;\n  uint16_t next;\n");
+  }
+  if (loops) {
+    fprintf(out, "top:\n");
+  }
+
+  for (uint16_t i = 0; i < len; i++) {
+    uint16_t pc = start + i;
+    emit_instruction(out, &use, start, len, pc, memory[pc]);
+  }
+  if (falls_off) {
+    fprintf(out, "  n = %d;\n  next = 0x%04X;\n", len, (uint16_t)(end + 1));
+  }
+  if (leaves) {
+    fprintf(out, "%s  vm->remaining -= n;\n", jumps ? "leave:\n" : "");
+    emit_spill(out, &use, "  ");
+    fprintf(out, "  return next;\n");
+  }
+  fprintf(out, "}\n");
+}
+
+static int next_segment(const uint16_t *memory, uint32_t *address, uint32_t *first,
+                        uint32_t *last)
+/*
+ The memory image goes out as runs of nonzero words from *address on;
+ vm_create zeroes the rest. Returns 0 past the last one.
+*/
+{
+  while (*address <= UINT16_MAX && !memory[*address]) {
+    (*address)++;
+  }
+  if (*address > UINT16_MAX) {
+    return 0;
+  }
+  *first = *last = *address;
+  for (; *address <= UINT16_MAX && *address - *last <= SEGMENT_GAP; (*address)++) {
+    if (memory[*address]) {
+      *last = *address;
+    }
+  }
+  *address = *last + 1;
+  return 1;
+}
+
+static size_t emit_segments(FILE *out, const uint16_t *memory)
+{
+  uint32_t address = 0, first, last;
+  size_t count = 0;
+  while (next_segment(memory, &address, &first, &last)) {
+    fprintf(out, "\nstatic const uint16_t words_%04X[] = {", first);
+    for (uint32_t i = first; i <= last; i++) {
+      fprintf(out, "%s0x%04X,", (i - first) % 8 ? " " : "\n  ", memory[i]);
+    }
+    fprintf(out, "\n};\n");
+    count++;
+  }
+  fprintf(out, "\nstatic const struct aot_segment segments[] = {\n");
+  address = 0;
+  while (next_segment(memory, &address, &first, &last)) {
+    fprintf(out, "  {0x%04X, %u, words_%04X},\n", first, last - first + 1, first);
+  }
+  fprintf(out, "};\n");
+  return count;
+}
+
+static void emit_string(FILE *out, const char *text)
+{
+  fputc('"', out);
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*text >= ' ' ? *text : '?', out);
+  }
+  fputc('"', out);
+}
+
+int aot_emit(const struct vm *vm, const char *source, FILE *out)
+{
+  struct cfg *cfg = cfg_build(vm, vm->reg[R_PC]);
+  uint16_t *starts = cfg ? malloc((UINT16_MAX + 1) * sizeof(uint16_t)) : NULL;
+  uint16_t *lens = starts ? malloc((UINT16_MAX + 1) * sizeof(uint16_t)) : NULL;
+  if (!lens) {
+    cfg_free(cfg);
+    free(starts);
+    return 0;
+  }
+
+  // the CFG's blocks, cut after every instruction that leaves compiled code;
+  // blocks in or running into the device page are left to the interpreter
+  size_t count = 0;
+  uint32_t instructions = 0;
+  for (size_t b = 0; b < cfg->block_count; b++) {
+    uint32_t start = cfg->blocks[b].start, end = cfg->blocks[b].end;
+    if (end < start || end >= M_KBSR) {
+      continue;
+    }
+    for (uint32_t pc = start; pc <= end; pc++) {
+      if (pc == end || ends_block(vm->memory, pc)) {
+        starts[count] = start;
+        lens[count++] = pc - start + 1;
+        instructions += pc - start + 1;
+        start = pc + 1;
+      }
+    }
+  }
+
+  fprintf(out, "/*\n * ");
+  fprintf(out, "Generated by GarbageEater --aot from %s: %zu blocks, %u instructions\n",
+          source, count, instructions);
+  fprintf(out, " * from x%04X. Build with libgarbageeater.a and its headers, e.g.\n"
+               " *   gcc -O2 -I<GarbageEater> -o program program.c libgarbageeater.a -pthread\n"
+               " */\n\n", vm->reg[R_PC]);
+  fprintf(out, "#include \"aot.h\"\n#include \"opcode.h\"\n#include \"utils.h\"\n");
+  for (size_t i = 0; i < count; i++) {
+    emit_block(out, vm->memory, starts[i], lens[i]);
+  }
+
+  size_t segment_count = emit_segments(out, vm->memory);
+  fprintf(out, "\nstatic const struct aot_entry blocks[] = {\n");
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, "  {0x%04X, %u, block_%04X},\n", starts[i], lens[i], starts[i]);
+  }
+  fprintf(out, "};\n\nstatic const struct aot_program program = {\n  ");
+  emit_string(out, source);
+  fprintf(out, ", 0x%04X, segments, %zu, blocks, %zu\n};\n\n", vm->reg[R_PC], segment_count,
+          count);
+  fprintf(out, "int main(void)\n{\n  return aot_main(&program);\n}\n");
+
+  cfg_free(cfg);
+  free(starts);
+  free(lens);
+  return 1;
+}
+
+/*
+* Runtime
+-----------------------------
+*/
+
+static int aot_invalidate(struct vm *vm, uint16_t address)
+/*
+ Code tracking callback: a store into a compiled block drops it.
+*/
+{
+  struct aot *aot = vm->aot;
+  if (!aot || !aot->owner[address]) {
+    return 0;
+  }
+  uint16_t start = aot->owner[address] - 1;
+  for (uint16_t i = 0; i < aot->len[start]; i++) {
+    aot->owner[(uint16_t)(start + i)] = 0;
+  }
+  aot->blocks[start] = NULL;
+  aot->overwritten = 1;
+  return 1;
+}
+
+int aot_store(struct vm *vm, uint16_t address, uint16_t value)
+{
+  vm->aot->overwritten = 0;
+  write_to_memory(vm, address, value);
+  return vm->aot->overwritten;
+}
+
+void aot_load(struct vm *vm, const struct aot_program *program)
+{
+  for (size_t i = 0; i < program->segment_count; i++) {
+    const struct aot_segment *segment = &program->segments[i];
+    for (uint32_t w = 0; w < segment->count; w++) {
+      vm->memory[(uint16_t)(segment->address + w)] = segment->words[w];
+    }
+  }
+  vm->reg[R_PC] = program->pc;
+  free_engine_caches(vm);
+}
+
+int aot_attach(struct vm *vm, const struct aot_program *program)
+{
+  aot_free(vm);
+  struct aot *aot = calloc(1, sizeof(struct aot));
+  if (!aot) {
+    return 0;
+  }
+  vm->aot = aot;
+  if (!smc_watch(vm, aot_invalidate)) {
+    aot_free(vm);
+    return 0;
+  }
+  for (size_t i = 0; i < program->block_count; i++) {
+    const struct aot_entry *entry = &program->blocks[i];
+    aot->blocks[entry->start] = entry->block;
+    aot->len[entry->start] = entry->len;
+    for (uint16_t w = 0; w < entry->len; w++) {
+      uint16_t address = entry->start + w;
+      aot->owner[address] = entry->start + 1;
+      smc_mark_code(vm, address);
+    }
+  }
+  return 1;
+}
+
+void aot_free(struct vm *vm)
+{
+  free(vm->aot);
+  vm->aot = NULL;
+}
+
+void run_aot(struct vm *vm)
+{
+  struct aot *aot = vm->aot;
+  while (vm->remaining > 0)
+  {
+    uint16_t pc = vm->reg[R_PC];
+    aot_block block = aot->blocks[pc];
+    if (block && vm->remaining >= aot->len[pc]) {
+      vm->reg[R_PC] = block(vm);
+    }
+    else {
+      // not compiled, dropped, or more than the budget left: interpret one
+      struct decoded d;
+      decode_instruction(read_from_memory(vm, vm->reg[R_PC]++), &d);
+      vm->remaining--;
+      d.handler(vm, &d);
+    }
+  }
+}
+
+int aot_main(const struct aot_program *program)
+{
+  struct vm *vm = vm_create();
+  if (!vm) {
+    fprintf(stderr, "Error: out of memory\n");
+    return EXIT_FAILURE;
+  }
+  aot_load(vm, program);
+  if (!aot_attach(vm, program)) {
+    fprintf(stderr, "Error: out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  install_interrupt_handler();
+  disable_input_buffering();
+  struct output_policy policy = {0, OUTPUT_FLUSH_USEC};
+  if (output_start(&policy)) {
+    atexit(output_shutdown);
+  }
+
+  enum vm_stop stop;
+  do {
+    stop = vm_run(vm, RUN_SLICE);
+    if (interrupted) {
+      exit_interrupted();
+    }
+  } while (stop == VM_STOP_LIMIT || stop == VM_STOP_INPUT);
+
+  output_shutdown();
+  restore_input_buffering();
+  if (stop == VM_STOP_ILLEGAL) {
+    fprintf(stderr, "Error: illegal trap x%02X at x%04X\n",
+            vm->memory[(uint16_t)(vm->reg[R_PC] - 1)] & 0xFF, (uint16_t)(vm->reg[R_PC] - 1));
+    return EXIT_FAILURE;
+  }
+  // HALT ends the process with status 1, as GarbageEater does
+  return stop == VM_STOP_HALT ? 1 : EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "utils.h"
+
+/** ahead-of-time recompilation
+ * aot_emit turns the code reachable from a VM's PC (as cfg_build finds it)
+ * into C: one function per basic block, guest registers and the last flag
+ * result in locals, loads and stores straight to vm->memory, and the
+ * interpreter's own helpers for anything with side effects (read_from_memory
+ * for the keyboard, write_to_memory through aot_store, op_trap). The file
+ * also holds the memory image and a main() that runs it through aot_main, so
+ * compiling it against libgarbageeater.a gives a standalone executable.
+ *
+ * At run time the blocks are attached to a VM and vm_run dispatches to them
+ * by PC. Everything else falls back to the pre-decoded handlers one
+ * instruction at a time until the PC reaches a block again: JMP, RET and
+ * JSRR targets the walk did not find, code past an unknown store, and any
+ * block whose words the guest overwrites, which is dropped for good.
+ **/
+
+typedef uint16_t (*aot_block)(struct vm *vm);
+
+/* a run of memory words, in host byte order */
+struct aot_segment
+{
+  uint16_t address;
+  uint32_t count;
+  const uint16_t *words;
+};
+
+struct aot_entry
+{
+  uint16_t start;
+  uint16_t len;             /* instructions */
+  aot_block block;          /* returns the next PC */
+};
+
+/* what a generated file hands to aot_main */
+struct aot_program
+{
+  const char *source;       /* the image it was made from */
+  uint16_t pc;
+  const struct aot_segment *segments;
+  size_t segment_count;
+  const struct aot_entry *blocks;
+  size_t block_count;
+};
+
+/* write the C for the program loaded in vm, starting at its PC; source is
+ * only quoted in comments. Returns 0 if out of memory. */
+int aot_emit(const struct vm *vm, const char *source, FILE *out);
+
+/* copy the program's memory image into vm and set its PC */
+void aot_load(struct vm *vm, const struct aot_program *program);
+
+/* run the program's blocks instead of vm's engine from the next vm_run on;
+ * vm must hold the code they were compiled from. Loading an image or a
+ * snapshot detaches them, as it drops the other engines' caches. Returns 0
+ * if out of memory. */
+int aot_attach(struct vm *vm, const struct aot_program *program);
+void aot_free(struct vm *vm);
+void run_aot(struct vm *vm);
+
+/* write_to_memory for generated code: nonzero if the store overwrote a
+ * compiled block, which must then return at once */
+int aot_store(struct vm *vm, uint16_t address, uint16_t value);
+
+/* the generated main(): load, attach and run to the end with the terminal
+ * set up as GarbageEater does; returns the process exit status */
+int aot_main(const struct aot_program *program);
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * Headless batch runner
+ *
+ * Runs every job of a manifest (see batch.h) in its own VM on a pool of
+ * worker threads and writes one tab-separated line per job, in manifest
+ * order, to the results file:
+ *
+ *   image  script  stop  instructions  seconds  cpu_seconds  output
+ *
+ * stop is halt, limit, input or illegal, or error if the image or script
+ * could not be read. seconds is the wall time from the job's start to its
+ * end, time spent waiting behind other jobs included, and cpu_seconds the
+ * CPU time its slices took. output is what the guest printed (at most
+ * BATCH_OUTPUT_MAX bytes) with backslash, tab, newline, carriage return and
+ * other non-printable bytes escaped as \\, \t, \n, \r and \xHH so every
+ * job stays on one line.
+ *
+ * Jobs are guests of the scheduler (sched.h), time-sliced so that long jobs
+ * do not hold up short ones; each job has its own VM, script and output
+ * buffer, so throughput scales with the core count. A script that is a FIFO
+ * or a character device is read as it arrives: a job waiting for more keys
+ * is parked on it until the writer sends some or closes it.
+ *
+ * With --simd, consecutive jobs with the same image and limit are cut into
+ * groups of up to SIMD_LANES first, and each worker thread takes one group
+ * at a time and runs it to the end in one simd_run. Their CPU time is split
+ * evenly between the jobs of the group. Jobs with a streamed script are left
+ * out and run on the scheduler once the groups are done.
+ *
+ * Every object image the manifest names is laid out once (vm_image_create)
+ * and mapped copy-on-write into each of its jobs' VMs, so a job holds only
+ * the guest pages it writes; the summary reports how many that was.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "sched.h"
+#include "simd.h"
+#include "snapshot.h"
+#include "utils.h"
+
+#define BATCH_OUTPUT_MAX (1 << 20) /* bytes of guest output kept per job */
+#define BATCH_WINDOW 16            /* jobs per worker in the scheduler at once */
+#define BATCH_STREAM_CHUNK 256     /* bytes read from a streamed script at once */
+
+/* console of one job: keys come from the script, output goes to a buffer */
+struct batch_console
+{
+  const char *input;
+  size_t input_len;
+  size_t input_pos;
+  int fd;              /* streamed script, or -1 if input holds all of it */
+  int fifo;
+  char chunk[BATCH_STREAM_CHUNK];
+  char *output;
+  size_t output_len;
+  size_t output_cap;
+};
+
+struct batch_pool;
+
+struct batch_job
+{
+  const char *image;
+  const char *script;  /* NULL for no input */
+  uint64_t limit;
+
+  const struct vm_image *shared; /* NULL to load the image itself */
+
+  struct batch_pool *pool;
+  struct vm *vm;
+  char *script_data;
+  struct batch_console console;
+  struct sched_guest guest;
+
+  struct timespec started;
+  const char *stop;
+  uint64_t instructions;
+  double seconds;
+  double cpu_seconds;
+  long dirty_pages;    /* of guest memory when it ended, -1 if unknown */
+};
+
+static int console_key_ready(void *ctx)
+{
+  struct batch_console *console = ctx;
+  if (console->input_pos < console->input_len) {
+    return 1;
+  }
+  if (console->fd < 0) {
+    // the script is all the input the job will ever get
+    return -1;
+  }
+  ssize_t got = read(console->fd, console->chunk, sizeof(console->chunk));
+  if (got > 0) {
+    console->input = console->chunk;
+    console->input_len = got;
+    console->input_pos = 0;
+    return 1;
+  }
+  if (got < 0) {
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  }
+  if (console->fifo) {
+    // a FIFO also reads empty before any writer opened it; only a hang-up
+    // means the writer has been and gone
+    struct pollfd pfd = {console->fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP) ? -1 : 0;
+  }
+  return -1;
+}
+
+static int console_read_key(void *ctx)
+{
+  struct batch_console *console = ctx;
+  if (console->input_pos >= console->input_len) {
+    return EOF;
+  }
+  return (unsigned char)console->input[console->input_pos++];
+}
+
+static void console_write(void *ctx, const char *buf, size_t len)
+{
+  struct batch_console *console = ctx;
+  if (len > BATCH_OUTPUT_MAX - console->output_len) {
+    len = BATCH_OUTPUT_MAX - console->output_len;
+  }
+  if (console->output_len + len > console->output_cap) {
+    size_t cap = console->output_cap ? console->output_cap * 2 : 4096;
+    while (cap < console->output_len + len) {
+      cap *= 2;
+    }
+    char *output = realloc(console->output, cap);
+    if (!output) {
+      return;
+    }
+    console->output = output;
+    console->output_cap = cap;
+  }
+  memcpy(console->output + console->output_len, buf, len);
+  console->output_len += len;
+}
+
+static void console_flush(void *ctx)
+{
+}
+
+static char *read_file(const char *path, size_t *size)
+/*
+ Read a whole file into a NUL-terminated buffer. Returns NULL and prints an
+ error if it cannot be read.
+*/
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Error: Could not find file %s\n", path);
+    return NULL;
+  }
+  size_t cap = 4096, len = 0;
+  char *data = malloc(cap);
+  while (data) {
+    len += fread(data + len, 1, cap - len - 1, file);
+    if (len < cap - 1) {
+      break;
+    }
+    cap *= 2;
+    char *grown = realloc(data, cap);
+    if (!grown) {
+      free(data);
+    }
+    data = grown;
+  }
+  fclose(file);
+  if (!data) {
+    return NULL;
+  }
+  data[len] = '\0';
+  *size = len;
+  return data;
+}
+
+static int open_script(struct batch_job *job)
+/*
+ A FIFO or device is streamed; anything else is read whole up front.
+*/
+{
+  struct batch_console *console = &job->console;
+  console->fd = -1;
+  if (!job->script) {
+    return 1;
+  }
+  struct stat info;
+  if (stat(job->script, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode))) {
+    console->fd = open(job->script, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    console->fifo = S_ISFIFO(info.st_mode);
+    if (console->fd < 0) {
+      fprintf(stderr, "Error: Could not find file %s\n", job->script);
+    }
+    return console->fd >= 0;
+  }
+  job->script_data = read_file(job->script, &console->input_len);
+  console->input = job->script_data;
+  return job->script_data != NULL;
+}
+
+static void end_job(struct batch_job *job)
+{
+  vm_destroy(job->vm);
+  job->vm = NULL;
+  free(job->script_data);
+  job->script_data = NULL;
+  if (job->console.fd >= 0) {
+    close(job->console.fd);
+    job->console.fd = -1;
+  }
+}
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int start_job(struct batch_job *job, const struct batch_options *options)
+/*
+ Set up the job's VM and console. Returns 0 if the job ends with an error
+ before it runs.
+*/
+{
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+  job->stop = "error";
+  job->vm = vm_create();
+  int loaded = job->vm && open_script(job)
+               && (job->shared ? vm_map_image(job->vm, job->shared)
+                               : read_program_code_into_memory(job->vm, job->image));
+  if (!loaded) {
+    end_job(job);
+    return 0;
+  }
+  struct vm_io io = {
+    &job->console, console_key_ready, console_read_key, console_write,
+    console_flush, NULL
+  };
+  vm_set_io(job->vm, &io);
+  vm_set_engine(job->vm, options->engine);
+  job->vm->fuse = options->fuse;
+  job->vm->idle_detection = options->idle_detection;
+  vm_set_strict(job->vm, options->strict);
+  return 1;
+}
+
+struct batch_pool
+{
+  struct batch_job *jobs;
+  size_t count;
+  size_t next;
+  const struct batch_options *options;
+  struct sched *sched;
+};
+
+static void finish_job(struct sched_guest *guest);
+
+static void admit_next(struct batch_pool *pool)
+/*
+ Hand the scheduler the next job that can start. Every VM holds its memory
+ and engine caches until it finishes, so only BATCH_WINDOW jobs per worker
+ are in the scheduler at once; each one that finishes lets the next in.
+*/
+{
+  size_t i;
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+    struct batch_job *job = &pool->jobs[i];
+    if (job->stop) {
+      // ran in a simd group
+      continue;
+    }
+    job->pool = pool;
+    if (start_job(job, pool->options)) {
+      job->guest.vm = job->vm;
+      job->guest.input_fd = job->console.fd;
+      job->guest.limit = job->limit;
+      job->guest.done = finish_job;
+      job->guest.user = job;
+      sched_add(pool->sched, &job->guest);
+      return;
+    }
+  }
+}
+
+static void finish_job(struct sched_guest *guest)
+/*
+ Called by the scheduler when a job's guest stops for good; only the
+ results and the output buffer outlive it.
+*/
+{
+  struct batch_job *job = guest->user;
+  job->stop = vm_stop_name(guest->stop);
+  job->instructions = vm_instructions(job->vm);
+  job->seconds = seconds_since(&job->started);
+  job->cpu_seconds = guest->cpu_ns / 1e9;
+  job->dirty_pages = vm_dirty_pages(job->vm);
+  end_job(job);
+  admit_next(job->pool);
+}
+
+static int is_streamed(const char *script)
+{
+  struct stat info;
+  return script && stat(script, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode));
+}
+
+struct simd_pool
+{
+  struct batch_job *jobs;
+  size_t count;
+  size_t next;
+  const struct batch_options *options;
+  pthread_mutex_t lock;
+  size_t groups;
+};
+
+static int claim_group(struct simd_pool *pool, struct batch_job **group, size_t *size)
+/*
+ Take the next run of jobs that share an image and a limit, leaving out the
+ streamed ones, which may be all of them. Returns 0 when every job is taken.
+*/
+{
+  size_t n = 0;
+  pthread_mutex_lock(&pool->lock);
+  int more = pool->next < pool->count;
+  while (pool->next < pool->count && n < SIMD_LANES) {
+    struct batch_job *job = &pool->jobs[pool->next];
+    if (n && (strcmp(job->image, group[0]->image) != 0 || job->limit != group[0]->limit)) {
+      break;
+    }
+    pool->next++;
+    if (!is_streamed(job->script)) {
+      group[n++] = job;
+    }
+  }
+  if (n) {
+    pool->groups++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  *size = n;
+  return more;
+}
+
+static void run_group(struct batch_job **group, size_t size, const struct batch_options *options)
+/*
+ One simd_run to the end. The scripts are read whole, so a job that stops
+ for input has used its script up and is finished, as on the scheduler.
+*/
+{
+  struct batch_job *jobs[SIMD_LANES];
+  struct vm *vms[SIMD_LANES];
+  enum vm_stop stops[SIMD_LANES];
+  int count = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (start_job(group[i], options)) {
+      jobs[count] = group[i];
+      vms[count++] = group[i]->vm;
+    }
+  }
+  if (!count) {
+    return;
+  }
+
+  uint64_t limit = jobs[0]->limit ? jobs[0]->limit : UINT64_MAX;
+  struct timespec start, end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  int ran = simd_run(vms, count, limit, stops);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  for (int i = 0; i < count; i++) {
+    struct batch_job *job = jobs[i];
+    job->stop = ran ? vm_stop_name(stops[i]) : "error";
+    job->instructions = vm_instructions(job->vm);
+    job->seconds = seconds_since(&job->started);
+    job->cpu_seconds = seconds / count;
+    job->dirty_pages = vm_dirty_pages(job->vm);
+    end_job(job);
+  }
+}
+
+static void *simd_worker(void *arg)
+{
+  struct simd_pool *pool = arg;
+  struct batch_job *group[SIMD_LANES];
+  size_t size;
+  while (claim_group(pool, group, &size)) {
+    run_group(group, size, pool->options);
+  }
+  return NULL;
+}
+
+static size_t run_simd_groups(struct batch_job *jobs, size_t count,
+                              const struct batch_options *options, long workers)
+/*
+ Run every job that can be grouped on workers threads. Returns the number
+ of groups.
+*/
+{
+  struct simd_pool pool = {jobs, count, 0, options, PTHREAD_MUTEX_INITIALIZER, 0};
+  pthread_t threads[workers];
+  long started = 0;
+  while (started < workers
+         && pthread_create(&threads[started], NULL, simd_worker, &pool) == 0) {
+    started++;
+  }
+  if (!started) {
+    simd_worker(&pool);
+  }
+  for (long i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return pool.groups;
+}
+
+static size_t parse_manifest(char *manifest, struct batch_job **jobs_out)
+/*
+ Split the manifest in place into jobs. Returns the number of jobs; the
+ strings point into manifest.
+*/
+{
+  size_t count = 0, cap = 64;
+  struct batch_job *jobs = malloc(cap * sizeof(*jobs));
+  char *line_state;
+  for (char *line = strtok_r(manifest, "\n", &line_state); line && jobs;
+       line = strtok_r(NULL, "\n", &line_state)) {
+    char *field_state;
+    char *image = strtok_r(line, " \t\r", &field_state);
+    if (!image || image[0] == '#') {
+      continue;
+    }
+    char *script = strtok_r(NULL, " \t\r", &field_state);
+    char *limit = strtok_r(NULL, " \t\r", &field_state);
+
+    if (count == cap) {
+      cap *= 2;
+      struct batch_job *grown = realloc(jobs, cap * sizeof(*jobs));
+      if (!grown) {
+        free(jobs);
+        jobs = NULL;
+        break;
+      }
+      jobs = grown;
+    }
+    struct batch_job *job = &jobs[count++];
+    memset(job, 0, sizeof(*job));
+    job->console.fd = -1;
+    job->image = image;
+    job->script = script && strcmp(script, "-") != 0 ? script : NULL;
+    job->limit = limit ? strtoull(limit, NULL, 10) : 0;
+    job->dirty_pages = -1;
+  }
+  *jobs_out = jobs;
+  return jobs ? count : 0;
+}
+
+static struct vm_image **share_images(struct batch_job *jobs, size_t count, size_t *distinct_out)
+/*
+ Lay out every object image the manifest names once, and point its jobs at
+ it. Snapshots, and images that cannot be read or are malformed, are left to
+ start_job to load (and report) as before. Returns one entry per distinct
+ path, NULL where it is not shared.
+*/
+{
+  const char **paths = malloc(count * sizeof(*paths));
+  struct vm_image **images = malloc(count * sizeof(*images));
+  size_t distinct = 0;
+  for (size_t i = 0; paths && images && i < count; i++) {
+    size_t j = 0;
+    while (j < distinct && strcmp(paths[j], jobs[i].image) != 0) {
+      j++;
+    }
+    if (j == distinct) {
+      size_t size;
+      char *data = read_file(jobs[i].image, &size);
+      paths[distinct] = jobs[i].image;
+      images[distinct++] = NULL;
+      if (data && !(size >= sizeof(SNAPSHOT_MAGIC)
+                    && memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0)) {
+        images[j] = vm_image_create(data, size);
+      }
+      free(data);
+    }
+    jobs[i].shared = images[j];
+  }
+  free(paths);
+  *distinct_out = images ? distinct : 0;
+  return images;
+}
+
+static void write_escaped(FILE *out, const char *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c == '\\') {
+      fputs("\\\\", out);
+    }
+    else if (c == '\t') {
+      fputs("\\t", out);
+    }
+    else if (c == '\n') {
+      fputs("\\n", out);
+    }
+    else if (c == '\r') {
+      fputs("\\r", out);
+    }
+    else if (c < 0x20 || c >= 0x7F) {
+      fprintf(out, "\\x%02X", c);
+    }
+    else {
+      fputc(c, out);
+    }
+  }
+}
+
+static void report_memory(const struct batch_job *jobs, size_t count,
+                          struct vm_image *const *images, size_t distinct)
+/*
+ How much guest memory the jobs wrote, which is what each of them held on
+ its own beyond its VM and engine caches.
+*/
+{
+  size_t shared = 0;
+  for (size_t i = 0; i < distinct; i++) {
+    shared += images[i] != NULL;
+  }
+  size_t measured = 0;
+  long total = 0, most = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (jobs[i].dirty_pages >= 0) {
+      measured++;
+      total += jobs[i].dirty_pages;
+      most = jobs[i].dirty_pages > most ? jobs[i].dirty_pages : most;
+    }
+  }
+  fprintf(stderr, "batch: %zu of %zu images shared copy-on-write", shared, distinct);
+  if (measured) {
+    double kb = sysconf(_SC_PAGESIZE) / 1024.0;
+    fprintf(stderr, "; dirty guest memory per job: mean %.1f KB, max %.1f KB",
+            total * kb / measured, most * kb);
+  }
+  fputc('\n', stderr);
+}
+
+int run_batch(const char *manifest_path, const char *results_path,
+              const struct batch_options *options)
+{
+  size_t manifest_size;
+  char *manifest = read_file(manifest_path, &manifest_size);
+  if (!manifest) {
+    return 1;
+  }
+
+  struct batch_job *jobs;
+  size_t count = parse_manifest(manifest, &jobs);
+  if (!jobs) {
+    free(manifest);
+    return 1;
+  }
+
+  FILE *results = stdout;
+  if (results_path && strcmp(results_path, "-") != 0) {
+    results = fopen(results_path, "w");
+    if (!results) {
+      fprintf(stderr, "Error: cannot write %s\n", results_path);
+      free(jobs);
+      free(manifest);
+      return 1;
+    }
+  }
+
+  long workers = options->jobs;
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers > (long)count) {
+    workers = count;
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  size_t distinct;
+  struct vm_image **images = share_images(jobs, count, &distinct);
+
+  size_t groups = 0;
+  if (options->simd) {
+    groups = run_simd_groups(jobs, count, options, workers);
+  }
+  size_t left = 0;
+  for (size_t i = 0; i < count; i++) {
+    left += !jobs[i].stop;
+  }
+
+  struct batch_pool pool = {jobs, count, 0, options, NULL};
+  int ran = 1;
+  if (left) {
+    pool.sched = sched_create(workers, options->slice);
+    for (long i = 0; pool.sched && i < workers * BATCH_WINDOW; i++) {
+      admit_next(&pool);
+    }
+    ran = pool.sched && sched_run(pool.sched);
+    if (!ran) {
+      fprintf(stderr, "Error: cannot start the scheduler\n");
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fprintf(results, "# image\tscript\tstop\tinstructions\tseconds\tcpu_seconds\toutput\n");
+  for (size_t i = 0; i < count; i++) {
+    struct batch_job *job = &jobs[i];
+    if (job->vm) {
+      // never ran
+      end_job(job);
+      job->stop = "error";
+    }
+    fprintf(results, "%s\t%s\t%s\t%llu\t%.6f\t%.6f\t", job->image,
+            job->script ? job->script : "-", job->stop ? job->stop : "error",
+            (unsigned long long)job->instructions, job->seconds, job->cpu_seconds);
+    write_escaped(results, job->console.output, job->console.output_len);
+    fputc('\n', results);
+    free(job->console.output);
+  }
+  if (results != stdout) {
+    fclose(results);
+  }
+
+  fprintf(stderr, "batch: %zu jobs on %ld workers in %.3f s\n", count, workers,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if (options->simd) {
+    fprintf(stderr, "batch: %zu simd groups of up to %d lanes (%s)\n", groups, SIMD_LANES,
+            simd_unit());
+  }
+  report_memory(jobs, count, images, distinct);
+  if (pool.sched) {
+    sched_report(pool.sched, stderr);
+    sched_destroy(pool.sched);
+  }
+
+  for (size_t i = 0; i < distinct; i++) {
+    vm_image_destroy(images[i]);
+  }
+  free(images);
+  free(jobs);
+  free(manifest);
+  return ran ? 0 : 1;
+}
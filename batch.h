@@ -0,0 +1,32 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "garbageeater.h"
+
+/** headless batch runs
+ * A manifest lists one job per line: image path, keystroke script path (or
+ * "-" for none) and an instruction limit (0 or missing for none), separated
+ * by whitespace. Blank lines and lines starting with '#' are skipped.
+ * Jobs run in their own VM, time-sliced on a pool of worker threads without
+ * touching the terminal; a job ends on HALT, its limit, an illegal trap, or
+ * when the guest wants a key after its script is used up ("input").
+ * With simd set, runs of up to SIMD_LANES consecutive jobs with the same
+ * image and limit run together through simd_run (simd.h) instead, one group
+ * per worker at a time; jobs with a streamed script still go to the
+ * scheduler afterwards.
+ **/
+struct batch_options
+{
+  int jobs;                /* worker threads, 0 for one per online core */
+  enum vm_engine engine;
+  int fuse;
+  int idle_detection;
+  int strict;              /* no extended trap vectors */
+  uint64_t slice;          /* instructions per time slice, 0 for the default */
+  int simd;                /* run jobs of the same image as lanes of simd_run */
+};
+
+int run_batch(const char *manifest_path, const char *results_path,
+              const struct batch_options *options);
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * Interpreter benchmark suite
+ *
+ * Runs a set of deterministic LC-3 kernels on every engine through
+ * libgarbageeater and reports millions of instructions per second, ns per
+ * instruction and the run-to-run spread. Every run of a kernel must retire
+ * the same number of instructions on every engine, so the suite doubles as a
+ * cross-engine consistency check.
+ *
+ *   GarbageEaterBench [--runs=N] [--engine=name] [--save=baseline.json]
+ *                     [--baseline=baseline.json] [--threshold=percent]
+ *
+ * --save writes the results as a JSON baseline; --baseline compares against
+ * one and exits with status 1 if any kernel got slower by more than the
+ * threshold (default 10%). `make bench` and `make bench-baseline` wrap these.
+ * The comparison uses the best of the runs, which is far less sensitive to
+ * other load on the machine than the mean.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "garbageeater.h"
+
+#define BENCH_RUNS 5
+#define BENCH_THRESHOLD 10.0
+#define BENCH_RESULTS_MAX 64
+
+/* hand-assembled instruction encodings */
+#define ADD_R(dr, sr1, sr2) (0x1000 | (dr) << 9 | (sr1) << 6 | (sr2))
+#define ADD_I(dr, sr1, imm) (0x1000 | (dr) << 9 | (sr1) << 6 | 0x20 | ((imm) & 0x1F))
+#define AND_R(dr, sr1, sr2) (0x5000 | (dr) << 9 | (sr1) << 6 | (sr2))
+#define AND_I(dr, sr1, imm) (0x5000 | (dr) << 9 | (sr1) << 6 | 0x20 | ((imm) & 0x1F))
+#define NOT(dr, sr) (0x903F | (dr) << 9 | (sr) << 6)
+#define BRP(off) (0x0200 | ((off) & 0x1FF))
+#define LD(dr, off) (0x2000 | (dr) << 9 | ((off) & 0x1FF))
+#define LEA(dr, off) (0xE000 | (dr) << 9 | ((off) & 0x1FF))
+#define LDR(dr, base, off) (0x6000 | (dr) << 9 | (base) << 6 | ((off) & 0x3F))
+#define STR(sr, base, off) (0x7000 | (sr) << 9 | (base) << 6 | ((off) & 0x3F))
+#define JSR(off) (0x4800 | ((off) & 0x7FF))
+#define RET 0xC1C0
+#define OUT 0xF021
+#define PUTS 0xF022
+#define HALT 0xF025
+
+/* x3000: nested counting loops of register-only arithmetic */
+static const uint16_t alu_kernel[] = {
+  LD(4, 10),          // x3000 R4 = OUTER
+  LD(1, 10),          // x3001 R1 = INNER
+  ADD_I(0, 0, 3),     // x3002
+  AND_I(2, 0, 7),
+  NOT(3, 2),
+  ADD_R(0, 0, 3),
+  ADD_I(1, 1, -1),
+  BRP(-6),            // x3007 -> x3002
+  ADD_I(4, 4, -1),
+  BRP(-9),            // x3009 -> x3001
+  HALT,
+  400,                // OUTER
+  5000                // INNER
+};
+
+/* x3000: read-modify-write over a 4K-word buffer at x4000 with stride 15 */
+static const uint16_t stride_kernel[] = {
+  LD(4, 15),          // x3000 R4 = OUTER
+  LD(5, 16),          // x3001 R5 = BASE
+  LD(6, 16),          // x3002 R6 = MASK
+  AND_I(1, 1, 0),
+  LD(3, 12),          // x3004 R3 = INNER
+  ADD_I(1, 1, 15),    // x3005
+  AND_R(1, 1, 6),
+  ADD_R(2, 5, 1),
+  LDR(0, 2, 0),
+  ADD_I(0, 0, 1),
+  STR(0, 2, 0),
+  ADD_I(3, 3, -1),
+  BRP(-8),            // x300C -> x3005
+  ADD_I(4, 4, -1),
+  BRP(-11),           // x300E -> x3004
+  HALT,
+  300,                // OUTER
+  4000,               // INNER
+  0x4000,             // BASE
+  0x0FFF              // MASK
+};
+
+/* x3000: three-deep JSR/RET chain keeping return addresses on a stack */
+static const uint16_t call_kernel[] = {
+  LD(3, 22),          // x3000 R3 = OUTER
+  LD(6, 23),          // x3001 R6 = STACK
+  LD(4, 21),          // x3002 R4 = INNER
+  JSR(5),             // x3003 -> F1
+  ADD_I(4, 4, -1),
+  BRP(-3),            // x3005 -> x3003
+  ADD_I(3, 3, -1),
+  BRP(-6),            // x3007 -> x3002
+  HALT,
+  ADD_I(6, 6, -1),    // x3009 F1
+  STR(7, 6, 0),
+  JSR(3),             // -> F2
+  LDR(7, 6, 0),
+  ADD_I(6, 6, 1),
+  RET,
+  ADD_I(6, 6, -1),    // x300F F2
+  STR(7, 6, 0),
+  JSR(3),             // -> F3
+  LDR(7, 6, 0),
+  ADD_I(6, 6, 1),
+  RET,
+  ADD_I(0, 0, 1),     // x3015 F3
+  RET,
+  200,                // OUTER
+  3000,               // INNER
+  0x5000              // STACK
+};
+
+/* x3000: OUT and PUTS in a loop */
+static const uint16_t trap_kernel[] = {
+  LD(4, 7),           // x3000 R4 = COUNT
+  LD(0, 7),           // x3001 R0 = CHAR
+  OUT,
+  LEA(0, 6),          // x3003 R0 = MESSAGE
+  PUTS,
+  ADD_I(4, 4, -1),
+  BRP(-6),            // x3006 -> x3001
+  HALT,
+  20000,              // COUNT
+  '*',                // CHAR
+  'h', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd', '\n', 0
+};
+
+struct kernel
+{
+  const char *name;
+  const uint16_t *code;     /* NULL: load image from path */
+  size_t words;
+  const char *path;
+  const char *script;       /* keystrokes for the guest, if any */
+};
+
+static const struct kernel kernels[] = {
+  {"alu", alu_kernel, sizeof(alu_kernel) / 2, NULL, NULL},
+  {"stride", stride_kernel, sizeof(stride_kernel) / 2, NULL, NULL},
+  {"calls", call_kernel, sizeof(call_kernel) / 2, NULL, NULL},
+  {"traps", trap_kernel, sizeof(trap_kernel) / 2, NULL, NULL},
+  {"2048", NULL, 0, "programs/2048.obj", "programs/2048.keys"},
+};
+
+/* headless console: keys from the script, output counted and dropped */
+struct bench_console
+{
+  const char *input;
+  size_t input_len;
+  size_t input_pos;
+  size_t output_len;
+};
+
+static int console_key_ready(void *ctx)
+{
+  struct bench_console *console = ctx;
+  return console->input_pos < console->input_len ? 1 : -1;
+}
+
+static int console_read_key(void *ctx)
+{
+  struct bench_console *console = ctx;
+  if (console->input_pos >= console->input_len) {
+    return EOF;
+  }
+  return (unsigned char)console->input[console->input_pos++];
+}
+
+static void console_write(void *ctx, const char *buf, size_t len)
+{
+  struct bench_console *console = ctx;
+  console->output_len += len;
+}
+
+static void console_flush(void *ctx)
+{
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = malloc(len > 0 ? len : 1);
+  if (data) {
+    *size = fread(data, 1, len, file);
+  }
+  fclose(file);
+  return data;
+}
+
+struct image
+{
+  uint8_t *bytes;
+  size_t size;
+  char *script;
+  size_t script_len;
+};
+
+static int prepare(const struct kernel *kernel, struct image *image)
+/*
+ Build the object image (origin x3000, big-endian) of a built-in kernel or
+ read the image and script of a program kernel. Returns 0 if a file is
+ missing.
+*/
+{
+  memset(image, 0, sizeof(*image));
+  if (kernel->code) {
+    image->size = 2 * (kernel->words + 1);
+    image->bytes = malloc(image->size);
+    if (!image->bytes) {
+      return 0;
+    }
+    image->bytes[0] = 0x30;
+    image->bytes[1] = 0x00;
+    for (size_t i = 0; i < kernel->words; i++) {
+      image->bytes[2 + 2 * i] = kernel->code[i] >> 8;
+      image->bytes[3 + 2 * i] = kernel->code[i] & 0xFF;
+    }
+    return 1;
+  }
+  image->bytes = (uint8_t *)read_file(kernel->path, &image->size);
+  if (kernel->script) {
+    image->script = read_file(kernel->script, &image->script_len);
+  }
+  return image->bytes && (!kernel->script || image->script);
+}
+
+static double run_once(const struct image *image, enum vm_engine engine,
+                       uint64_t *instructions)
+{
+  struct bench_console console = {image->script, image->script_len, 0, 0};
+  struct vm_io io = {
+    &console, console_key_ready, console_read_key, console_write, console_flush, NULL
+  };
+  struct vm *vm = vm_create();
+  vm_set_io(vm, &io);
+  vm_set_engine(vm, engine);
+  vm_load_image(vm, image->bytes, image->size);
+
+  // engine caches are built inside the timed region: that is real cost too
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  vm_run(vm, UINT64_MAX);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  *instructions = vm_instructions(vm);
+  vm_destroy(vm);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+struct result
+{
+  char kernel[32];
+  char engine[16];
+  uint64_t instructions;
+  double mips;              /* mean over the runs */
+  double best_mips;
+  double ns_per_instruction;
+  double stddev_percent;
+};
+
+static int load_baseline(const char *path, struct result *results)
+/*
+ Read back the JSON written by save_baseline: one result object per line.
+ Returns the number of results, or -1 if the file cannot be read.
+*/
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  char line[512];
+  int count = 0;
+  while (count < BENCH_RESULTS_MAX && fgets(line, sizeof(line), file)) {
+    struct result *r = &results[count];
+    unsigned long long instructions;
+    if (sscanf(line, " {\"kernel\": \"%31[^\"]\", \"engine\": \"%15[^\"]\", "
+               "\"instructions\": %llu, \"mips\": %lf, \"best_mips\": %lf",
+               r->kernel, r->engine, &instructions, &r->mips, &r->best_mips) == 5) {
+      r->instructions = instructions;
+      count++;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+static int save_baseline(const char *path, const struct result *results, int count,
+                         int runs)
+{
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return 0;
+  }
+  fprintf(file, "{\n  \"runs\": %d,\n  \"results\": [\n", runs);
+  for (int i = 0; i < count; i++) {
+    const struct result *r = &results[i];
+    fprintf(file, "    {\"kernel\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+            "\"mips\": %.3f, \"best_mips\": %.3f, \"ns_per_instruction\": %.4f, "
+            "\"stddev_percent\": %.2f}%s\n",
+            r->kernel, r->engine, (unsigned long long)r->instructions, r->mips,
+            r->best_mips, r->ns_per_instruction, r->stddev_percent, i + 1 < count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  return fclose(file) == 0;
+}
+
+static const struct result *find(const struct result *results, int count,
+                                 const char *kernel, const char *engine)
+{
+  for (int i = 0; i < count; i++) {
+    if (strcmp(results[i].kernel, kernel) == 0 && strcmp(results[i].engine, engine) == 0) {
+      return &results[i];
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+  int runs = BENCH_RUNS;
+  int only_engine = -1;
+  double threshold = BENCH_THRESHOLD;
+  const char *save_path = NULL;
+  const char *baseline_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--runs=", 7) == 0) {
+      runs = atoi(argv[i] + 7);
+    }
+    else if (strncmp(argv[i], "--engine=", 9) == 0) {
+      for (int e = 0; e < VM_ENGINE_COUNT; e++) {
+        if (strcmp(argv[i] + 9, vm_engine_name(e)) == 0) {
+          only_engine = e;
+        }
+      }
+      if (only_engine < 0) {
+        fprintf(stderr, "Error: unknown engine %s\n", argv[i] + 9);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(argv[i], "--save=", 7) == 0) {
+      save_path = argv[i] + 7;
+    }
+    else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+      baseline_path = argv[i] + 11;
+    }
+    else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+      threshold = atof(argv[i] + 12);
+    }
+    else {
+      fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (runs < 1) {
+    runs = 1;
+  }
+
+  struct result baseline[BENCH_RESULTS_MAX];
+  int baseline_count = 0;
+  if (baseline_path) {
+    baseline_count = load_baseline(baseline_path, baseline);
+    if (baseline_count < 0) {
+      printf("no baseline at %s (make bench-baseline creates one)\n\n", baseline_path);
+      baseline_path = NULL;
+    }
+  }
+
+  struct result results[BENCH_RESULTS_MAX];
+  int count = 0;
+  int regressions = 0;
+  int inconsistent = 0;
+
+  printf("%-8s %-9s %12s %10s %9s %8s%s\n", "kernel", "engine", "instructions",
+         "MIPS", "ns/instr", "stddev", baseline_path ? "  vs baseline" : "");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    struct image image;
+    if (!prepare(&kernels[k], &image)) {
+      printf("%-8s skipped: cannot read %s\n", kernels[k].name, kernels[k].path);
+      free(image.bytes);
+      free(image.script);
+      continue;
+    }
+    uint64_t expected = 0;
+    for (int e = 0; e < VM_ENGINE_COUNT; e++) {
+      if (only_engine >= 0 && e != only_engine) {
+        continue;
+      }
+      double sum = 0, sum_sq = 0, best = 0;
+      uint64_t instructions = 0;
+      // one untimed run first so page faults and cold caches stay out
+      run_once(&image, e, &instructions);
+      for (int run = 0; run < runs; run++) {
+        uint64_t retired;
+        double seconds = run_once(&image, e, &retired);
+        double mips = retired / seconds / 1e6;
+        sum += mips;
+        sum_sq += mips * mips;
+        if (mips > best) {
+          best = mips;
+        }
+        if (expected == 0) {
+          expected = retired;
+        }
+        if (retired != expected) {
+          inconsistent++;
+        }
+        instructions = retired;
+      }
+      struct result *r = &results[count++];
+      snprintf(r->kernel, sizeof(r->kernel), "%s", kernels[k].name);
+      snprintf(r->engine, sizeof(r->engine), "%s", vm_engine_name(e));
+      r->instructions = instructions;
+      r->mips = sum / runs;
+      r->best_mips = best;
+      r->ns_per_instruction = 1e3 / r->mips;
+      double variance = sum_sq / runs - r->mips * r->mips;
+      r->stddev_percent = 100 * sqrt(variance > 0 ? variance : 0) / r->mips;
+
+      printf("%-8s %-9s %12llu %10.2f %9.3f %7.2f%%", r->kernel, r->engine,
+             (unsigned long long)r->instructions, r->mips, r->ns_per_instruction,
+             r->stddev_percent);
+      const struct result *base = baseline_path ? find(baseline, baseline_count, r->kernel, r->engine) : NULL;
+      if (base) {
+        double change = 100 * (r->best_mips - base->best_mips) / base->best_mips;
+        int regressed = change < -threshold;
+        regressions += regressed;
+        printf(" %+7.1f%%%s", change, regressed ? "  REGRESSION" : "");
+      }
+      printf("\n");
+    }
+    free(image.bytes);
+    free(image.script);
+  }
+
+  if (inconsistent) {
+    printf("\nerror: %d runs retired a different instruction count than the first engine\n",
+           inconsistent);
+  }
+  if (baseline_path) {
+    printf("\n%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s",
+           threshold);
+  }
+  if (save_path) {
+    if (!save_baseline(save_path, results, count, runs)) {
+      fprintf(stderr, "Error: cannot write %s\n", save_path);
+      return EXIT_FAILURE;
+    }
+    printf("\nbaseline saved to %s\n", save_path);
+  }
+  return regressions || inconsistent ? 1 : EXIT_SUCCESS;
+}
@@ -0,0 +1,705 @@
+/*
+ * Static control-flow graph
+ *
+ * cfg_build makes two passes over a state byte per address. The first walks
+ * straight-line code from every leader (the entry point and each branch,
+ * call and return-site target) and marks what it reaches; the second cuts
+ * the reached words into blocks at leaders and block-ending instructions.
+ * Loops are natural loops over the dominator tree of the graph without call
+ * edges, computed with Cooper, Harvey and Kennedy's iterative algorithm from
+ * a virtual root above every subroutine entry. Apart from the dominator
+ * iteration, which settles in a few rounds on structured code, every step is
+ * linear in the size of the image.
+ */
+
+#include <stdlib.h>
+
+#include "cfg.h"
+#include "disasm.h"
+#include "opcode.h"
+
+/* per-address state while building */
+enum
+{
+  REACHED = 1 << 0,
+  LEADER = 1 << 1,
+  ENDS = 1 << 2,            /* ends a block: branch, jump, call or trap */
+  ENTRY = 1 << 3,           /* target of a call */
+  RESOLVED = 1 << 4         /* JMP/JSRR whose register the walk worked out */
+};
+
+#define NONE UINT32_MAX
+
+struct successors
+{
+  uint8_t exit;
+  int count;
+  uint16_t target[2];
+  uint8_t kind[2];
+};
+
+struct builder
+{
+  const uint16_t *memory;
+  uint8_t *state;
+  uint16_t *resolved;       /* register targets, where RESOLVED */
+  uint16_t *stack;          /* leaders not walked yet */
+  size_t depth;
+};
+
+static const char *exit_names[CFG_EXIT_COUNT] = {
+  "fallthrough", "branch", "jump", "indirect", "call", "return", "trap", "halt"
+};
+
+const char *cfg_exit_name(enum cfg_exit exit)
+{
+  return exit < CFG_EXIT_COUNT ? exit_names[exit] : "unknown";
+}
+
+static void add_successor(struct successors *out, uint16_t target, int kind)
+{
+  out->target[out->count] = target;
+  out->kind[out->count] = kind;
+  out->count++;
+}
+
+static int decode_exit(const uint16_t *memory, uint16_t address, const uint16_t *known,
+                       struct successors *out)
+/*
+ If the instruction at address ends a block, fill in out and return 1. known
+ is the value of the JMP/JSRR base register if the caller worked it out.
+*/
+{
+  uint16_t bits = memory[address];
+  uint16_t next = address + 1;
+  out->count = 0;
+  switch (bits >> 12) {
+    case OP_BR: {
+      int nzp = (bits >> 9) & 0x7;
+      if (!nzp) {
+        return 0;   // never taken: a NOP
+      }
+      add_successor(out, next + get_sign_extension(bits & 0x1FF, 9), CFG_EDGE_BRANCH);
+      if (nzp == (F_N | F_Z | F_P)) {
+        out->exit = CFG_EXIT_JUMP;
+      }
+      else {
+        out->exit = CFG_EXIT_BRANCH;
+        add_successor(out, next, CFG_EDGE_FALLTHROUGH);
+      }
+      return 1;
+    }
+    case OP_JMP:
+      if (((bits >> 6) & 0x7) == R_7) {
+        out->exit = CFG_EXIT_RETURN;
+      }
+      else if (known) {
+        out->exit = CFG_EXIT_JUMP;
+        add_successor(out, *known, CFG_EDGE_BRANCH);
+      }
+      else {
+        out->exit = CFG_EXIT_INDIRECT;
+      }
+      return 1;
+    case OP_JSR:
+      out->exit = CFG_EXIT_CALL;
+      if (bits & 0x0800) {
+        add_successor(out, next + get_sign_extension(bits & 0x7FF, 11), CFG_EDGE_CALL);
+      }
+      else if (known) {
+        add_successor(out, *known, CFG_EDGE_CALL);
+      }
+      add_successor(out, next, CFG_EDGE_FALLTHROUGH);
+      return 1;
+    case OP_TRAP:
+      switch (bits & 0xFF) {
+        case T_GETC:
+        case T_OUT:
+        case T_PUTS:
+        case T_IN:
+        case T_PUTSP:
+        case T_MUL:
+        case T_DIVMOD:
+        case T_MEMCPY:
+        case T_MEMSET:
+        case T_STRLEN:
+        case T_STRCMP:
+          out->exit = CFG_EXIT_TRAP;
+          add_successor(out, next, CFG_EDGE_FALLTHROUGH);
+          return 1;
+      }
+      out->exit = CFG_EXIT_HALT;
+      return 1;
+  }
+  return 0;
+}
+
+static int resolve_register(const uint16_t *memory, uint16_t address, uint16_t *target)
+/*
+ The LEA-then-JMP and LD-then-JMP idioms: if the word before the JMP/JSRR at
+ address loads its base register, that gives the target.
+*/
+{
+  uint16_t bits = memory[address];
+  uint16_t previous = memory[(uint16_t)(address - 1)];
+  if (((previous >> 9) & 0x7) != ((bits >> 6) & 0x7)) {
+    return 0;
+  }
+  uint16_t pc9 = address + get_sign_extension(previous & 0x1FF, 9);
+  if ((previous >> 12) == OP_LEA) {
+    *target = pc9;
+    return 1;
+  }
+  if ((previous >> 12) == OP_LD) {
+    *target = memory[pc9];
+    return 1;
+  }
+  return 0;
+}
+
+static void add_leader(struct builder *b, uint16_t address)
+{
+  if (!(b->state[address] & (REACHED | LEADER))) {
+    b->stack[b->depth++] = address;
+  }
+  b->state[address] |= LEADER;
+}
+
+static void walk(struct builder *b, uint16_t address)
+/*
+ Mark straight-line code from a leader up to the instruction that ends it,
+ queueing its successors. Running into code already walked makes that word
+ a leader, splitting the block it was in.
+*/
+{
+  int have_previous = 0;
+  for (;;) {
+    if (b->state[address] & REACHED) {
+      b->state[address] |= LEADER;
+      return;
+    }
+    b->state[address] |= REACHED;
+
+    uint16_t bits = b->memory[address];
+    int opcode = bits >> 12;
+    const uint16_t *known = NULL;
+    if (have_previous && (opcode == OP_JMP || (opcode == OP_JSR && !(bits & 0x0800)))
+        && resolve_register(b->memory, address, &b->resolved[address])) {
+      b->state[address] |= RESOLVED;
+      known = &b->resolved[address];
+    }
+    struct successors next;
+    if (decode_exit(b->memory, address, known, &next)) {
+      b->state[address] |= ENDS;
+      for (int i = 0; i < next.count; i++) {
+        if (next.kind[i] == CFG_EDGE_CALL) {
+          b->state[next.target[i]] |= ENTRY;
+        }
+        add_leader(b, next.target[i]);
+      }
+      return;
+    }
+    if (address == UINT16_MAX) {
+      add_leader(b, 0);   // PC wraps around
+      return;
+    }
+    address++;
+    have_previous = 1;
+  }
+}
+
+static int cut_blocks(struct cfg *cfg, struct builder *b)
+/*
+ Second pass: one block per leader, running to the first word that ends a
+ block or comes before another leader; then the edges between them.
+*/
+{
+  size_t count = 0;
+  for (uint32_t a = 0; a <= UINT16_MAX; a++) {
+    count += (b->state[a] & (REACHED | LEADER)) == (REACHED | LEADER);
+  }
+  cfg->blocks = calloc(count ? count : 1, sizeof(*cfg->blocks));
+  cfg->edges = calloc(count ? 2 * count : 1, sizeof(*cfg->edges));
+  if (!cfg->blocks || !cfg->edges) {
+    return 0;
+  }
+
+  for (uint32_t a = 0; a <= UINT16_MAX; a++) {
+    cfg->block_at[a] = -1;
+  }
+  for (uint32_t a = 0; a <= UINT16_MAX; a++) {
+    if ((b->state[a] & (REACHED | LEADER)) != (REACHED | LEADER)) {
+      continue;
+    }
+    uint32_t end = a;
+    while (!(b->state[end] & ENDS) && end < UINT16_MAX && !(b->state[end + 1] & LEADER)) {
+      end++;
+    }
+    struct cfg_block *block = &cfg->blocks[cfg->block_count];
+    block->start = a;
+    block->end = end;
+    for (uint32_t i = a; i <= end; i++) {
+      cfg->block_at[i] = cfg->block_count;
+    }
+    cfg->block_count++;
+    a = end;
+  }
+
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    struct cfg_block *block = &cfg->blocks[i];
+    struct successors next;
+    if (b->state[block->end] & ENDS) {
+      const uint16_t *known = b->state[block->end] & RESOLVED ? &b->resolved[block->end] : NULL;
+      decode_exit(b->memory, block->end, known, &next);
+    }
+    else {
+      next.exit = CFG_EXIT_FALLTHROUGH;
+      next.count = 0;
+      add_successor(&next, block->end + 1, CFG_EDGE_FALLTHROUGH);
+    }
+    block->exit = next.exit;
+    block->first_edge = cfg->edge_count;
+    block->edge_count = next.count;
+    for (int e = 0; e < next.count; e++) {
+      cfg->edges[cfg->edge_count++] = (struct cfg_edge){
+        i, cfg->block_at[next.target[e]], next.kind[e], 0
+      };
+    }
+  }
+  return 1;
+}
+
+static int find_subroutines(struct cfg *cfg, struct builder *b, uint32_t *queue)
+/*
+ The entry point, then call targets by address; each claims the blocks it
+ reaches without following calls that nobody has claimed yet.
+*/
+{
+  size_t count = 1;
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    count += (b->state[cfg->blocks[i].start] & ENTRY) && cfg->blocks[i].start != cfg->entry;
+  }
+  cfg->subroutines = calloc(count, sizeof(*cfg->subroutines));
+  if (!cfg->subroutines) {
+    return 0;
+  }
+  cfg->subroutines[cfg->subroutine_count++].block = cfg->block_at[cfg->entry];
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    if ((b->state[cfg->blocks[i].start] & ENTRY) && cfg->blocks[i].start != cfg->entry) {
+      cfg->subroutines[cfg->subroutine_count++].block = i;
+    }
+  }
+
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    cfg->blocks[i].subroutine = NONE;
+  }
+  for (size_t s = 0; s < cfg->subroutine_count; s++) {
+    struct cfg_subroutine *sub = &cfg->subroutines[s];
+    sub->entry = cfg->blocks[sub->block].start;
+    size_t head = 0, tail = 0;
+    if (cfg->blocks[sub->block].subroutine == NONE) {
+      cfg->blocks[sub->block].subroutine = s;
+      queue[tail++] = sub->block;
+    }
+    while (head < tail) {
+      struct cfg_block *block = &cfg->blocks[queue[head++]];
+      for (uint32_t e = block->first_edge; e < block->first_edge + block->edge_count; e++) {
+        uint32_t to = cfg->edges[e].to;
+        if (cfg->edges[e].kind != CFG_EDGE_CALL && cfg->blocks[to].subroutine == NONE) {
+          cfg->blocks[to].subroutine = s;
+          queue[tail++] = to;
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    struct cfg_block *block = &cfg->blocks[i];
+    if (block->subroutine == NONE) {
+      block->subroutine = 0;   // only reachable by a jump the walk resolved differently
+    }
+    struct cfg_subroutine *sub = &cfg->subroutines[block->subroutine];
+    sub->blocks++;
+    sub->instructions += block->end - block->start + 1;
+    sub->call_sites += block->exit == CFG_EXIT_CALL;
+    sub->returns |= block->exit == CFG_EXIT_RETURN;
+  }
+  return 1;
+}
+
+/* dominator analysis over the call-free graph; node n is the virtual root */
+struct dominators
+{
+  uint32_t *pred_start;     /* CSR predecessor lists */
+  uint32_t *preds;
+  uint32_t *idom;
+  uint32_t *postorder;      /* position in postorder, per node */
+  uint32_t *order;          /* nodes in reverse postorder */
+  uint32_t *pre;            /* dominator tree interval numbering */
+  uint32_t *post;
+  uint8_t *is_root;
+};
+
+static int dominates(const struct dominators *d, uint32_t a, uint32_t b)
+{
+  return d->pre[a] <= d->pre[b] && d->post[b] <= d->post[a];
+}
+
+static uint32_t intersect(const struct dominators *d, uint32_t a, uint32_t b)
+{
+  while (a != b) {
+    while (d->postorder[a] < d->postorder[b]) {
+      a = d->idom[a];
+    }
+    while (d->postorder[b] < d->postorder[a]) {
+      b = d->idom[b];
+    }
+  }
+  return a;
+}
+
+static uint32_t next_successor(const struct cfg *cfg, uint32_t node, uint32_t *i)
+/*
+ The call-free successor of node at or after edge *i, moving *i past it, or
+ NONE after the last. The virtual root's successors are the subroutine
+ entries.
+*/
+{
+  if (node == cfg->block_count) {
+    return *i < cfg->subroutine_count ? cfg->subroutines[(*i)++].block : NONE;
+  }
+  const struct cfg_block *block = &cfg->blocks[node];
+  while (*i < block->edge_count) {
+    const struct cfg_edge *edge = &cfg->edges[block->first_edge + (*i)++];
+    if (edge->kind != CFG_EDGE_CALL) {
+      return edge->to;
+    }
+  }
+  return NONE;
+}
+
+static void compute_dominators(struct cfg *cfg, struct dominators *d, uint32_t *stack,
+                               uint32_t *cursor)
+{
+  size_t n = cfg->block_count;
+  size_t root = n;
+
+  // predecessor lists, counted then filled
+  for (size_t i = 0; i < cfg->edge_count; i++) {
+    if (cfg->edges[i].kind != CFG_EDGE_CALL) {
+      d->pred_start[cfg->edges[i].to + 1]++;
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    d->pred_start[i + 1] += d->pred_start[i];
+    cursor[i] = d->pred_start[i];
+  }
+  for (size_t i = 0; i < cfg->edge_count; i++) {
+    if (cfg->edges[i].kind != CFG_EDGE_CALL) {
+      d->preds[cursor[cfg->edges[i].to]++] = cfg->edges[i].from;
+    }
+  }
+  for (size_t s = 0; s < cfg->subroutine_count; s++) {
+    d->is_root[cfg->subroutines[s].block] = 1;
+  }
+
+  // reverse postorder from an explicit depth-first search; cursor holds
+  // each node's next edge
+  size_t visited = 0;
+  for (size_t i = 0; i <= n; i++) {
+    d->postorder[i] = NONE;
+    cursor[i] = 0;
+  }
+  size_t depth = 0;
+  stack[depth++] = root;
+  d->postorder[root] = 0;   // on the stack
+  while (depth) {
+    uint32_t node = stack[depth - 1];
+    uint32_t next = next_successor(cfg, node, &cursor[node]);
+    if (next == NONE) {
+      d->postorder[node] = visited;
+      d->order[n - visited++] = node;
+      depth--;
+    }
+    else if (d->postorder[next] == NONE) {
+      d->postorder[next] = 0;
+      stack[depth++] = next;
+    }
+  }
+  // blocks only a differently resolved jump leads to were not reached
+  size_t first = n + 1 - visited;
+
+  for (size_t i = 0; i <= n; i++) {
+    d->idom[i] = NONE;
+  }
+  d->idom[root] = root;
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (size_t k = first + 1; k <= n; k++) {
+      uint32_t node = d->order[k];
+      uint32_t idom = d->is_root[node] ? root : NONE;
+      for (uint32_t p = d->pred_start[node]; p < d->pred_start[node + 1]; p++) {
+        uint32_t pred = d->preds[p];
+        if (d->idom[pred] == NONE) {
+          continue;
+        }
+        idom = idom == NONE ? pred : intersect(d, pred, idom);
+      }
+      if (d->idom[node] != idom) {
+        d->idom[node] = idom;
+        changed = 1;
+      }
+    }
+  }
+
+  // number the dominator tree so dominates() is two comparisons: children
+  // lists reuse cursor (first child) and stack (next sibling)
+  for (size_t i = 0; i <= n; i++) {
+    cursor[i] = NONE;
+    d->pre[i] = d->post[i] = NONE;
+  }
+  for (size_t k = n; k > first; k--) {
+    uint32_t node = d->order[k];
+    stack[node] = cursor[d->idom[node]];
+    cursor[d->idom[node]] = node;
+  }
+  uint32_t counter = 0;
+  uint32_t node = root;
+  d->pre[root] = counter++;
+  while (node != NONE) {
+    if (cursor[node] != NONE) {
+      uint32_t child = cursor[node];
+      cursor[node] = stack[child];   // pop the child off the list
+      d->pre[child] = counter++;
+      node = child;
+    }
+    else {
+      d->post[node] = counter++;
+      node = node == root ? NONE : d->idom[node];
+    }
+  }
+}
+
+static int find_loops(struct cfg *cfg, struct dominators *d, uint32_t *mark, uint32_t *work)
+{
+  size_t n = cfg->block_count;
+  for (size_t e = 0; e < cfg->edge_count; e++) {
+    struct cfg_edge *edge = &cfg->edges[e];
+    edge->back = edge->kind != CFG_EDGE_CALL && d->pre[edge->from] != NONE
+                 && dominates(d, edge->to, edge->from);
+  }
+
+  size_t count = 0;
+  for (size_t h = 0; h < n; h++) {
+    for (uint32_t p = d->pred_start[h]; p < d->pred_start[h + 1]; p++) {
+      if (d->pre[d->preds[p]] != NONE && dominates(d, h, d->preds[p])) {
+        count++;
+        break;
+      }
+    }
+  }
+  cfg->loops = calloc(count ? count : 1, sizeof(*cfg->loops));
+  if (!cfg->loops) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    mark[i] = NONE;
+  }
+  for (uint32_t h = 0; h < n; h++) {
+    struct cfg_loop *loop = &cfg->loops[cfg->loop_count];
+    size_t top = 0;
+    for (uint32_t p = d->pred_start[h]; p < d->pred_start[h + 1]; p++) {
+      uint32_t pred = d->preds[p];
+      if (d->pre[pred] != NONE && dominates(d, h, pred)) {
+        loop->back_edges++;
+        if (mark[pred] != cfg->loop_count && pred != h) {
+          mark[pred] = cfg->loop_count;
+          work[top++] = pred;
+        }
+      }
+    }
+    if (!loop->back_edges) {
+      continue;
+    }
+    // the body: everything that reaches a back edge without passing the header
+    loop->header = h;
+    cfg->blocks[h].loop_header = 1;
+    mark[h] = cfg->loop_count;
+    loop->first = cfg->blocks[h].start;
+    loop->last = cfg->blocks[h].end;
+    loop->blocks = 1;
+    loop->instructions = cfg->blocks[h].end - cfg->blocks[h].start + 1;
+    cfg->blocks[h].loop_depth += cfg->blocks[h].loop_depth < UINT8_MAX;
+    while (top) {
+      struct cfg_block *block = &cfg->blocks[work[--top]];
+      loop->blocks++;
+      loop->instructions += block->end - block->start + 1;
+      loop->first = block->start < loop->first ? block->start : loop->first;
+      loop->last = block->end > loop->last ? block->end : loop->last;
+      block->loop_depth += block->loop_depth < UINT8_MAX;
+      uint32_t node = block - cfg->blocks;
+      for (uint32_t p = d->pred_start[node]; p < d->pred_start[node + 1]; p++) {
+        uint32_t pred = d->preds[p];
+        if (mark[pred] != cfg->loop_count && d->pre[pred] != NONE) {
+          mark[pred] = cfg->loop_count;
+          work[top++] = pred;
+        }
+      }
+    }
+    cfg->loop_count++;
+  }
+  for (size_t i = 0; i < cfg->loop_count; i++) {
+    cfg->loops[i].depth = cfg->blocks[cfg->loops[i].header].loop_depth;
+  }
+  return 1;
+}
+
+struct cfg *cfg_build(const struct vm *vm, uint16_t entry)
+{
+  struct cfg *cfg = calloc(1, sizeof(*cfg));
+  struct builder b = {vm->memory};
+  b.state = calloc(UINT16_MAX + 1, 1);
+  b.resolved = malloc((UINT16_MAX + 1) * sizeof(*b.resolved));
+  b.stack = malloc((UINT16_MAX + 1) * sizeof(*b.stack));
+  // scratch for the later passes: one word per block and the virtual root
+  size_t words = UINT16_MAX + 2;
+  uint32_t *scratch[3] = {
+    malloc(words * sizeof(uint32_t)), malloc(words * sizeof(uint32_t)),
+    malloc(words * sizeof(uint32_t))
+  };
+  struct dominators d = {
+    calloc(words + 1, sizeof(uint32_t)), malloc(2 * words * sizeof(uint32_t)),
+    malloc(words * sizeof(uint32_t)), malloc(words * sizeof(uint32_t)),
+    malloc(words * sizeof(uint32_t)), malloc(words * sizeof(uint32_t)),
+    malloc(words * sizeof(uint32_t)), calloc(words, 1)
+  };
+  int ok = cfg && b.state && b.resolved && b.stack && scratch[0] && scratch[1] && scratch[2]
+           && d.pred_start && d.preds && d.idom && d.postorder && d.order && d.pre && d.post
+           && d.is_root;
+
+  if (ok) {
+    cfg->entry = entry;
+    add_leader(&b, entry);
+    while (b.depth) {
+      walk(&b, b.stack[--b.depth]);
+    }
+    ok = cut_blocks(cfg, &b) && find_subroutines(cfg, &b, scratch[0]);
+    if (ok) {
+      compute_dominators(cfg, &d, scratch[0], scratch[1]);
+      ok = find_loops(cfg, &d, scratch[0], scratch[2]);
+    }
+  }
+
+  free(b.state);
+  free(b.resolved);
+  free(b.stack);
+  for (int i = 0; i < 3; i++) {
+    free(scratch[i]);
+  }
+  free(d.pred_start);
+  free(d.preds);
+  free(d.idom);
+  free(d.postorder);
+  free(d.order);
+  free(d.pre);
+  free(d.post);
+  free(d.is_root);
+  if (!ok) {
+    cfg_free(cfg);
+    return NULL;
+  }
+  return cfg;
+}
+
+void cfg_free(struct cfg *cfg)
+{
+  if (!cfg) {
+    return;
+  }
+  free(cfg->blocks);
+  free(cfg->edges);
+  free(cfg->loops);
+  free(cfg->subroutines);
+  free(cfg);
+}
+
+static void write_block(const struct cfg *cfg, const struct vm *vm, uint32_t i, FILE *out)
+{
+  const struct cfg_block *block = &cfg->blocks[i];
+  fprintf(out, "    b%u [label=\"", i);
+  for (uint32_t a = block->start; a <= block->end; a++) {
+    char text[32];
+    disassemble(a, vm->memory[a], text, sizeof(text));
+    fprintf(out, "x%04X  %s\\l", a, text);
+  }
+  if (block->exit == CFG_EXIT_INDIRECT) {
+    fprintf(out, "(indirect jump)\\l");
+  }
+  fprintf(out, "\"%s];\n", block->loop_header ? ", style=bold" : "");
+}
+
+void cfg_write_dot(const struct cfg *cfg, const struct vm *vm, FILE *out)
+{
+  fprintf(out, "digraph cfg {\n");
+  fprintf(out, "  // entry x%04X: %zu blocks, %zu edges, %zu loops, %zu subroutines\n",
+          cfg->entry, cfg->block_count, cfg->edge_count, cfg->loop_count,
+          cfg->subroutine_count);
+  for (size_t i = 0; i < cfg->loop_count; i++) {
+    const struct cfg_loop *loop = &cfg->loops[i];
+    fprintf(out, "  // loop x%04X-x%04X: header x%04X, depth %d, %u back edge%s, "
+            "%u block%s, %u instructions\n", loop->first, loop->last,
+            cfg->blocks[loop->header].start, loop->depth, loop->back_edges,
+            loop->back_edges == 1 ? "" : "s", loop->blocks, loop->blocks == 1 ? "" : "s",
+            loop->instructions);
+  }
+  fprintf(out, "  node [shape=box, fontname=\"monospace\", fontsize=10];\n");
+
+  // blocks grouped by subroutine: counting sort on the owner
+  uint32_t *start = calloc(cfg->subroutine_count + 1, sizeof(*start));
+  uint32_t *order = malloc((cfg->block_count ? cfg->block_count : 1) * sizeof(*order));
+  if (!start || !order) {
+    free(start);
+    free(order);
+    fprintf(out, "}\n");
+    return;
+  }
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    start[cfg->blocks[i].subroutine + 1]++;
+  }
+  for (size_t s = 0; s < cfg->subroutine_count; s++) {
+    start[s + 1] += start[s];
+  }
+  for (size_t i = 0; i < cfg->block_count; i++) {
+    order[start[cfg->blocks[i].subroutine]++] = i;
+  }
+  uint32_t next = 0;
+  for (size_t s = 0; s < cfg->subroutine_count; s++) {
+    const struct cfg_subroutine *sub = &cfg->subroutines[s];
+    fprintf(out, "  subgraph cluster_%zu {\n", s);
+    fprintf(out, "    label=\"%s x%04X%s\";\n", s ? "subroutine" : "entry", sub->entry,
+            s && !sub->returns ? " (no RET)" : "");
+    for (; next < start[s]; next++) {
+      write_block(cfg, vm, order[next], out);
+    }
+    fprintf(out, "  }\n");
+  }
+  free(start);
+  free(order);
+
+  for (size_t i = 0; i < cfg->edge_count; i++) {
+    const struct cfg_edge *edge = &cfg->edges[i];
+    fprintf(out, "  b%u -> b%u", edge->from, edge->to);
+    if (edge->kind == CFG_EDGE_CALL) {
+      fprintf(out, " [style=dashed, label=\"call\"]");
+    }
+    else if (edge->back) {
+      fprintf(out, " [color=blue, penwidth=2]");
+    }
+    else if (edge->kind == CFG_EDGE_BRANCH && cfg->blocks[edge->from].exit == CFG_EXIT_BRANCH) {
+      fprintf(out, " [label=\"taken\"]");
+    }
+    fprintf(out, ";\n");
+  }
+  fprintf(out, "}\n");
+}
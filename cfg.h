@@ -0,0 +1,109 @@
+#ifndef CFG_H_
+#define CFG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "utils.h"
+
+/** static control-flow graph
+ * Built from a VM's memory as it is when cfg_build runs; code the guest
+ * writes later is not seen. Every word reachable from the entry point is
+ * treated as an instruction. BR and JSR targets are followed, and so are JMP
+ * and JSRR when the instruction just before them in the block loads the
+ * register with LEA or LD; any other JMP is left without a successor and
+ * marked CFG_EXIT_INDIRECT. TRAPs other than HALT return to the next word,
+ * unknown vectors stop the machine. Blocks, edges, loops and subroutines are
+ * indexed arrays; edges are grouped by their source block.
+ **/
+
+/* why a block ends */
+enum cfg_exit
+{
+  CFG_EXIT_FALLTHROUGH = 0, /* the next word starts another block */
+  CFG_EXIT_BRANCH,          /* conditional BR: taken and fall-through edges */
+  CFG_EXIT_JUMP,            /* BRnzp, or a JMP with a known target */
+  CFG_EXIT_INDIRECT,        /* JMP to a register the CFG cannot follow */
+  CFG_EXIT_CALL,            /* JSR/JSRR: call edge and return-site edge */
+  CFG_EXIT_RETURN,          /* RET */
+  CFG_EXIT_TRAP,            /* a trap that continues with the next word */
+  CFG_EXIT_HALT,            /* TRAP x25 or an unknown vector */
+  CFG_EXIT_COUNT
+};
+
+enum cfg_edge_kind
+{
+  CFG_EDGE_FALLTHROUGH = 0, /* next word, including a call's return site */
+  CFG_EDGE_BRANCH,          /* taken BR or a resolved JMP */
+  CFG_EDGE_CALL             /* JSR/JSRR to a subroutine entry */
+};
+
+struct cfg_edge
+{
+  uint32_t from;            /* block indices */
+  uint32_t to;
+  uint8_t kind;             /* enum cfg_edge_kind */
+  uint8_t back;             /* closes a loop: to dominates from */
+};
+
+struct cfg_block
+{
+  uint16_t start;
+  uint16_t end;             /* last instruction, inclusive */
+  uint8_t exit;             /* enum cfg_exit */
+  uint8_t loop_depth;       /* 0 outside every loop */
+  uint8_t loop_header;
+  uint32_t first_edge;      /* this block's edges are first_edge.. */
+  uint32_t edge_count;
+  uint32_t subroutine;      /* index of the subroutine it belongs to */
+};
+
+/* a natural loop: every back edge into one header, merged */
+struct cfg_loop
+{
+  uint32_t header;          /* block index */
+  uint32_t back_edges;
+  uint32_t blocks;
+  uint32_t instructions;
+  uint16_t first;           /* lowest and highest address in the body */
+  uint16_t last;
+  uint8_t depth;            /* 1 for an outermost loop */
+};
+
+/* the entry point, or a JSR/JSRR target, with the blocks reached from it
+ * without following calls; shared code belongs to the first one found
+ * (the entry point, then by address) */
+struct cfg_subroutine
+{
+  uint16_t entry;
+  uint32_t block;
+  uint32_t blocks;
+  uint32_t instructions;
+  uint32_t call_sites;      /* calls made from it */
+  int returns;              /* contains a RET */
+};
+
+struct cfg
+{
+  uint16_t entry;
+  struct cfg_block *blocks;
+  size_t block_count;
+  struct cfg_edge *edges;
+  size_t edge_count;
+  struct cfg_loop *loops;
+  size_t loop_count;
+  struct cfg_subroutine *subroutines;
+  size_t subroutine_count;
+  int32_t block_at[UINT16_MAX + 1]; /* block holding each address, or -1 */
+};
+
+/* analyse the program reachable from entry; returns NULL if out of memory */
+struct cfg *cfg_build(const struct vm *vm, uint16_t entry);
+void cfg_free(struct cfg *cfg);
+
+/* write the graph in Graphviz dot: one cluster per subroutine, loop headers
+ * in bold, back edges in blue and calls dashed */
+void cfg_write_dot(const struct cfg *cfg, const struct vm *vm, FILE *out);
+
+const char *cfg_exit_name(enum cfg_exit exit);
+
+#endif
@@ -0,0 +1,655 @@
+#include "decode.h"
+#include "opcode.h"
+#include "profile.h"
+#include "utils.h"
+
+/*
+* Decoded Handlers
+-----------------------------
+* Each handler performs exactly the same work as its op_* counterpart in
+* opcode.c, but reads register indices and offsets from a pre-decoded record
+* instead of extracting them from the instruction bits. ADD, AND, BR and JSR
+* are split by addressing mode so the mode test is also done at decode time.
+*
+* Args:
+*   struct vm *vm: machine to execute on
+*   const struct decoded *d: record produced by decode_instruction
+*/
+
+static void dec_add_reg(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = vm->reg[d->SR1] + vm->reg[d->SR2];
+  update_flag(vm, d->DR);
+}
+
+static void dec_add_imm(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = vm->reg[d->SR1] + d->imm;
+  update_flag(vm, d->DR);
+}
+
+static void dec_and_reg(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = vm->reg[d->SR1] & vm->reg[d->SR2];
+  update_flag(vm, d->DR);
+}
+
+static void dec_and_imm(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = vm->reg[d->SR1] & d->imm;
+  update_flag(vm, d->DR);
+}
+
+static void dec_not(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = ~vm->reg[d->SR1];
+  update_flag(vm, d->DR);
+}
+
+static void dec_ld(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = read_from_memory(vm, vm->reg[R_PC] + d->imm);
+  update_flag(vm, d->DR);
+}
+
+static void dec_ldi(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = read_from_memory(vm, read_from_memory(vm, vm->reg[R_PC] + d->imm));
+  update_flag(vm, d->DR);
+}
+
+static void dec_ldr(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = read_from_memory(vm, vm->reg[d->SR1] + d->imm);
+  update_flag(vm, d->DR);
+}
+
+static void dec_lea(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[d->DR] = vm->reg[R_PC] + d->imm;
+  update_flag(vm, d->DR);
+}
+
+static void dec_br(struct vm *vm, const struct decoded *d)
+{
+  if (d->DR & cond_flag_of(vm->flag_result)) {
+    vm->reg[R_PC] += d->imm;
+  }
+}
+
+static void dec_jmp(struct vm *vm, const struct decoded *d)
+{
+  vm->reg[R_PC] = vm->reg[d->SR1];
+}
+
+static void dec_jsr(struct vm *vm, const struct decoded *d)
+{
+  uint16_t temp = vm->reg[R_PC];
+  vm->reg[R_PC] += d->imm;
+  vm->reg[R_7] = temp;
+}
+
+static void dec_jsrr(struct vm *vm, const struct decoded *d)
+{
+  uint16_t temp = vm->reg[R_PC];
+  vm->reg[R_PC] = vm->reg[d->SR1];
+  vm->reg[R_7] = temp;
+}
+
+static void dec_st(struct vm *vm, const struct decoded *d)
+{
+  write_to_memory(vm, vm->reg[R_PC] + d->imm, vm->reg[d->DR]);
+}
+
+static void dec_sti(struct vm *vm, const struct decoded *d)
+{
+  write_to_memory(vm, read_from_memory(vm, vm->reg[R_PC] + d->imm), vm->reg[d->DR]);
+}
+
+static void dec_str(struct vm *vm, const struct decoded *d)
+{
+  write_to_memory(vm, vm->reg[d->SR1] + d->imm, vm->reg[d->DR]);
+}
+
+static void dec_trap(struct vm *vm, const struct decoded *d)
+{
+  // traps are rare and slow anyway, so reuse the reference implementation
+  op_trap(vm, d->bits);
+}
+
+static void dec_nop(struct vm *vm, const struct decoded *d)
+{
+  // RTI and the reserved opcode do nothing, same as run_switch
+}
+
+static void dec_device(struct vm *vm, const struct decoded *d)
+{
+  // fetching the keyboard status register polls the keyboard, as in run_switch
+  struct decoded fetched;
+  decode_instruction(read_from_memory(vm, d - vm->decoded), &fetched);
+  fetched.handler(vm, &fetched);
+}
+
+static void dec_undecoded(struct vm *vm, const struct decoded *d)
+{
+  // first run of a word outside known code: decode its line, then run it
+  decode_code_line(vm, d - vm->decoded);
+  d->handler(vm, d);
+}
+
+/* handler for each decoded_kind */
+static const decoded_handler kind_handlers[K_COUNT] = {
+  [K_BR] = dec_br,
+  [K_ADD_REG] = dec_add_reg,
+  [K_ADD_IMM] = dec_add_imm,
+  [K_AND_REG] = dec_and_reg,
+  [K_AND_IMM] = dec_and_imm,
+  [K_NOT] = dec_not,
+  [K_LD] = dec_ld,
+  [K_LDI] = dec_ldi,
+  [K_LDR] = dec_ldr,
+  [K_LEA] = dec_lea,
+  [K_ST] = dec_st,
+  [K_STI] = dec_sti,
+  [K_STR] = dec_str,
+  [K_JMP] = dec_jmp,
+  [K_JSR] = dec_jsr,
+  [K_JSRR] = dec_jsrr,
+  [K_TRAP] = dec_trap,
+  [K_NOP] = dec_nop,
+  [K_DEVICE] = dec_device,
+  [K_UNDECODED] = dec_undecoded,
+};
+
+void decode_instruction(uint16_t bits, struct decoded *d)
+/*
+ Fill in a decoded record for one instruction word. Field layout follows the
+ op_* functions in opcode.c so both paths compute identical operands.
+*/
+{
+  uint16_t opcode = bits >> 12;
+  d->bits = bits;
+  d->DR = (bits >> 9) & 0x7;
+  d->SR1 = (bits >> 6) & 0x7;
+  d->SR2 = bits & 0x7;
+  d->imm = 0;
+
+  switch (opcode) {
+    case OP_BR:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_BR;
+      break;
+    case OP_ADD:
+      d->imm = get_sign_extension(bits & 0x1F, 5);
+      d->kind = ((bits >> 5) & 0x1) ? K_ADD_IMM : K_ADD_REG;
+      break;
+    case OP_AND:
+      d->imm = get_sign_extension(bits & 0x1F, 5);
+      d->kind = ((bits >> 5) & 0x1) ? K_AND_IMM : K_AND_REG;
+      break;
+    case OP_NOT:
+      d->kind = K_NOT;
+      break;
+    case OP_LD:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_LD;
+      break;
+    case OP_LDI:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_LDI;
+      break;
+    case OP_LDR:
+      d->imm = get_sign_extension(bits & 0x3F, 6);
+      d->kind = K_LDR;
+      break;
+    case OP_LEA:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_LEA;
+      break;
+    case OP_ST:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_ST;
+      break;
+    case OP_STI:
+      d->imm = get_sign_extension(bits & 0x1FF, 9);
+      d->kind = K_STI;
+      break;
+    case OP_STR:
+      d->imm = get_sign_extension(bits & 0x3F, 6);
+      d->kind = K_STR;
+      break;
+    case OP_JMP:
+      d->kind = K_JMP;
+      break;
+    case OP_JSR:
+      if ((bits >> 11) & 1) {
+        d->imm = get_sign_extension(bits & 0x7FF, 11);
+        d->kind = K_JSR;
+      }
+      else {
+        d->kind = K_JSRR;
+      }
+      break;
+    case OP_TRAP:
+      d->imm = bits & 0xFF;
+      d->kind = K_TRAP;
+      break;
+    default:
+      // OP_RTI and OP_RES
+      d->kind = K_NOP;
+      break;
+  }
+  d->handler = kind_handlers[d->kind];
+}
+
+static void fuse_at(struct vm *vm, uint32_t address);
+static void refuse(struct vm *vm, uint16_t address);
+
+static int redecode(struct vm *vm, uint16_t address)
+/*
+ Code tracking callback: a store hit a code line, so rebuild the record for
+ address and any superinstruction covering it. Returns 1 if the word changed.
+*/
+{
+  struct decoded *d = &vm->decoded[address];
+  // an undecoded record reads memory when it first runs anyway, a device
+  // record every time
+  if (d->kind == K_UNDECODED || d->kind == K_DEVICE || d->bits == vm->memory[address]) {
+    return 0;
+  }
+  decode_instruction(vm->memory[address], d);
+  if (vm->fusion) {
+    refuse(vm, address);
+  }
+  return 1;
+}
+
+int init_decoded_table(struct vm *vm)
+/*
+ Allocate the record table with every record K_UNDECODED and start tracking
+ stores into the code it will hold. Returns 0 if it cannot be allocated.
+*/
+{
+  if (!vm->decoded) {
+    vm->decoded = malloc((UINT16_MAX + 1) * sizeof(struct decoded));
+    if (!vm->decoded) {
+      return 0;
+    }
+  }
+  const struct decoded undecoded = {dec_undecoded, 0, 0, 0, K_UNDECODED, 0, 0};
+  for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+    vm->decoded[address] = undecoded;
+  }
+  smc_watch(vm, redecode);
+  return 1;
+}
+
+void decode_code_line(struct vm *vm, uint16_t address)
+/*
+ Decode every record in the code line holding address and mark the line, so
+ stores into it from now on keep the records in sync through redecode.
+*/
+{
+  uint32_t first = address & ~(CODE_LINE_WORDS - 1);
+  for (uint32_t a = first; a < first + CODE_LINE_WORDS; a++) {
+    decode_instruction(vm->memory[a], &vm->decoded[a]);
+  }
+  if (first == (M_KBSR & ~(CODE_LINE_WORDS - 1))) {
+    const struct decoded device = {dec_device, 0, 0, 0, K_DEVICE, 0, 0};
+    vm->decoded[M_KBSR] = device;
+  }
+  smc_mark_code(vm, address);
+  if (vm->fusion) {
+    // patterns may start up to two records before the line
+    for (uint32_t a = first >= 2 ? first - 2 : 0; a < first + CODE_LINE_WORDS; a++) {
+      fuse_at(vm, a);
+    }
+  }
+}
+
+/*
+* Superinstructions
+-----------------------------
+* A fused handler executes two or three consecutive records with a single
+* dispatch. Control transfers are only allowed as the last element, so a
+* fused handler always falls through to the next record the same way the
+* dispatch loop would. A store that rewrites the next record (self-modifying
+* code) is caught by checking the next record's kind and bailing out to a
+* normal dispatch.
+*
+* The candidate patterns are listed in FUSED_PATTERNS. Which of them are
+* worth a handler depends on what the program actually runs, so a fusing VM
+* first runs FUSE_TRAINING instructions on the switch engine with the
+* profiler on; fuse_superinstructions then weighs every place a pattern
+* matches by how often it ran there and enables the FUSE_MAX_PATTERNS that
+* would have saved the most dispatches.
+*/
+
+#define FUSE_MAX_PATTERNS 16
+#define FUSE_TRAINING (1 << 17)
+
+#define IS_STORE_KIND(k) ((k) == K_ST || (k) == K_STI || (k) == K_STR)
+#define IS_LOAD_KIND(k) ((k) == K_LD || (k) == K_LDI || (k) == K_LDR)
+
+/* X(name, length, kind1, handler1, kind2, handler2, kind3, handler3) */
+#define FUSED_PATTERNS(X) \
+  X(and_add, 2, K_AND_IMM, dec_and_imm, K_ADD_IMM, dec_add_imm, K_COUNT, dec_nop) \
+  X(add_br, 2, K_ADD_IMM, dec_add_imm, K_BR, dec_br, K_COUNT, dec_nop) \
+  X(addr_br, 2, K_ADD_REG, dec_add_reg, K_BR, dec_br, K_COUNT, dec_nop) \
+  X(and_br, 2, K_AND_IMM, dec_and_imm, K_BR, dec_br, K_COUNT, dec_nop) \
+  X(ld_br, 2, K_LD, dec_ld, K_BR, dec_br, K_COUNT, dec_nop) \
+  X(ldr_br, 2, K_LDR, dec_ldr, K_BR, dec_br, K_COUNT, dec_nop) \
+  X(not_add, 2, K_NOT, dec_not, K_ADD_IMM, dec_add_imm, K_COUNT, dec_nop) \
+  X(add_add, 2, K_ADD_IMM, dec_add_imm, K_ADD_IMM, dec_add_imm, K_COUNT, dec_nop) \
+  X(addr_addr, 2, K_ADD_REG, dec_add_reg, K_ADD_REG, dec_add_reg, K_COUNT, dec_nop) \
+  X(add_addr, 2, K_ADD_IMM, dec_add_imm, K_ADD_REG, dec_add_reg, K_COUNT, dec_nop) \
+  X(ldr_add, 2, K_LDR, dec_ldr, K_ADD_IMM, dec_add_imm, K_COUNT, dec_nop) \
+  X(ldr_ldr, 2, K_LDR, dec_ldr, K_LDR, dec_ldr, K_COUNT, dec_nop) \
+  X(ld_addr, 2, K_LD, dec_ld, K_ADD_REG, dec_add_reg, K_COUNT, dec_nop) \
+  X(ld_ld, 2, K_LD, dec_ld, K_LD, dec_ld, K_COUNT, dec_nop) \
+  X(add_ldr, 2, K_ADD_IMM, dec_add_imm, K_LDR, dec_ldr, K_COUNT, dec_nop) \
+  X(addr_ldr, 2, K_ADD_REG, dec_add_reg, K_LDR, dec_ldr, K_COUNT, dec_nop) \
+  X(ldr_str, 2, K_LDR, dec_ldr, K_STR, dec_str, K_COUNT, dec_nop) \
+  X(str_str, 2, K_STR, dec_str, K_STR, dec_str, K_COUNT, dec_nop) \
+  X(str_add, 2, K_STR, dec_str, K_ADD_IMM, dec_add_imm, K_COUNT, dec_nop) \
+  X(str_ldr, 2, K_STR, dec_str, K_LDR, dec_ldr, K_COUNT, dec_nop) \
+  X(add_str, 2, K_ADD_IMM, dec_add_imm, K_STR, dec_str, K_COUNT, dec_nop) \
+  X(add_jmp, 2, K_ADD_IMM, dec_add_imm, K_JMP, dec_jmp, K_COUNT, dec_nop) \
+  X(add_jsr, 2, K_ADD_IMM, dec_add_imm, K_JSR, dec_jsr, K_COUNT, dec_nop) \
+  X(ld_jsr, 2, K_LD, dec_ld, K_JSR, dec_jsr, K_COUNT, dec_nop) \
+  X(ldr_add_str, 3, K_LDR, dec_ldr, K_ADD_IMM, dec_add_imm, K_STR, dec_str) \
+  X(not_add_addr, 3, K_NOT, dec_not, K_ADD_IMM, dec_add_imm, K_ADD_REG, dec_add_reg) \
+  X(ld_addr_br, 3, K_LD, dec_ld, K_ADD_REG, dec_add_reg, K_BR, dec_br) \
+  X(and_add_br, 3, K_AND_IMM, dec_and_imm, K_ADD_IMM, dec_add_imm, K_BR, dec_br) \
+  X(add_addr_br, 3, K_ADD_IMM, dec_add_imm, K_ADD_REG, dec_add_reg, K_BR, dec_br) \
+  X(ldr_add_jmp, 3, K_LDR, dec_ldr, K_ADD_IMM, dec_add_imm, K_JMP, dec_jmp) \
+  X(str_ldr_str, 3, K_STR, dec_str, K_LDR, dec_ldr, K_STR, dec_str) \
+  X(ldr_str_ldr, 3, K_LDR, dec_ldr, K_STR, dec_str, K_LDR, dec_ldr) \
+  X(addr_addr_addr, 3, K_ADD_REG, dec_add_reg, K_ADD_REG, dec_add_reg, K_ADD_REG, dec_add_reg) \
+  X(str_str_str, 3, K_STR, dec_str, K_STR, dec_str, K_STR, dec_str) \
+  X(ldr_ldr_ldr, 3, K_LDR, dec_ldr, K_LDR, dec_ldr, K_LDR, dec_ldr)
+
+enum fused_pattern
+{
+#define FUSED_ENUM(name, len, k1, h1, k2, h2, k3, h3) FUSED_##name,
+  FUSED_PATTERNS(FUSED_ENUM)
+#undef FUSED_ENUM
+  FUSED_COUNT
+};
+
+/* per-VM fusion state: the profile of the training run while it lasts,
+ * executions of each fused handler, the dispatches it would have saved in
+ * training and whether the pattern was selected */
+struct fusion
+{
+  struct profile *training;
+  uint64_t trained;
+  uint64_t hits[FUSED_COUNT];
+  uint64_t weight[FUSED_COUNT];
+  int enabled[FUSED_COUNT];
+};
+
+static void fused_bail(struct vm *vm, const struct decoded *next)
+{
+  // a store rewrote the next record: dispatch it normally
+  vm->reg[R_PC]++;
+  vm->remaining--;
+  next->handler(vm, next);
+}
+
+/* a fused handler only runs as a unit if the whole pattern fits in the
+ * budget, so vm_run never executes more instructions than it was given; a
+ * load from M_KBSR may stop the VM (request_stop), and then the rest of the
+ * pattern must not run, just as the dispatch loop would not run it */
+#define FUSED_HANDLER(name, len, k1, h1, k2, h2, k3, h3) \
+static void fused_##name(struct vm *vm, const struct decoded *d) \
+{ \
+  if (vm->remaining < len - 1) { \
+    h1(vm, d); \
+    return; \
+  } \
+  vm->fusion->hits[FUSED_##name]++; \
+  h1(vm, d); \
+  if (IS_LOAD_KIND(k1) && vm->stop) { \
+    return; \
+  } \
+  if (IS_STORE_KIND(k1) && d[1].kind != k2) { \
+    fused_bail(vm, d + 1); \
+    return; \
+  } \
+  vm->reg[R_PC]++; \
+  vm->remaining--; \
+  h2(vm, d + 1); \
+  if (len == 3) { \
+    if (IS_LOAD_KIND(k2) && vm->stop) { \
+      return; \
+    } \
+    if (IS_STORE_KIND(k2) && d[2].kind != k3) { \
+      fused_bail(vm, d + 2); \
+      return; \
+    } \
+    vm->reg[R_PC]++; \
+    vm->remaining--; \
+    h3(vm, d + 2); \
+  } \
+}
+FUSED_PATTERNS(FUSED_HANDLER)
+#undef FUSED_HANDLER
+
+struct fused_info
+{
+  const char *name;
+  int len;
+  uint8_t kinds[3];
+  decoded_handler handler;
+};
+
+static const struct fused_info fused_info[FUSED_COUNT] = {
+#define FUSED_INFO(name, len, k1, h1, k2, h2, k3, h3) \
+  {#name, len, {k1, k2, k3}, fused_##name},
+  FUSED_PATTERNS(FUSED_INFO)
+#undef FUSED_INFO
+};
+
+static int pattern_matches(const struct decoded *records, int p, uint32_t address)
+{
+  if (address + fused_info[p].len > UINT16_MAX) {
+    return 0;
+  }
+  for (int i = 0; i < fused_info[p].len; i++) {
+    if (records[address + i].kind != fused_info[p].kinds[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void fuse_at(struct vm *vm, uint32_t address)
+/*
+ Install the longest enabled pattern starting at address, or the plain
+ handler if none matches.
+*/
+{
+  struct decoded *d = &vm->decoded[address];
+  d->handler = kind_handlers[d->kind];
+  int best_len = 1;
+  for (int p = 0; p < FUSED_COUNT; p++) {
+    if (vm->fusion->enabled[p] && fused_info[p].len > best_len
+        && pattern_matches(vm->decoded, p, address)) {
+      d->handler = fused_info[p].handler;
+      best_len = fused_info[p].len;
+    }
+  }
+}
+
+int fuse_superinstructions(struct vm *vm, const uint64_t *pc_count)
+/*
+ Weigh every candidate pattern by the dispatches it would have saved given
+ the executions per address in pc_count, enable the heaviest ones and install
+ their handlers in the lines decoded so far; later lines get them from
+ decode_code_line. Must run after init_decoded_table. Returns 0 if the fusion
+ state cannot be allocated.
+*/
+{
+  // the table only holds code that has run, so match over a scratch copy
+  struct decoded *image = malloc((UINT16_MAX + 1) * sizeof(struct decoded));
+  if (!vm->fusion) {
+    vm->fusion = calloc(1, sizeof(struct fusion));
+  }
+  if (!vm->fusion || !image) {
+    free(image);
+    return 0;
+  }
+  struct fusion *f = vm->fusion;
+  memset(f->weight, 0, sizeof(f->weight));
+  memset(f->enabled, 0, sizeof(f->enabled));
+  for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+    decode_instruction(vm->memory[address], &image[address]);
+  }
+  for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+    if (!pc_count[address]) {
+      continue;
+    }
+    for (int p = 0; p < FUSED_COUNT; p++) {
+      if (!pattern_matches(image, p, address)) {
+        continue;
+      }
+      // the pattern only runs as a unit as often as its least run element
+      uint64_t runs = pc_count[address];
+      for (int i = 1; i < fused_info[p].len; i++) {
+        if (pc_count[address + i] < runs) {
+          runs = pc_count[address + i];
+        }
+      }
+      f->weight[p] += runs * (fused_info[p].len - 1);
+    }
+  }
+  free(image);
+
+  for (int picked = 0; picked < FUSE_MAX_PATTERNS; picked++) {
+    int best = -1;
+    for (int p = 0; p < FUSED_COUNT; p++) {
+      if (!f->enabled[p] && f->weight[p] > 0
+          && (best < 0 || f->weight[p] > f->weight[best])) {
+        best = p;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    f->enabled[best] = 1;
+  }
+
+  for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+    fuse_at(vm, address);
+  }
+  return 1;
+}
+
+static void train_fusion(struct vm *vm)
+/*
+ Run what is left of the training period, or the whole budget if that is
+ less, on the switch engine with the training profile, and pick the patterns
+ once the period is over. The rest of the budget is held back meanwhile so
+ the slice stops where training does.
+*/
+{
+  struct fusion *f = vm->fusion;
+  int64_t rest = vm->remaining - (int64_t)(FUSE_TRAINING - f->trained);
+  if (rest < 0) {
+    rest = 0;
+  }
+  vm->remaining -= rest;
+  vm->icount_base -= rest;
+  uint64_t before = vm_icount(vm);
+  vm->profile = f->training;
+  run_switch(vm);
+  vm->profile = NULL;
+  f->trained += vm_icount(vm) - before;
+  if (vm->stop != VM_STOP_NONE) {
+    // request_stop zeroed the budget, held back part included
+    return;
+  }
+  vm->remaining += rest;
+  vm->icount_base += rest;
+  if (f->trained >= FUSE_TRAINING) {
+    fuse_superinstructions(vm, f->training->pc_count);
+    free(f->training);
+    f->training = NULL;
+  }
+}
+
+void free_fusion(struct vm *vm)
+{
+  if (vm->fusion) {
+    free(vm->fusion->training);
+  }
+  free(vm->fusion);
+  vm->fusion = NULL;
+}
+
+static void refuse(struct vm *vm, uint16_t address)
+{
+  // the records that can start a pattern covering address
+  for (int back = 0; back < 3 && back <= address; back++) {
+    fuse_at(vm, address - back);
+  }
+}
+
+void print_fusion_report(struct vm *vm)
+{
+  struct fusion *f = vm->fusion;
+  if (!f) {
+    return;
+  }
+  uint64_t saved = 0;
+  uint64_t count = vm_icount(vm);
+  if (f->training) {
+    fprintf(stderr, "superinstructions: none, the program stopped within its first %d "
+            "instructions (the training run)\n", FUSE_TRAINING);
+    return;
+  }
+  fprintf(stderr, "superinstructions (saved in training, executions, dispatches saved):\n");
+  for (int p = 0; p < FUSED_COUNT; p++) {
+    if (!f->enabled[p]) {
+      continue;
+    }
+    uint64_t pattern_saved = f->hits[p] * (fused_info[p].len - 1);
+    saved += pattern_saved;
+    fprintf(stderr, "  %-16s %12llu %12llu %12llu\n", fused_info[p].name,
+            (unsigned long long)f->weight[p], (unsigned long long)f->hits[p],
+            (unsigned long long)pattern_saved);
+  }
+  fprintf(stderr, "instructions: %llu  dispatches: %llu  saved: %llu (%.1f%%)\n",
+          (unsigned long long)count,
+          (unsigned long long)(count - saved), (unsigned long long)saved,
+          count ? 100.0 * saved / count : 0.0);
+}
+
+void run_decoded(struct vm *vm)
+{
+  if (!vm->decoded) {
+    if (!init_decoded_table(vm)) {
+      // no memory for the record table: the reference engine needs none
+      run_switch(vm);
+      return;
+    }
+    if (vm->fuse && !vm->fusion) {
+      vm->fusion = calloc(1, sizeof(struct fusion));
+      if (vm->fusion) {
+        vm->fusion->training = calloc(1, sizeof(struct profile));
+      }
+    }
+  }
+  if (vm->fusion && vm->fusion->training) {
+    train_fusion(vm);
+  }
+
+  struct decoded *decoded = vm->decoded;
+  while (vm->remaining > 0)
+  {
+    const struct decoded *d = &decoded[vm->reg[R_PC]++];
+    vm->remaining--;
+    d->handler(vm, d);
+  }
+}
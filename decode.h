@@ -0,0 +1,63 @@
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <stdint.h>
+
+/** pre-decoded instruction record
+ * Built once per memory word by decode_instruction so the dispatch loop never
+ * has to shift, mask or sign-extend an instruction again. Records start out
+ * K_UNDECODED and are decoded a code line (smc.h) at a time the first time
+ * one of them runs, so only code is ever decoded and tracked. Register indices and
+ * sign-extended offsets are stored exactly as the op_* functions would compute
+ * them from the raw bits.
+ **/
+enum decoded_kind
+{
+  K_BR = 0,
+  K_ADD_REG,
+  K_ADD_IMM,
+  K_AND_REG,
+  K_AND_IMM,
+  K_NOT,
+  K_LD,
+  K_LDI,
+  K_LDR,
+  K_LEA,
+  K_ST,
+  K_STI,
+  K_STR,
+  K_JMP,
+  K_JSR,
+  K_JSRR,
+  K_TRAP,
+  K_NOP,     /* RTI and reserved */
+  K_DEVICE,  /* the word at M_KBSR: fetched through read_from_memory each time */
+  K_UNDECODED, /* not decoded yet: decodes its line on first execution */
+  K_COUNT
+};
+
+struct vm;
+struct decoded;
+typedef void (*decoded_handler)(struct vm *vm, const struct decoded *d);
+
+struct decoded
+{
+  decoded_handler handler; /* op_* equivalent that executes this record */
+  uint8_t DR;              /* DR, SR of a store, or n/z/p mask of a BR */
+  uint8_t SR1;             /* SR1, SR or BaseR */
+  uint8_t SR2;             /* SR2 of register-mode ADD/AND */
+  uint8_t kind;            /* decoded_kind, one per handler */
+  uint16_t imm;            /* sign-extended imm5/offset6/PCoffset9/11, trapvect8 */
+  uint16_t bits;           /* raw instruction word */
+};
+
+void decode_instruction(uint16_t bits, struct decoded *d);
+int init_decoded_table(struct vm *vm);
+void decode_code_line(struct vm *vm, uint16_t address);
+void run_decoded(struct vm *vm);
+
+int fuse_superinstructions(struct vm *vm, const uint64_t *pc_count);
+void free_fusion(struct vm *vm);
+void print_fusion_report(struct vm *vm);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * LC-3 disassembler
+ *
+ * Produces the usual assembler syntax (ADD R1, R2, #-3; BRnz x3002; ...) for
+ * reports. Reserved opcodes and unknown trap vectors come out as .FILL or
+ * TRAP xNN so every word has a printable form.
+ */
+
+#include "disasm.h"
+#include "opcode.h"
+#include "utils.h"
+
+static const char *opcode_names[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+const char *opcode_name(int opcode)
+{
+  return opcode_names[opcode & 0xF];
+}
+
+const char *trap_name(uint16_t vector)
+{
+  switch (vector) {
+    case T_GETC:
+      return "GETC";
+    case T_OUT:
+      return "OUT";
+    case T_PUTS:
+      return "PUTS";
+    case T_IN:
+      return "IN";
+    case T_PUTSP:
+      return "PUTSP";
+    case T_HALT:
+      return "HALT";
+    case T_MUL:
+      return "MUL";
+    case T_DIVMOD:
+      return "DIVMOD";
+    case T_MEMCPY:
+      return "MEMCPY";
+    case T_MEMSET:
+      return "MEMSET";
+    case T_STRLEN:
+      return "STRLEN";
+    case T_STRCMP:
+      return "STRCMP";
+  }
+  return NULL;
+}
+
+void disassemble(uint16_t address, uint16_t bits, char *buf, size_t size)
+{
+  int dr = (bits >> 9) & 0x7;
+  int sr1 = (bits >> 6) & 0x7;
+  uint16_t next = address + 1;
+  uint16_t pc9 = next + get_sign_extension(bits & 0x1FF, 9);
+
+  switch (bits >> 12) {
+    case OP_BR:
+      if ((bits & 0x0E00) == 0) {
+        snprintf(buf, size, "NOP");
+      }
+      else {
+        snprintf(buf, size, "BR%s%s%s x%04X", bits & 0x0800 ? "n" : "",
+                 bits & 0x0400 ? "z" : "", bits & 0x0200 ? "p" : "", pc9);
+      }
+      break;
+    case OP_ADD:
+    case OP_AND:
+      if (bits & 0x20) {
+        snprintf(buf, size, "%s R%d, R%d, #%d", opcode_name(bits >> 12), dr, sr1,
+                 (int16_t)get_sign_extension(bits & 0x1F, 5));
+      }
+      else {
+        snprintf(buf, size, "%s R%d, R%d, R%d", opcode_name(bits >> 12), dr, sr1,
+                 bits & 0x7);
+      }
+      break;
+    case OP_LD:
+    case OP_ST:
+    case OP_LDI:
+    case OP_STI:
+    case OP_LEA:
+      snprintf(buf, size, "%s R%d, x%04X", opcode_name(bits >> 12), dr, pc9);
+      break;
+    case OP_JSR:
+      if (bits & 0x0800) {
+        snprintf(buf, size, "JSR x%04X",
+                 (uint16_t)(next + get_sign_extension(bits & 0x7FF, 11)));
+      }
+      else {
+        snprintf(buf, size, "JSRR R%d", sr1);
+      }
+      break;
+    case OP_LDR:
+    case OP_STR:
+      snprintf(buf, size, "%s R%d, R%d, #%d", opcode_name(bits >> 12), dr, sr1,
+               (int16_t)get_sign_extension(bits & 0x3F, 6));
+      break;
+    case OP_NOT:
+      snprintf(buf, size, "NOT R%d, R%d", dr, sr1);
+      break;
+    case OP_JMP:
+      if (sr1 == R_7) {
+        snprintf(buf, size, "RET");
+      }
+      else {
+        snprintf(buf, size, "JMP R%d", sr1);
+      }
+      break;
+    case OP_RTI:
+      snprintf(buf, size, "RTI");
+      break;
+    case OP_TRAP:
+      if (trap_name(bits & 0xFF)) {
+        snprintf(buf, size, "%s", trap_name(bits & 0xFF));
+      }
+      else {
+        snprintf(buf, size, "TRAP x%02X", bits & 0xFF);
+      }
+      break;
+    default:
+      snprintf(buf, size, ".FILL x%04X", bits);
+      break;
+  }
+}
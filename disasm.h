@@ -0,0 +1,17 @@
+#ifndef DISASM_H_
+#define DISASM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* mnemonic of a 4-bit opcode (enum instruction_set) */
+const char *opcode_name(int opcode);
+
+/* name of a trap vector, extended ones included, or NULL if it has none */
+const char *trap_name(uint16_t vector);
+
+/* write the assembly for the instruction bits found at address into buf,
+ * with PC-relative operands resolved to absolute addresses */
+void disassemble(uint16_t address, uint16_t bits, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef GARBAGEEATER_H_
+#define GARBAGEEATER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** libgarbageeater: embeddable LC-3 virtual machine
+ * Every struct vm is an independent machine with its own registers, memory
+ * and engine caches, so one process can host any number of them. A single
+ * instance must only be used by one thread at a time; different instances
+ * may run concurrently.
+ *
+ *   struct vm *vm = vm_create();
+ *   vm_load_image(vm, image, size);
+ *   while (vm_run(vm, 1000000) == VM_STOP_LIMIT) { ... }
+ *   vm_destroy(vm);
+ **/
+
+struct vm;
+
+/* why vm_run returned */
+enum vm_stop
+{
+  VM_STOP_NONE = 0, /* still running (only seen from inside a callback) */
+  VM_STOP_HALT,     /* TRAP x25 */
+  VM_STOP_LIMIT,    /* the instruction budget passed to vm_run ran out */
+  VM_STOP_INPUT,    /* the guest needs a key and the I/O backend has none */
+  VM_STOP_ILLEGAL,  /* unknown TRAP vector; PC points past the TRAP */
+  VM_STOP_WATCH     /* a store hit a watchpoint; PC points past the store */
+};
+
+/* execution engines, all producing identical guest-visible behaviour */
+enum vm_engine
+{
+  VM_ENGINE_SWITCH = 0, /* switch over opcode calling op_* */
+  VM_ENGINE_DECODED,    /* pre-decoded records (default) */
+  VM_ENGINE_THREADED,   /* computed-goto dispatch */
+  VM_ENGINE_JIT,        /* x86-64 basic-block translation */
+  VM_ENGINE_COUNT
+};
+
+/** console I/O backend
+ * The default backend (vm_stdio_io) reads the process's stdin and writes its
+ * stdout. An embedder can supply its own; ctx is passed to every callback.
+ * If wait_key is NULL the VM never blocks: when the guest needs a key that is
+ * not available, vm_run returns VM_STOP_INPUT and the next vm_run carries on
+ * where it left off. A poll of the keyboard status register only stops the
+ * run once the guest is idle, or at once if key_ready says input is closed.
+ * wait_key may also return early without a key (e.g. on a signal); the run
+ * then stops with VM_STOP_INPUT as if there were no wait_key.
+ **/
+struct vm_io
+{
+  void *ctx;
+  int (*key_ready)(void *ctx);   /* >0 if read_key has a byte now, 0 if
+                                    not yet, <0 if no more input will come */
+  int (*read_key)(void *ctx);    /* next input byte, EOF reads as 0xFF */
+  void (*write)(void *ctx, const char *buf, size_t len);
+  void (*flush)(void *ctx);      /* the guest is looking for input */
+  void (*wait_key)(void *ctx);   /* block until key_ready or interrupted,
+                                    may be NULL */
+};
+
+extern const struct vm_io vm_stdio_io;
+
+struct vm *vm_create(void);
+void vm_destroy(struct vm *vm);
+
+void vm_set_io(struct vm *vm, const struct vm_io *io);
+void vm_set_engine(struct vm *vm, enum vm_engine engine);
+
+/* the VM runs native MUL, DIVMOD, MEMCPY, MEMSET, STRLEN and STRCMP routines
+ * at TRAP x30-x35 (see opcode.h); a strict VM stops on them with
+ * VM_STOP_ILLEGAL like on any other unknown vector */
+void vm_set_strict(struct vm *vm, int strict);
+
+/* TRAPs executed with this vector, whether it exists or not */
+uint64_t vm_trap_calls(const struct vm *vm, uint8_t vector);
+
+/* load an LC-3 object image (big-endian origin word followed by big-endian
+ * code words) from a buffer; returns 0 if the buffer is too short */
+int vm_load_image(struct vm *vm, const void *image, size_t size);
+
+/** shared memory images
+ * vm_image_create lays an object image out as a whole guest memory once;
+ * vm_map_image gives a VM that memory copy-on-write, replacing all of its
+ * own (the rest of memory reads as zero, as in a new VM). Every VM mapped
+ * from one image shares its pages until it stores to them, so mapping costs
+ * about the same for any image size and a VM's own memory is only the pages
+ * it has written. Where the kernel has no memory files each VM gets a copy.
+ * An image may be destroyed while VMs still use it.
+ **/
+struct vm_image;
+
+/* returns NULL if the image is malformed or out of memory */
+struct vm_image *vm_image_create(const void *image, size_t size);
+void vm_image_destroy(struct vm_image *image);
+int vm_map_image(struct vm *vm, const struct vm_image *image);
+
+/* host pages of guest memory this VM holds on its own (written since they
+ * were mapped), or -1 where the kernel does not say (not Linux, no
+ * /proc/self/pagemap) */
+long vm_dirty_pages(const struct vm *vm);
+
+/* save the whole machine (registers, memory including the device registers,
+ * instruction count and input the guest has not read yet) to a snapshot
+ * file, or restore one over this VM; both return 0 on failure. Call them
+ * between vm_run calls. A restored VM maps the file's memory copy-on-write,
+ * so resuming costs about as much as opening the file. */
+int vm_save_snapshot(struct vm *vm, const char *path);
+int vm_load_snapshot(struct vm *vm, const char *path);
+
+/* record every key the guest reads, with the instruction count at which it
+ * read it, to a text log; or replay such a log as the guest's only input,
+ * each key becoming available exactly at its recorded count. A replayed run
+ * retires the same instructions as the recorded one on every engine, and
+ * stops with VM_STOP_INPUT once the log is used up. Replay wraps the I/O
+ * backend set at the time (output still goes there) and turns idle
+ * detection off. Both return 0 if the file cannot be used. */
+int vm_record_input(struct vm *vm, const char *path);
+int vm_replay_input(struct vm *vm, const char *path);
+
+/* execute at most max_instructions instructions */
+enum vm_stop vm_run(struct vm *vm, uint64_t max_instructions);
+
+/* instructions retired since vm_create */
+uint64_t vm_instructions(const struct vm *vm);
+
+/* registers are indexed 0-7 for R0-R7, 8 for PC and 9 for the N/Z/P flags */
+uint16_t vm_get_reg(const struct vm *vm, int index);
+void vm_set_reg(struct vm *vm, int index, uint16_t value);
+uint16_t vm_peek(const struct vm *vm, uint16_t address);
+void vm_poke(struct vm *vm, uint16_t address, uint16_t value);
+
+const char *vm_stop_name(enum vm_stop stop);
+const char *vm_engine_name(enum vm_engine engine);
+
+#endif
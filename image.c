@@ -0,0 +1,112 @@
+/*
+ * Object image loading
+ *
+ * LC-3 images are big-endian, so every word needs a byte swap on the way
+ * into memory. On x86 the swap is a byte shuffle over 16 (AVX2) or 8 (SSSE3)
+ * words at a time, chosen at run time so one binary runs everywhere; other
+ * CPUs and the tail of each image use the scalar loop.
+ */
+
+#include "image.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_X86_SIMD 1
+#endif
+
+typedef void (*swap_fn)(uint16_t *dst, const uint8_t *src, size_t words);
+
+const char *image_problem(const uint8_t *bytes, size_t size)
+{
+  if (size < 2) {
+    return "is not an LC-3 image";
+  }
+  if (size % 2) {
+    return "has an odd number of bytes";
+  }
+  uint16_t origin = (bytes[0] << 8) | bytes[1];
+  if ((size - 2) / 2 > (size_t)(UINT16_MAX + 1 - origin)) {
+    return "does not fit in the 64K address space";
+  }
+  return NULL;
+}
+
+struct image_span image_span(const uint8_t *bytes, size_t size)
+{
+  struct image_span span = {(bytes[0] << 8) | bytes[1], (size - 2) / 2};
+  return span;
+}
+
+struct image_span image_overlap(struct image_span a, struct image_span b)
+{
+  uint32_t start = a.origin > b.origin ? a.origin : b.origin;
+  uint32_t a_end = a.origin + a.words, b_end = b.origin + b.words;
+  uint32_t end = a_end < b_end ? a_end : b_end;
+  struct image_span overlap = {start, end > start ? end - start : 0};
+  return overlap;
+}
+
+static void swap_scalar(uint16_t *dst, const uint8_t *src, size_t words)
+{
+  for (size_t i = 0; i < words; i++) {
+    dst[i] = (src[2 * i] << 8) | src[2 * i + 1];
+  }
+}
+
+#ifdef IMAGE_X86_SIMD
+__attribute__((target("ssse3")))
+static void swap_ssse3(uint16_t *dst, const uint8_t *src, size_t words)
+{
+  const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 8 <= words; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, swap));
+  }
+  swap_scalar(dst + i, src + 2 * i, words - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(uint16_t *dst, const uint8_t *src, size_t words)
+{
+  // vpshufb shuffles within each 128-bit lane, so the pattern repeats
+  const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 16 <= words; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, swap));
+  }
+  swap_scalar(dst + i, src + 2 * i, words - i);
+}
+#endif
+
+static swap_fn select_swap(const char **name)
+{
+#ifdef IMAGE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return swap_avx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    *name = "ssse3";
+    return swap_ssse3;
+  }
+#endif
+  *name = "scalar";
+  return swap_scalar;
+}
+
+void load_big_endian_words(uint16_t *dst, const uint8_t *src, size_t words)
+{
+  const char *name;
+  select_swap(&name)(dst, src, words);
+}
+
+const char *byteswap_name(void)
+{
+  const char *name;
+  select_swap(&name);
+  return name;
+}
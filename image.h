@@ -0,0 +1,36 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** LC-3 object images
+ * An image is a big-endian origin word followed by big-endian code words
+ * loaded at consecutive addresses from the origin.
+ **/
+
+/* NULL if the image is well formed and fits between its origin and xFFFF,
+ * otherwise what is wrong with it */
+const char *image_problem(const uint8_t *bytes, size_t size);
+
+/* the addresses an image loads: words consecutive words from origin */
+struct image_span
+{
+  uint16_t origin;
+  uint32_t words;           /* up to 65536, 0 for none */
+};
+
+/* where a well-formed image (see image_problem) loads */
+struct image_span image_span(const uint8_t *bytes, size_t size);
+
+/* the addresses both spans load, with no words if they do not overlap */
+struct image_span image_overlap(struct image_span a, struct image_span b);
+
+/* copy big-endian words from src (any alignment) to host-order dst, using
+ * the widest byte shuffle the CPU supports */
+void load_big_endian_words(uint16_t *dst, const uint8_t *src, size_t words);
+
+/* which implementation load_big_endian_words uses on this CPU */
+const char *byteswap_name(void);
+
+#endif
@@ -0,0 +1,847 @@
+/*
+ * x86-64 basic-block JIT
+ *
+ * LC-3 code is translated one basic block at a time into native code in an
+ * executable code cache. A block runs until it reaches a BR, JMP, JSR/JSRR or
+ * TRAP, the end of the program area, or MAX_BLOCK_LEN instructions.
+ *
+ * Host register assignment inside a block:
+ *   r8d..r15d  LC-3 R0..R7, zero-extended 16-bit values
+ *   esi        last flag-setting result (flag_result, see utils.h)
+ *   rbx        the struct vm, which starts with reg[]
+ *   rbp        &vm->memory[0]
+ *   eax, ecx, edx, edi  scratch
+ *
+ * Loads that may hit M_KBSR, every store and every TRAP call back into the C
+ * helpers in utils.c and opcode.c, so MMIO, self-modifying code and console
+ * I/O behave exactly as they do in the interpreters. Registers are written
+ * back to reg[] around those calls.
+ *
+ * Blocks jump directly to each other through jit->body when the successor has
+ * already been translated; otherwise they return the next PC to run_jit.
+ * Every block body starts by checking that the remaining budget covers the
+ * whole block, so chained blocks honour vm_run's instruction limit and stop
+ * as soon as a helper calls request_stop.
+ * Anything that cannot be translated (code in the MMIO page, a full code
+ * cache, a host that refuses executable mappings) runs one instruction at a
+ * time through the pre-decoded handlers instead.
+ *
+ * Each VM has its own code cache, since translated code embeds the addresses
+ * of that VM's tables.
+ */
+
+#include "jit.h"
+#include "decode.h"
+#include "opcode.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+
+#define CODE_CACHE_SIZE (4 << 20)
+#define MAX_BLOCK_LEN 64
+#define MAX_INSTR_CODE 512 /* upper bound on native bytes per instruction */
+
+/* host registers */
+enum host_reg
+{
+  H_RAX = 0,
+  H_RCX,
+  H_RDX,
+  H_RBX,
+  H_RSP,
+  H_RBP,
+  H_RSI,
+  H_RDI,
+  H_R8,
+  H_R9,
+  H_R10,
+  H_R11,
+  H_R12,
+  H_R13,
+  H_R14,
+  H_R15
+};
+
+#define GUEST(r) (H_R8 + (r)) /* host register holding LC-3 register r */
+#define H_FLAGS H_RSI
+
+typedef uint16_t (*jit_entry)(void);
+
+struct jit
+{
+  /* native entry (full prologue) and body (registers already loaded) per PC */
+  jit_entry blocks[UINT16_MAX + 1];
+  void *body[UINT16_MAX + 1];
+
+  /* instructions in the block starting at each PC */
+  uint8_t len[UINT16_MAX + 1];
+
+  /* nonzero for every guest address covered by a translated block */
+  uint8_t code_map[UINT16_MAX + 1];
+
+  /* set when a store invalidated the cache, checked by the storing block */
+  int flushed;
+
+  uint8_t *code_base, *code_ptr, *code_end;
+};
+
+/* translator state, per thread so separate VMs can compile concurrently */
+static __thread uint8_t *code_ptr;
+
+/* number of guest instructions not yet taken off vm->remaining */
+static __thread int pending_count;
+
+/* guest register holding the last flag-setting result that has not been
+ * copied to esi yet, or -1 if esi is up to date */
+static __thread int lazy_flag_reg;
+
+/* cache of the VM whose block is being translated */
+static __thread struct jit *cache;
+
+/* fields of struct vm the generated code addresses from rbx with a disp8 */
+#define VM_FLAGS_OFFSET offsetof(struct vm, flag_result)
+#define VM_REMAINING_OFFSET offsetof(struct vm, remaining)
+#define VM_STOP_OFFSET offsetof(struct vm, stop)
+_Static_assert(offsetof(struct vm, reg) == 0, "reg must start struct vm");
+_Static_assert(offsetof(struct vm, stop) < 128, "disp8 out of range");
+
+/*
+* Code Emitter
+-----------------------------
+* Minimal x86-64 encoder covering only the instruction forms the translator
+* needs. All register operands are host_reg numbers.
+*/
+
+static void emit8(uint8_t b)
+{
+  *code_ptr++ = b;
+}
+
+static void emit16(uint16_t v)
+{
+  memcpy(code_ptr, &v, 2);
+  code_ptr += 2;
+}
+
+static void emit32(uint32_t v)
+{
+  memcpy(code_ptr, &v, 4);
+  code_ptr += 4;
+}
+
+static void emit64(uint64_t v)
+{
+  memcpy(code_ptr, &v, 8);
+  code_ptr += 8;
+}
+
+static void emit_rex(int w, int r, int x, int b)
+{
+  uint8_t rex = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+  if (rex != 0x40) {
+    emit8(rex);
+  }
+}
+
+static void emit_modrm(int mod, int r, int rm)
+{
+  emit8((mod << 6) | ((r & 7) << 3) | (rm & 7));
+}
+
+/* <op> dst32, src32 for the 0x01 (add), 0x21 (and), 0x89 (mov) family */
+static void emit_rr(uint8_t op, int dst, int src)
+{
+  emit_rex(0, src, 0, dst);
+  emit8(op);
+  emit_modrm(3, src, dst);
+}
+
+/* 0x81 /ext dst32, imm32: ext 0 = add, 4 = and, 7 = cmp */
+static void emit_ri(int ext, int dst, uint32_t imm)
+{
+  emit_rex(0, 0, 0, dst);
+  emit8(0x81);
+  emit_modrm(3, ext, dst);
+  emit32(imm);
+}
+
+static void emit_mov_ri(int dst, uint32_t imm)
+{
+  emit_rex(0, 0, 0, dst);
+  emit8(0xB8 + (dst & 7));
+  emit32(imm);
+}
+
+static void emit_mov_ri64(int dst, uint64_t imm)
+{
+  emit_rex(1, 0, 0, dst);
+  emit8(0xB8 + (dst & 7));
+  emit64(imm);
+}
+
+static void emit_test_ri(int dst, uint32_t imm)
+{
+  emit_rex(0, 0, 0, dst);
+  emit8(0xF7);
+  emit_modrm(3, 0, dst);
+  emit32(imm);
+}
+
+static void emit_not(int dst)
+{
+  emit_rex(0, 0, 0, dst);
+  emit8(0xF7);
+  emit_modrm(3, 2, dst);
+}
+
+/* movzx dst32, src16 */
+static void emit_movzx_rr(int dst, int src)
+{
+  emit_rex(0, dst, 0, src);
+  emit8(0x0F);
+  emit8(0xB7);
+  emit_modrm(3, dst, src);
+}
+
+/* movzx dst32, word [rbx + disp8]: reload from reg[] */
+static void emit_load_reg(int dst, int guest_reg)
+{
+  emit_rex(0, dst, 0, H_RBX);
+  emit8(0x0F);
+  emit8(0xB7);
+  emit_modrm(1, dst, H_RBX);
+  emit8(guest_reg * 2);
+}
+
+/* mov word [rbx + disp8], src16: spill to reg[] */
+static void emit_store_reg(int guest_reg, int src)
+{
+  emit8(0x66);
+  emit_rex(0, src, 0, H_RBX);
+  emit8(0x89);
+  emit_modrm(1, src, H_RBX);
+  emit8(guest_reg * 2);
+}
+
+/* mov word [rbx + disp8], imm16 */
+static void emit_store_reg_imm(int guest_reg, uint16_t imm)
+{
+  emit8(0x66);
+  emit8(0xC7);
+  emit_modrm(1, 0, H_RBX);
+  emit8(guest_reg * 2);
+  emit16(imm);
+}
+
+/* movzx dst32, word [rbp + disp32]: guest load from a constant address */
+static void emit_load_mem_abs(int dst, uint16_t address)
+{
+  emit_rex(0, dst, 0, H_RBP);
+  emit8(0x0F);
+  emit8(0xB7);
+  emit_modrm(2, dst, H_RBP);
+  emit32(address * 2);
+}
+
+/* movzx dst32, word [rbp + rcx*2]: guest load from the address in ecx */
+static void emit_load_mem_rcx(int dst)
+{
+  emit_rex(0, dst, 0, H_RBP);
+  emit8(0x0F);
+  emit8(0xB7);
+  emit_modrm(1, dst, 4);
+  emit8(0x4D); /* SIB: scale 2, index rcx, base rbp */
+  emit8(0x00);
+}
+
+static void emit_push(int r)
+{
+  emit_rex(0, 0, 0, r);
+  emit8(0x50 + (r & 7));
+}
+
+static void emit_pop(int r)
+{
+  emit_rex(0, 0, 0, r);
+  emit8(0x58 + (r & 7));
+}
+
+static void emit_call(void *fn)
+{
+  emit_mov_ri64(H_RAX, (uint64_t)fn);
+  emit8(0xFF);
+  emit8(0xD0); /* call rax */
+}
+
+/* jcc/jmp with a 32-bit displacement; returns the location to patch */
+static uint8_t *emit_jcc32(uint8_t cc)
+{
+  emit8(0x0F);
+  emit8(0x80 | cc);
+  emit32(0);
+  return code_ptr - 4;
+}
+
+static uint8_t *emit_jmp32(void)
+{
+  emit8(0xE9);
+  emit32(0);
+  return code_ptr - 4;
+}
+
+static void patch32(uint8_t *at)
+{
+  int32_t rel = (int32_t)(code_ptr - (at + 4));
+  memcpy(at, &rel, 4);
+}
+
+#define CC_Z 0x4
+#define CC_NZ 0x5
+
+/*
+* Register Spilling
+-----------------------------
+* reg[] is the canonical copy outside a block. A full spill writes back all
+* guest registers and the flags; a partial spill only the caller-saved host
+* registers (r8..r11 and esi), which is enough for helpers that do not look at
+* guest registers.
+*/
+
+/* mov [rbx + disp8], esi or mov esi, [rbx + disp8] for the flag result */
+static void emit_flags_access(uint8_t op)
+{
+  emit8(op);
+  emit_modrm(1, H_FLAGS, H_RBX);
+  emit8(VM_FLAGS_OFFSET);
+}
+
+static void emit_spill(int full)
+{
+  int last = full ? R_7 : R_3;
+  for (int r = R_0; r <= last; r++) {
+    emit_store_reg(r, GUEST(r));
+  }
+  emit_flags_access(0x89);
+}
+
+static void emit_reload(int full)
+{
+  int last = full ? R_7 : R_3;
+  for (int r = R_0; r <= last; r++) {
+    emit_load_reg(GUEST(r), r);
+  }
+  emit_flags_access(0x8B);
+}
+
+/* retire n instructions: sub qword [rbx + remaining], n */
+static void emit_add_count(int n)
+{
+  if (n) {
+    emit8(0x48);
+    emit8(0x81);
+    emit_modrm(1, 5, H_RBX);
+    emit8(VM_REMAINING_OFFSET);
+    emit32(n);
+  }
+}
+
+static void emit_flush_count(void)
+{
+  emit_add_count(pending_count);
+  pending_count = 0;
+}
+
+/* full spill with PC and instruction count made visible, for helpers that
+ * may inspect or change machine state. The helper is called as fn(vm, ecx).
+ * The count is taken back afterwards because the call may sit on a
+ * conditional path; the block exit retires it. */
+static void emit_full_call(void *fn, uint16_t next_pc)
+{
+  emit_add_count(pending_count);
+  emit_spill(1);
+  emit_store_reg_imm(R_PC, next_pc);
+  emit8(0x48);
+  emit8(0x89);
+  emit8(0xDF); /* mov rdi, rbx */
+  emit_rr(0x89, H_RSI, H_RCX);
+  emit_call(fn);
+  emit_reload(1);
+  emit_add_count(-pending_count);
+}
+
+/*
+* Lazy Flags
+-----------------------------
+* Flag-setting instructions only note which guest register holds their
+* result. The result is copied into esi before anything that can observe it
+* (a spill, a BR, a block exit) and N/Z/P are only computed by a BR.
+*/
+
+static void emit_materialize_flags(void)
+{
+  if (lazy_flag_reg >= 0) {
+    emit_rr(0x89, H_FLAGS, GUEST(lazy_flag_reg));
+    lazy_flag_reg = -1;
+  }
+}
+
+/* eax = cond_flag_of(esi) */
+static void emit_cond_flag(void)
+{
+  emit8(0x31);
+  emit8(0xC0);           /* xor eax, eax */
+  emit_ri(7, H_FLAGS, COND_UNSET);
+  emit8(0x74);           /* je done */
+  uint8_t *j1 = code_ptr++;
+  emit_mov_ri(H_RAX, F_Z);
+  emit_rr(0x85, H_FLAGS, H_FLAGS);
+  emit8(0x74);           /* jz done */
+  uint8_t *j2 = code_ptr++;
+  emit_mov_ri(H_RAX, F_P);
+  emit_test_ri(H_FLAGS, 0x8000);
+  emit8(0x74);           /* jz done */
+  uint8_t *j3 = code_ptr++;
+  emit_mov_ri(H_RAX, F_N);
+  *j1 = (uint8_t)(code_ptr - (j1 + 1));
+  *j2 = (uint8_t)(code_ptr - (j2 + 1));
+  *j3 = (uint8_t)(code_ptr - (j3 + 1));
+}
+
+static void emit_epilogue(void)
+{
+  emit8(0x48);
+  emit8(0x83);
+  emit8(0xC4);
+  emit8(0x08); /* add rsp, 8 */
+  emit_pop(H_R15);
+  emit_pop(H_R14);
+  emit_pop(H_R13);
+  emit_pop(H_R12);
+  emit_pop(H_RBP);
+  emit_pop(H_RBX);
+  emit8(0xC3);
+}
+
+/* leave the block for a statically known PC, chaining if possible */
+static void emit_exit_static(uint16_t target)
+{
+  emit_flush_count();
+  emit_mov_ri64(H_RAX, (uint64_t)&cache->body[target]);
+  emit8(0x48);
+  emit8(0x8B);
+  emit8(0x00); /* mov rax, [rax] */
+  emit8(0x48);
+  emit8(0x85);
+  emit8(0xC0); /* test rax, rax */
+  emit8(0x74);
+  emit8(0x02); /* jz +2 */
+  emit8(0xFF);
+  emit8(0xE0); /* jmp rax */
+  emit_spill(1);
+  emit_mov_ri(H_RAX, target);
+  emit_epilogue();
+}
+
+/* leave the block for the PC held in ecx */
+static void emit_exit_dynamic(void)
+{
+  emit_flush_count();
+  emit_mov_ri64(H_RDX, (uint64_t)cache->body);
+  emit8(0x48);
+  emit8(0x8B);
+  emit8(0x14);
+  emit8(0xCA); /* mov rdx, [rdx + rcx*8] */
+  emit8(0x48);
+  emit8(0x85);
+  emit8(0xD2); /* test rdx, rdx */
+  emit8(0x74);
+  emit8(0x02); /* jz +2 */
+  emit8(0xFF);
+  emit8(0xE2); /* jmp rdx */
+  emit_spill(1);
+  emit_rr(0x89, H_RAX, H_RCX);
+  emit_epilogue();
+}
+
+/*
+* Memory Access
+-----------------------------
+* Loads go straight to memory[] unless the address is M_KBSR, which has to go
+* through read_from_memory. Stores always go through jit_store so write-side
+* bookkeeping (pre-decoded tables, this cache) stays in one place.
+*/
+
+static int jit_store(struct vm *vm, uint16_t address, uint16_t value)
+{
+  write_to_memory(vm, address, value);
+  return vm->jit->flushed;
+}
+
+/* A keyboard poll can stop the run (no key, non-blocking backend). Finish
+ * the load and leave so the block does not run past the stop. Loads into
+ * the ecx scratch are the first half of LDI/STI and are not checked. */
+static void emit_stop_check(int dst, uint16_t next_pc)
+{
+  if (dst == H_RCX) {
+    return;
+  }
+  emit8(0x83);
+  emit_modrm(1, 7, H_RBX);
+  emit8(VM_STOP_OFFSET);
+  emit8(0); /* cmp dword [rbx + stop], 0 */
+  uint8_t *cont = emit_jcc32(CC_Z);
+  emit_rr(0x89, H_FLAGS, dst);
+  emit_add_count(pending_count);
+  emit_spill(1);
+  emit_mov_ri(H_RAX, next_pc);
+  emit_epilogue();
+  patch32(cont);
+}
+
+/* dst = guest memory[ecx] */
+static void emit_load_dynamic(int dst, uint16_t next_pc)
+{
+  emit_ri(7, H_RCX, M_KBSR); /* cmp ecx, M_KBSR */
+  uint8_t *fast = emit_jcc32(CC_NZ);
+  emit_full_call(read_from_memory, next_pc);
+  emit_movzx_rr(dst, H_RAX);
+  emit_stop_check(dst, next_pc);
+  uint8_t *done = emit_jmp32();
+  patch32(fast);
+  emit_load_mem_rcx(dst);
+  patch32(done);
+}
+
+/* dst = guest memory[address] for a constant address */
+static void emit_load_static(int dst, uint16_t address, uint16_t next_pc)
+{
+  if (address == M_KBSR) {
+    emit_mov_ri(H_RCX, address);
+    emit_full_call(read_from_memory, next_pc);
+    emit_movzx_rr(dst, H_RAX);
+    emit_stop_check(dst, next_pc);
+  }
+  else {
+    emit_load_mem_abs(dst, address);
+  }
+}
+
+/* guest memory[ecx] = src, leaving the block if the store hit translated code */
+static void emit_store(int src, uint16_t next_pc)
+{
+  emit_spill(0);
+  emit8(0x48);
+  emit8(0x89);
+  emit8(0xDF); /* mov rdi, rbx */
+  emit_rr(0x89, H_RSI, H_RCX);
+  emit_movzx_rr(H_RDX, src);
+  emit_call(jit_store);
+  emit_reload(0);
+  emit_rr(0x85, H_RAX, H_RAX); /* test eax, eax */
+  uint8_t *cont = emit_jcc32(CC_Z);
+  emit_add_count(pending_count);
+  emit_spill(1);
+  emit_mov_ri(H_RAX, next_pc);
+  emit_epilogue();
+  patch32(cont);
+}
+
+/*
+* Translator
+-----------------------------
+*/
+
+static struct jit *jit_init(void)
+{
+  struct jit *j = calloc(1, sizeof(struct jit));
+  if (!j) {
+    return NULL;
+  }
+  j->code_base = mmap(NULL, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j->code_base == MAP_FAILED) {
+    j->code_base = NULL;
+    return j;
+  }
+  j->code_ptr = j->code_base;
+  j->code_end = j->code_base + CODE_CACHE_SIZE;
+  return j;
+}
+
+void jit_free(struct vm *vm)
+{
+  struct jit *j = vm->jit;
+  if (!j) {
+    return;
+  }
+  if (j->code_base) {
+    munmap(j->code_base, CODE_CACHE_SIZE);
+  }
+  free(j);
+  vm->jit = NULL;
+}
+
+static void jit_flush(struct jit *j)
+{
+  memset(j->blocks, 0, sizeof(j->blocks));
+  memset(j->body, 0, sizeof(j->body));
+  memset(j->code_map, 0, sizeof(j->code_map));
+  j->code_ptr = j->code_base;
+  j->flushed = 1;
+}
+
+static int jit_invalidate(struct vm *vm, uint16_t address)
+/*
+ Code tracking callback. Lines are coarser than code_map, so only a store
+ into a word that was actually translated flushes the cache.
+*/
+{
+  if (vm->jit && vm->jit->code_map[address]) {
+    jit_flush(vm->jit);
+    return 1;
+  }
+  return 0;
+}
+
+static jit_entry jit_compile(struct vm *vm, uint16_t start)
+/*
+ Translate the basic block starting at start. Returns NULL if the block
+ cannot be translated and must be interpreted.
+*/
+{
+  struct jit *j = vm->jit;
+  if (start >= M_KBSR) {
+    return NULL;
+  }
+  if (j->code_end - j->code_ptr < MAX_BLOCK_LEN * MAX_INSTR_CODE + 256) {
+    jit_flush(j);
+    j->flushed = 0;
+  }
+
+  cache = j;
+  code_ptr = j->code_ptr;
+  jit_entry entry = (jit_entry)code_ptr;
+  pending_count = 0;
+  lazy_flag_reg = -1;
+
+  /* prologue: save callee-saved registers, keep the stack 16-byte aligned */
+  emit_push(H_RBX);
+  emit_push(H_RBP);
+  emit_push(H_R12);
+  emit_push(H_R13);
+  emit_push(H_R14);
+  emit_push(H_R15);
+  emit8(0x48);
+  emit8(0x83);
+  emit8(0xEC);
+  emit8(0x08); /* sub rsp, 8 */
+  emit_mov_ri64(H_RBX, (uint64_t)vm);
+  emit_mov_ri64(H_RBP, (uint64_t)vm->memory);
+  emit_reload(1);
+
+  /* budget check: cmp qword [rbx + remaining], block length; jl out */
+  void *body = code_ptr;
+  emit8(0x48);
+  emit8(0x81);
+  emit_modrm(1, 7, H_RBX);
+  emit8(VM_REMAINING_OFFSET);
+  emit32(0);
+  uint8_t *block_len = code_ptr - 4;
+  uint8_t *over_budget = emit_jcc32(0xC);
+
+  uint16_t pc = start;
+  int n;
+
+  for (n = 0; ; n++) {
+    if (n == MAX_BLOCK_LEN || pc >= M_KBSR) {
+      emit_materialize_flags();
+      emit_exit_static(pc);
+      break;
+    }
+
+    uint16_t bits = vm->memory[pc];
+    uint16_t next = pc + 1;
+    struct decoded d;
+    decode_instruction(bits, &d);
+    j->code_map[pc] = 1;
+    smc_mark_code(vm, pc);
+    pending_count++;
+
+    int dr = GUEST(d.DR);
+    int sr1 = GUEST(d.SR1);
+    int end = 0;
+
+    // everything except pure register arithmetic may spill or leave the block
+    if (d.kind != K_ADD_REG && d.kind != K_ADD_IMM && d.kind != K_AND_REG
+        && d.kind != K_AND_IMM && d.kind != K_NOT && d.kind != K_LEA) {
+      emit_materialize_flags();
+    }
+
+    switch (d.kind) {
+      case K_ADD_REG:
+      case K_AND_REG:
+        emit_rr(0x89, H_RAX, sr1);
+        emit_rr(d.kind == K_ADD_REG ? 0x01 : 0x21, H_RAX, GUEST(d.SR2));
+        emit_movzx_rr(dr, H_RAX);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_ADD_IMM:
+      case K_AND_IMM:
+        emit_rr(0x89, H_RAX, sr1);
+        emit_ri(d.kind == K_ADD_IMM ? 0 : 4, H_RAX, d.imm);
+        emit_movzx_rr(dr, H_RAX);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_NOT:
+        emit_rr(0x89, H_RAX, sr1);
+        emit_not(H_RAX);
+        emit_movzx_rr(dr, H_RAX);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_LEA:
+        emit_mov_ri(dr, (uint16_t)(next + d.imm));
+        lazy_flag_reg = d.DR;
+        break;
+      case K_LD:
+        emit_load_static(dr, next + d.imm, next);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_LDI:
+        emit_load_static(H_RCX, next + d.imm, next);
+        emit_load_dynamic(dr, next);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_LDR:
+        emit_rr(0x89, H_RCX, sr1);
+        emit_ri(0, H_RCX, d.imm);
+        emit_movzx_rr(H_RCX, H_RCX);
+        emit_load_dynamic(dr, next);
+        lazy_flag_reg = d.DR;
+        break;
+      case K_ST:
+        emit_mov_ri(H_RCX, (uint16_t)(next + d.imm));
+        emit_store(dr, next);
+        break;
+      case K_STI:
+        emit_load_static(H_RCX, next + d.imm, next);
+        emit_store(dr, next);
+        break;
+      case K_STR:
+        emit_rr(0x89, H_RCX, sr1);
+        emit_ri(0, H_RCX, d.imm);
+        emit_movzx_rr(H_RCX, H_RCX);
+        emit_store(dr, next);
+        break;
+      case K_BR:
+        if (d.DR) {
+          emit_cond_flag();
+          emit_test_ri(H_RAX, d.DR);
+          uint8_t *not_taken = emit_jcc32(CC_Z);
+          int count = pending_count;
+          emit_exit_static(next + d.imm);
+          patch32(not_taken);
+          pending_count = count;
+          emit_exit_static(next);
+          end = 1;
+        }
+        break;
+      case K_JMP:
+        emit_rr(0x89, H_RCX, sr1);
+        emit_exit_dynamic();
+        end = 1;
+        break;
+      case K_JSR:
+        emit_mov_ri(GUEST(R_7), next);
+        emit_exit_static(next + d.imm);
+        end = 1;
+        break;
+      case K_JSRR:
+        emit_rr(0x89, H_RCX, sr1);
+        emit_mov_ri(GUEST(R_7), next);
+        emit_exit_dynamic();
+        end = 1;
+        break;
+      case K_TRAP:
+        // the trap may rewind PC or stop the run, so exit through reg[R_PC]
+        emit_mov_ri(H_RCX, bits);
+        emit_full_call(op_trap, next);
+        emit_load_reg(H_RCX, R_PC);
+        emit_exit_dynamic();
+        end = 1;
+        break;
+      default:
+        // RTI and reserved opcodes are no-ops
+        break;
+    }
+
+    if (end) {
+      n++;
+      break;
+    }
+    pc = next;
+  }
+
+  // not enough budget left for the whole block: hand back to run_jit
+  uint32_t len = n;
+  memcpy(block_len, &len, 4);
+  patch32(over_budget);
+  emit_spill(1);
+  emit_mov_ri(H_RAX, start);
+  emit_epilogue();
+
+  j->code_ptr = code_ptr;
+  j->blocks[start] = entry;
+  j->body[start] = body;
+  j->len[start] = len;
+  return entry;
+}
+
+void run_jit(struct vm *vm)
+{
+  if (!vm->jit) {
+    vm->jit = jit_init();
+    if (!vm->jit) {
+      run_decoded(vm);
+      return;
+    }
+    if (!vm->jit->code_base) {
+      fprintf(stderr, "jit: executable memory unavailable, interpreting\n");
+    }
+    smc_watch(vm, jit_invalidate);
+  }
+
+  struct jit *j = vm->jit;
+  while (vm->remaining > 0)
+  {
+    uint16_t pc = vm->reg[R_PC];
+    jit_entry block = j->blocks[pc];
+    if (!block && j->code_base) {
+      block = jit_compile(vm, pc);
+    }
+
+    if (block && vm->remaining >= j->len[pc]) {
+      vm->reg[R_PC] = block();
+      j->flushed = 0;
+    }
+    else {
+      // fall back to the pre-decoded handlers for one instruction
+      struct decoded d;
+      decode_instruction(read_from_memory(vm, vm->reg[R_PC]++), &d);
+      vm->remaining--;
+      d.handler(vm, &d);
+    }
+  }
+}
+
+#else
+
+void jit_free(struct vm *vm)
+{
+}
+
+void run_jit(struct vm *vm)
+{
+  run_decoded(vm);
+}
+
+#endif
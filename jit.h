@@ -0,0 +1,11 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+struct vm;
+
+void run_jit(struct vm *vm);
+void jit_free(struct vm *vm);
+
+#endif
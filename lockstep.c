@@ -0,0 +1,433 @@
+/*
+ * Lockstep differential checking
+ *
+ * Both machines get their own console over the same key buffer and hash
+ * what they print, so input, output and memory can be compared without
+ * keeping copies. write_to_memory marks every page it stores to
+ * (smc_note_store); a comparison only looks at pages either machine marked
+ * since the last one, plus the two device registers read_from_memory sets
+ * behind its back.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "disasm.h"
+#include "opcode.h"
+#include "utils.h"
+
+#define PAGE_WORDS (1 << CODE_PAGE_SHIFT)
+
+struct lockstep_console
+{
+  const uint8_t *input;
+  size_t input_len;
+  size_t input_pos;
+  uint64_t output_len;
+  uint64_t output_hash;     /* FNV-1a of everything printed */
+};
+
+struct machine
+{
+  struct vm *vm;
+  struct lockstep_console console;
+};
+
+static int console_key_ready(void *ctx)
+{
+  struct lockstep_console *console = ctx;
+  return console->input_pos < console->input_len ? 1 : -1;
+}
+
+static int console_read_key(void *ctx)
+{
+  struct lockstep_console *console = ctx;
+  if (console->input_pos >= console->input_len) {
+    return EOF;
+  }
+  return console->input[console->input_pos++];
+}
+
+static void console_write(void *ctx, const char *buf, size_t len)
+{
+  struct lockstep_console *console = ctx;
+  uint64_t hash = console->output_hash;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)buf[i]) * 0x100000001B3ULL;
+  }
+  console->output_hash = hash;
+  console->output_len += len;
+}
+
+static void console_flush(void *ctx)
+{
+}
+
+static void machine_stop(struct machine *machine)
+{
+  vm_destroy(machine->vm);
+  machine->vm = NULL;
+}
+
+static int machine_start(struct machine *machine, enum vm_engine engine,
+                         const struct lockstep_options *options,
+                         lockstep_loader load, void *ctx)
+{
+  struct lockstep_console console = {options->input, options->input_len, 0, 0,
+                                     0xCBF29CE484222325ULL};
+  machine->console = console;
+  machine->vm = vm_create();
+  if (!machine->vm) {
+    return 0;
+  }
+  struct vm_io io = {
+    &machine->console, console_key_ready, console_read_key, console_write,
+    console_flush, NULL
+  };
+  vm_set_io(machine->vm, &io);
+  vm_set_engine(machine->vm, engine);
+  vm_set_strict(machine->vm, options->strict);
+  machine->vm->fuse = options->fuse && engine == VM_ENGINE_DECODED;
+  // keys are never late, so a polling guest must not be cut short
+  machine->vm->idle_detection = 0;
+  if (!load(machine->vm, ctx)) {
+    machine_stop(machine);
+    return 0;
+  }
+  // both loaded the same program: only what they store from now on counts
+  memset(machine->vm->code.dirty, 0, sizeof(machine->vm->code.dirty));
+  return 1;
+}
+
+static void add_diff(struct lockstep_report *report, enum lockstep_field field,
+                     uint16_t where, uint64_t reference, uint64_t candidate)
+{
+  if (report->diff_count < LOCKSTEP_MAX_DIFFS) {
+    struct lockstep_diff diff = {field, where, reference, candidate};
+    report->diffs[report->diff_count++] = diff;
+  }
+}
+
+static void compare_word(struct lockstep_report *report, const struct vm *reference,
+                         const struct vm *candidate, uint16_t address)
+{
+  if (reference->memory[address] != candidate->memory[address]) {
+    report->memory_diffs++;
+    add_diff(report, LOCKSTEP_MEMORY, address, reference->memory[address],
+             candidate->memory[address]);
+  }
+}
+
+static int compare(struct machine *reference, struct machine *candidate,
+                   enum vm_stop reference_stop, enum vm_stop candidate_stop,
+                   struct lockstep_report *report)
+/*
+ Fill report->diffs with what differs between the machines and clear their
+ dirty pages. Returns the number of differences found.
+*/
+{
+  struct vm *ref = reference->vm, *cand = candidate->vm;
+  report->diff_count = 0;
+  report->memory_diffs = 0;
+
+  if (reference_stop != candidate_stop) {
+    add_diff(report, LOCKSTEP_STOP, 0, reference_stop, candidate_stop);
+  }
+  if (vm_instructions(ref) != vm_instructions(cand)) {
+    add_diff(report, LOCKSTEP_INSTRUCTIONS, 0, vm_instructions(ref), vm_instructions(cand));
+  }
+  for (int r = 0; r <= R_PC; r++) {
+    if (ref->reg[r] != cand->reg[r]) {
+      add_diff(report, LOCKSTEP_REGISTER, r, ref->reg[r], cand->reg[r]);
+    }
+  }
+  uint16_t ref_flags = get_cond_flag(ref), cand_flags = get_cond_flag(cand);
+  if (ref_flags != cand_flags) {
+    add_diff(report, LOCKSTEP_FLAGS, 0, ref_flags, cand_flags);
+  }
+  if (reference->console.input_pos != candidate->console.input_pos) {
+    add_diff(report, LOCKSTEP_INPUT, 0, reference->console.input_pos,
+             candidate->console.input_pos);
+  }
+  if (reference->console.output_len != candidate->console.output_len
+      || reference->console.output_hash != candidate->console.output_hash) {
+    add_diff(report, LOCKSTEP_OUTPUT, 0, reference->console.output_len,
+             candidate->console.output_len);
+  }
+
+  for (int i = 0; i < CODE_PAGES / 64; i++) {
+    uint64_t dirty = ref->code.dirty[i] | cand->code.dirty[i];
+    ref->code.dirty[i] = cand->code.dirty[i] = 0;
+    while (dirty) {
+      uint32_t page = i * 64 + __builtin_ctzll(dirty);
+      dirty &= dirty - 1;
+      uint16_t *a = ref->memory + page * PAGE_WORDS, *b = cand->memory + page * PAGE_WORDS;
+      if (memcmp(a, b, PAGE_WORDS * sizeof(uint16_t)) != 0) {
+        for (uint32_t word = 0; word < PAGE_WORDS; word++) {
+          compare_word(report, ref, cand, page * PAGE_WORDS + word);
+        }
+      }
+    }
+  }
+  compare_word(report, ref, cand, M_KBSR);
+  compare_word(report, ref, cand, M_KBDR);
+  return report->diff_count;
+}
+
+static uint64_t run_both(struct machine *reference, struct machine *candidate,
+                         uint64_t budget, enum vm_stop *reference_stop,
+                         enum vm_stop *candidate_stop)
+{
+  *reference_stop = vm_run(reference->vm, budget);
+  *candidate_stop = vm_run(candidate->vm, budget);
+  return vm_instructions(reference->vm);
+}
+
+static uint64_t next_budget(const struct lockstep_options *options, uint64_t interval,
+                            uint64_t done)
+{
+  if (options->limit && options->limit - done < interval) {
+    return options->limit - done;
+  }
+  return interval;
+}
+
+static void narrow(lockstep_loader load, void *ctx, const struct lockstep_options *options,
+                   uint64_t interval, uint64_t good, struct lockstep_report *report)
+/*
+ The machines matched after good instructions and differ at the end of the
+ next interval. Rebuild them, run them to good with the same intervals as
+ before (a bug may depend on where vm_run stops), then single-step. If no
+ step shows the difference, keep the interval's report.
+*/
+{
+  struct machine reference, candidate;
+  int started = machine_start(&reference, VM_ENGINE_SWITCH, options, load, ctx);
+  if (started && !machine_start(&candidate, options->engine, options, load, ctx)) {
+    machine_stop(&reference);
+    started = 0;
+  }
+  if (!started) {
+    return;
+  }
+  struct lockstep_report step = *report;
+  enum vm_stop reference_stop = VM_STOP_LIMIT, candidate_stop = VM_STOP_LIMIT;
+  uint64_t done = 0;
+  while (done < good && reference_stop == VM_STOP_LIMIT) {
+    uint64_t budget = next_budget(options, interval, done);
+    if (budget > good - done) {
+      budget = good - done;
+    }
+    done = run_both(&reference, &candidate, budget, &reference_stop, &candidate_stop);
+  }
+  compare(&reference, &candidate, reference_stop, candidate_stop, &step);
+
+  uint64_t end = good + next_budget(options, interval, good);
+  while (vm_instructions(reference.vm) < end) {
+    uint16_t pc = reference.vm->reg[R_PC];
+    uint16_t bits = reference.vm->memory[pc];
+    run_both(&reference, &candidate, 1, &reference_stop, &candidate_stop);
+    if (compare(&reference, &candidate, reference_stop, candidate_stop, &step)) {
+      step.exact = 1;
+      step.instructions = vm_instructions(reference.vm);
+      step.stop = reference_stop;
+      step.pc = pc;
+      step.bits = bits;
+      *report = step;
+      break;
+    }
+    if (reference_stop != VM_STOP_LIMIT) {
+      break;
+    }
+  }
+  machine_stop(&reference);
+  machine_stop(&candidate);
+}
+
+int lockstep_run(lockstep_loader load, void *ctx, const struct lockstep_options *options,
+                 struct lockstep_report *report)
+{
+  memset(report, 0, sizeof(*report));
+  uint64_t interval = options->interval ? options->interval : LOCKSTEP_INTERVAL;
+  struct machine reference, candidate;
+  if (!machine_start(&reference, VM_ENGINE_SWITCH, options, load, ctx)) {
+    return 0;
+  }
+  if (!machine_start(&candidate, options->engine, options, load, ctx)) {
+    machine_stop(&reference);
+    return 0;
+  }
+
+  uint64_t good = 0;
+  enum vm_stop reference_stop = VM_STOP_LIMIT, candidate_stop;
+  uint64_t budget;
+  while (reference_stop == VM_STOP_LIMIT && (budget = next_budget(options, interval, good))) {
+    uint64_t done = run_both(&reference, &candidate, budget, &reference_stop, &candidate_stop);
+    if (compare(&reference, &candidate, reference_stop, candidate_stop, report)) {
+      report->diverged = 1;
+      report->instructions = done;
+      report->stop = reference_stop;
+      machine_stop(&reference);
+      machine_stop(&candidate);
+      narrow(load, ctx, options, interval, good, report);
+      return 1;
+    }
+    good = done;
+  }
+  report->instructions = good;
+  report->stop = reference_stop;
+  machine_stop(&reference);
+  machine_stop(&candidate);
+  return 1;
+}
+
+static const char *flags_name(uint64_t flags)
+{
+  return flags == F_N ? "N" : flags == F_Z ? "Z" : flags == F_P ? "P" : "none";
+}
+
+void lockstep_print_report(const struct lockstep_report *report, enum vm_engine engine,
+                           FILE *out)
+{
+  const char *name = vm_engine_name(engine);
+  if (!report->diverged) {
+    fprintf(out, "lockstep: %s matches the reference over %llu instructions (%s)\n", name,
+            (unsigned long long)report->instructions, vm_stop_name(report->stop));
+    return;
+  }
+  if (report->exact) {
+    char text[64];
+    disassemble(report->pc, report->bits, text, sizeof(text));
+    fprintf(out, "lockstep: %s differs from the reference after instruction %llu,\n"
+            "  x%04X: %04X  %s\n", name, (unsigned long long)report->instructions,
+            report->pc, report->bits, text);
+  }
+  else {
+    fprintf(out, "lockstep: %s differs from the reference at instruction %llu; "
+            "single-stepping did not reproduce it\n", name,
+            (unsigned long long)report->instructions);
+  }
+  for (int i = 0; i < report->diff_count; i++) {
+    const struct lockstep_diff *diff = &report->diffs[i];
+    unsigned long long ref = diff->reference, cand = diff->candidate;
+    switch (diff->field) {
+      case LOCKSTEP_REGISTER:
+        if (diff->where == R_PC) {
+          fprintf(out, "  PC: reference x%04llX, %s x%04llX\n", ref, name, cand);
+        }
+        else {
+          fprintf(out, "  R%d: reference x%04llX, %s x%04llX\n", diff->where, ref, name, cand);
+        }
+        break;
+      case LOCKSTEP_FLAGS:
+        fprintf(out, "  flags: reference %s, %s %s\n", flags_name(ref), name, flags_name(cand));
+        break;
+      case LOCKSTEP_MEMORY:
+        fprintf(out, "  memory x%04X: reference x%04llX, %s x%04llX\n", diff->where, ref,
+                name, cand);
+        break;
+      case LOCKSTEP_OUTPUT:
+        fprintf(out, "  output: reference %llu bytes, %s %llu bytes%s\n", ref, name, cand,
+                ref == cand ? " with different contents" : "");
+        break;
+      case LOCKSTEP_INPUT:
+        fprintf(out, "  keys read: reference %llu, %s %llu\n", ref, name, cand);
+        break;
+      case LOCKSTEP_STOP:
+        fprintf(out, "  stop: reference %s, %s %s\n", vm_stop_name(ref), name,
+                vm_stop_name(cand));
+        break;
+      case LOCKSTEP_INSTRUCTIONS:
+        fprintf(out, "  instructions: reference %llu, %s %llu\n", ref, name, cand);
+        break;
+    }
+  }
+  int listed = 0;
+  for (int i = 0; i < report->diff_count; i++) {
+    listed += report->diffs[i].field == LOCKSTEP_MEMORY;
+  }
+  if (report->memory_diffs > (uint32_t)listed) {
+    fprintf(out, "  ... %u more memory words differ\n", report->memory_diffs - listed);
+  }
+}
+
+/*
+* Random Programs
+-----------------------------
+*/
+
+static uint64_t next_random(uint64_t *state)
+{
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* opcode weights out of 64: mostly ALU, branches and memory */
+static const uint8_t opcode_weights[16] = {
+  [OP_BR] = 8, [OP_ADD] = 10, [OP_LD] = 4, [OP_ST] = 3, [OP_JSR] = 3, [OP_AND] = 8,
+  [OP_LDR] = 5, [OP_STR] = 4, [OP_RTI] = 1, [OP_NOT] = 4, [OP_LDI] = 2, [OP_STI] = 2,
+  [OP_JMP] = 2, [OP_RES] = 1, [OP_LEA] = 4, [OP_TRAP] = 3
+};
+
+/* trap vectors that return; a random one (HALT, unknown) now and then */
+static const uint8_t returning_traps[] = {
+  T_GETC, T_OUT, T_PUTS, T_IN, T_PUTSP,
+  T_MUL, T_DIVMOD, T_MEMCPY, T_MEMSET, T_STRLEN, T_STRCMP
+};
+
+static uint16_t random_instruction(uint64_t *state)
+{
+  uint64_t r = next_random(state);
+  uint16_t bits = r;
+  if (((r >> 32) & 15) == 0) {
+    // a zero word (a BR that never branches) in every sixteen ends the
+    // strings PUTS, STRLEN and STRCMP walk soon enough
+    return 0;
+  }
+  int pick = (r >> 16) & 63;
+  int opcode = 0;
+  while (pick >= opcode_weights[opcode]) {
+    pick -= opcode_weights[opcode++];
+  }
+  bits = (opcode << 12) | (bits & 0x0FFF);
+  if (opcode == OP_TRAP) {
+    unsigned which = (r >> 24) % (sizeof(returning_traps) + 1);
+    if (which < sizeof(returning_traps)) {
+      bits = (bits & 0xFF00) | returning_traps[which];
+    }
+  }
+  return bits;
+}
+
+static uint16_t and_r2(uint16_t imm5)
+{
+  return (OP_AND << 12) | (R_2 << 9) | (R_2 << 6) | (1 << 5) | imm5;
+}
+
+int lockstep_random_program(struct vm *vm, void *seed)
+{
+  uint64_t state = *(uint64_t *)seed * 0x9E3779B97F4A7C15ULL + 1;
+  for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+    uint16_t bits = random_instruction(&state);
+    uint16_t vector = bits & 0xFF;
+    if (bits >> 12 == OP_TRAP && (vector == T_MEMCPY || vector == T_MEMSET) &&
+        address + 2 <= UINT16_MAX) {
+      // a random count would make most of a run one block copy: AND R2 with
+      // #0..15 before, and clear it after, in case a loop jumps straight back
+      // to the trap
+      vm->memory[address++] = and_r2(next_random(&state) & 15);
+      vm->memory[address++] = bits;
+      bits = and_r2(0);
+    }
+    vm->memory[address] = bits;
+  }
+  free_engine_caches(vm);
+  for (int r = 0; r <= R_PC; r++) {
+    vm->reg[r] = next_random(&state);
+  }
+  return 1;
+}
@@ -0,0 +1,90 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "garbageeater.h"
+
+/** lockstep differential checking
+ * Runs a candidate engine and the reference switch engine (the op_*
+ * functions) side by side on the same machine and the same keys, interval
+ * instructions at a time, and after every interval compares registers,
+ * N/Z/P flags, the memory pages either VM stored to since the last
+ * comparison, the device registers, the bytes each one printed and read,
+ * and why each run stopped. On a mismatch both machines are rebuilt and
+ * replayed with the same intervals up to the last matching point, then
+ * single-stepped, so the report names the one instruction after which they
+ * first differ.
+ **/
+
+#define LOCKSTEP_MAX_DIFFS 8
+
+/* set up a fresh VM: load the program and registers. Called for both
+ * machines, and again for both when narrowing down a divergence; returns 0
+ * on failure */
+typedef int (*lockstep_loader)(struct vm *vm, void *ctx);
+
+struct lockstep_options
+{
+  enum vm_engine engine;    /* the candidate */
+  int fuse;
+  int strict;
+  uint64_t limit;           /* instructions, 0 for none */
+  uint64_t interval;        /* between comparisons, 0 for LOCKSTEP_INTERVAL */
+  const uint8_t *input;     /* keys both machines read, in order */
+  size_t input_len;
+};
+
+#define LOCKSTEP_INTERVAL 4096
+
+enum lockstep_field
+{
+  LOCKSTEP_REGISTER = 0,    /* where: register index, R_PC included */
+  LOCKSTEP_FLAGS,
+  LOCKSTEP_MEMORY,          /* where: address */
+  LOCKSTEP_OUTPUT,          /* values: bytes printed */
+  LOCKSTEP_INPUT,           /* values: keys read */
+  LOCKSTEP_STOP,            /* values: enum vm_stop */
+  LOCKSTEP_INSTRUCTIONS     /* values: instructions retired */
+};
+
+struct lockstep_diff
+{
+  uint8_t field;            /* enum lockstep_field */
+  uint16_t where;
+  uint64_t reference;
+  uint64_t candidate;
+};
+
+struct lockstep_report
+{
+  int diverged;
+  int exact;                /* narrowed to one instruction; if not, the
+                               machines differ somewhere in the interval
+                               ending at instructions */
+  uint64_t instructions;    /* retired by each machine when they stopped,
+                               or when they first differ */
+  enum vm_stop stop;        /* how the reference stopped */
+  uint16_t pc;              /* the instruction after which they differ */
+  uint16_t bits;
+  struct lockstep_diff diffs[LOCKSTEP_MAX_DIFFS];
+  int diff_count;
+  uint32_t memory_diffs;    /* words that differ, listed or not */
+};
+
+/* returns 0 if a loader fails, otherwise fills in report */
+int lockstep_run(lockstep_loader load, void *ctx, const struct lockstep_options *options,
+                 struct lockstep_report *report);
+
+void lockstep_print_report(const struct lockstep_report *report, enum vm_engine engine,
+                           FILE *out);
+
+/* a lockstep_loader for random programs; seed points to a uint64_t. All of
+ * memory gets random instructions, biased towards ALU, branch and memory
+ * operations and trap vectors that return, and the registers and PC random
+ * values, so any jump lands on code; a run ends when it meets a HALT or an
+ * unknown vector (rarely generated, or written by a store) or the keys run
+ * out */
+int lockstep_random_program(struct vm *vm, void *seed);
+
+#endif
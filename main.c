@@ -39,14 +39,521 @@
 
 #include "opcode.h"
 #include "utils.h"
+#include "decode.h"
+#include "output.h"
+#include "batch.h"
+#include "image.h"
+#include "perf.h"
+#include "profile.h"
+#include "cfg.h"
+#include "disasm.h"
+#include "lockstep.h"
+#include "trace.h"
+#include "watch.h"
+#include "aot.h"
 
 extern int errno;
 
+/* --stats bookkeeping, reported from print_stats at exit */
+static struct vm *vm;
+static struct timeval stats_start;
+static int images_loaded;
+static double load_seconds;
+
+static void print_stats(void)
+{
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  double seconds = (end.tv_sec - stats_start.tv_sec)
+                   + (end.tv_usec - stats_start.tv_usec) / 1e6;
+  uint64_t count = vm_instructions(vm);
+  fprintf(stderr, "load: %d image%s in %.3f ms (byteswap: %s)\n", images_loaded,
+          images_loaded == 1 ? "" : "s", load_seconds * 1e3, byteswap_name());
+  fprintf(stderr, "engine: %s  instructions: %llu  time: %.3f s  MIPS: %.2f\n",
+          vm_engine_name(vm->engine), (unsigned long long)count, seconds,
+          seconds > 0 ? count / seconds / 1e6 : 0.0);
+  fprintf(stderr, "idle waits: %llu  output: %llu bytes in %llu writes\n",
+          (unsigned long long)vm->idle_waits, (unsigned long long)output_bytes,
+          (unsigned long long)output_writes);
+  smc_report(vm, stderr);
+  long dirty = vm_dirty_pages(vm);
+  if (dirty >= 0) {
+    fprintf(stderr, "memory: %ld dirty pages (%ld KB)\n", dirty,
+            dirty * sysconf(_SC_PAGESIZE) / 1024);
+  }
+  const char *separator = "traps:";
+  for (int vector = 0; vector <= 0xFF; vector++) {
+    if (vm->trap_calls[vector]) {
+      const char *name = trap_name(vector);
+      if (name) {
+        fprintf(stderr, "%s %s %llu", separator, name, (unsigned long long)vm->trap_calls[vector]);
+      }
+      else {
+        fprintf(stderr, "%s x%02X %llu", separator, vector,
+                (unsigned long long)vm->trap_calls[vector]);
+      }
+      separator = ",";
+    }
+  }
+  if (*separator == ',') {
+    fputc('\n', stderr);
+  }
+}
+
+static void print_fusion(void)
+{
+  print_fusion_report(vm);
+}
+
+/* --profile[=file]: report written at exit, to stderr by default */
+static const char *profile_path;
+
+static void write_profile(void)
+{
+  FILE *out = profile_path ? fopen(profile_path, "w") : stderr;
+  if (!out) {
+    fprintf(stderr, "Error: cannot write %s\n", profile_path);
+    return;
+  }
+  profile_report(vm, out);
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+
+/* --perf[=window]: counters read every window instructions, reported at
+ * exit to stderr */
+static struct perf perf;
+
+static void write_perf(void)
+{
+  perf_window(&perf, vm);
+  perf_report(&perf, vm, stderr);
+  perf_close(&perf);
+}
+
+/* --trace=file: written while the program runs, closed at exit with its
+ * totals on stderr */
+static void close_trace(void)
+{
+  trace_close(vm, stderr);
+}
+
+/* --decode-trace=file: print a trace as text on stdout */
+static int decode_trace(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    fprintf(stderr, "Error: Could not find file %s\n", path);
+    return EXIT_FAILURE;
+  }
+  int ok = trace_decode(in, stdout);
+  fclose(in);
+  if (!ok) {
+    fprintf(stderr, "Error: %s is not a trace or is cut short\n", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* --aot=file.c: recompile the loaded program to C */
+static int write_aot(const char *path, const char *source)
+{
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    fprintf(stderr, "Error: cannot write %s\n", path);
+    return EXIT_FAILURE;
+  }
+  int ok = aot_emit(vm, source, out);
+  if (fclose(out) != 0 || !ok) {
+    fprintf(stderr, "Error: cannot write %s\n", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* --watch=xADDR[,xADDR...]: hex guest addresses, x prefix optional; returns
+ * 0 on a malformed list or if watchpoints are not available */
+static int arm_watchpoints(const char *list)
+{
+  while (*list) {
+    if (*list == 'x' || *list == 'X') {
+      list++;
+    }
+    char *end;
+    unsigned long address = strtoul(list, &end, 16);
+    if (end == list || address > UINT16_MAX || (*end && *end != ',')) {
+      fprintf(stderr, "Error: --watch takes hex addresses like x4000,x4001\n");
+      return 0;
+    }
+    if (!watch_add(vm, address)) {
+      fprintf(stderr, "Error: watchpoints need x86-64 Linux and mapped guest memory\n");
+      return 0;
+    }
+    list = *end ? end + 1 : end;
+  }
+  return 1;
+}
+
+static void print_watch_hits(void)
+{
+  struct watch_hit hits[WATCH_MAX_HITS];
+  uint64_t missed;
+  size_t count = watch_take_hits(vm, hits, WATCH_MAX_HITS, &missed);
+  for (size_t i = 0; i < count; i++) {
+    char text[64];
+    disassemble(hits[i].pc, vm->memory[hits[i].pc], text, sizeof(text));
+    fprintf(stderr, "watch: x%04X changed from x%04X to x%04X by x%04X: %s (instruction %llu)\n",
+            hits[i].address, hits[i].old_value, hits[i].new_value, hits[i].pc, text,
+            (unsigned long long)hits[i].instruction);
+  }
+  if (missed) {
+    fprintf(stderr, "watch: %llu more not recorded\n", (unsigned long long)missed);
+  }
+}
+
+/* --dump-cfg[=file]: analyse the loaded program, write its CFG as Graphviz
+ * dot (to stdout by default) and exit without running it */
+static int dump_cfg(const char *path)
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  struct cfg *cfg = cfg_build(vm, vm->reg[R_PC]);
+  gettimeofday(&end, NULL);
+  if (!cfg) {
+    fprintf(stderr, "Error: out of memory\n");
+    return EXIT_FAILURE;
+  }
+  FILE *out = path ? fopen(path, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "Error: cannot write %s\n", path);
+    cfg_free(cfg);
+    return EXIT_FAILURE;
+  }
+  cfg_write_dot(cfg, vm, out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  fprintf(stderr, "cfg: %zu blocks, %zu edges, %zu loops, %zu subroutines from x%04X in %.3f ms\n",
+          cfg->block_count, cfg->edge_count, cfg->loop_count, cfg->subroutine_count,
+          cfg->entry, ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec)) / 1e3);
+  cfg_free(cfg);
+  return EXIT_SUCCESS;
+}
+
+/* --lockstep[=keys]: run the images on the chosen engine and on the
+ * reference switch engine side by side and report the first difference */
+struct image_list
+{
+  const char **paths;
+  int count;
+};
+
+static int load_images(struct vm *target, void *ctx)
+{
+  const struct image_list *images = ctx;
+  for (int i = 0; i < images->count; i++) {
+    if (!read_program_code_into_memory(target, images->paths[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static uint8_t *read_keys(const char *path, size_t *len)
+{
+  *len = 0;
+  if (!path) {
+    return NULL;
+  }
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  size_t cap = 4096;
+  uint8_t *keys = malloc(cap);
+  size_t got;
+  while (keys && (got = fread(keys + *len, 1, cap - *len, file)) > 0) {
+    *len += got;
+    if (*len == cap) {
+      cap *= 2;
+      uint8_t *grown = realloc(keys, cap);
+      if (!grown) {
+        free(keys);
+      }
+      keys = grown;
+    }
+  }
+  fclose(file);
+  return keys;
+}
+
+static int run_lockstep(const char **paths, int path_count, const char *keys_path,
+                        struct lockstep_options *options)
+{
+  struct image_list images = {paths, path_count};
+  uint8_t *keys = read_keys(keys_path, &options->input_len);
+  if (keys_path && !keys) {
+    fprintf(stderr, "Error: Could not find file %s\n", keys_path);
+    return EXIT_FAILURE;
+  }
+  options->input = keys;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  struct lockstep_report report;
+  int ran = lockstep_run(load_images, &images, options, &report);
+  gettimeofday(&end, NULL);
+  free(keys);
+  if (!ran) {
+    return EXIT_FAILURE;
+  }
+  lockstep_print_report(&report, options->engine, stderr);
+  fprintf(stderr, "lockstep: %.3f s\n",
+          (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+  return report.diverged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* --fuzz=programs[:seed]: lockstep random programs from consecutive seeds,
+ * each with its own random keys, for up to --limit instructions */
+#define FUZZ_LIMIT 1000000
+#define FUZZ_KEYS 256
+
+static int run_fuzz(const char *spec, struct lockstep_options *options)
+{
+  char *end;
+  unsigned long long programs = strtoull(spec, &end, 10);
+  uint64_t seed = *end == ':' ? strtoull(end + 1, NULL, 0) : 1;
+  if (!options->limit) {
+    options->limit = FUZZ_LIMIT;
+  }
+  uint8_t keys[FUZZ_KEYS];
+  options->input = keys;
+  options->input_len = sizeof(keys);
+
+  uint64_t total = 0;
+  struct timeval start, now;
+  gettimeofday(&start, NULL);
+  for (unsigned long long i = 0; i < programs; i++, seed++) {
+    for (size_t k = 0; k < sizeof(keys); k++) {
+      keys[k] = (seed * 131 + k * 7919) >> 3;
+    }
+    struct lockstep_report report;
+    lockstep_run(lockstep_random_program, &seed, options, &report);
+    total += report.instructions;
+    if (report.diverged) {
+      fprintf(stderr, "fuzz: seed %llu\n", (unsigned long long)seed);
+      lockstep_print_report(&report, options->engine, stderr);
+      return EXIT_FAILURE;
+    }
+  }
+  gettimeofday(&now, NULL);
+  double seconds = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+  fprintf(stderr, "fuzz: %s matches the reference on %llu programs, %llu instructions "
+          "in %.3f s (%.2f M/s through both)\n", vm_engine_name(options->engine), programs,
+          (unsigned long long)total, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+  return EXIT_SUCCESS;
+}
+
+/* --snapshot: SIGUSR1, or Ctrl-\ at the terminal (SIGQUIT), asks for a
+ * snapshot. Like Ctrl-C it is served after the current RUN_SLICE, or at once
+ * if the guest is waiting for a key. */
+
+static volatile sig_atomic_t snapshot_requested;
+
+static void request_snapshot(int signal)
+{
+  snapshot_requested = 1;
+}
+
+static void install_snapshot_triggers(void)
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_snapshot;
+  sigemptyset(&action.sa_mask);
+  // no SA_RESTART: a blocked wait for input must return to save
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGQUIT, &action, NULL);
+}
+
 int main(int argc, const char *argv[])
 {
   // use errno for error handling
   int errnum;
-  if (argc <= 1) {
+  enum vm_engine engine = VM_ENGINE_DECODED;
+  int stats = 0;
+  int fuse = 0;
+  int idle_detection = 1;
+  int profile = 0;
+  uint64_t perf_slice = 0;
+  int strict = 0;
+  const char *batch_manifest = NULL;
+  const char *batch_results = NULL;
+  int batch_jobs = 0;
+  uint64_t batch_slice = 0;
+  int batch_simd = 0;
+  struct output_policy output_policy = {0, OUTPUT_FLUSH_USEC};
+  // images load in command-line order, so later ones overwrite earlier ones
+  const char *paths[argc];
+  int path_count = 0;
+  const char *snapshot_path = NULL;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  int cfg = 0;
+  const char *cfg_path = NULL;
+  int lockstep = 0;
+  const char *lockstep_keys = NULL;
+  const char *fuzz = NULL;
+  uint64_t limit = 0;
+  const char *trace_path = NULL;
+  const char *decode_path = NULL;
+  const char *watch_list = NULL;
+  const char *aot_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine=switch") == 0) {
+      engine = VM_ENGINE_SWITCH;
+    }
+    else if (strcmp(argv[i], "--engine=decoded") == 0) {
+      engine = VM_ENGINE_DECODED;
+    }
+    else if (strcmp(argv[i], "--engine=threaded") == 0) {
+      engine = VM_ENGINE_THREADED;
+    }
+    else if (strcmp(argv[i], "--engine=jit") == 0) {
+      engine = VM_ENGINE_JIT;
+    }
+    else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+    }
+    else if (strcmp(argv[i], "--fuse") == 0) {
+      fuse = 1;
+    }
+    else if (strcmp(argv[i], "--strict") == 0) {
+      strict = 1;
+    }
+    else if (strcmp(argv[i], "--no-idle") == 0) {
+      idle_detection = 0;
+    }
+    else if (strncmp(argv[i], "--flush=bytes:", 14) == 0) {
+      output_policy.flush_bytes = strtoull(argv[i] + 14, NULL, 10);
+    }
+    else if (strncmp(argv[i], "--flush=usec:", 13) == 0) {
+      output_policy.flush_usec = strtoull(argv[i] + 13, NULL, 10);
+    }
+    else if (strcmp(argv[i], "--flush=input") == 0) {
+      // flush only when the guest waits for input or exits
+      output_policy.flush_bytes = 0;
+      output_policy.flush_usec = 0;
+    }
+    else if (strncmp(argv[i], "--batch=", 8) == 0) {
+      batch_manifest = argv[i] + 8;
+    }
+    else if (strncmp(argv[i], "--results=", 10) == 0) {
+      batch_results = argv[i] + 10;
+    }
+    else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      batch_jobs = atoi(argv[i] + 7);
+    }
+    else if (strncmp(argv[i], "--slice=", 8) == 0) {
+      batch_slice = strtoull(argv[i] + 8, NULL, 10);
+    }
+    else if (strcmp(argv[i], "--simd") == 0) {
+      batch_simd = 1;
+    }
+    else if (strcmp(argv[i], "--profile") == 0) {
+      profile = 1;
+    }
+    else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = 1;
+      profile_path = argv[i] + 10;
+    }
+    else if (strcmp(argv[i], "--perf") == 0) {
+      perf_slice = PERF_WINDOW;
+    }
+    else if (strncmp(argv[i], "--perf=", 7) == 0) {
+      perf_slice = strtoull(argv[i] + 7, NULL, 10);
+      if (!perf_slice) {
+        fprintf(stderr, "Error: --perf needs a window of at least one instruction\n");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strcmp(argv[i], "--dump-cfg") == 0) {
+      cfg = 1;
+    }
+    else if (strncmp(argv[i], "--dump-cfg=", 11) == 0) {
+      cfg = 1;
+      cfg_path = argv[i] + 11;
+    }
+    else if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = 1;
+    }
+    else if (strncmp(argv[i], "--lockstep=", 11) == 0) {
+      lockstep = 1;
+      lockstep_keys = argv[i] + 11;
+    }
+    else if (strncmp(argv[i], "--fuzz=", 7) == 0) {
+      fuzz = argv[i] + 7;
+    }
+    else if (strncmp(argv[i], "--limit=", 8) == 0) {
+      limit = strtoull(argv[i] + 8, NULL, 10);
+    }
+    else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_path = argv[i] + 8;
+    }
+    else if (strncmp(argv[i], "--decode-trace=", 15) == 0) {
+      decode_path = argv[i] + 15;
+    }
+    else if (strncmp(argv[i], "--aot=", 6) == 0) {
+      aot_path = argv[i] + 6;
+    }
+    else if (strncmp(argv[i], "--watch=", 8) == 0) {
+      watch_list = argv[i] + 8;
+    }
+    else if (strncmp(argv[i], "--record=", 9) == 0) {
+      record_path = argv[i] + 9;
+    }
+    else if (strncmp(argv[i], "--replay=", 9) == 0) {
+      replay_path = argv[i] + 9;
+    }
+    else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+      snapshot_path = argv[i] + 11;
+    }
+    else if (strncmp(argv[i], "--resume=", 9) == 0) {
+      // the loader recognises snapshots; the flag just says what is expected
+      paths[path_count++] = argv[i] + 9;
+    }
+    else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    else {
+      paths[path_count++] = argv[i];
+    }
+  }
+
+  if (batch_manifest) {
+    // headless: no terminal setup, no output thread, no signal handler
+    struct batch_options batch = {batch_jobs, engine, fuse, idle_detection, strict,
+                                   batch_slice, batch_simd};
+    return run_batch(batch_manifest, batch_results, &batch) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (decode_path) {
+    return decode_trace(decode_path);
+  }
+
+  if (lockstep || fuzz) {
+    struct lockstep_options options = {engine, fuse, strict, limit, 0, NULL, 0};
+    if (fuzz) {
+      return run_fuzz(fuzz, &options);
+    }
+    if (path_count) {
+      return run_lockstep(paths, path_count, lockstep_keys, &options);
+    }
+  }
+
+  if (path_count == 0) {
     errno = 2;
     errnum = errno;
     fprintf(stderr, "Value of errno:%d\n", errno);
@@ -55,112 +562,153 @@ int main(int argc, const char *argv[])
     return EXIT_FAILURE;
   }
 
+  vm = vm_create();
+  if (!vm) {
+    fprintf(stderr, "Error: out of memory\n");
+    return EXIT_FAILURE;
+  }
+  vm_set_engine(vm, engine);
+  vm_set_strict(vm, strict);
+  vm->idle_detection = idle_detection;
+  vm->fuse = fuse && engine == VM_ENGINE_DECODED;
+
+  struct timeval load_start, load_end;
+  gettimeofday(&load_start, NULL);
+  if (read_program_images(vm, paths, path_count) < 0) {
+    return EXIT_FAILURE;
+  }
+  gettimeofday(&load_end, NULL);
+  images_loaded = path_count;
+  load_seconds = (load_end.tv_sec - load_start.tv_sec)
+                 + (load_end.tv_usec - load_start.tv_usec) / 1e6;
+
+  if (cfg) {
+    return dump_cfg(cfg_path);
+  }
+  if (aot_path) {
+    return write_aot(aot_path, paths[path_count - 1]);
+  }
+
+  if (record_path && !vm_record_input(vm, record_path)) {
+    fprintf(stderr, "Error: cannot write %s\n", record_path);
+    return EXIT_FAILURE;
+  }
+  if (replay_path && !vm_replay_input(vm, replay_path)) {
+    fprintf(stderr, "Error: %s is not a readable input log\n", replay_path);
+    return EXIT_FAILURE;
+  }
+
   // make it work with unix terminal
-  signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
-
-  // file path to program LC-3 should run
-  const char *path_to_code = argv[1];
-  read_program_code_into_memory(path_to_code);
-
-  // 0x3000 is the default PC position, start of memory available for programs
-  uint16_t PC_INIT = 0x3000;
-  reg[R_PC] = PC_INIT;
-
-  while (1)
-  {
-    // load instruction from memory
-    uint16_t instruction = read_from_memory(reg[R_PC]++);
-    uint16_t opcode = instruction >> 12;
-
-    switch (opcode) {
-      
-      // branch
-      case OP_BR:
-        op_br(instruction);
-        break;
-      
-      // add
-      case OP_ADD:
-        op_add(instruction);
-        break;
-      
-      // load
-      case OP_LD:
-        op_ld(instruction);
-        break;
-      
-      // store
-      case OP_ST:
-        op_st(instruction);
-        break;
-      
-      // jump register
-      case OP_JSR:
-        op_jsr(instruction);
-        break;
-
-      // bitwise and
-      case OP_AND:
-        op_and(instruction);
-        break;
-
-      // load register
-      case OP_LDR:
-        op_ldr(instruction);
-        break;
-      
-      // store register
-      case OP_STR:
-        op_str(instruction);
-        break;
-
-      // unused
-      case OP_RTI:
-        break;
-
-      // bitwise not
-      case OP_NOT:
-        op_not(instruction);
-        break;
-
-      // load indirect
-      case OP_LDI:
-        op_ldi(instruction);
-        break;
-      
-      // store indirect
-      case OP_STI:
-        op_sti(instruction);
-        break;
-      
-      // jump
-      case OP_JMP:
-        op_jmp(instruction);
-        break;
-      
-      // reserve (unused)
-      case OP_RES:
-        break;
-
-      // load effective address  
-      case OP_LEA:
-        op_lea(instruction);
-        break;
-      
-      // execute trap
-      case OP_TRAP:
-        op_trap(instruction);
-        break;
-      
-      default:
-        abort();
-        break;
-    }
-  }
-
-  // restore terminal state
+  install_interrupt_handler();
+  if (snapshot_path) {
+    install_snapshot_triggers();
+  }
+  if (!replay_path) {
+    // a replay never reads the terminal
+    disable_input_buffering();
+  }
+
+  if (output_start(&output_policy)) {
+    atexit(output_shutdown);
+  }
+
+  if (fuse && engine != VM_ENGINE_DECODED) {
+    fprintf(stderr, "Warning: --fuse only applies to --engine=decoded\n");
+  }
+  if (vm->fuse) {
+    atexit(print_fusion);
+  }
+
+  if (profile) {
+    if (!profile_enable(vm)) {
+      fprintf(stderr, "Error: out of memory\n");
+      return EXIT_FAILURE;
+    }
+    atexit(write_profile);
+    if (engine != VM_ENGINE_SWITCH) {
+      fprintf(stderr, "Note: --profile runs the switch engine\n");
+    }
+  }
+
+  if (trace_path) {
+    if (!trace_open(vm, trace_path)) {
+      fprintf(stderr, "Error: cannot write %s\n", trace_path);
+      return EXIT_FAILURE;
+    }
+    atexit(close_trace);
+    if (engine != VM_ENGINE_SWITCH) {
+      fprintf(stderr, "Note: --trace runs the switch engine\n");
+    }
+  }
+
+  if (watch_list) {
+    if (!arm_watchpoints(watch_list)) {
+      return EXIT_FAILURE;
+    }
+    if (engine != VM_ENGINE_SWITCH) {
+      fprintf(stderr, "Note: --watch runs the switch engine\n");
+    }
+  }
+
+  if (stats) {
+    gettimeofday(&stats_start, NULL);
+    atexit(print_stats);
+  }
+
+  if (perf_slice) {
+    // opened last so that the counts cover the guest and not our setup
+    if (perf_open(&perf, vm)) {
+      atexit(write_perf);
+    }
+    else {
+      fprintf(stderr, "perf: counters unavailable (%s), running uncounted\n", perf.error);
+      perf_slice = 0;
+    }
+  }
+
+  enum vm_stop stop;
+  do {
+    stop = vm_run(vm, perf_slice ? perf_slice : RUN_SLICE);
+    if (interrupted) {
+      exit_interrupted();
+    }
+    if (perf_slice) {
+      perf_window(&perf, vm);
+    }
+    if (snapshot_requested) {
+      snapshot_requested = 0;
+      output_flush();
+      if (vm_save_snapshot(vm, snapshot_path)) {
+        fprintf(stderr, "\r\nsnapshot: saved %s at %llu instructions\r\n", snapshot_path,
+                (unsigned long long)vm_instructions(vm));
+      }
+      else {
+        fprintf(stderr, "\r\nsnapshot: cannot write %s\r\n", snapshot_path);
+      }
+    }
+    // the stdio backend only stops for input when a signal cut a wait short;
+    // a replay stops for input when its log is used up
+  } while (stop == VM_STOP_LIMIT || (stop == VM_STOP_INPUT && !replay_path));
+
+  output_shutdown();
   restore_input_buffering();
 
-  return EXIT_SUCCESS;
+  if (stop == VM_STOP_INPUT) {
+    fprintf(stderr, "replay: input log used up after %llu instructions\n",
+            (unsigned long long)vm_instructions(vm));
+    return EXIT_SUCCESS;
+  }
+  if (stop == VM_STOP_ILLEGAL) {
+    fprintf(stderr, "Error: illegal trap x%02X at x%04X\n",
+            vm->memory[(uint16_t)(vm->reg[R_PC] - 1)] & 0xFF,
+            (uint16_t)(vm->reg[R_PC] - 1));
+    return EXIT_FAILURE;
+  }
+  if (stop == VM_STOP_WATCH) {
+    print_watch_hits();
+    return EXIT_FAILURE;
+  }
+
+  // HALT has always ended the process with status 1
+  return stop == VM_STOP_HALT ? 1 : EXIT_SUCCESS;
 }
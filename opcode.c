@@ -1,16 +1,7 @@
 #include "opcode.h"
 #include "utils.h"
-
-/* trap codes: 6 trap code operations */
-enum trap_codes
-{
-  T_GETC = 0x20,
-  T_OUT,
-  T_PUTS,
-  T_IN,
-  T_PUTSP,
-  T_HALT
-};
+#include "profile.h"
+#include "trace.h"
 
 
 /*
@@ -37,7 +28,7 @@ enum trap_codes
 *     incremented PC
 */
 
-void op_add(uint16_t bits)
+void op_add(struct vm *vm, uint16_t bits)
 {
   /*
   * The second source operand is added to the contents of SR1 and the result is
@@ -52,17 +43,17 @@ void op_add(uint16_t bits)
   if ((bits >> 5) & 0x1) {
     // mode 1: bit[5]=1, add a small constant
     uint16_t imm5 = get_sign_extension(bits & 0b11111, 5);
-    reg[DR] = reg[SR1] + imm5;
+    vm->reg[DR] = vm->reg[SR1] + imm5;
   }
   else {
     // mode 2: bit[5]=0, add value from second source register
     uint16_t SR2 = (bits >> 0) & 0x7;
-    reg[DR] = reg[SR1] + reg[SR2];
+    vm->reg[DR] = vm->reg[SR1] + vm->reg[SR2];
   }
-  update_flag(DR);
+  update_flag(vm, DR);
 }
 
-void op_and(uint16_t bits)
+void op_and(struct vm *vm, uint16_t bits)
 {
   /*
   * The second source operand is ANDed with the contents of SR1 and the result 
@@ -78,17 +69,17 @@ void op_and(uint16_t bits)
   if ((bits >> 5) & 0x1) {
     // mode 1: and a small constant
     uint16_t imm5 = get_sign_extension(bits & 0x1F, 5);
-    reg[DR] = reg[SR1] & imm5;
+    vm->reg[DR] = vm->reg[SR1] & imm5;
   }
   else {
     // mode 2: and value from SR2
     uint16_t SR2 = bits & 0x7;
-    reg[DR] = reg[SR1] & reg[SR2];
+    vm->reg[DR] = vm->reg[SR1] & vm->reg[SR2];
   }
-  update_flag(DR);
+  update_flag(vm, DR);
 }
 
-void op_not(uint16_t bits)
+void op_not(struct vm *vm, uint16_t bits)
 {
   /*
   * The bit-wise complement of the contents of SR is stored in DR. Condition 
@@ -97,11 +88,11 @@ void op_not(uint16_t bits)
 
   uint16_t DR = (bits >> 9) & 0x7;
   uint16_t SR = (bits >> 6) & 0x7;
-  reg[DR] = ~reg[SR];
-  update_flag(DR);
+  vm->reg[DR] = ~vm->reg[SR];
+  update_flag(vm, DR);
 }
 
-void op_ld(uint16_t bits)
+void op_ld(struct vm *vm, uint16_t bits)
 {
   /*
   * Address computed by sign-extending bits [8:0] to 16 bits and adding 
@@ -112,12 +103,12 @@ void op_ld(uint16_t bits)
 
   uint16_t DR = (bits >> 9) & 0x7;
   uint16_t PCoffset9 = bits;
-  uint16_t address = reg[R_PC] + get_sign_extension(PCoffset9, 9);
-  reg[DR] = read_from_memory(address);
-  update_flag(DR);
+  uint16_t address = vm->reg[R_PC] + get_sign_extension(PCoffset9, 9);
+  vm->reg[DR] = read_from_memory(vm, address);
+  update_flag(vm, DR);
 }
 
-void op_ldi(uint16_t bits)
+void op_ldi(struct vm *vm, uint16_t bits)
 {
   /*
   * Address computed by sign-extending bits [8:0] to 16 bits and adding 
@@ -128,11 +119,11 @@ void op_ldi(uint16_t bits)
 
   uint16_t DR = (bits >> 9) & 0x7;
   uint16_t PCoffset9 = get_sign_extension(bits & 0x1FF, 9);
-  reg[DR] = read_from_memory(read_from_memory(reg[R_PC] + PCoffset9));
-  update_flag(DR);
+  vm->reg[DR] = read_from_memory(vm, read_from_memory(vm, vm->reg[R_PC] + PCoffset9));
+  update_flag(vm, DR);
 }
 
-void op_ldr(uint16_t bits)
+void op_ldr(struct vm *vm, uint16_t bits)
 {
   /*
    * Address computed by sign-extending bits [5:0] to 16 bits and adding 
@@ -144,12 +135,12 @@ void op_ldr(uint16_t bits)
   uint16_t DR = (bits >> 9) & 0x7;
   uint16_t BaseR = (bits >> 6) & 0x7;
   uint16_t offset6 = bits & 0x3f;
-  uint16_t address = reg[BaseR] + get_sign_extension(offset6, 6);
-  reg[DR] = read_from_memory(address);
-  update_flag(DR);
+  uint16_t address = vm->reg[BaseR] + get_sign_extension(offset6, 6);
+  vm->reg[DR] = read_from_memory(vm, address);
+  update_flag(vm, DR);
 }
 
-void op_lea(uint16_t bits)
+void op_lea(struct vm *vm, uint16_t bits)
 {
   /*
   * Address computed by sign-extending bits [8:0] to 16 bits and adding this 
@@ -160,12 +151,12 @@ void op_lea(uint16_t bits)
 
   uint16_t DR = (bits >> 9) & 0x7;
   uint16_t PCoffset9 = bits & 0x1FF;
-  uint16_t address = reg[R_PC] + get_sign_extension(PCoffset9, 9);
-  reg[DR] = address;
-  update_flag(DR);
+  uint16_t address = vm->reg[R_PC] + get_sign_extension(PCoffset9, 9);
+  vm->reg[DR] = address;
+  update_flag(vm, DR);
 }
 
-void op_br(uint16_t bits)
+void op_br(struct vm *vm, uint16_t bits)
 {
   /*
   * The condition codes specified by bits [11:9] are tested. If bit [11] is 
@@ -176,12 +167,12 @@ void op_br(uint16_t bits)
 
   uint16_t PCoffset9 = get_sign_extension(bits & 0x1FF, 9);
   uint16_t cond_flag = (bits >> 9) & 0x7;
-  if (cond_flag & reg[R_F]) {
-    reg[R_PC] += PCoffset9;
+  if (cond_flag & get_cond_flag(vm)) {
+    vm->reg[R_PC] += PCoffset9;
   }
 }
 
-void op_jmp(uint16_t bits)
+void op_jmp(struct vm *vm, uint16_t bits)
 {
   /* 
   * Program unconditionally jumps to the location specified in BaseR, which 
@@ -191,10 +182,10 @@ void op_jmp(uint16_t bits)
 
   uint16_t BaseR = (bits >> 6) & 0x7;
   // adjust PC to move to new address
-  reg[R_PC] = reg[BaseR]; 
+  vm->reg[R_PC] = vm->reg[BaseR]; 
 }
 
-void op_jsr(uint16_t bits)
+void op_jsr(struct vm *vm, uint16_t bits)
 {
   /* 
   * Jumps to new address and links previous location. The incremented PC is 
@@ -207,25 +198,25 @@ void op_jsr(uint16_t bits)
   */
 
   // assign PC to temp register for backlinking
-  uint16_t temp = reg[R_PC];
+  uint16_t temp = vm->reg[R_PC];
   // check if opcode indicates jsr or jsrr
   uint16_t jsr_flag = (bits >> 11) & 1;
   if (jsr_flag) {
       // run jsr taking PCoffset11
       uint16_t PCoffset11 = get_sign_extension(bits & 0x7FF, 11);
       // jump via given PCoffset11
-      reg[R_PC] += PCoffset11;
+      vm->reg[R_PC] += PCoffset11;
     }
   else {
     // run jsrr taking BaseR
     uint16_t BaseR = (bits >> 6) & 0x7;
     // jump to register val
-    reg[R_PC] = reg[BaseR]; 
+    vm->reg[R_PC] = vm->reg[BaseR]; 
   }
-  reg[R_7] = temp;
+  vm->reg[R_7] = temp;
 }
 
-void op_st(uint16_t bits)
+void op_st(struct vm *vm, uint16_t bits)
 {
   /*
   * Stores the contents of the register specified in SR at a location in 
@@ -235,11 +226,11 @@ void op_st(uint16_t bits)
 
   uint16_t SR = (bits >> 9) & 0x7;
   uint16_t PCoffset9 = get_sign_extension(bits, 9);
-  uint16_t address = (reg[R_PC] + PCoffset9);
-  write_to_memory(address, reg[SR]);
+  uint16_t address = (vm->reg[R_PC] + PCoffset9);
+  write_to_memory(vm, address, vm->reg[SR]);
 }
 
-void op_sti(uint16_t bits)
+void op_sti(struct vm *vm, uint16_t bits)
 {
   /*
   * Stores the contents of the register specified in SR at a location in 
@@ -251,11 +242,11 @@ void op_sti(uint16_t bits)
 
   uint16_t SR = (bits >> 9) & 0x7;
   uint16_t PCoffset9 = get_sign_extension(bits, 9);
-  uint16_t address = (reg[R_PC] + PCoffset9);
-  write_to_memory(read_from_memory(address), reg[SR]);
+  uint16_t address = (vm->reg[R_PC] + PCoffset9);
+  write_to_memory(vm, read_from_memory(vm, address), vm->reg[SR]);
 }
 
-void op_str(uint16_t bits)
+void op_str(struct vm *vm, uint16_t bits)
 {
   /*
   * Stores the contents of the register specified in SR at a location in 
@@ -267,11 +258,58 @@ void op_str(uint16_t bits)
   uint16_t SR1 = (bits >> 9) & 0x7;
   uint16_t BaseR = (bits >> 6) & 0x7;
   uint16_t PCoffset6 = get_sign_extension(bits & 0x3F, 6);
-  uint16_t address = reg[BaseR] + PCoffset6;
-  write_to_memory(address, reg[SR1]);
+  uint16_t address = vm->reg[BaseR] + PCoffset6;
+  write_to_memory(vm, address, vm->reg[SR1]);
+}
+
+static void guest_putc(struct vm *vm, char c)
+{
+  vm->io.write(vm->io.ctx, &c, 1);
+}
+
+static void undo_input_trap(struct vm *vm)
+/*
+ A TRAP that needs a key that has not arrived is undone: PC goes back to the
+ TRAP, it is not counted, and the VM stops with VM_STOP_INPUT. The next
+ vm_run executes the TRAP again.
+*/
+{
+  vm->reg[R_PC]--;
+  vm->remaining++;
+  request_stop(vm, VM_STOP_INPUT);
+}
+
+static int input_would_stall(struct vm *vm)
+/*
+ With an I/O backend that cannot block (no wait_key), give up on the TRAP
+ before it has any effect.
+*/
+{
+  if (vm->io.wait_key || input_ready(vm) > 0) {
+    return 0;
+  }
+  undo_input_trap(vm);
+  return 1;
+}
+
+static int guest_getc(struct vm *vm, uint16_t *key)
+/*
+ Wait for and read the next key. Returns 0, with the TRAP undone, if the wait
+ was interrupted before a key arrived.
+*/
+{
+  if (input_ready(vm) <= 0) {
+    vm->io.wait_key(vm->io.ctx);
+    if (input_ready(vm) <= 0) {
+      undo_input_trap(vm);
+      return 0;
+    }
+  }
+  *key = input_read(vm) & 0b11111111;
+  return 1;
 }
 
-void trap_getc()
+void trap_getc(struct vm *vm)
 {
   /*
   * Reads a character from keyboard.
@@ -279,22 +317,24 @@ void trap_getc()
   * are cleared.
   */
 
-  reg[R_0] = getchar() & 0b11111111;
-  fflush(stdin);
+  uint16_t key;
+  if (input_would_stall(vm) || !guest_getc(vm, &key)) {
+    return;
+  }
+  vm->reg[R_0] = key;
 }
 
-void trap_out()
+void trap_out(struct vm *vm)
 {
   /*
   * Writes a character in R_0 to console avoiding automatic buffering. 
   * Clears (or flushes) output buffer and prints buffered data to console. 
   */
 
-  fprintf(stdout, "%c", reg[R_0]);
-  fflush(stdout);
+  guest_putc(vm, vm->reg[R_0]);
 }
 
-void trap_in()
+void trap_in(struct vm *vm)
 {
   /*
   * Prints a prompt and reads a character from keyboard. The character is 
@@ -302,14 +342,21 @@ void trap_in()
   * the first eight bits of R_0 are cleared.
   */
 
-  puts("Enter a character:\n");
-  reg[R_0] = getchar() & 0b11111111;
-  fprintf(stdout, "%c", reg[R_0]);
-  fflush(stdin);
-  fflush(stdout);
+  if (input_would_stall(vm)) {
+    return;
+  }
+  const char prompt[] = "Enter a character:\n\n";
+  vm->io.write(vm->io.ctx, prompt, sizeof(prompt) - 1);
+  uint16_t key;
+  if (!guest_getc(vm, &key)) {
+    // interrupted: the prompt is shown again when the TRAP reruns
+    return;
+  }
+  vm->reg[R_0] = key;
+  guest_putc(vm, vm->reg[R_0]);
 }
 
-void trap_puts()
+void trap_puts(struct vm *vm)
 {
   /*
   * Writes a string of ASCII characters to the console beginning at the address
@@ -317,55 +364,167 @@ void trap_puts()
   * occurs.
   */
 
-  uint16_t address = reg[R_0];
-  uint16_t val = read_from_memory(address);
+  uint16_t address = vm->reg[R_0];
+  uint16_t val = read_from_memory(vm, address);
   while (val) {
     char first_char = val & 0xFF;
-    putc(first_char, stdout);
+    guest_putc(vm, first_char);
     char second_char = val >> 8;
     // if second char exists, write to stdout
     if (second_char) {
-      putc(first_char, stdout);
+      guest_putc(vm, first_char);
     }
-    val = read_from_memory(++address);
+    val = read_from_memory(vm, ++address);
   }
-  // move buffered data to console
-  fflush(stdout); 
 }
 
-void trap_putsp()
+void trap_putsp(struct vm *vm)
 {
   /* 
   * Prints the contents of R_0 to console.
   */
 
-  uint16_t *c = memory + reg[R_0];
-  while (*c)
+  // the address wraps at xFFFF like every other memory access
+  uint16_t address = vm->reg[R_0];
+  while (vm->memory[address])
   {
-    char char1 = (*c) & 0xFF;
-    putc(char1, stdout);
-    char char2 = (*c) >> 8;
+    char char1 = vm->memory[address] & 0xFF;
+    guest_putc(vm, char1);
+    char char2 = vm->memory[address] >> 8;
     if (char2) {
-      putc(char2, stdout);
+      guest_putc(vm, char2);
     }
-    ++c;
+    ++address;
   }
-  fflush(stdout);
 }
 
-void trap_halt()
+void trap_halt(struct vm *vm)
 {
   /*
   * Halts execution and prints a message to the console.
   */
 
-  puts("\nHALT\n");
-  fflush(stdout);
-  restore_input_buffering();
-  exit(1);
+  const char message[] = "\nHALT\n\n";
+  vm->io.write(vm->io.ctx, message, sizeof(message) - 1);
+  request_stop(vm, VM_STOP_HALT);
+}
+
+/*
+* Extended Trap Vectors
+-----------------------------
+* See enum extended_trap_codes in opcode.h. Stores go through write_to_memory
+* one word at a time, so code tracking sees a copy over code like any other
+* store.
+*/
+
+static void trap_mul(struct vm *vm)
+{
+  vm->reg[R_0] = (uint32_t)vm->reg[R_0] * vm->reg[R_1];
+  update_flag(vm, R_0);
 }
 
-void op_trap(uint16_t bits)
+static void trap_divmod(struct vm *vm)
+{
+  int32_t dividend = (int16_t)vm->reg[R_0];
+  int32_t divisor = (int16_t)vm->reg[R_1];
+  if (divisor == 0) {
+    vm->reg[R_1] = vm->reg[R_0];
+    vm->reg[R_0] = 0xFFFF;
+  }
+  else {
+    // in 32 bits x8000 / -1 is +32768, which wraps back to x8000
+    vm->reg[R_0] = dividend / divisor;
+    vm->reg[R_1] = dividend % divisor;
+  }
+  update_flag(vm, R_0);
+}
+
+static void trap_memcpy(struct vm *vm)
+{
+  uint16_t dst = vm->reg[R_0];
+  uint16_t src = vm->reg[R_1];
+  uint16_t count = vm->reg[R_2];
+  if (dst != src && (uint16_t)(dst - src) < count) {
+    // dst lies inside the source: copy from the end, like memmove
+    for (uint32_t i = count; i-- > 0;) {
+      write_to_memory(vm, dst + i, vm->memory[(uint16_t)(src + i)]);
+    }
+  }
+  else {
+    for (uint32_t i = 0; i < count; i++) {
+      write_to_memory(vm, dst + i, vm->memory[(uint16_t)(src + i)]);
+    }
+  }
+}
+
+static void trap_memset(struct vm *vm)
+{
+  uint16_t dst = vm->reg[R_0];
+  for (uint32_t i = 0; i < vm->reg[R_2]; i++) {
+    write_to_memory(vm, dst + i, vm->reg[R_1]);
+  }
+}
+
+static void trap_strlen(struct vm *vm)
+{
+  uint16_t start = vm->reg[R_0];
+  uint16_t length = 0;
+  while (length < UINT16_MAX && vm->memory[(uint16_t)(start + length)]) {
+    length++;
+  }
+  vm->reg[R_0] = length;
+  update_flag(vm, R_0);
+}
+
+static void trap_strcmp(struct vm *vm)
+{
+  uint16_t a = vm->reg[R_0];
+  uint16_t b = vm->reg[R_1];
+  uint16_t result = 0;
+  for (uint32_t i = 0; i <= UINT16_MAX; i++) {
+    uint16_t x = vm->memory[(uint16_t)(a + i)];
+    uint16_t y = vm->memory[(uint16_t)(b + i)];
+    if (x != y) {
+      result = x < y ? 0xFFFF : 1;
+      break;
+    }
+    if (!x) {
+      break;
+    }
+  }
+  vm->reg[R_0] = result;
+  update_flag(vm, R_0);
+}
+
+static int extended_trap(struct vm *vm, uint16_t trapvector8)
+/*
+ Run an extended vector; returns 0 if there is none by that number.
+*/
+{
+  switch (trapvector8) {
+    case T_MUL:
+      trap_mul(vm);
+      return 1;
+    case T_DIVMOD:
+      trap_divmod(vm);
+      return 1;
+    case T_MEMCPY:
+      trap_memcpy(vm);
+      return 1;
+    case T_MEMSET:
+      trap_memset(vm);
+      return 1;
+    case T_STRLEN:
+      trap_strlen(vm);
+      return 1;
+    case T_STRCMP:
+      trap_strcmp(vm);
+      return 1;
+  }
+  return 0;
+}
+
+void op_trap(struct vm *vm, uint16_t bits)
 {
   /*
   * R_7 is loaded with the incremented PC. (This enables a return to the 
@@ -374,28 +533,173 @@ void op_trap(uint16_t bits)
   */
 
   uint16_t trapvector8 = bits & 0b11111111;
+  uint16_t next = vm->reg[R_PC];
   switch (trapvector8)
   {
   case T_GETC:
-    trap_getc();
+    trap_getc(vm);
     break;
   case T_OUT:
-    trap_out();
+    trap_out(vm);
     break;
   case T_PUTS:
-    trap_puts();
+    trap_puts(vm);
     break;
   case T_IN:
-    trap_in();
+    trap_in(vm);
     break;
   case T_PUTSP:
-    trap_putsp();
+    trap_putsp(vm);
     break;
   case T_HALT:
-    trap_halt();
+    trap_halt(vm);
     break;
   default:
-    abort();
+    if (vm->strict || !extended_trap(vm, trapvector8)) {
+      request_stop(vm, VM_STOP_ILLEGAL);
+    }
     break;
   }
+  // an input TRAP undone for want of a key runs again later: count it then
+  if (vm->stop == VM_STOP_INPUT && vm->reg[R_PC] != next) {
+    return;
+  }
+  vm->side_effects++;
+  vm->trap_calls[trapvector8]++;
+}
+
+static inline __attribute__((always_inline)) void switch_loop(struct vm *vm, const int profiling,
+                                                              const int tracing)
+/*
+ Reference engine: fetch, decode and execute one instruction at a time through
+ the op_* functions above. Inlined once per combination by run_switch, with
+ profiling and tracing constants, so either costs nothing when it is off.
+*/
+{
+  while (vm->remaining > 0)
+  {
+    // load instruction from memory
+    uint16_t pc = vm->reg[R_PC]++;
+    uint16_t instruction = read_from_memory(vm, pc);
+    uint16_t opcode = instruction >> 12;
+    vm->remaining--;
+
+    if (profiling) {
+      profile_count(vm, pc, instruction);
+    }
+
+    switch (opcode) {
+      
+      // branch
+      case OP_BR:
+        op_br(vm, instruction);
+        break;
+      
+      // add
+      case OP_ADD:
+        op_add(vm, instruction);
+        break;
+      
+      // load
+      case OP_LD:
+        op_ld(vm, instruction);
+        break;
+      
+      // store
+      case OP_ST:
+        op_st(vm, instruction);
+        break;
+      
+      // jump register
+      case OP_JSR:
+        op_jsr(vm, instruction);
+        break;
+
+      // bitwise and
+      case OP_AND:
+        op_and(vm, instruction);
+        break;
+
+      // load register
+      case OP_LDR:
+        op_ldr(vm, instruction);
+        break;
+      
+      // store register
+      case OP_STR:
+        op_str(vm, instruction);
+        break;
+
+      // unused
+      case OP_RTI:
+        break;
+
+      // bitwise not
+      case OP_NOT:
+        op_not(vm, instruction);
+        break;
+
+      // load indirect
+      case OP_LDI:
+        op_ldi(vm, instruction);
+        break;
+      
+      // store indirect
+      case OP_STI:
+        op_sti(vm, instruction);
+        break;
+      
+      // jump
+      case OP_JMP:
+        op_jmp(vm, instruction);
+        break;
+      
+      // reserve (unused)
+      case OP_RES:
+        break;
+
+      // load effective address  
+      case OP_LEA:
+        op_lea(vm, instruction);
+        break;
+      
+      // execute trap
+      case OP_TRAP:
+        op_trap(vm, instruction);
+        break;
+      
+      default:
+        abort();
+        break;
+    }
+
+    // an input TRAP undone for want of a key did not execute
+    if ((profiling || tracing) && vm->stop == VM_STOP_INPUT && vm->reg[R_PC] == pc) {
+      if (profiling) {
+        profile_uncount(vm, pc, instruction);
+      }
+    }
+    else if (tracing) {
+      trace_instruction(vm->trace, vm, pc, instruction);
+    }
+  }
+}
+
+void run_switch(struct vm *vm)
+{
+  if (vm->trace) {
+    trace_sync(vm);
+    if (vm->profile) {
+      switch_loop(vm, 1, 1);
+    }
+    else {
+      switch_loop(vm, 0, 1);
+    }
+  }
+  else if (vm->profile) {
+    switch_loop(vm, 1, 0);
+  }
+  else {
+    switch_loop(vm, 0, 0);
+  }
 }
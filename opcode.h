@@ -36,19 +36,59 @@ enum instruction_set
    OP_TRAP    /* execute trap */
  };
 
-void op_br(uint16_t bits);
-void op_add(uint16_t bits);
-void op_ld(uint16_t bits);
-void op_st(uint16_t bits);
-void op_jsr(uint16_t bits);
-void op_and(uint16_t bits);
-void op_ldr(uint16_t bits);
-void op_str(uint16_t bits);
-void op_not(uint16_t bits);
-void op_ldi(uint16_t bits);
-void op_sti(uint16_t bits);
-void op_jmp(uint16_t bits);
-void op_lea(uint16_t bits);
-void op_trap(uint16_t bits);
+/* trap codes: 6 trap code operations */
+enum trap_codes
+{
+  T_GETC = 0x20,
+  T_OUT,
+  T_PUTS,
+  T_IN,
+  T_PUTSP,
+  T_HALT
+};
+
+/** extended trap vectors
+ * Native routines for what LC-3 programs otherwise build from long shift-add
+ * and copy loops. Each counts as one instruction and sets N/Z/P from R0 when
+ * it writes R0. A strict VM (vm_set_strict, --strict) treats them as unknown
+ * vectors.
+ *   MUL     R0 = R0 * R1, low 16 bits
+ *   DIVMOD  R0 = R0 / R1, R1 = R0 % R1, signed and rounding toward zero;
+ *           dividing by zero gives R0 = -1 and leaves the dividend in R1
+ *   MEMCPY  copy R2 words from R1 to R0; overlapping ranges are fine
+ *   MEMSET  store R1 in the R2 words from R0
+ *   STRLEN  R0 = words before the x0000 ending the string at R0
+ *   STRCMP  R0 = -1, 0 or 1 comparing the strings at R0 and R1 word by word
+ * Addresses wrap at xFFFF and device registers are read as stored, without
+ * polling the keyboard.
+ **/
+enum extended_trap_codes
+{
+  T_MUL = 0x30,
+  T_DIVMOD,
+  T_MEMCPY,
+  T_MEMSET,
+  T_STRLEN,
+  T_STRCMP
+};
+
+struct vm;
+
+void op_br(struct vm *vm, uint16_t bits);
+void op_add(struct vm *vm, uint16_t bits);
+void op_ld(struct vm *vm, uint16_t bits);
+void op_st(struct vm *vm, uint16_t bits);
+void op_jsr(struct vm *vm, uint16_t bits);
+void op_and(struct vm *vm, uint16_t bits);
+void op_ldr(struct vm *vm, uint16_t bits);
+void op_str(struct vm *vm, uint16_t bits);
+void op_not(struct vm *vm, uint16_t bits);
+void op_ldi(struct vm *vm, uint16_t bits);
+void op_sti(struct vm *vm, uint16_t bits);
+void op_jmp(struct vm *vm, uint16_t bits);
+void op_lea(struct vm *vm, uint16_t bits);
+void op_trap(struct vm *vm, uint16_t bits);
+
+void run_switch(struct vm *vm);
 
 #endif
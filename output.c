@@ -0,0 +1,260 @@
+/*
+ * Coalesced console output
+ *
+ * TRAP OUT/PUTS/PUTSP/IN/HALT append guest output to a ring buffer instead of
+ * writing and flushing stdout per call. A writer thread drains the buffer to
+ * STDOUT_FILENO with a single writev (two iovecs when the data wraps) whenever
+ * a flush is requested: before the guest waits for input, when flush_bytes are
+ * pending, when the oldest pending byte is flush_usec old, and at exit.
+ *
+ * Bytes reach the terminal in exactly the order the guest produced them, so
+ * the guest-visible output is unchanged; only the number of write(2) calls
+ * goes down. Until output_start is called (e.g. in the unit tests) every call
+ * falls back to stdio with an fflush, as the trap routines used to do.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+#define OUTPUT_RING_SIZE (1 << 16)
+
+static char ring[OUTPUT_RING_SIZE];
+/* free-running write and read positions, moved under lock; output_flush
+ * peeks at both without it */
+static size_t head, tail;
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;  /* writer wakeup */
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER; /* room / drained */
+
+static struct output_policy policy;
+static int running;
+static int flush_requested;
+static int stopping;
+static struct timespec oldest; /* when the oldest pending byte was written */
+
+uint64_t output_bytes;
+uint64_t output_writes;
+
+static void write_segments(size_t from, size_t to)
+/*
+ Write ring[from, to) with one writev, retrying short writes. Called by the
+ writer thread without holding the lock; the producer never touches this
+ range until tail moves past it.
+*/
+{
+  while (from != to) {
+    struct iovec iov[2];
+    int count = 1;
+    size_t start = from % OUTPUT_RING_SIZE;
+    size_t len = to - from;
+    iov[0].iov_base = ring + start;
+    iov[0].iov_len = len;
+    if (start + len > OUTPUT_RING_SIZE) {
+      iov[0].iov_len = OUTPUT_RING_SIZE - start;
+      iov[1].iov_base = ring;
+      iov[1].iov_len = len - iov[0].iov_len;
+      count = 2;
+    }
+
+    ssize_t written = writev(STDOUT_FILENO, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // output is gone (closed pipe); drop it like stdio would
+    }
+    output_writes++;
+    output_bytes += written;
+    from += written;
+  }
+}
+
+static void deadline_after(struct timespec *ts, const struct timespec *from,
+                           uint64_t usec)
+{
+  ts->tv_sec = from->tv_sec + usec / 1000000;
+  ts->tv_nsec = from->tv_nsec + (usec % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static void *writer_main(void *arg)
+{
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (!flush_requested && !stopping) {
+      size_t pending = head - tail;
+      if (policy.flush_bytes && pending >= policy.flush_bytes) {
+        break;
+      }
+      if (policy.flush_usec && pending) {
+        struct timespec deadline;
+        deadline_after(&deadline, &oldest, policy.flush_usec);
+        if (pthread_cond_timedwait(&work, &lock, &deadline) == ETIMEDOUT) {
+          break;
+        }
+      }
+      else {
+        pthread_cond_wait(&work, &lock);
+      }
+    }
+
+    size_t from = tail, to = head;
+    flush_requested = 0;
+    if (from != to) {
+      pthread_mutex_unlock(&lock);
+      write_segments(from, to);
+      pthread_mutex_lock(&lock);
+      __atomic_store_n(&tail, to, __ATOMIC_RELAXED);
+      if (head != tail) {
+        clock_gettime(CLOCK_REALTIME, &oldest);
+      }
+      pthread_cond_broadcast(&space);
+    }
+    if (stopping && head == tail) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int output_start(const struct output_policy *p)
+{
+  policy = *p;
+  flush_requested = 0;
+  stopping = 0;
+
+  // the writer inherits a fully blocked signal mask so SIGINT is always
+  // handled on the VM thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int failed = pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (failed) {
+    return 0;
+  }
+  running = 1;
+  return 1;
+}
+
+void output_shutdown(void)
+/*
+ Drain everything still buffered and stop the writer. Safe to call more than
+ once, and registered with atexit by main so trap_halt's exit drains too.
+*/
+{
+  if (!running) {
+    fflush(stdout);
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  running = 0;
+}
+
+void output_write(const char *buf, size_t len)
+{
+  if (!running) {
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  while (len > 0) {
+    size_t room = OUTPUT_RING_SIZE - (head - tail);
+    if (room == 0) {
+      // ring is full: hand it to the writer and wait for space
+      flush_requested = 1;
+      pthread_cond_signal(&work);
+      pthread_cond_wait(&space, &lock);
+      continue;
+    }
+    if (head == tail) {
+      clock_gettime(CLOCK_REALTIME, &oldest);
+      if (policy.flush_usec) {
+        pthread_cond_signal(&work); // start the age timer
+      }
+    }
+    size_t chunk = len < room ? len : room;
+    size_t start = head % OUTPUT_RING_SIZE;
+    size_t first = chunk < OUTPUT_RING_SIZE - start ? chunk : OUTPUT_RING_SIZE - start;
+    memcpy(ring + start, buf, first);
+    memcpy(ring, buf + first, chunk - first);
+    __atomic_store_n(&head, head + chunk, __ATOMIC_RELAXED);
+    buf += chunk;
+    len -= chunk;
+  }
+  if (policy.flush_bytes && head - tail >= policy.flush_bytes) {
+    pthread_cond_signal(&work);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void output_putc(char c)
+{
+  output_write(&c, 1);
+}
+
+void output_flush(void)
+/*
+ Ask the writer to write out everything buffered so far. Does not wait. Cheap
+ when nothing is pending, so it can sit on the keyboard polling path.
+*/
+{
+  if (!running) {
+    fflush(stdout);
+    return;
+  }
+  // every VM on the stdio backend shares the ring, so other threads move
+  // head too; a thread always sees its own writes, so a stale value can only
+  // skip a flush the writing thread will ask for itself, or cause a spare one
+  if (__atomic_load_n(&head, __ATOMIC_RELAXED) == __atomic_load_n(&tail, __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  if (head != tail) {
+    flush_requested = 1;
+    pthread_cond_signal(&work);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void output_input_wait(void)
+/*
+ The guest is about to wait for a key: everything it printed so far has to
+ be visible, so request a flush and wait for the writer to finish it.
+*/
+{
+  if (!running) {
+    fflush(stdout);
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  if (head != tail) {
+    flush_requested = 1;
+    pthread_cond_signal(&work);
+    size_t target = head;
+    while (tail < target) {
+      pthread_cond_wait(&space, &lock);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** console output flush policy
+ * Output is always flushed before the guest waits for input and when the VM
+ * exits. flush_bytes and flush_usec add size- and age-based flushes; 0 turns
+ * them off. By default output is at most OUTPUT_FLUSH_USEC old, so a guest
+ * that prints progress without ever reading input is seen as it runs.
+ **/
+
+#define OUTPUT_FLUSH_USEC 5000
+struct output_policy
+{
+  size_t flush_bytes;   /* flush once this many bytes are pending */
+  uint64_t flush_usec;  /* flush once the oldest pending byte is this old */
+};
+
+int output_start(const struct output_policy *policy);
+void output_shutdown(void);
+
+void output_putc(char c);
+void output_write(const char *buf, size_t len);
+void output_flush(void);
+void output_input_wait(void);
+
+extern uint64_t output_bytes;
+extern uint64_t output_writes;
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * Host performance counters
+ *
+ * The counters are one perf_event group led by the first one that opens, so
+ * a single read returns all of them together with how long the group was
+ * enabled and how long it actually counted; when the PMU is shared and the
+ * group only counted part of a window, the window's counts are scaled up by
+ * enabled / running, as perf stat does. Only user-mode events are asked for,
+ * which perf_event_paranoid up to 2 allows, and which leaves out the read
+ * itself and the time the guest spends blocked waiting for a key.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "disasm.h"
+#include "profile.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *counter_names[PERF_COUNTERS] = {
+  "cycles", "instructions", "branch-misses", "L1d-misses", "task-clock"
+};
+
+#if defined(__linux__)
+
+static const struct
+{
+  uint32_t type;
+  uint64_t config;
+} events[PERF_COUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                       | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+static int open_event(enum perf_counter counter, int leader)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = events[counter].type;
+  attr.config = events[counter].config;
+  attr.disabled = leader < 0; // the group starts when perf_open enables it
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                     | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+}
+
+static int read_group(const struct perf *perf, uint64_t *values, uint64_t *enabled,
+                      uint64_t *running)
+{
+  // nr, time_enabled, time_running, then one value per event
+  uint64_t buffer[3 + PERF_COUNTERS];
+  ssize_t want = (3 + perf->open) * sizeof(uint64_t);
+  if (read(perf->leader, buffer, sizeof(buffer)) < want) {
+    return 0;
+  }
+  *enabled = buffer[1];
+  *running = buffer[2];
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    values[counter] = perf->slot[counter] >= 0 ? buffer[3 + perf->slot[counter]] : 0;
+  }
+  return 1;
+}
+
+static void add_counter(struct perf *perf, enum perf_counter counter, int fd)
+{
+  if (perf->leader < 0) {
+    perf->leader = fd;
+  }
+  perf->fd[counter] = fd;
+  perf->slot[counter] = perf->open++;
+}
+
+int perf_open(struct perf *perf, const struct vm *vm)
+{
+  memset(perf, 0, sizeof(*perf));
+  perf->leader = -1;
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    perf->fd[counter] = perf->slot[counter] = -1;
+  }
+
+  int error = 0;
+  for (int counter = 0; counter < PERF_TASK_CLOCK; counter++) {
+    int fd = open_event(counter, perf->leader);
+    if (fd >= 0) {
+      add_counter(perf, counter, fd);
+    }
+    else if (!error) {
+      error = errno;
+    }
+  }
+  if (!perf->open) {
+    // no PMU (most VMs and containers) or no permission: time is still worth having
+    perf->error = strerror(error);
+    int fd = open_event(PERF_TASK_CLOCK, -1);
+    if (fd < 0) {
+      return 0;
+    }
+    add_counter(perf, PERF_TASK_CLOCK, fd);
+  }
+
+  ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  if (!read_group(perf, perf->last, &perf->last_enabled, &perf->last_running)) {
+    perf_close(perf);
+    perf->error = "cannot read the counters";
+    return 0;
+  }
+  perf->last_instructions = vm_icount(vm);
+  if (vm->profile) {
+    memcpy(perf->last_ops, vm->profile->op_count, sizeof(perf->last_ops));
+  }
+  return perf->open;
+}
+
+void perf_close(struct perf *perf)
+{
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    if (perf->fd[counter] >= 0) {
+      close(perf->fd[counter]);
+      perf->fd[counter] = -1;
+    }
+  }
+  perf->open = 0;
+}
+
+void perf_window(struct perf *perf, const struct vm *vm)
+{
+  uint64_t now[PERF_COUNTERS], enabled, running;
+  if (!perf->open || !read_group(perf, now, &enabled, &running)) {
+    return;
+  }
+  uint64_t instructions = vm_icount(vm) - perf->last_instructions;
+  uint64_t enabled_delta = enabled - perf->last_enabled;
+  uint64_t running_delta = running - perf->last_running;
+  double delta[PERF_COUNTERS];
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    delta[counter] = now[counter] - perf->last[counter];
+  }
+  memcpy(perf->last, now, sizeof(now));
+  perf->last_enabled = enabled;
+  perf->last_running = running;
+  perf->last_instructions += instructions;
+
+  uint64_t ops[16] = {0};
+  uint64_t ran = 0;
+  if (vm->profile) {
+    for (int op = 0; op < 16; op++) {
+      ops[op] = vm->profile->op_count[op] - perf->last_ops[op];
+      ran += ops[op];
+    }
+    memcpy(perf->last_ops, vm->profile->op_count, sizeof(perf->last_ops));
+  }
+
+  if (!instructions) {
+    return;
+  }
+  perf->windows++;
+  if (!running_delta) {
+    perf->lost++;
+    return;
+  }
+  double scale = 1.0;
+  if (running_delta < enabled_delta) {
+    perf->scaled++;
+    scale = (double)enabled_delta / running_delta;
+  }
+  perf->instructions += instructions;
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    delta[counter] *= scale;
+    perf->total[counter] += delta[counter];
+  }
+  for (int op = 0; op < 16 && ran; op++) {
+    if (ops[op]) {
+      perf->ops[op] += ops[op];
+      for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+        perf->by_op[op][counter] += delta[counter] * ops[op] / ran;
+      }
+    }
+  }
+}
+
+#else
+
+int perf_open(struct perf *perf, const struct vm *vm)
+{
+  memset(perf, 0, sizeof(*perf));
+  perf->error = "perf events need Linux";
+  return 0;
+}
+
+void perf_close(struct perf *perf)
+{
+}
+
+void perf_window(struct perf *perf, const struct vm *vm)
+{
+}
+
+#endif
+
+static const char *engine_of(const struct vm *vm)
+{
+  if (vm->profile || vm->trace || vm->watch) {
+    return vm_engine_name(VM_ENGINE_SWITCH);
+  }
+  return vm->aot ? "aot" : vm_engine_name(vm->engine);
+}
+
+static double per(double count, uint64_t instructions)
+{
+  return instructions ? count / instructions : 0.0;
+}
+
+void perf_report(const struct perf *perf, const struct vm *vm, FILE *out)
+{
+  int hardware = perf->slot[PERF_CYCLES] >= 0;
+  enum perf_counter time = hardware ? PERF_CYCLES : PERF_TASK_CLOCK;
+  const char *time_unit = hardware ? "cycles" : "ns";
+
+  fprintf(out, "perf: %s engine, %llu windows, %llu guest instructions, counting",
+          engine_of(vm), (unsigned long long)perf->windows,
+          (unsigned long long)perf->instructions);
+  for (int counter = 0; counter < PERF_COUNTERS; counter++) {
+    if (perf->slot[counter] >= 0) {
+      fprintf(out, " %s", counter_names[counter]);
+    }
+  }
+  fputc('\n', out);
+  if (!hardware) {
+    fprintf(out, "perf: no hardware counters (%s), timing only\n", perf->error);
+  }
+  if (perf->lost || perf->scaled) {
+    fprintf(out, "perf: the kernel counted %llu windows only in part (scaled up) and %llu "
+            "not at all\n", (unsigned long long)perf->scaled, (unsigned long long)perf->lost);
+  }
+
+  fprintf(out, "perf: per guest instruction: %.2f %s", per(perf->total[time], perf->instructions),
+          time_unit);
+  if (perf->slot[PERF_INSTRUCTIONS] >= 0) {
+    fprintf(out, ", %.2f host instructions (IPC %.2f)",
+            per(perf->total[PERF_INSTRUCTIONS], perf->instructions),
+            hardware ? per(perf->total[PERF_INSTRUCTIONS], 1) / (perf->total[PERF_CYCLES] ?: 1)
+                     : 0.0);
+  }
+  if (perf->slot[PERF_BRANCH_MISSES] >= 0) {
+    fprintf(out, ", %.4f branch misses", per(perf->total[PERF_BRANCH_MISSES], perf->instructions));
+  }
+  if (perf->slot[PERF_L1D_MISSES] >= 0) {
+    fprintf(out, ", %.4f L1d misses", per(perf->total[PERF_L1D_MISSES], perf->instructions));
+  }
+  fputc('\n', out);
+
+  uint64_t charged = 0;
+  for (int op = 0; op < 16; op++) {
+    charged += perf->ops[op];
+  }
+  if (!charged) {
+    if (!vm->profile) {
+      fprintf(out, "perf: add --profile to charge the counts to opcodes\n");
+    }
+    return;
+  }
+  int order[16];
+  for (int op = 0; op < 16; op++) {
+    order[op] = op;
+  }
+  // sixteen entries: insertion sort by count
+  for (int i = 1; i < 16; i++) {
+    for (int j = i; j > 0 && perf->ops[order[j]] > perf->ops[order[j - 1]]; j--) {
+      int swap = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = swap;
+    }
+  }
+  fprintf(out, "\n  %-5s %14s %12s %14s %12s\n", "op", "count", time_unit, "br-miss/100",
+          "L1d miss/1k");
+  for (int i = 0; i < 16 && perf->ops[order[i]]; i++) {
+    int op = order[i];
+    fprintf(out, "  %-5s %14llu %12.2f", opcode_name(op), (unsigned long long)perf->ops[op],
+            per(perf->by_op[op][time], perf->ops[op]));
+    if (perf->slot[PERF_BRANCH_MISSES] >= 0) {
+      fprintf(out, " %14.3f", 100 * per(perf->by_op[op][PERF_BRANCH_MISSES], perf->ops[op]));
+    }
+    else {
+      fprintf(out, " %14s", "-");
+    }
+    if (perf->slot[PERF_L1D_MISSES] >= 0) {
+      fprintf(out, " %12.3f", 1000 * per(perf->by_op[op][PERF_L1D_MISSES], perf->ops[op]));
+    }
+    else {
+      fprintf(out, " %12s", "-");
+    }
+    fputc('\n', out);
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "utils.h"
+
+/** host performance counters
+ * perf_open asks the kernel (perf_event_open) for user-mode cycles,
+ * instructions, branch misses and L1d read misses of the calling thread, as
+ * one group so they count over the same time. Whatever it cannot have it
+ * goes without: with no hardware counter at all (no PMU in a VM, or perf
+ * events not allowed) it falls back to the task clock, and with not even
+ * that the run goes on uncounted.
+ *
+ * The caller runs the guest in windows of a fixed number of instructions
+ * and calls perf_window after each one. A window's counts go to the engine
+ * totals and, while the VM is being profiled (so its opcode histogram is
+ * kept), are shared among the opcodes it ran in proportion to how many of
+ * each it ran: opcodes that run in slow windows are charged more, and the
+ * smaller the windows the sharper the split.
+ **/
+
+#define PERF_WINDOW 1024    /* guest instructions per window by default */
+
+enum perf_counter
+{
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_TASK_CLOCK,          /* nanoseconds, only without hardware counters */
+  PERF_COUNTERS
+};
+
+struct perf
+{
+  int fd[PERF_COUNTERS];    /* -1 if not open */
+  int slot[PERF_COUNTERS];  /* position in the group read, -1 if not open */
+  int open;
+  int leader;
+  const char *error;        /* why the hardware counters are missing */
+
+  uint64_t last[PERF_COUNTERS];
+  uint64_t last_enabled, last_running;
+  uint64_t last_instructions;
+  uint64_t last_ops[16];
+
+  double total[PERF_COUNTERS];
+  double by_op[16][PERF_COUNTERS];
+  uint64_t ops[16];         /* guest instructions charged per opcode */
+  uint64_t instructions;    /* guest instructions in counted windows */
+  uint64_t windows;
+  uint64_t lost;            /* windows the kernel did not count at all */
+  uint64_t scaled;          /* ... and counted only part of the time */
+};
+
+/* open the counters and take the starting values; returns the number of
+ * counters open, 0 if none (perf->error says why) */
+int perf_open(struct perf *perf, const struct vm *vm);
+
+/* charge everything since the last call to the guest instructions retired
+ * since then */
+void perf_window(struct perf *perf, const struct vm *vm);
+
+void perf_report(const struct perf *perf, const struct vm *vm, FILE *out);
+void perf_close(struct perf *perf);
+
+#endif
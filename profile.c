@@ -0,0 +1,160 @@
+/*
+ * Execution profiler
+ *
+ * profile_count (profile.h) runs inside the switch engine's dispatch loop
+ * when profiling is on; the loop is compiled a second time without it, so
+ * leaving the profiler off costs nothing per instruction. This file sets the
+ * profile up and writes the report.
+ */
+
+#include <stdlib.h>
+
+#include "profile.h"
+#include "disasm.h"
+
+#define PROFILE_TOP_ADDRESSES 20
+#define PROFILE_TOP_LOOPS 10
+
+struct ranked
+{
+  uint64_t count;
+  uint64_t extra;   /* loops: iterations */
+  uint16_t first;
+  uint16_t last;
+};
+
+static int by_count_descending(const void *a, const void *b)
+{
+  const struct ranked *x = a, *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->first - y->first;
+}
+
+int profile_enable(struct vm *vm)
+{
+  free(vm->profile);
+  vm->profile = calloc(1, sizeof(struct profile));
+  return vm->profile != NULL;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+  return total ? 100.0 * part / total : 0.0;
+}
+
+static void report_addresses(struct vm *vm, FILE *out, uint64_t total)
+{
+  struct profile *profile = vm->profile;
+  struct ranked *ranked = malloc((UINT16_MAX + 1) * sizeof(*ranked));
+  if (!ranked) {
+    return;
+  }
+  size_t count = 0;
+  for (uint32_t pc = 0; pc <= UINT16_MAX; pc++) {
+    if (profile->pc_count[pc]) {
+      ranked[count++] = (struct ranked){profile->pc_count[pc], 0, pc, pc};
+    }
+  }
+  qsort(ranked, count, sizeof(*ranked), by_count_descending);
+
+  fprintf(out, "\nhottest addresses\n");
+  fprintf(out, "%14s %6s  %-7s  %-20s %s\n", "count", "%", "address", "instruction",
+          "branches");
+  for (size_t i = 0; i < count && i < PROFILE_TOP_ADDRESSES; i++) {
+    uint16_t pc = ranked[i].first;
+    char text[32];
+    disassemble(pc, vm->memory[pc], text, sizeof(text));
+    fprintf(out, "%14llu %5.1f%%  x%04X    ", (unsigned long long)ranked[i].count,
+            percent(ranked[i].count, total), pc);
+    if (!profile->br_taken[pc] && !profile->br_not_taken[pc]) {
+      fprintf(out, "%s", text);
+    }
+    else {
+      fprintf(out, "%-20s taken %llu, not taken %llu", text,
+              (unsigned long long)profile->br_taken[pc],
+              (unsigned long long)profile->br_not_taken[pc]);
+    }
+    fputc('\n', out);
+  }
+  free(ranked);
+}
+
+static void report_loops(struct vm *vm, FILE *out, uint64_t total)
+/*
+ A loop's weight is every instruction executed between its target and its
+ back-edge, so nested loops also count their inner loops.
+*/
+{
+  struct profile *profile = vm->profile;
+  // prefix[a] = executions of all addresses below a
+  uint64_t *prefix = malloc((UINT16_MAX + 2) * sizeof(*prefix));
+  struct ranked *ranked = malloc((UINT16_MAX + 1) * sizeof(*ranked));
+  if (!prefix || !ranked) {
+    free(prefix);
+    free(ranked);
+    return;
+  }
+  prefix[0] = 0;
+  for (uint32_t pc = 0; pc <= UINT16_MAX; pc++) {
+    prefix[pc + 1] = prefix[pc] + profile->pc_count[pc];
+  }
+  size_t count = 0;
+  for (uint32_t pc = 0; pc <= UINT16_MAX; pc++) {
+    if (profile->back_edges[pc]) {
+      uint16_t head = profile->back_edge_target[pc];
+      ranked[count++] = (struct ranked){prefix[pc + 1] - prefix[head],
+                                        profile->back_edges[pc], head, pc};
+    }
+  }
+  qsort(ranked, count, sizeof(*ranked), by_count_descending);
+
+  fprintf(out, "\nhottest loops\n");
+  fprintf(out, "%14s %6s %12s  %s\n", "instructions", "%", "iterations", "range");
+  for (size_t i = 0; i < count && i < PROFILE_TOP_LOOPS; i++) {
+    char text[32];
+    disassemble(ranked[i].last, vm->memory[ranked[i].last], text, sizeof(text));
+    fprintf(out, "%14llu %5.1f%% %12llu  x%04X-x%04X (%d words, closed by %s)\n",
+            (unsigned long long)ranked[i].count, percent(ranked[i].count, total),
+            (unsigned long long)ranked[i].extra, ranked[i].first, ranked[i].last,
+            ranked[i].last - ranked[i].first + 1, text);
+  }
+  free(prefix);
+  free(ranked);
+}
+
+void profile_report(struct vm *vm, FILE *out)
+{
+  struct profile *profile = vm->profile;
+  if (!profile) {
+    return;
+  }
+  uint64_t total = 0;
+  for (int op = 0; op < 16; op++) {
+    total += profile->op_count[op];
+  }
+  fprintf(out, "profile: %llu instructions\n", (unsigned long long)total);
+
+  report_addresses(vm, out, total);
+  report_loops(vm, out, total);
+
+  fprintf(out, "\nopcode histogram\n");
+  int order[16];
+  for (int op = 0; op < 16; op++) {
+    order[op] = op;
+  }
+  // sixteen entries: insertion sort by count
+  for (int i = 1; i < 16; i++) {
+    for (int j = i; j > 0 && profile->op_count[order[j]] > profile->op_count[order[j - 1]]; j--) {
+      int swap = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = swap;
+    }
+  }
+  for (int i = 0; i < 16 && profile->op_count[order[i]]; i++) {
+    fprintf(out, "  %-5s %14llu %5.1f%%\n", opcode_name(order[i]),
+            (unsigned long long)profile->op_count[order[i]],
+            percent(profile->op_count[order[i]], total));
+  }
+}
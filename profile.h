@@ -0,0 +1,72 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdio.h>
+#include "opcode.h"
+#include "utils.h"
+
+/** execution profile
+ * Filled by the switch engine while vm->profile is set (vm_run then ignores
+ * the selected engine). A back-edge is a taken BR, or a JMP other than RET,
+ * to an address at or before its own: the loop it closes spans the target
+ * through the jumping instruction.
+ **/
+struct profile
+{
+  uint64_t pc_count[UINT16_MAX + 1];
+  uint64_t op_count[16];
+  uint64_t br_taken[UINT16_MAX + 1];
+  uint64_t br_not_taken[UINT16_MAX + 1];
+  uint64_t back_edges[UINT16_MAX + 1];       /* per jumping address */
+  uint16_t back_edge_target[UINT16_MAX + 1]; /* where the last one went */
+};
+
+static inline void profile_count(struct vm *vm, uint16_t pc, uint16_t instruction)
+/*
+ Count the instruction at pc before it executes, predicting from the current
+ state where a BR or JMP will go.
+*/
+{
+  struct profile *profile = vm->profile;
+  uint16_t opcode = instruction >> 12;
+  profile->pc_count[pc]++;
+  profile->op_count[opcode]++;
+
+  uint16_t target;
+  if (opcode == OP_BR) {
+    if (!(((instruction >> 9) & 0x7) & get_cond_flag(vm))) {
+      profile->br_not_taken[pc]++;
+      return;
+    }
+    profile->br_taken[pc]++;
+    target = pc + 1 + get_sign_extension(instruction & 0x1FF, 9);
+  }
+  else if (opcode == OP_JMP && ((instruction >> 6) & 0x7) != R_7) {
+    target = vm->reg[(instruction >> 6) & 0x7];
+  }
+  else {
+    return;
+  }
+  if (target <= pc) {
+    profile->back_edges[pc]++;
+    profile->back_edge_target[pc] = target;
+  }
+}
+
+static inline void profile_uncount(struct vm *vm, uint16_t pc, uint16_t instruction)
+/*
+ Take back the count of an input TRAP that was undone before it executed; it
+ is counted again when it reruns.
+*/
+{
+  vm->profile->pc_count[pc]--;
+  vm->profile->op_count[instruction >> 12]--;
+}
+
+/* start collecting into a fresh profile; returns 0 if out of memory */
+int profile_enable(struct vm *vm);
+
+/* write the hottest addresses, loops and the opcode histogram to out */
+void profile_report(struct vm *vm, FILE *out);
+
+#endif
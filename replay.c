@@ -0,0 +1,178 @@
+/*
+ * Input record and replay
+ *
+ * A log is text, one key per line after a comment header:
+ *
+ *   # GarbageEater input log v1: <instructions> <key>
+ *   1873 110
+ *
+ * where instructions is vm_instructions() while the consuming instruction
+ * runs (it already counts that instruction, on every engine) and key is the
+ * value read_key returned. Recording happens in input_read (utils.c), the one
+ * place guest reads go through.
+ *
+ * Replay is an I/O backend that offers no key until the instruction count
+ * reaches the next event's, so polls before that see an empty keyboard just
+ * as they did when recording, and the poll or TRAP at that count gets the
+ * key. Idle detection is switched off because it would stop the run while
+ * the guest polls towards the next event.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "garbageeater.h"
+#include "utils.h"
+
+#define REPLAY_HEADER "# GarbageEater input log v1: <instructions> <key>\n"
+
+struct replay_event
+{
+  uint64_t instructions;
+  int key;
+};
+
+struct replay
+{
+  struct vm *vm;
+  struct vm_io inner;       /* output still goes here */
+  struct replay_event *events;
+  size_t count;
+  size_t pos;
+};
+
+int vm_record_input(struct vm *vm, const char *path)
+{
+  FILE *record = fopen(path, "w");
+  if (!record) {
+    return 0;
+  }
+  fputs(REPLAY_HEADER, record);
+  if (vm->input_record) {
+    fclose(vm->input_record);
+  }
+  vm->input_record = record;
+  return 1;
+}
+
+static int replay_key_ready(void *ctx)
+{
+  struct replay *replay = ctx;
+  if (replay->pos >= replay->count) {
+    return -1;
+  }
+  return vm_icount(replay->vm) >= replay->events[replay->pos].instructions;
+}
+
+static int replay_read_key(void *ctx)
+{
+  struct replay *replay = ctx;
+  if (replay->pos >= replay->count) {
+    return EOF;
+  }
+  return replay->events[replay->pos++].key;
+}
+
+static void replay_write(void *ctx, const char *buf, size_t len)
+{
+  struct replay *replay = ctx;
+  replay->inner.write(replay->inner.ctx, buf, len);
+}
+
+static void replay_flush(void *ctx)
+{
+  struct replay *replay = ctx;
+  replay->inner.flush(replay->inner.ctx);
+}
+
+static size_t parse_log(FILE *file, struct replay_event **events_out)
+/*
+ Returns the number of events, or (size_t)-1 if a line is malformed or the
+ counts go backwards.
+*/
+{
+  size_t count = 0, cap = 256;
+  struct replay_event *events = malloc(cap * sizeof(*events));
+  char line[128];
+  uint64_t last = 0;
+  while (events && fgets(line, sizeof(line), file)) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    unsigned long long instructions;
+    int key;
+    if (sscanf(line, "%llu %d", &instructions, &key) != 2 || instructions < last) {
+      free(events);
+      *events_out = NULL;
+      return (size_t)-1;
+    }
+    if (count == cap) {
+      cap *= 2;
+      struct replay_event *grown = realloc(events, cap * sizeof(*events));
+      if (!grown) {
+        free(events);
+        events = NULL;
+        break;
+      }
+      events = grown;
+    }
+    events[count++] = (struct replay_event){instructions, key};
+    last = instructions;
+  }
+  *events_out = events;
+  return events ? count : (size_t)-1;
+}
+
+int vm_replay_input(struct vm *vm, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  struct replay_event *events;
+  size_t count = parse_log(file, &events);
+  fclose(file);
+  if (count == (size_t)-1) {
+    return 0;
+  }
+  struct replay *replay = malloc(sizeof(*replay));
+  if (!replay) {
+    free(events);
+    return 0;
+  }
+  replay->vm = vm;
+  replay->inner = vm->replay ? vm->replay->inner : vm->io;
+  replay->events = events;
+  replay->count = count;
+  replay->pos = 0;
+  if (vm->replay) {
+    free(vm->replay->events);
+    free(vm->replay);
+  }
+
+  struct vm_io io = {
+    replay, replay_key_ready, replay_read_key, replay_write, replay_flush, NULL
+  };
+  vm->io = io;
+  vm->replay = replay;
+  vm->idle_detection = 0;
+  // keys typed ahead before the replay began are not part of it
+  vm->pending_pos = vm->pending_len = 0;
+  return 1;
+}
+
+void replay_free(struct vm *vm)
+/*
+ Drop the replay and close the record log, for vm_destroy.
+*/
+{
+  if (vm->replay) {
+    free(vm->replay->events);
+    free(vm->replay);
+    vm->replay = NULL;
+  }
+  if (vm->input_record) {
+    fclose(vm->input_record);
+    vm->input_record = NULL;
+  }
+}
@@ -0,0 +1,589 @@
+/*
+ * Many-instance scheduler
+ *
+ * Every worker owns a run queue guarded by its own mutex; the owner takes
+ * from the head and puts preempted guests at the tail, thieves take half of
+ * a queue from its head. A preempted guest whose worker has nothing else
+ * queued simply keeps running, so a lone guest does not bounce between
+ * threads. runnable counts queued guests and idle counts sleeping workers;
+ * both are sequentially consistent so that an enqueue either sees a
+ * sleeping worker and signals it, or the worker sees the guest before it
+ * sleeps.
+ *
+ * Parked guests with an input fd sit in an epoll set, armed one-shot while
+ * they are parked; a poller thread queues them again when the fd fires.
+ * park_lock orders parking against wakeups: a wake that arrives while the
+ * guest is still running sets wake_pending and the guest is queued instead
+ * of parked.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "sched.h"
+#include "utils.h"
+
+#define POLLER_EVENTS 64
+
+enum guest_state
+{
+  GUEST_ACTIVE = 0, /* queued or running */
+  GUEST_PARKED,
+  GUEST_DONE
+};
+
+struct sched_queue
+{
+  pthread_mutex_t lock;
+  struct sched_guest *head;
+  struct sched_guest *tail;
+  uint32_t depth;
+  uint32_t peak_depth;
+};
+
+struct sched_worker
+{
+  struct sched *sched;
+  int index;
+  pthread_t thread;
+  struct sched_queue queue;
+  uint64_t slices;
+  uint64_t steals;
+  uint64_t stolen;
+  uint64_t busy_ns;
+  uint64_t depth_sum;       /* queue depth summed over depth_samples takes */
+  uint64_t depth_samples;
+  int victim;               /* where the next raid starts looking */
+} __attribute__((aligned(64)));
+
+struct sched
+{
+  struct sched_worker *workers;
+  int worker_count;
+  uint64_t slice;
+  uint32_t next_worker;     /* sched_add deals guests out round robin */
+
+  pthread_mutex_t lock;     /* idle workers sleep on work under lock */
+  pthread_cond_t work;
+  uint32_t idle;
+  uint32_t runnable;
+  uint32_t live;
+  int shutdown;
+
+  pthread_mutex_t park_lock;
+  uint32_t parked;
+  uint64_t parks;
+  uint64_t wakeups;
+  int epoll_fd;
+  int event_fd;             /* in the epoll set with a NULL guest: stop */
+
+  uint64_t finished;
+  uint64_t guest_cpu_ns;
+  uint64_t guest_cpu_max_ns;
+  struct timespec start;
+  int running;
+  double seconds;
+};
+
+static uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+static void queue_push(struct sched_queue *queue, struct sched_guest *guest)
+{
+  guest->next = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail) {
+    queue->tail->next = guest;
+  }
+  else {
+    queue->head = guest;
+  }
+  queue->tail = guest;
+  uint32_t depth = queue->depth + 1;
+  __atomic_store_n(&queue->depth, depth, __ATOMIC_RELAXED);
+  if (depth > queue->peak_depth) {
+    __atomic_store_n(&queue->peak_depth, depth, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void enqueue(struct sched *sched, int worker, struct sched_guest *guest)
+{
+  guest->worker = worker;
+  queue_push(&sched->workers[worker].queue, guest);
+  __atomic_add_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->idle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_signal(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+static struct sched_guest *take(struct sched *sched, struct sched_worker *worker)
+/*
+ Pop the head of the worker's own queue, sampling its depth.
+*/
+{
+  struct sched_queue *queue = &worker->queue;
+  if (!__atomic_load_n(&queue->depth, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  pthread_mutex_lock(&queue->lock);
+  struct sched_guest *guest = queue->head;
+  if (guest) {
+    __atomic_add_fetch(&worker->depth_sum, queue->depth, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&worker->depth_samples, 1, __ATOMIC_RELAXED);
+    queue->head = guest->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+    __atomic_store_n(&queue->depth, queue->depth - 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  if (guest) {
+    __atomic_sub_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+  }
+  return guest;
+}
+
+static struct sched_guest *steal(struct sched *sched, struct sched_worker *thief)
+/*
+ Take half (rounded up) of the first non-empty queue found, starting after
+ the last victim. The first guest taken is returned to run, the rest go to
+ the thief's own queue.
+*/
+{
+  for (int i = 0; i < sched->worker_count; i++) {
+    int index = (thief->victim + i) % sched->worker_count;
+    struct sched_queue *queue = &sched->workers[index].queue;
+    if (index == thief->index || !__atomic_load_n(&queue->depth, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    pthread_mutex_lock(&queue->lock);
+    struct sched_guest *first = queue->head;
+    if (!first) {
+      pthread_mutex_unlock(&queue->lock);
+      continue;
+    }
+    uint32_t count = (queue->depth + 1) / 2;
+    struct sched_guest *last = first;
+    for (uint32_t n = 1; n < count; n++) {
+      last = last->next;
+    }
+    queue->head = last->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+    __atomic_store_n(&queue->depth, queue->depth - count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->lock);
+    last->next = NULL;
+
+    thief->victim = index + 1;
+    __atomic_add_fetch(&thief->steals, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&thief->stolen, count, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+    struct sched_guest *guest = first->next;
+    while (guest) {
+      struct sched_guest *next = guest->next;
+      guest->worker = thief->index;
+      queue_push(&thief->queue, guest);
+      guest = next;
+    }
+    return first;
+  }
+  return NULL;
+}
+
+static int wait_for_work(struct sched *sched)
+/*
+ Sleep until a guest is queued anywhere. Returns 0 once every guest is done.
+*/
+{
+  pthread_mutex_lock(&sched->lock);
+  __atomic_add_fetch(&sched->idle, 1, __ATOMIC_SEQ_CST);
+  while (!sched->shutdown && !__atomic_load_n(&sched->runnable, __ATOMIC_SEQ_CST)) {
+    pthread_cond_wait(&sched->work, &sched->lock);
+  }
+  __atomic_sub_fetch(&sched->idle, 1, __ATOMIC_SEQ_CST);
+  int more = !sched->shutdown;
+  pthread_mutex_unlock(&sched->lock);
+  return more;
+}
+
+static void wake(struct sched *sched, struct sched_guest *guest)
+{
+  pthread_mutex_lock(&sched->park_lock);
+  if (guest->state == GUEST_PARKED) {
+    guest->state = GUEST_ACTIVE;
+    sched->parked--;
+    sched->wakeups++;
+    pthread_mutex_unlock(&sched->park_lock);
+    enqueue(sched, guest->worker, guest);
+    return;
+  }
+  if (guest->state == GUEST_ACTIVE) {
+    guest->wake_pending = 1;
+  }
+  pthread_mutex_unlock(&sched->park_lock);
+}
+
+static int park(struct sched *sched, struct sched_guest *guest)
+/*
+ Returns 0 if the guest should be queued again instead: it was woken while
+ it ran, or epoll cannot watch its fd (a regular file is always readable).
+*/
+{
+  pthread_mutex_lock(&sched->park_lock);
+  if (guest->wake_pending) {
+    guest->wake_pending = 0;
+    pthread_mutex_unlock(&sched->park_lock);
+    return 0;
+  }
+  if (guest->input_fd >= 0) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = guest;
+    int op = guest->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(sched->epoll_fd, op, guest->input_fd, &event) != 0) {
+      pthread_mutex_unlock(&sched->park_lock);
+      return 0;
+    }
+    guest->watched = 1;
+  }
+  guest->state = GUEST_PARKED;
+  guest->parks++;
+  sched->parked++;
+  sched->parks++;
+  pthread_mutex_unlock(&sched->park_lock);
+  return 1;
+}
+
+static void stop_workers(struct sched *sched)
+{
+  pthread_mutex_lock(&sched->lock);
+  sched->shutdown = 1;
+  pthread_cond_broadcast(&sched->work);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static void finish(struct sched *sched, struct sched_guest *guest, enum vm_stop stop)
+{
+  guest->stop = stop;
+  pthread_mutex_lock(&sched->park_lock);
+  if (guest->watched) {
+    // not armed: it only is while parked
+    epoll_ctl(sched->epoll_fd, EPOLL_CTL_DEL, guest->input_fd, NULL);
+    guest->watched = 0;
+  }
+  guest->state = GUEST_DONE;
+  pthread_mutex_unlock(&sched->park_lock);
+
+  __atomic_add_fetch(&sched->finished, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&sched->guest_cpu_ns, guest->cpu_ns, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&sched->guest_cpu_max_ns, __ATOMIC_RELAXED);
+  while (guest->cpu_ns > max
+         && !__atomic_compare_exchange_n(&sched->guest_cpu_max_ns, &max, guest->cpu_ns, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  if (guest->done) {
+    guest->done(guest);
+  }
+  // after the callback, so sched_run cannot return while one still runs
+  if (__atomic_sub_fetch(&sched->live, 1, __ATOMIC_SEQ_CST) == 0) {
+    stop_workers(sched);
+  }
+}
+
+static struct sched_guest *run_slice(struct sched *sched, struct sched_worker *worker,
+                                     struct sched_guest *guest)
+/*
+ Run one slice. Returns the guest if it should run another slice at once
+ because nothing else is queued here, NULL if it was queued, parked or
+ finished.
+*/
+{
+  uint64_t budget = sched->slice;
+  if (guest->limit && guest->limit - guest->instructions < budget) {
+    budget = guest->limit - guest->instructions;
+  }
+  uint64_t before = vm_instructions(guest->vm);
+  struct timespec start, end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  enum vm_stop stop = vm_run(guest->vm, budget);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  uint64_t ns = elapsed_ns(&start, &end);
+  guest->instructions += vm_instructions(guest->vm) - before;
+  guest->cpu_ns += ns;
+  guest->slices++;
+  __atomic_add_fetch(&worker->busy_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&worker->slices, 1, __ATOMIC_RELAXED);
+
+  if (stop == VM_STOP_LIMIT && guest->limit && guest->instructions >= guest->limit) {
+    finish(sched, guest, stop);
+    return NULL;
+  }
+  if (stop == VM_STOP_INPUT) {
+    int ready = input_ready(guest->vm);
+    if (ready < 0) {
+      finish(sched, guest, stop);
+      return NULL;
+    }
+    if (ready == 0 && park(sched, guest)) {
+      return NULL;
+    }
+  }
+  else if (stop != VM_STOP_LIMIT) {
+    finish(sched, guest, stop);
+    return NULL;
+  }
+
+  // preempted, or input is ready
+  if (!__atomic_load_n(&worker->queue.depth, __ATOMIC_RELAXED)) {
+    return guest;
+  }
+  enqueue(sched, worker->index, guest);
+  return NULL;
+}
+
+static void *sched_worker(void *arg)
+{
+  struct sched_worker *worker = arg;
+  struct sched *sched = worker->sched;
+  struct sched_guest *guest = NULL;
+  for (;;) {
+    if (!guest) {
+      guest = take(sched, worker);
+    }
+    if (!guest) {
+      guest = steal(sched, worker);
+    }
+    if (!guest) {
+      if (!wait_for_work(sched)) {
+        break;
+      }
+      continue;
+    }
+    guest = run_slice(sched, worker, guest);
+  }
+  return NULL;
+}
+
+static void *sched_poller(void *arg)
+{
+  struct sched *sched = arg;
+  struct epoll_event events[POLLER_EVENTS];
+  for (;;) {
+    int count = epoll_wait(sched->epoll_fd, events, POLLER_EVENTS, -1);
+    if (count < 0 && errno != EINTR) {
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (!events[i].data.ptr) {
+        return NULL;
+      }
+      wake(sched, events[i].data.ptr);
+    }
+  }
+  return NULL;
+}
+
+struct sched *sched_create(int workers, uint64_t slice)
+{
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+  struct sched *sched = calloc(1, sizeof(*sched));
+  if (!sched) {
+    return NULL;
+  }
+  if (posix_memalign((void **)&sched->workers, 64, workers * sizeof(*sched->workers)) != 0) {
+    free(sched);
+    return NULL;
+  }
+  memset(sched->workers, 0, workers * sizeof(*sched->workers));
+  sched->worker_count = workers;
+  sched->slice = slice ? slice : SCHED_DEFAULT_SLICE;
+  for (int i = 0; i < workers; i++) {
+    struct sched_worker *worker = &sched->workers[i];
+    worker->sched = sched;
+    worker->index = i;
+    worker->victim = i + 1;
+    pthread_mutex_init(&worker->queue.lock, NULL);
+  }
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->work, NULL);
+  pthread_mutex_init(&sched->park_lock, NULL);
+
+  sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  sched->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (sched->epoll_fd < 0 || sched->event_fd < 0
+      || epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->event_fd, &event) != 0) {
+    sched_destroy(sched);
+    return NULL;
+  }
+  return sched;
+}
+
+void sched_destroy(struct sched *sched)
+{
+  if (!sched) {
+    return;
+  }
+  for (int i = 0; i < sched->worker_count; i++) {
+    pthread_mutex_destroy(&sched->workers[i].queue.lock);
+  }
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->work);
+  pthread_mutex_destroy(&sched->park_lock);
+  if (sched->epoll_fd >= 0) {
+    close(sched->epoll_fd);
+  }
+  if (sched->event_fd >= 0) {
+    close(sched->event_fd);
+  }
+  free(sched->workers);
+  free(sched);
+}
+
+void sched_add(struct sched *sched, struct sched_guest *guest)
+{
+  guest->stop = VM_STOP_NONE;
+  guest->instructions = guest->cpu_ns = guest->slices = guest->parks = 0;
+  guest->state = GUEST_ACTIVE;
+  guest->wake_pending = 0;
+  guest->watched = 0;
+  __atomic_add_fetch(&sched->live, 1, __ATOMIC_SEQ_CST);
+  uint32_t worker = __atomic_fetch_add(&sched->next_worker, 1, __ATOMIC_RELAXED);
+  enqueue(sched, worker % sched->worker_count, guest);
+}
+
+void sched_wake(struct sched *sched, struct sched_guest *guest)
+{
+  if (guest->input_fd < 0) {
+    wake(sched, guest);
+  }
+}
+
+int sched_run(struct sched *sched)
+{
+  if (!__atomic_load_n(&sched->live, __ATOMIC_SEQ_CST)) {
+    return 1;
+  }
+  sched->shutdown = 0;
+  clock_gettime(CLOCK_MONOTONIC, &sched->start);
+  __atomic_store_n(&sched->running, 1, __ATOMIC_RELEASE);
+
+  pthread_t poller;
+  if (pthread_create(&poller, NULL, sched_poller, sched) != 0) {
+    __atomic_store_n(&sched->running, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+  int started = 0;
+  while (started < sched->worker_count
+         && pthread_create(&sched->workers[started].thread, NULL, sched_worker,
+                           &sched->workers[started]) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    // no threads available: be the only worker, stealing from every queue
+    sched_worker(&sched->workers[0]);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(sched->workers[i].thread, NULL);
+  }
+
+  // wake the poller with the event fd, then drain it for the next run
+  uint64_t one = 1;
+  if (write(sched->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    pthread_cancel(poller);
+  }
+  pthread_join(poller, NULL);
+  while (read(sched->event_fd, &one, sizeof(one)) > 0) {
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sched->seconds = elapsed_ns(&sched->start, &end) / 1e9;
+  __atomic_store_n(&sched->running, 0, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void sched_get_stats(const struct sched *sched, struct sched_stats *stats,
+                     struct sched_worker_stats *per_worker)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->workers = sched->worker_count;
+  if (__atomic_load_n(&sched->running, __ATOMIC_ACQUIRE)) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats->seconds = elapsed_ns(&sched->start, &now) / 1e9;
+  }
+  else {
+    stats->seconds = sched->seconds;
+  }
+  for (int i = 0; i < sched->worker_count; i++) {
+    const struct sched_worker *worker = &sched->workers[i];
+    struct sched_worker_stats entry;
+    entry.slices = __atomic_load_n(&worker->slices, __ATOMIC_RELAXED);
+    entry.steals = __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+    entry.stolen = __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+    entry.busy_ns = __atomic_load_n(&worker->busy_ns, __ATOMIC_RELAXED);
+    entry.depth = __atomic_load_n(&worker->queue.depth, __ATOMIC_RELAXED);
+    entry.peak_depth = __atomic_load_n(&worker->queue.peak_depth, __ATOMIC_RELAXED);
+    uint64_t samples = __atomic_load_n(&worker->depth_samples, __ATOMIC_RELAXED);
+    entry.mean_depth = samples
+      ? (double)__atomic_load_n(&worker->depth_sum, __ATOMIC_RELAXED) / samples : 0.0;
+    stats->slices += entry.slices;
+    stats->steals += entry.steals;
+    if (per_worker) {
+      per_worker[i] = entry;
+    }
+  }
+  stats->parks = __atomic_load_n(&sched->parks, __ATOMIC_RELAXED);
+  stats->wakeups = __atomic_load_n(&sched->wakeups, __ATOMIC_RELAXED);
+  stats->live = __atomic_load_n(&sched->live, __ATOMIC_RELAXED);
+  stats->runnable = __atomic_load_n(&sched->runnable, __ATOMIC_RELAXED);
+  stats->parked = __atomic_load_n(&sched->parked, __ATOMIC_RELAXED);
+  stats->finished = __atomic_load_n(&sched->finished, __ATOMIC_RELAXED);
+  stats->guest_cpu_ns = __atomic_load_n(&sched->guest_cpu_ns, __ATOMIC_RELAXED);
+  stats->guest_cpu_max_ns = __atomic_load_n(&sched->guest_cpu_max_ns, __ATOMIC_RELAXED);
+}
+
+void sched_report(const struct sched *sched, FILE *out)
+{
+  struct sched_stats stats;
+  struct sched_worker_stats *workers = malloc(sched->worker_count * sizeof(*workers));
+  sched_get_stats(sched, &stats, workers);
+  fprintf(out, "sched: %llu guests on %d workers in %.3f s: %llu slices, %llu steals "
+          "(%.1f/s), %llu parks, %llu wakeups\n",
+          (unsigned long long)stats.finished, stats.workers, stats.seconds,
+          (unsigned long long)stats.slices, (unsigned long long)stats.steals,
+          stats.seconds > 0 ? stats.steals / stats.seconds : 0.0,
+          (unsigned long long)stats.parks, (unsigned long long)stats.wakeups);
+  fprintf(out, "sched: guest cpu mean %.3f ms, max %.3f ms\n",
+          stats.finished ? stats.guest_cpu_ns / 1e6 / stats.finished : 0.0,
+          stats.guest_cpu_max_ns / 1e6);
+  for (int i = 0; workers && i < stats.workers; i++) {
+    fprintf(out, "worker %d: %llu slices, busy %.3f s, %llu steals taking %llu guests, "
+            "queue depth mean %.1f peak %u\n", i,
+            (unsigned long long)workers[i].slices, workers[i].busy_ns / 1e9,
+            (unsigned long long)workers[i].steals, (unsigned long long)workers[i].stolen,
+            workers[i].mean_depth, workers[i].peak_depth);
+  }
+  free(workers);
+}
@@ -0,0 +1,100 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "garbageeater.h"
+
+/** many-instance scheduler
+ * Time-slices any number of guests on a pool of worker threads. Every worker
+ * owns a run queue; a guest runs for at most one slice of instructions, then
+ * goes to the back of the queue of the worker that ran it. A worker whose
+ * queue is empty steals half of another worker's queue, and sleeps only when
+ * every queue is empty.
+ * A guest's I/O backend must not block (wait_key NULL). When it stops with
+ * VM_STOP_INPUT and key_ready says a key may still come, the guest is parked:
+ * an input_fd is watched with epoll and the guest is queued again once the fd
+ * is readable or hung up; without one, only sched_wake brings it back. A
+ * guest ends on HALT, an illegal trap, its instruction limit, or when it
+ * wants a key after key_ready has reported the input closed.
+ **/
+
+struct sched;
+
+struct sched_guest
+{
+  /* set by the caller before sched_add */
+  struct vm *vm;
+  int input_fd;             /* readable when a key may be ready, or -1 */
+  uint64_t limit;           /* instructions, 0 for none */
+  void (*done)(struct sched_guest *guest); /* runs on a worker, may be NULL */
+  void *user;
+
+  /* filled in by the scheduler; final once done has been called */
+  enum vm_stop stop;
+  uint64_t instructions;    /* retired under the scheduler */
+  uint64_t cpu_ns;          /* worker thread CPU time spent in its slices */
+  uint64_t slices;
+  uint64_t parks;
+
+  /* owned by the scheduler */
+  struct sched_guest *next;
+  int state;
+  int wake_pending;
+  int watched;              /* input_fd is in the epoll set */
+  int worker;               /* last worker that ran it */
+};
+
+struct sched_worker_stats
+{
+  uint64_t slices;
+  uint64_t steals;          /* successful raids on other queues */
+  uint64_t stolen;          /* guests taken in them */
+  uint64_t busy_ns;         /* CPU time spent running guests */
+  uint32_t depth;           /* guests in its queue now */
+  uint32_t peak_depth;
+  double mean_depth;        /* sampled every time the worker takes a guest */
+};
+
+struct sched_stats
+{
+  int workers;
+  double seconds;           /* wall time in sched_run */
+  uint64_t slices;
+  uint64_t steals;
+  uint64_t parks;
+  uint64_t wakeups;
+  uint32_t live;            /* guests added and not done */
+  uint32_t runnable;        /* ... waiting in a run queue */
+  uint32_t parked;          /* ... waiting for input */
+  uint64_t finished;        /* guests done */
+  uint64_t guest_cpu_ns;    /* total and largest CPU time of finished guests */
+  uint64_t guest_cpu_max_ns;
+};
+
+/* workers 0 for one per online core; slice 0 for SCHED_DEFAULT_SLICE */
+#define SCHED_DEFAULT_SLICE 100000
+struct sched *sched_create(int workers, uint64_t slice);
+void sched_destroy(struct sched *sched);
+
+/* queue a guest; also allowed while sched_run runs, from any thread */
+void sched_add(struct sched *sched, struct sched_guest *guest);
+
+/* queue a parked guest again, e.g. after giving its backend more input;
+ * safe from any thread and at any time, a wake for a guest that is not
+ * parked makes it skip its next park */
+void sched_wake(struct sched *sched, struct sched_guest *guest);
+
+/* run until every guest added is done; returns 0 if the threads or the
+ * event source could not be set up */
+int sched_run(struct sched *sched);
+
+/* counters so far; per_worker, if not NULL, gets stats.workers entries.
+ * Safe to call from another thread while sched_run runs. */
+void sched_get_stats(const struct sched *sched, struct sched_stats *stats,
+                     struct sched_worker_stats *per_worker);
+
+/* a summary line and one line per worker */
+void sched_report(const struct sched *sched, FILE *out);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Shared memory images
+ *
+ * vm_image_create lays an object image out once as a whole 64K-word guest
+ * memory in a memory file (memfd), and vm_map_image maps that file into a
+ * VM with MAP_PRIVATE: every VM mapping the same image reads the same
+ * physical pages, and the kernel gives a VM its own copy of a page the first
+ * time it stores to it. Spawning a VM is one mmap however large the image,
+ * and what it holds on its own is only the pages it has written.
+ *
+ * vm_dirty_pages asks /proc/self/pagemap which pages of a VM's memory are
+ * its own: present and mapped only there, or swapped out, and not a page of
+ * a file. That covers the copies made from a shared image as well as the
+ * pages of an ordinary VM's anonymous memory that were written (reads of
+ * untouched anonymous memory map the shared zero page, which is not counted).
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "garbageeater.h"
+#include "image.h"
+#include "utils.h"
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE (1ULL << 61)      /* file page or shared anonymous */
+#define PAGEMAP_EXCLUSIVE (1ULL << 56) /* mapped exactly once */
+#define PAGEMAP_MIN_PAGE 4096
+
+struct vm_image
+{
+  int fd;                   /* the memory file, or -1 without memfd */
+  uint16_t *memory;         /* its words, read-only, or a malloc'd copy */
+};
+
+struct vm_image *vm_image_create(const void *image, size_t size)
+{
+  const uint8_t *bytes = image;
+  if (image_problem(bytes, size)) {
+    return NULL;
+  }
+  struct vm_image *shared = malloc(sizeof(*shared));
+  if (!shared) {
+    return NULL;
+  }
+  shared->fd = -1;
+  shared->memory = MAP_FAILED;
+#if defined(__linux__)
+  shared->fd = memfd_create("lc3-image", MFD_CLOEXEC);
+  if (shared->fd >= 0 && ftruncate(shared->fd, MEMORY_BYTES) == 0) {
+    shared->memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          shared->fd, 0);
+  }
+#endif
+  if (shared->memory == MAP_FAILED) {
+    // no memory file: every VM gets a copy, as vm_load_image would give it
+    if (shared->fd >= 0) {
+      close(shared->fd);
+      shared->fd = -1;
+    }
+    shared->memory = calloc(1, MEMORY_BYTES);
+    if (!shared->memory) {
+      free(shared);
+      return NULL;
+    }
+  }
+
+  uint16_t origin = (bytes[0] << 8) | bytes[1];
+  load_big_endian_words(shared->memory + origin, bytes + 2, (size - 2) / 2);
+  if (shared->fd >= 0) {
+    mprotect(shared->memory, MEMORY_BYTES, PROT_READ);
+  }
+  return shared;
+}
+
+void vm_image_destroy(struct vm_image *shared)
+{
+  if (!shared) {
+    return;
+  }
+  if (shared->fd >= 0) {
+    munmap(shared->memory, MEMORY_BYTES);
+    close(shared->fd);
+  }
+  else {
+    free(shared->memory);
+  }
+  free(shared);
+}
+
+int vm_map_image(struct vm *vm, const struct vm_image *shared)
+{
+  uint16_t *memory = MAP_FAILED;
+  if (shared->fd >= 0) {
+    memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE, shared->fd, 0);
+  }
+  if (memory == MAP_FAILED) {
+    memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1, 0);
+    if (memory == MAP_FAILED) {
+      return 0;
+    }
+    memcpy(memory, shared->memory, MEMORY_BYTES);
+  }
+  replace_memory(vm, memory, 1);
+  return 1;
+}
+
+long vm_dirty_pages(const struct vm *vm)
+{
+#if defined(__linux__)
+  long page = sysconf(_SC_PAGESIZE);
+  if (page < PAGEMAP_MIN_PAGE) {
+    return -1;
+  }
+  int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  uintptr_t first = (uintptr_t)vm->memory / page;
+  uintptr_t last = ((uintptr_t)vm->memory + MEMORY_BYTES - 1) / page;
+  uint64_t entries[MEMORY_BYTES / PAGEMAP_MIN_PAGE + 1];
+  size_t len = (last - first + 1) * sizeof(entries[0]);
+  ssize_t got = pread(fd, entries, len, first * sizeof(entries[0]));
+  close(fd);
+  if (got != (ssize_t)len) {
+    return -1;
+  }
+  long dirty = 0;
+  for (uintptr_t i = 0; i <= last - first; i++) {
+    uint64_t entry = entries[i];
+    if ((entry & PAGEMAP_SWAPPED)
+        || ((entry & PAGEMAP_PRESENT) && (entry & PAGEMAP_EXCLUSIVE) && !(entry & PAGEMAP_FILE))) {
+      dirty++;
+    }
+  }
+  return dirty;
+#else
+  return -1;
+#endif
+}
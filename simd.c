@@ -0,0 +1,598 @@
+/*
+ * SIMD lockstep interpreter
+ *
+ * The group keeps one vector per guest register with a lane per VM, and runs
+ * a set of lanes that share a PC (the running set) with that PC in a scalar:
+ * while they agree on where to go next, fetching, decoding and branching
+ * happen once for all of them and only the ALU work is done per lane, by the
+ * vector unit. Lanes outside the set wait with their PC in pc; the set is
+ * chosen again (settle, reselect) whenever its PC reaches the lowest waiting
+ * one, so lanes that took different sides of a branch run the join point
+ * together, and whenever its own lanes disagree about a branch or a jump.
+ *
+ * Everything with side effects is per lane and scalar: loads and stores hit
+ * each VM's memory, and TRAP and the keyboard registers run through op_* on
+ * a VM brought up to date with its lane (step_alone), exactly as run_switch
+ * would run them. Retired instructions are counted per lane in ticks and
+ * folded into vm->remaining at least every 0xFFFF steps, and never later than
+ * the lane with the smallest budget runs out.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+#include "opcode.h"
+#include "utils.h"
+
+// every function that takes or returns lanes is inlined into one of the two
+// simd_loop copies, so the generic copy's calling convention never matters
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef uint16_t lanes __attribute__((vector_size(SIMD_LANES * sizeof(uint16_t))));
+typedef int16_t signed_lanes __attribute__((vector_size(SIMD_LANES * sizeof(int16_t))));
+
+#define LANE_BITS_EVEN 0x55555555u /* lane_bits gives two bits per lane */
+#define NO_PC 0x10000
+#define MAX_QUANTUM 0xFFFF         /* ticks are 16 bits wide */
+
+struct simd_group
+{
+  lanes reg[R_PC];
+  lanes pc;                 /* lanes not running; running ones are at p */
+  lanes result;             /* last flag-setting result */
+  lanes unset;              /* all ones until a flag-setting instruction */
+  lanes ticks;              /* retired since the last fold */
+  lanes alive;
+  lanes run;                /* the running set */
+  uint32_t run_bits;        /* lane_bits(run) */
+  uint16_t p;
+  uint32_t wait_min;        /* lowest PC of an alive lane not running */
+  int lead;                 /* a running lane; its memory holds the code */
+  struct vm *vms[SIMD_LANES];
+  uint64_t same[(UINT16_MAX + 1) / 64]; /* words equal in every alive lane */
+};
+
+static inline __attribute__((always_inline)) lanes splat(uint16_t value)
+{
+  return (lanes){0} + value;
+}
+
+static inline __attribute__((always_inline)) lanes blend(lanes mask, lanes a, lanes b)
+{
+  return (a & mask) | (b & ~mask);
+}
+
+static inline __attribute__((always_inline)) uint32_t lane_bits_generic(lanes mask)
+{
+  uint32_t bits = 0;
+  for (int i = 0; i < SIMD_LANES; i++) {
+    bits |= (uint32_t)(mask[i] & 3) << (2 * i);
+  }
+  return bits;
+}
+
+#if defined(__x86_64__)
+static inline __attribute__((target("avx2"))) uint32_t lane_bits_avx2(lanes mask)
+{
+  return _mm256_movemask_epi8((__m256i)mask);
+}
+#endif
+
+static inline __attribute__((always_inline)) uint32_t lane_bits(lanes mask, const int avx2)
+/*
+ Two bits per lane that is all ones in mask, lane 0 lowest.
+*/
+{
+#if defined(__x86_64__)
+  if (avx2) {
+    return lane_bits_avx2(mask);
+  }
+#endif
+  return lane_bits_generic(mask);
+}
+
+static inline int take_lane(uint32_t *bits)
+/*
+ Pop the lowest lane off a lane_bits & LANE_BITS_EVEN set.
+*/
+{
+  int lane = __builtin_ctz(*bits) >> 1;
+  *bits &= *bits - 1;
+  return lane;
+}
+
+static inline void forget_word(struct simd_group *g, uint16_t address)
+{
+  g->same[address >> 6] &= ~(1ULL << (address & 63));
+}
+
+static inline __attribute__((always_inline)) void set_result(struct simd_group *g, uint16_t dr, lanes value, lanes mask)
+{
+  g->reg[dr] = blend(mask, value, g->reg[dr]);
+  g->result = blend(mask, value, g->result);
+  g->unset &= ~mask;
+}
+
+static void lane_to_vm(struct simd_group *g, int lane, uint16_t pc)
+{
+  struct vm *vm = g->vms[lane];
+  for (int r = R_0; r < R_PC; r++) {
+    vm->reg[r] = g->reg[r][lane];
+  }
+  vm->reg[R_PC] = pc;
+  vm->flag_result = g->unset[lane] ? COND_UNSET : g->result[lane];
+}
+
+static void lane_from_vm(struct simd_group *g, int lane)
+{
+  struct vm *vm = g->vms[lane];
+  for (int r = R_0; r < R_PC; r++) {
+    g->reg[r][lane] = vm->reg[r];
+  }
+  g->pc[lane] = vm->reg[R_PC];
+  g->unset[lane] = vm->flag_result == COND_UNSET ? 0xFFFF : 0;
+  g->result[lane] = vm->flag_result;
+}
+
+static void execute(struct vm *vm, uint16_t instruction)
+/*
+ One instruction through the op_* functions, as switch_loop dispatches it.
+*/
+{
+  switch (instruction >> 12) {
+    case OP_BR:
+      op_br(vm, instruction);
+      break;
+    case OP_ADD:
+      op_add(vm, instruction);
+      break;
+    case OP_LD:
+      op_ld(vm, instruction);
+      break;
+    case OP_ST:
+      op_st(vm, instruction);
+      break;
+    case OP_JSR:
+      op_jsr(vm, instruction);
+      break;
+    case OP_AND:
+      op_and(vm, instruction);
+      break;
+    case OP_LDR:
+      op_ldr(vm, instruction);
+      break;
+    case OP_STR:
+      op_str(vm, instruction);
+      break;
+    case OP_NOT:
+      op_not(vm, instruction);
+      break;
+    case OP_LDI:
+      op_ldi(vm, instruction);
+      break;
+    case OP_STI:
+      op_sti(vm, instruction);
+      break;
+    case OP_JMP:
+      op_jmp(vm, instruction);
+      break;
+    case OP_LEA:
+      op_lea(vm, instruction);
+      break;
+    case OP_TRAP:
+      op_trap(vm, instruction);
+      break;
+    default:
+      // RTI and RES do nothing here either
+      break;
+  }
+}
+
+static void step_alone(struct simd_group *g, int lane)
+/*
+ Run the instruction at p for one lane on its own VM. The lane's tick for it
+ is already counted, so folding its ticks first leaves vm->remaining where
+ run_switch would have it, and a stop or the end of its budget ends the lane.
+*/
+{
+  struct vm *vm = g->vms[lane];
+  vm->remaining -= g->ticks[lane];
+  g->ticks[lane] = 0;
+  lane_to_vm(g, lane, g->p + 1);
+  uint64_t stores = vm->code.stores;
+  execute(vm, read_from_memory(vm, g->p));
+  lane_from_vm(g, lane);
+  if (vm->code.stores != stores) {
+    // a trap stored somewhere: it may have been code
+    memset(g->same, 0, sizeof(g->same));
+  }
+  if (vm->stop != VM_STOP_NONE || vm->remaining <= 0) {
+    g->alive[lane] = 0;
+  }
+}
+
+static void run_alone(struct simd_group *g, uint32_t lanes_bits)
+{
+  for (uint32_t bits = lanes_bits & LANE_BITS_EVEN; bits;) {
+    step_alone(g, take_lane(&bits));
+  }
+}
+
+static inline __attribute__((always_inline)) void settle(struct simd_group *g)
+/*
+ Give the running lanes their PC back, so that every lane's is in pc.
+*/
+{
+  g->pc = blend(g->run, splat(g->p), g->pc);
+  g->run = (lanes){0};
+  g->run_bits = 0;
+}
+
+static inline __attribute__((always_inline)) int reselect(struct simd_group *g, const int avx2)
+/*
+ Run the alive lanes at the lowest PC next. Returns 0 if no lane is alive.
+*/
+{
+  uint32_t alive = lane_bits(g->alive, avx2) & LANE_BITS_EVEN;
+  if (!alive) {
+    return 0;
+  }
+  uint32_t p = NO_PC;
+  for (uint32_t bits = alive; bits;) {
+    int lane = take_lane(&bits);
+    if (g->pc[lane] < p) {
+      p = g->pc[lane];
+    }
+  }
+  g->p = p;
+  g->run = (lanes)(g->pc == splat(p)) & g->alive;
+  g->run_bits = lane_bits(g->run, avx2);
+  g->lead = __builtin_ctz(g->run_bits) >> 1;
+  g->wait_min = NO_PC;
+  for (uint32_t bits = alive & ~g->run_bits; bits;) {
+    int lane = take_lane(&bits);
+    if (g->pc[lane] < g->wait_min) {
+      g->wait_min = g->pc[lane];
+    }
+  }
+  return 1;
+}
+
+static inline __attribute__((always_inline)) uint32_t fold(struct simd_group *g, const int avx2)
+/*
+ Move the ticks into each VM's budget and end the lanes that used it up.
+ Returns how many steps may run before the next fold, 0 if none is alive.
+*/
+{
+  uint32_t quantum = 0;
+  for (uint32_t bits = lane_bits(g->alive, avx2) & LANE_BITS_EVEN; bits;) {
+    int lane = take_lane(&bits);
+    struct vm *vm = g->vms[lane];
+    vm->remaining -= g->ticks[lane];
+    if (vm->remaining <= 0) {
+      g->alive[lane] = 0;
+    }
+    else if (!quantum || vm->remaining < quantum) {
+      quantum = vm->remaining < MAX_QUANTUM ? vm->remaining : MAX_QUANTUM;
+    }
+  }
+  g->ticks = (lanes){0};
+  return quantum;
+}
+
+static inline __attribute__((always_inline)) void check_word(struct simd_group *g, uint16_t instruction, const int avx2)
+/*
+ The instruction at p is not known to be the same in every alive lane:
+ compare, and leave the running lanes that hold something else waiting at p.
+*/
+{
+  uint16_t p = g->p;
+  int differ = 0;
+  for (uint32_t bits = lane_bits(g->alive, avx2) & LANE_BITS_EVEN; bits;) {
+    int lane = take_lane(&bits);
+    if (g->vms[lane]->memory[p] != instruction) {
+      differ = 1;
+      if (g->run[lane]) {
+        g->run[lane] = 0;
+        g->pc[lane] = p;
+        g->wait_min = p;
+      }
+    }
+  }
+  if (!differ) {
+    // the device registers change behind the guest's back
+    if (p < M_KBSR) {
+      g->same[p >> 6] |= 1ULL << (p & 63);
+    }
+  }
+  else {
+    g->run_bits = lane_bits(g->run, avx2);
+  }
+}
+
+static inline __attribute__((always_inline)) void simd_loop(struct simd_group *g, const int avx2)
+{
+  uint32_t left = 0;
+  for (;;) {
+    if (left == 0) {
+      settle(g);
+      left = fold(g, avx2);
+      if (!left || !reselect(g, avx2)) {
+        return;
+      }
+    }
+
+    uint16_t p = g->p;
+    if (p == M_KBSR) {
+      // fetching reads the keyboard status
+      g->ticks -= g->run;
+      left--;
+      g->pc = blend(g->run, splat(p + 1), g->pc);
+      run_alone(g, g->run_bits);
+      goto scattered;
+    }
+    uint16_t instruction = g->vms[g->lead]->memory[p];
+    if (!smc_bit(g->same, p)) {
+      check_word(g, instruction, avx2);
+    }
+    lanes run = g->run;
+    g->ticks -= run;
+    left--;
+
+    uint16_t next = p + 1;
+    uint16_t dr = (instruction >> 9) & 0x7;
+    uint16_t sr1 = (instruction >> 6) & 0x7;
+    switch (instruction >> 12) {
+      case OP_ADD:
+        if (instruction & 0x20) {
+          set_result(g, dr, g->reg[sr1] + get_sign_extension(instruction & 0x1F, 5), run);
+        }
+        else {
+          set_result(g, dr, g->reg[sr1] + g->reg[instruction & 0x7], run);
+        }
+        break;
+
+      case OP_AND:
+        if (instruction & 0x20) {
+          set_result(g, dr, g->reg[sr1] & get_sign_extension(instruction & 0x1F, 5), run);
+        }
+        else {
+          set_result(g, dr, g->reg[sr1] & g->reg[instruction & 0x7], run);
+        }
+        break;
+
+      case OP_NOT:
+        set_result(g, dr, ~g->reg[sr1], run);
+        break;
+
+      case OP_LEA:
+        set_result(g, dr, splat(next + get_sign_extension(instruction & 0x1FF, 9)), run);
+        break;
+
+      case OP_BR: {
+        uint16_t nzp = dr;
+        if (!nzp) {
+          break;
+        }
+        uint16_t target = next + get_sign_extension(instruction & 0x1FF, 9);
+        signed_lanes value = (signed_lanes)g->result;
+        lanes taken = (lanes){0};
+        if (nzp & 4) {
+          taken |= (lanes)(value < 0);
+        }
+        if (nzp & 2) {
+          taken |= (lanes)(value == 0);
+        }
+        if (nzp & 1) {
+          taken |= (lanes)(value > 0);
+        }
+        taken &= run & ~g->unset;
+        uint32_t taken_bits = lane_bits(taken, avx2);
+        if (taken_bits == g->run_bits) {
+          next = target;
+        }
+        else if (taken_bits) {
+          g->pc = blend(taken, splat(target), blend(run, splat(next), g->pc));
+          goto scattered;
+        }
+        break;
+      }
+
+      case OP_JMP:
+      case OP_JSR: {
+        int link = instruction >> 12 == OP_JSR;
+        if (link && (instruction & 0x800)) {
+          next += get_sign_extension(instruction & 0x7FF, 11);
+        }
+        else {
+          lanes target = g->reg[sr1];
+          uint16_t first = target[g->lead];
+          if (lane_bits((lanes)(target == splat(first)) & run, avx2) == g->run_bits) {
+            next = first;
+          }
+          else {
+            g->pc = blend(run, target, g->pc);
+            if (link) {
+              g->reg[R_7] = blend(run, splat(p + 1), g->reg[R_7]);
+            }
+            goto scattered;
+          }
+        }
+        if (link) {
+          g->reg[R_7] = blend(run, splat(p + 1), g->reg[R_7]);
+        }
+        break;
+      }
+
+      case OP_LD:
+      case OP_LDR:
+      case OP_LDI: {
+        uint16_t opcode = instruction >> 12;
+        uint16_t address = next + get_sign_extension(instruction & 0x1FF, 9);
+        if (opcode != OP_LDR && address == M_KBSR) {
+          g->pc = blend(run, splat(next), g->pc);
+          run_alone(g, g->run_bits);
+          goto scattered;
+        }
+        lanes value = (lanes){0};
+        lanes loaded = run;
+        uint32_t slow = 0;
+        for (uint32_t bits = g->run_bits & LANE_BITS_EVEN; bits;) {
+          int lane = take_lane(&bits);
+          const uint16_t *memory = g->vms[lane]->memory;
+          if (opcode == OP_LDR) {
+            address = g->reg[sr1][lane] + get_sign_extension(instruction & 0x3F, 6);
+          }
+          uint16_t final = opcode == OP_LDI ? memory[address] : address;
+          if (final == M_KBSR) {
+            slow |= 3u << (2 * lane);
+            loaded[lane] = 0;
+            continue;
+          }
+          value[lane] = memory[final];
+        }
+        set_result(g, dr, value, loaded);
+        if (slow) {
+          g->pc = blend(run, splat(next), g->pc);
+          run_alone(g, slow);
+          goto scattered;
+        }
+        break;
+      }
+
+      case OP_ST:
+      case OP_STR:
+      case OP_STI: {
+        uint16_t opcode = instruction >> 12;
+        uint16_t address = next + get_sign_extension(instruction & 0x1FF, 9);
+        if (opcode == OP_STI && address == M_KBSR) {
+          g->pc = blend(run, splat(next), g->pc);
+          run_alone(g, g->run_bits);
+          goto scattered;
+        }
+        for (uint32_t bits = g->run_bits & LANE_BITS_EVEN; bits;) {
+          int lane = take_lane(&bits);
+          struct vm *vm = g->vms[lane];
+          if (opcode == OP_STR) {
+            address = g->reg[sr1][lane] + get_sign_extension(instruction & 0x3F, 6);
+          }
+          uint16_t final = opcode == OP_STI ? vm->memory[address] : address;
+          write_to_memory(vm, final, g->reg[dr][lane]);
+          forget_word(g, final);
+        }
+        break;
+      }
+
+      case OP_TRAP:
+        g->pc = blend(run, splat(next), g->pc);
+        run_alone(g, g->run_bits);
+        goto scattered;
+
+      default:
+        // RTI and RES
+        break;
+    }
+
+    g->p = next;
+    if (next >= g->wait_min) {
+      // caught up with a waiting lane: run the lowest PC again
+      settle(g);
+      if (!reselect(g, avx2)) {
+        return;
+      }
+    }
+    continue;
+
+  scattered:
+    // the running lanes' PCs are in pc already
+    g->run = (lanes){0};
+    g->run_bits = 0;
+    if (!reselect(g, avx2)) {
+      return;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("avx2"))) void simd_loop_avx2(struct simd_group *g)
+{
+  simd_loop(g, 1);
+}
+#endif
+
+static void simd_loop_generic(struct simd_group *g)
+{
+  simd_loop(g, 0);
+}
+
+static int have_avx2(void)
+{
+#if defined(__x86_64__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+const char *simd_unit(void)
+{
+  return have_avx2() ? "avx2" : "generic";
+}
+
+int simd_run(struct vm *const *vms, int count, uint64_t max_instructions,
+             enum vm_stop *stops)
+{
+  if (count < 1 || count > SIMD_LANES) {
+    return 0;
+  }
+  struct simd_group *g;
+  if (posix_memalign((void **)&g, sizeof(lanes), sizeof(*g)) != 0) {
+    return 0;
+  }
+  memset(g, 0, sizeof(*g));
+  if (max_instructions > INT64_MAX) {
+    max_instructions = INT64_MAX;
+  }
+
+  uint32_t grouped = 0;
+  for (int lane = 0; lane < count; lane++) {
+    struct vm *vm = vms[lane];
+    if (vm->profile || vm->trace || vm->watch) {
+      // their hooks live in the switch engine
+      stops[lane] = vm_run(vm, max_instructions);
+      continue;
+    }
+    grouped |= 3u << (2 * lane);
+    vm->stop = VM_STOP_NONE;
+    vm->icount_base = vm_icount(vm) + max_instructions;
+    vm->remaining = max_instructions;
+    g->vms[lane] = vm;
+    lane_from_vm(g, lane);
+    g->alive[lane] = max_instructions ? 0xFFFF : 0;
+  }
+
+  if (have_avx2()) {
+#if defined(__x86_64__)
+    simd_loop_avx2(g);
+#endif
+  }
+  else {
+    simd_loop_generic(g);
+  }
+
+  for (uint32_t bits = grouped & LANE_BITS_EVEN; bits;) {
+    int lane = take_lane(&bits);
+    struct vm *vm = g->vms[lane];
+    lane_to_vm(g, lane, g->pc[lane]);
+    if (vm->stop == VM_STOP_NONE) {
+      vm->stop = VM_STOP_LIMIT;
+    }
+    stops[lane] = vm->stop;
+  }
+  free(g);
+  return 1;
+}
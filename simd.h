@@ -0,0 +1,35 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <stdint.h>
+#include "garbageeater.h"
+
+/** SIMD lockstep runs
+ * simd_run runs up to SIMD_LANES VMs holding the same program (memory and
+ * input may differ) as one: their registers live side by side, one vector
+ * per LC-3 register, and each step executes one instruction for every lane
+ * whose PC is the group's PC, so ADD, AND, NOT, LEA, the flag results and BR
+ * conditions are single vector operations (AVX2 when the CPU has it).
+ * Loads and stores go to each lane's own memory; TRAPs and keyboard reads
+ * call the interpreter's op_* functions for one lane at a time.
+ * Lanes whose branches go different ways are masked off: the group always
+ * runs the lanes with the lowest PC, and the others wait until it catches up
+ * with them, which is where structured code reconverges. A lane whose
+ * memory holds a different instruction at the group's PC waits likewise.
+ * Each VM ends up as if vm_run(vm, max_instructions) had run it alone.
+ * A VM that is profiled, traced or watched runs on its own through vm_run
+ * first. The I/O backends must not block (wait_key NULL), since one waiting
+ * lane would stall the rest.
+ **/
+
+#define SIMD_LANES 16
+
+/* stops[i] gets what vm_run would have returned for vms[i]; returns 0 if
+ * count is not 1..SIMD_LANES or out of memory */
+int simd_run(struct vm *const *vms, int count, uint64_t max_instructions,
+             enum vm_stop *stops);
+
+/* the vector unit simd_run uses here: "avx2" or "generic" */
+const char *simd_unit(void);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Self-modifying code tracking
+ *
+ * write_to_memory (utils.c) counts every store and tests the page bitmap
+ * inline; everything here runs only for stores into a page that holds code,
+ * for engines marking code, and for reports.
+ */
+
+#include <string.h>
+
+#include "smc.h"
+#include "utils.h"
+
+void smc_page_store(struct vm *vm, uint16_t address)
+{
+  struct code_tracking *code = &vm->code;
+  code->page_stores++;
+  if (!smc_bit(code->lines, address >> CODE_LINE_SHIFT)) {
+    return;
+  }
+  code->line_stores++;
+  int changed = 0;
+  for (int i = 0; i < code->callback_count; i++) {
+    changed |= code->callbacks[i](vm, address);
+  }
+  code->rewrites += changed != 0;
+}
+
+void smc_mark_code(struct vm *vm, uint16_t address)
+{
+  struct code_tracking *code = &vm->code;
+  uint32_t line = address >> CODE_LINE_SHIFT;
+  if (smc_bit(code->lines, line)) {
+    return;
+  }
+  code->lines[line >> 6] |= 1ULL << (line & 63);
+  code->pages[(address >> CODE_PAGE_SHIFT) >> 6] |= 1ULL << ((address >> CODE_PAGE_SHIFT) & 63);
+  code->code_lines++;
+}
+
+int smc_is_code(const struct vm *vm, uint16_t address)
+{
+  return smc_bit(vm->code.lines, address >> CODE_LINE_SHIFT);
+}
+
+int smc_watch(struct vm *vm, smc_callback callback)
+{
+  struct code_tracking *code = &vm->code;
+  for (int i = 0; i < code->callback_count; i++) {
+    if (code->callbacks[i] == callback) {
+      return 1;
+    }
+  }
+  if (code->callback_count == SMC_MAX_CALLBACKS) {
+    return 0;
+  }
+  code->callbacks[code->callback_count++] = callback;
+  return 1;
+}
+
+void smc_reset(struct vm *vm)
+{
+  struct code_tracking *code = &vm->code;
+  memset(code->pages, 0, sizeof(code->pages));
+  memset(code->lines, 0, sizeof(code->lines));
+  code->callback_count = 0;
+  code->code_lines = 0;
+}
+
+void smc_report(const struct vm *vm, FILE *out)
+{
+  const struct code_tracking *code = &vm->code;
+  fprintf(out, "stores: %llu  to code pages: %llu  to code lines: %llu  "
+          "rewrote code: %llu  code lines: %u of %d\n",
+          (unsigned long long)code->stores, (unsigned long long)code->page_stores,
+          (unsigned long long)code->line_stores, (unsigned long long)code->rewrites,
+          code->code_lines, CODE_LINES);
+}
@@ -0,0 +1,81 @@
+#ifndef SMC_H_
+#define SMC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/** self-modifying code tracking
+ * Engines that cache decoded or translated guest code mark the memory it
+ * came from with smc_mark_code, one CODE_LINE_WORDS line at a time, and
+ * register a callback with smc_watch. Every store checks the page bitmap
+ * and, only for a page holding code, the line bitmap; a store into a code
+ * line calls each callback with the address so the engine can drop or
+ * rebuild what it cached there. Stores to data never leave the inline test.
+ * Marks only ever grow until free_engine_caches resets them with the
+ * caches, so a stale mark costs a callback, never a missed invalidation.
+ **/
+#define CODE_LINE_SHIFT 4
+#define CODE_PAGE_SHIFT 8
+#define CODE_LINE_WORDS (1 << CODE_LINE_SHIFT)
+#define CODE_LINES ((UINT16_MAX + 1) >> CODE_LINE_SHIFT)
+#define CODE_PAGES ((UINT16_MAX + 1) >> CODE_PAGE_SHIFT)
+#define SMC_MAX_CALLBACKS 4
+
+struct vm;
+
+/* returns nonzero if the store changed something the engine had cached */
+typedef int (*smc_callback)(struct vm *vm, uint16_t address);
+
+struct code_tracking
+{
+  uint64_t pages[CODE_PAGES / 64];
+  uint64_t lines[CODE_LINES / 64];
+  smc_callback callbacks[SMC_MAX_CALLBACKS];
+  int callback_count;
+  uint32_t code_lines;      /* lines marked */
+
+  uint64_t dirty[CODE_PAGES / 64]; /* pages stored to since lockstep last
+                                      compared them (lockstep.c) */
+  uint64_t stores;          /* every guest store */
+  uint64_t page_stores;     /* ... into a page holding code */
+  uint64_t line_stores;     /* ... into a code line: callbacks ran */
+  uint64_t rewrites;        /* ... that changed a word an engine cached;
+                               the decoded engines cache whole lines, so
+                               data sharing a line with code counts too */
+};
+
+static inline int smc_bit(const uint64_t *bitmap, uint32_t index)
+{
+  return (bitmap[index >> 6] >> (index & 63)) & 1;
+}
+
+static inline int smc_page_has_code(const struct code_tracking *code, uint16_t address)
+{
+  return smc_bit(code->pages, address >> CODE_PAGE_SHIFT);
+}
+
+/* the slow half of the store check, for stores into a page holding code */
+void smc_page_store(struct vm *vm, uint16_t address);
+
+/* record that cached code was built from the line holding address */
+void smc_mark_code(struct vm *vm, uint16_t address);
+int smc_is_code(const struct vm *vm, uint16_t address);
+
+/* call back on every store into a code line; registering twice is a no-op,
+ * returns 0 if the table is full */
+int smc_watch(struct vm *vm, smc_callback callback);
+
+static inline void smc_note_store(struct code_tracking *code, uint16_t address)
+{
+  uint32_t page = address >> CODE_PAGE_SHIFT;
+  code->dirty[page >> 6] |= 1ULL << (page & 63);
+  code->stores++;
+}
+
+/* forget all marks and callbacks, keeping the counters and dirty pages */
+void smc_reset(struct vm *vm);
+
+/* one line of counters for --stats */
+void smc_report(const struct vm *vm, FILE *out);
+
+#endif
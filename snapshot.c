@@ -0,0 +1,157 @@
+/*
+ * Machine snapshots
+ *
+ * vm_save_snapshot writes registers, the instruction count, all 64K words of
+ * memory (the keyboard and display registers are memory-mapped, so device
+ * state comes along) and any input that has arrived but not been read by
+ * the guest. vm_load_snapshot validates the header and maps the memory image
+ * MAP_PRIVATE, so the guest's writes never reach the file and only the pages
+ * it touches are ever read from disk.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "garbageeater.h"
+#include "utils.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_INPUT_MAX 4096 /* bytes taken from the backend per save */
+
+static void take_arrived_input(struct vm *vm)
+/*
+ Move input the backend already has into pending_input, so it is saved with
+ the snapshot and the running guest still reads it afterwards.
+*/
+{
+  uint8_t bytes[SNAPSHOT_INPUT_MAX];
+  size_t len = 0;
+  while (len < sizeof(bytes) && vm->io.key_ready(vm->io.ctx) > 0) {
+    int key = vm->io.read_key(vm->io.ctx);
+    if (key == EOF) {
+      break;
+    }
+    bytes[len++] = key;
+  }
+  queue_input(vm, bytes, len);
+}
+
+int vm_save_snapshot(struct vm *vm, const char *path)
+{
+  take_arrived_input(vm);
+
+  struct snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.flag_result = vm->flag_result;
+  header.instructions = vm_icount(vm);
+  header.side_effects = vm->side_effects;
+  header.input_len = vm->pending_len - vm->pending_pos;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  get_cond_flag(vm);
+  memcpy(header.reg, vm->reg, sizeof(header.reg));
+
+  // write beside the target and rename, so a crash never leaves half a file
+  size_t tmp_len = strlen(path) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  if (!tmp) {
+    return 0;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+  FILE *file = fopen(tmp, "wb");
+  if (!file) {
+    free(tmp);
+    return 0;
+  }
+
+  static const char padding[SNAPSHOT_MEMORY_OFFSET];
+  int saved = fwrite(&header, sizeof(header), 1, file) == 1
+              && fwrite(padding, 1, sizeof(padding) - sizeof(header), file)
+                 == sizeof(padding) - sizeof(header)
+              && fwrite(vm->memory, 1, MEMORY_BYTES, file) == MEMORY_BYTES
+              && fwrite(vm->pending_input + vm->pending_pos, 1, header.input_len, file)
+                 == header.input_len;
+  saved = fclose(file) == 0 && saved;
+  saved = saved && rename(tmp, path) == 0;
+  if (!saved) {
+    remove(tmp);
+  }
+  free(tmp);
+  return saved;
+}
+
+static int header_is_valid(const struct snapshot_header *header, off_t file_size)
+{
+  return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+         && header->version == SNAPSHOT_VERSION
+         && header->byte_order == SNAPSHOT_BYTE_ORDER
+         && header->flag_result <= COND_UNSET
+         && file_size >= (off_t)(SNAPSHOT_MEMORY_OFFSET + MEMORY_BYTES)
+         && header->input_len == file_size - SNAPSHOT_MEMORY_OFFSET - MEMORY_BYTES;
+}
+
+int vm_load_snapshot(struct vm *vm, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct snapshot_header header;
+  struct stat st;
+  if (fstat(fd, &st) != 0
+      || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || !header_is_valid(&header, st.st_size)) {
+    close(fd);
+    return 0;
+  }
+
+  int mapped = 1;
+  uint16_t *memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, SNAPSHOT_MEMORY_OFFSET);
+  if (memory == MAP_FAILED) {
+    // e.g. pages larger than SNAPSHOT_MEMORY_OFFSET: read it instead
+    mapped = 0;
+    memory = malloc(MEMORY_BYTES);
+    if (!memory
+        || pread(fd, memory, MEMORY_BYTES, SNAPSHOT_MEMORY_OFFSET) != MEMORY_BYTES) {
+      free(memory);
+      close(fd);
+      return 0;
+    }
+  }
+
+  uint8_t *input = malloc(header.input_len ? header.input_len : 1);
+  if (!input || pread(fd, input, header.input_len, SNAPSHOT_MEMORY_OFFSET + MEMORY_BYTES)
+                != (ssize_t)header.input_len) {
+    free(input);
+    if (mapped) {
+      munmap(memory, MEMORY_BYTES);
+    }
+    else {
+      free(memory);
+    }
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  replace_memory(vm, memory, mapped);
+  vm->pending_pos = vm->pending_len = 0;
+  queue_input(vm, input, header.input_len);
+  free(input);
+
+  memcpy(vm->reg, header.reg, sizeof(vm->reg));
+  vm->flag_result = header.flag_result;
+  vm->icount_base = header.instructions;
+  vm->remaining = 0;
+  vm->side_effects = header.side_effects;
+  vm->idle_spins = 0;
+  vm->stop = VM_STOP_NONE;
+  return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include "utils.h"
+
+/** snapshot file layout
+ *   0                       struct snapshot_header, zero padded
+ *   SNAPSHOT_MEMORY_OFFSET  memory x0000-xFFFF, one host-order word each
+ *   + MEMORY_BYTES          input_len bytes of input not yet read
+ * The memory image starts on a page boundary so it can be mapped straight
+ * into the VM. Snapshots are only portable between hosts with the same byte
+ * order; byte_order tells them apart.
+ **/
+#define SNAPSHOT_MAGIC "LC3SNAP" /* sizeof includes the NUL: 8 bytes */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x0102
+#define SNAPSHOT_MEMORY_OFFSET 4096
+
+struct snapshot_header
+{
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  uint32_t version;
+  uint32_t flag_result;
+  uint64_t instructions;  /* retired count, so --stats carries on */
+  uint64_t side_effects;
+  uint64_t input_len;
+  uint16_t byte_order;
+  uint16_t reg[R_SIZE];
+};
+
+#endif
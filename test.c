@@ -2,191 +2,1166 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "opcode.h"
 #include "utils.h"
+#include "decode.h"
+#include "cfg.h"
+#include "sched.h"
+#include "lockstep.h"
+#include "trace.h"
+#include "watch.h"
+#include "aot.h"
+#include "simd.h"
+#include "perf.h"
+#include "profile.h"
+#include "output.h"
+#include "image.h"
+#include "batch.h"
 #include "minunit.h"
 
 int tests_run = 0;
 
+static struct vm *vm;
+
+/* x3000: ADD R0, R0, #1; BRnzp #-2, counting up forever */
+static const uint8_t loop_program[] = {0x30, 0x00, 0x10, 0x21, 0x0F, 0xFE};
+
+/* x3000: AND R0, R0, #0; JSR add; LD R1, patch; ST R1, add; JSR add; HALT
+ * add: ADD R0, R0, #1; RET; x0000; patch: .FILL ADD R0, R0, #7
+ * It patches its own subroutine between the calls, leaving R0 = 8. */
+static const uint8_t smc_program[] = {0x30, 0x00, 0x50, 0x20, 0x48, 0x04, 0x22, 0x06, 0x32,
+                                      0x02, 0x48, 0x01, 0xF0, 0x25, 0x10, 0x21, 0xC1, 0xC0,
+                                      0x00, 0x00, 0x10, 0x27};
+
 static char *test_add() {
-    reg[1] = 5;
-    reg[3] = 4;
-    op_add(5187);
+    vm->reg[1] = 5;
+    vm->reg[3] = 4;
+    op_add(vm, 5187);
     char *message = "test ADD failed'";
-    mu_assert(message, reg[2] == 9);
+    mu_assert(message, vm->reg[2] == 9);
     return NULL;
 }
 
 static char *test_addi() {
-    reg[1] = 5;
-    op_add(0b0001010001100111); // adding 7 with 5
+    vm->reg[1] = 5;
+    op_add(vm, 0b0001010001100111); // adding 7 with 5
     char *message = "test ADDI failed'";
-    mu_assert(message, reg[2] == 12);
+    mu_assert(message, vm->reg[2] == 12);
     return NULL;
 }
 
 static char *test_and() {
-    reg[1] = 6;
-    reg[3] = 3;
-    op_and(0b0101010001000011); // anding regs 1 and 3 and output in reg 2
+    vm->reg[1] = 6;
+    vm->reg[3] = 3;
+    op_and(vm, 0b0101010001000011); // anding regs 1 and 3 and output in reg 2
     char *message = "test AND failed'";
-    mu_assert(message, reg[2] == 2);
+    mu_assert(message, vm->reg[2] == 2);
     return NULL;
 }
 
 static char *test_andi() {
-    reg[1] = 6;
-    op_and(0b0101010001100111); // anding regs 1 and number 5 and output in reg 2
+    vm->reg[1] = 6;
+    op_and(vm, 0b0101010001100111); // anding regs 1 and number 5 and output in reg 2
     char *message = "test ANDI failed'";
-    mu_assert(message, reg[2] == 6);
+    mu_assert(message, vm->reg[2] == 6);
     return NULL;
 }
 
 // this not will not all 16 bits we are unsure if this is intended
 static char *test_not() {
-    reg[1] = 0b110;
-    op_not(0b1001010001111111); // not register 1 output register 2
+    vm->reg[1] = 0b110;
+    op_not(vm, 0b1001010001111111); // not register 1 output register 2
     char *message = "test NOT failed'";
-    mu_assert(message, reg[2] == 0b1111111111111001);
+    mu_assert(message, vm->reg[2] == 0b1111111111111001);
     return NULL;
 }
 
 static char *test_br() {
-    reg[R_PC] = 0;
-    op_br(0b0000111000000011); // not register 1 output register 2
+    vm->reg[R_PC] = 0;
+    op_br(vm, 0b0000111000000011); // not register 1 output register 2
     char *message = "test BR failed'";
-    mu_assert(message, reg[R_PC] == 3);
+    mu_assert(message, vm->reg[R_PC] == 3);
     return NULL;
 }
 
 static char *test_jmp() {
-  reg[2] = 0b011;
-  reg[R_PC] = 0;
-  op_jmp(0b1100000010000000);
+  vm->reg[2] = 0b011;
+  vm->reg[R_PC] = 0;
+  op_jmp(vm, 0b1100000010000000);
   char *message = "test JMP failed";
-  mu_assert(message, reg[R_PC] == reg[2]);
+  mu_assert(message, vm->reg[R_PC] == vm->reg[2]);
   return NULL;
 }
 
 static char *test_jsr() {
-  reg[R_PC] = 0;
-  op_jsr(0b0100100000000010);
+  vm->reg[R_PC] = 0;
+  op_jsr(vm, 0b0100100000000010);
   char *message = "test JSR failed";
-  mu_assert(message, reg[R_PC] == 2);
+  mu_assert(message, vm->reg[R_PC] == 2);
   return NULL;
 }
 
 static char *test_ld() {
-  reg[R_PC] = 1;
-  write_to_memory(4, 5); //address 4, value 5; test should load 5 back into the DR
-  op_ld(0b0100010000000011); //register 2 is DR, PCoffset is 3
+  vm->reg[R_PC] = 1;
+  write_to_memory(vm, 4, 5); //address 4, value 5; test should load 5 back into the DR
+  op_ld(vm, 0b0100010000000011); //register 2 is DR, PCoffset is 3
   char *message = "test LD failed";
-  mu_assert(message, reg[2] == 5);
+  mu_assert(message, vm->reg[2] == 5);
   return NULL;
 }
 
 static char *test_ldi() {
-  reg[R_PC] = 5;
-  write_to_memory(11, 12); //address 4, value 5; est should load 5 back into the DR
-  write_to_memory(12, 40); //store value 12 at memory position 40
-  op_ldi(0b1010010000000110); //register 2 is DR, PCoffset is 6
+  vm->reg[R_PC] = 5;
+  write_to_memory(vm, 11, 12); //address 4, value 5; est should load 5 back into the DR
+  write_to_memory(vm, 12, 40); //store value 12 at memory position 40
+  op_ldi(vm, 0b1010010000000110); //register 2 is DR, PCoffset is 6
   char *message = "test LDI failed";
-  mu_assert(message, reg[2] == 40);
+  mu_assert(message, vm->reg[2] == 40);
   return NULL;
 }
 
 static char *test_ldr() {
-  reg[7] = 10;
-  write_to_memory(17, 100); //address 4, value 100; est should load 5 back into the DR
-  op_ldr(0b0110010111000111); //register 2 is DR, BaseR is 7 and offset6 is 7
+  vm->reg[7] = 10;
+  write_to_memory(vm, 17, 100); //address 4, value 100; est should load 5 back into the DR
+  op_ldr(vm, 0b0110010111000111); //register 2 is DR, BaseR is 7 and offset6 is 7
   char *message = "test LDR failed";
-  mu_assert(message, reg[2] == 100);
+  mu_assert(message, vm->reg[2] == 100);
   return NULL;
 }
 
 static char *test_lea() {
-  reg[R_PC] = 50;
-  op_lea(0b1110010000000111); //register 2 is DR, offset is 511
+  vm->reg[R_PC] = 50;
+  op_lea(vm, 0b1110010000000111); //register 2 is DR, offset is 511
   char *message = "test LEA failed";
-  mu_assert(message, reg[2] == 57);
+  mu_assert(message, vm->reg[2] == 57);
   return NULL;
 }
 
 static char *test_st() {
-  reg[R_PC] = 0;
-  op_st(0b0011010000000010); //register 2 is SR, 2 is PCoffset
+  vm->reg[R_PC] = 0;
+  op_st(vm, 0b0011010000000010); //register 2 is SR, 2 is PCoffset
   char *message = "test ST failed";
-  reg[5] = read_from_memory(2);
-  mu_assert(message, reg[5] == 57);
+  vm->reg[5] = read_from_memory(vm, 2);
+  mu_assert(message, vm->reg[5] == 57);
   return NULL;
 }
 
 static char *test_sti() {
-  reg[R_PC] = 0;
-  write_to_memory(3, 5);
-  op_sti(0b1011101000000011); //register 5 is SR (contents are 57 from the previous test), 3 is PCoffset
+  vm->reg[R_PC] = 0;
+  write_to_memory(vm, 3, 5);
+  op_sti(vm, 0b1011101000000011); //register 5 is SR (contents are 57 from the previous test), 3 is PCoffset
   char *message = "test STI failed";
-  reg[2] = read_from_memory(3);
-  mu_assert(message, reg[2] == 5);
+  vm->reg[2] = read_from_memory(vm, 3);
+  mu_assert(message, vm->reg[2] == 5);
   return NULL;
 }
 
 
 static char *test_str() {
-  reg[5] = 5;
-  op_str(0b0111101101000101); //register 5 is SR, 5 is PCoffset, 5 is BaseR
+  vm->reg[5] = 5;
+  op_str(vm, 0b0111101101000101); //register 5 is SR, 5 is PCoffset, 5 is BaseR
   char *message = "test STR failed";
-  reg[2] = read_from_memory(10);
-  mu_assert(message, reg[2] == 5);
+  vm->reg[2] = read_from_memory(vm, 10);
+  mu_assert(message, vm->reg[2] == 5);
   return NULL;
 }
 
 static char *test_getc() {
   puts("Type 'a'");
-  op_trap(0b1111000000100000); //trapvector8 is x20: getc
+  op_trap(vm, 0b1111000000100000); //trapvector8 is x20: getc
   char *message = "test TRAP:getc failed";
-  mu_assert(message, reg[R_0] == 97); // enter a for this test
+  mu_assert(message, vm->reg[R_0] == 97); // enter a for this test
   return NULL;
 }
 
 static char *test_out() {
-  reg[R_0] = 98;
+  vm->reg[R_0] = 98;
   puts("This should print 'b'.");
-  op_trap(0b1111000000100001); //trapvector8 is x21: out
+  op_trap(vm, 0b1111000000100001); //trapvector8 is x21: out
   char *message = "test TRAP:out failed";
-  mu_assert(message, reg[R_0] == 98); // should print b
+  mu_assert(message, vm->reg[R_0] == 98); // should print b
   return NULL;
 }
 
 static char *test_puts() {
-  reg[R_0] = 0;
+  vm->reg[R_0] = 0;
   printf("\n");
   puts("This should print 'abc'.");
-  write_to_memory(0, 97);
-  write_to_memory(1, 98);
-  write_to_memory(2, 99);
-  write_to_memory(3, 0x0000);
-  op_trap(0b1111000000100010); //trapvector8 is x22: puts
+  write_to_memory(vm, 0, 97);
+  write_to_memory(vm, 1, 98);
+  write_to_memory(vm, 2, 99);
+  write_to_memory(vm, 3, 0x0000);
+  op_trap(vm, 0b1111000000100010); //trapvector8 is x22: puts
   char *message = "test TRAP:puts failed";
-  mu_assert(message, reg[R_0] == 0); // should print abc which it does
+  mu_assert(message, vm->reg[R_0] == 0); // should print abc which it does
   return NULL;
 }
 
-// this works but also stops the rest of the code from running
 static char *test_halt() {
   printf("\n");
-  op_trap(0b1111000000100101); //trapvector8 is x25: halt
+  op_trap(vm, 0b1111000000100101); //trapvector8 is x25: halt
   char *message = "test TRAP:halt failed";
-  mu_assert(message, reg[R_0] == 98); // enter b for this test
+  mu_assert(message, vm->stop == VM_STOP_HALT); // stops the VM, not the process
   return NULL;
 }
 
 static char *test_in() {
   printf("\n");
   puts("Type 'b'");
-  op_trap(0b1111000000100011); //trapvector8 is x23: in
+  op_trap(vm, 0b1111000000100011); //trapvector8 is x23: in
   char *message = "test TRAP:in failed";
-  mu_assert(message, reg[R_0] == 98); // enter b for this test
+  mu_assert(message, vm->reg[R_0] == 98); // enter b for this test
+  return NULL;
+}
+
+static off_t wait_for_size(int fd, off_t size, int max_ms) {
+  struct stat st;
+  for (int ms = 0; ms < max_ms; ms++) {
+    fstat(fd, &st);
+    if (st.st_size >= size) {
+      break;
+    }
+    usleep(1000);
+  }
+  fstat(fd, &st);
+  return st.st_size;
+}
+
+static char *test_output() {
+  // stdout goes to a file while the writer thread runs
+  char *message = "test output failed";
+  FILE *file = tmpfile();
+  int fd = fileno(file);
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
+
+  // byte bound: nothing is written until 16 bytes are pending
+  struct output_policy bytes = {16, 0};
+  mu_assert(message, output_start(&bytes));
+  output_write("0123456789", 10);
+  usleep(20000);
+  mu_assert(message, wait_for_size(fd, 0, 0) == 0);
+  output_write("abcdef", 6);
+  mu_assert(message, wait_for_size(fd, 16, 2000) == 16);
+  output_shutdown();
+
+  // age bound: written once the oldest byte is 50 ms old, not before
+  struct output_policy age = {0, 50000};
+  mu_assert(message, output_start(&age));
+  output_putc('x');
+  mu_assert(message, wait_for_size(fd, 17, 0) == 16);
+  mu_assert(message, wait_for_size(fd, 17, 2000) == 17);
+  output_shutdown();
+
+  // order: uneven writes that wrap the ring many times, with flushes in between
+  struct output_policy order = {4096, 0};
+  mu_assert(message, output_start(&order));
+  char chunk[3001];
+  size_t total = 0;
+  for (size_t len = 1; total < 300000; len = len * 7 % 3001 + 1) {
+    for (size_t i = 0; i < len; i++) {
+      chunk[i] = (total + i) % 251;
+    }
+    output_write(chunk, len);
+    total += len;
+  }
+  output_shutdown();
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  mu_assert(message, wait_for_size(fd, 17 + total, 0) == (off_t)(17 + total));
+  char *contents = malloc(17 + total);
+  mu_assert(message, pread(fd, contents, 17 + total, 0) == (ssize_t)(17 + total));
+  mu_assert(message, memcmp(contents, "0123456789abcdefx", 17) == 0);
+  for (size_t i = 0; i < total; i++) {
+    mu_assert(message, contents[17 + i] == (char)(i % 251));
+  }
+  free(contents);
+  fclose(file);
+  return NULL;
+}
+
+static char *test_flags() {
+  vm->reg[1] = 1;
+  op_add(vm, 0b0001010001111111); // adding -1 to 1 gives zero
+  char *message = "test lazy flags failed";
+  mu_assert(message, get_cond_flag(vm) == F_Z);
+  op_not(vm, 0b1001010010111111); // not of zero is negative
+  mu_assert(message, get_cond_flag(vm) == F_N && vm->reg[R_F] == F_N);
+  return NULL;
+}
+
+static char *test_decoded() {
+  struct decoded d;
+  vm->reg[1] = 5;
+  decode_instruction(0b0001010001111001, &d); // adding -7 to 5
+  d.handler(vm, &d);
+  char *message = "test decoded ADDI failed";
+  mu_assert(message, d.imm == 0xFFF9 && vm->reg[2] == 0xFFFE);
+  return NULL;
+}
+
+/* console for the fusion tests: key_ready returns ready, nothing is ever
+ * read and output is only hashed */
+struct polled_console {
+  int ready;
+  uint64_t output_hash;
+  uint64_t output_bytes;
+};
+
+static int polled_key_ready(void *ctx) {
+  struct polled_console *console = ctx;
+  return console->ready;
+}
+
+static int polled_read_key(void *ctx) {
+  return 0;
+}
+
+static void polled_write(void *ctx, const char *buf, size_t len) {
+  struct polled_console *console = ctx;
+  for (size_t i = 0; i < len; i++) {
+    console->output_hash = (console->output_hash ^ (uint8_t)buf[i]) * 0x100000001B3ULL;
+  }
+  console->output_bytes += len;
+}
+
+static void polled_flush(void *ctx) {
+}
+
+static char *test_input_stall() {
+  // x3000: GETC; HALT, on a backend with no key yet and no way to wait for one:
+  // every run undoes the GETC, and only the run that gets a key counts it
+  const uint8_t program[] = {0x30, 0x00, 0xF0, 0x20, 0xF0, 0x25};
+  char *message = "test input stall failed";
+  for (int engine = 0; engine < VM_ENGINE_COUNT; engine++) {
+    struct polled_console console = {0, 0, 0};
+    struct vm_io io = {&console, polled_key_ready, polled_read_key, polled_write, polled_flush,
+                       NULL};
+    struct vm *run = vm_create();
+    vm_set_io(run, &io);
+    vm_set_engine(run, engine);
+    mu_assert(message, vm_load_image(run, program, sizeof(program)));
+    for (int i = 0; i < 3; i++) {
+      mu_assert(message, vm_run(run, 100) == VM_STOP_INPUT);
+    }
+    mu_assert(message, vm_instructions(run) == 0 && vm_trap_calls(run, 0x20) == 0);
+    console.ready = 1;
+    mu_assert(message, vm_run(run, 100) == VM_STOP_HALT);
+    mu_assert(message, vm_instructions(run) == 2 && vm_trap_calls(run, 0x20) == 1);
+    mu_assert(message, vm_trap_calls(run, 0x25) == 1);
+    vm_destroy(run);
+  }
+  return NULL;
+}
+
+static char *test_fusion_stop() {
+  // x3000: LD R1, kbsr; poll: LDR R0, R1, #0; BRzp poll; HALT; kbsr: .FILL xFE00
+  // LDR and BR fuse; once input closes the LDR stops the run and the BR must
+  // not retire with it
+  const uint8_t program[] = {0x30, 0x00, 0x22, 0x03, 0x60, 0x40, 0x07, 0xFE, 0xF0, 0x25,
+                             0xFE, 0x00};
+  char *message = "test fusion stop failed";
+  uint64_t counts[2];
+  uint16_t pcs[2];
+  for (int fuse = 0; fuse < 2; fuse++) {
+    struct polled_console console = {0, 0, 0};
+    struct vm_io io = {&console, polled_key_ready, polled_read_key, polled_write, polled_flush,
+                       NULL};
+    struct vm *run = vm_create();
+    vm_set_io(run, &io);
+    run->idle_detection = 0;
+    run->fuse = fuse;
+    mu_assert(message, vm_load_image(run, program, sizeof(program)));
+    mu_assert(message, vm_run(run, 1 << 20) == VM_STOP_LIMIT);
+    console.ready = -1;
+    mu_assert(message, vm_run(run, 1000) == VM_STOP_INPUT);
+    counts[fuse] = vm_instructions(run);
+    pcs[fuse] = vm_get_reg(run, R_PC);
+    vm_destroy(run);
+  }
+  mu_assert(message, counts[0] == counts[1] && pcs[0] == pcs[1] && pcs[0] == 0x3002);
+  return NULL;
+}
+
+static char *test_fusion() {
+  // x3000: LEA R1, buf; AND R3, R3, #0; ADD R3, R3, #8
+  // loop: LDR R4, R1, #0; ADD R4, R4, #3; STR R4, R1, #0; ADD R1, R1, #1;
+  // ADD R3, R3, #-1; BRp loop; LD R0, char; OUT; ADD R5, R5, #-1; BRnp x3000;
+  // HALT; x0000; char: .FILL 'A'; buf: eight words
+  // 3000 passes of 55 instructions: well past the training run, after which
+  // the fused VM runs ldr_add_str, add_br and the rest
+  const uint8_t program[] = {0x30, 0x00, 0xE2, 0x0F, 0x56, 0xE0, 0x16, 0xE8, 0x68, 0x40,
+                             0x19, 0x23, 0x78, 0x40, 0x12, 0x61, 0x16, 0xFF, 0x03, 0xFA,
+                             0x20, 0x05, 0xF0, 0x21, 0x1B, 0x7F, 0x0B, 0xF3, 0xF0, 0x25,
+                             0x00, 0x00, 0x00, 0x41};
+  char *message = "test fusion failed";
+  struct polled_console consoles[2] = {{0, 0, 0}, {0, 0, 0}};
+  struct vm *runs[2];
+  for (int fuse = 0; fuse < 2; fuse++) {
+    struct vm_io io = {&consoles[fuse], polled_key_ready, polled_read_key, polled_write,
+                       polled_flush, NULL};
+    runs[fuse] = vm_create();
+    vm_set_io(runs[fuse], &io);
+    runs[fuse]->fuse = fuse;
+    mu_assert(message, vm_load_image(runs[fuse], program, sizeof(program)));
+    vm_set_reg(runs[fuse], R_5, 3000);
+  }
+  mu_assert(message, vm_run(runs[0], 1 << 20) == VM_STOP_HALT);
+  // the fused VM in slices, so training ends inside one
+  enum vm_stop stop;
+  while ((stop = vm_run(runs[1], 1000)) == VM_STOP_LIMIT) {
+  }
+  mu_assert(message, stop == VM_STOP_HALT);
+  mu_assert(message, vm_instructions(runs[0]) == vm_instructions(runs[1]));
+  for (int r = 0; r < R_SIZE; r++) {
+    mu_assert(message, vm_get_reg(runs[0], r) == vm_get_reg(runs[1], r));
+  }
+  mu_assert(message, memcmp(runs[0]->memory, runs[1]->memory, MEMORY_BYTES) == 0);
+  mu_assert(message, vm_peek(runs[1], 0x3010) == (uint16_t)(3 * 3000));
+  // an 'A' per pass, then what HALT prints
+  mu_assert(message, consoles[0].output_bytes > 3000);
+  mu_assert(message, consoles[0].output_bytes == consoles[1].output_bytes);
+  mu_assert(message, consoles[0].output_hash == consoles[1].output_hash);
+  vm_destroy(runs[0]);
+  vm_destroy(runs[1]);
+  return NULL;
+}
+
+static char *test_idle() {
+  // x3000: LDI R0, kbsr; BRzp #-2; HALT; kbsr: .FILL xFE00 spins on the
+  // status register; storing R0 in between is a side effect, so that loop
+  // is not idle however long it polls
+  const uint8_t spin[] = {0x30, 0x00, 0xA0, 0x02, 0x07, 0xFE, 0xF0, 0x25, 0xFE, 0x00};
+  const uint8_t store[] = {0x30, 0x00, 0xA0, 0x03, 0x30, 0x03, 0x07, 0xFD, 0xF0, 0x25,
+                           0xFE, 0x00, 0x00, 0x00};
+  char *message = "test idle detection failed";
+  for (int engine = 0; engine < VM_ENGINE_COUNT; engine++) {
+    struct polled_console console = {0, 0, 0};
+    struct vm_io io = {&console, polled_key_ready, polled_read_key, polled_write, polled_flush,
+                       NULL};
+    struct vm *run = vm_create();
+    vm_set_engine(run, engine);
+    vm_set_io(run, &io);
+    mu_assert(message, vm_load_image(run, spin, sizeof(spin)));
+    // the first two polls differ (R0 and the flags are still unset in the
+    // first), then IDLE_SPIN_POLLS identical ones hand the wait back
+    mu_assert(message, vm_run(run, 10000) == VM_STOP_INPUT);
+    mu_assert(message, vm_instructions(run) == 2 * (IDLE_SPIN_POLLS + 1) + 1);
+    mu_assert(message, vm_get_reg(run, R_PC) == 0x3001);
+    mu_assert(message, vm_load_image(run, store, sizeof(store)));
+    vm_set_reg(run, R_PC, 0x3000);
+    mu_assert(message, vm_run(run, 10000) == VM_STOP_LIMIT);
+    vm_destroy(run);
+  }
+  return NULL;
+}
+
+static char *test_image() {
+  char *message = "test image failed";
+  // an odd number of words from an odd address takes the SIMD loop and its tail
+  uint8_t bytes[2 * 37 + 1];
+  uint16_t words[37 + 2];
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = i * 37 + 11;
+  }
+  memset(words, 0, sizeof(words));
+  load_big_endian_words(words + 1, bytes + 1, 37);
+  for (int i = 0; i < 37; i++) {
+    mu_assert(message, words[i + 1] == ((bytes[1 + 2 * i] << 8) | bytes[2 + 2 * i]));
+  }
+  mu_assert(message, words[0] == 0 && words[38] == 0);
+
+  // origin xFFFF has room for one word only
+  const uint8_t last[] = {0xFF, 0xFF, 0x12, 0x34, 0x56, 0x78};
+  struct vm *run = vm_create();
+  mu_assert(message, image_problem(last, 4) == NULL && image_problem(last, 6) != NULL);
+  mu_assert(message, !vm_load_image(run, last, 6) && vm_peek(run, 0xFFFF) == 0);
+  mu_assert(message, vm_load_image(run, last, 4) && vm_peek(run, 0xFFFF) == 0x1234);
+
+  struct image_span os = {0x3000, 0x100}, next = {0x3100, 4}, inside = {0x30FE, 4};
+  mu_assert(message, image_overlap(os, next).words == 0);
+  struct image_span overlap = image_overlap(inside, os);
+  mu_assert(message, overlap.origin == 0x30FE && overlap.words == 2);
+  overlap = image_overlap(image_span(last, 4), (struct image_span){0, 0x10000});
+  mu_assert(message, overlap.origin == 0xFFFF && overlap.words == 1);
+
+  // x3000: 1 2 3, then x3002: 9 over the last word of it
+  const char *paths[] = {"test_image_a.obj", "test_image_b.obj"};
+  const uint8_t a[] = {0x30, 0x00, 0, 1, 0, 2, 0, 3}, b[] = {0x30, 0x02, 0, 9};
+  FILE *file = fopen(paths[0], "wb");
+  fwrite(a, 1, sizeof(a), file);
+  fclose(file);
+  file = fopen(paths[1], "wb");
+  fwrite(b, 1, sizeof(b), file);
+  fclose(file);
+  int overlaps = read_program_images(run, paths, 2);
+  remove(paths[0]);
+  remove(paths[1]);
+  mu_assert(message, overlaps == 1 && vm_peek(run, 0x3001) == 2 && vm_peek(run, 0x3002) == 9);
+  vm_destroy(run);
+  return NULL;
+}
+
+static char *test_run() {
+  // loop_program, then a HALT image at x4000
+  const uint8_t halt[] = {0x40, 0x00, 0xF0, 0x25};
+  char *message = "test vm_run failed";
+  for (int engine = 0; engine < VM_ENGINE_COUNT; engine++) {
+    struct vm *run = vm_create();
+    vm_set_engine(run, engine);
+    mu_assert(message, vm_load_image(run, loop_program, sizeof(loop_program)));
+    mu_assert(message, vm_run(run, 1001) == VM_STOP_LIMIT);
+    mu_assert(message, vm_instructions(run) == 1001 && vm_get_reg(run, 0) == 501);
+    mu_assert(message, vm_load_image(run, halt, sizeof(halt)));
+    vm_set_reg(run, R_PC, 0x4000);
+    mu_assert(message, vm_run(run, 1000) == VM_STOP_HALT);
+    mu_assert(message, vm_instructions(run) == 1002);
+    vm_destroy(run);
+  }
+  return NULL;
+}
+
+static char *test_snapshot() {
+  // loop_program, saved after 101 instructions
+  const char *path = "test_snapshot.snap";
+  char *message = "test snapshot failed";
+  struct vm *saved = vm_create();
+  mu_assert(message, vm_load_image(saved, loop_program, sizeof(loop_program)));
+  vm_run(saved, 101);
+  vm_poke(saved, 0x5000, 0xBEEF);
+  mu_assert(message, vm_save_snapshot(saved, path));
+  struct vm *resumed = vm_create();
+  mu_assert(message, read_program_code_into_memory(resumed, path));
+  remove(path);
+  mu_assert(message, vm_instructions(resumed) == 101 && vm_peek(resumed, 0x5000) == 0xBEEF);
+  vm_run(saved, 100);
+  vm_run(resumed, 100);
+  for (int r = 0; r < R_SIZE; r++) {
+    mu_assert(message, vm_get_reg(saved, r) == vm_get_reg(resumed, r));
+  }
+  vm_destroy(saved);
+  vm_destroy(resumed);
+  return NULL;
+}
+
+static char *test_replay() {
+  // x3000: GETC; ADD R2, R0, #0; GETC; HALT
+  const uint8_t program[] = {0x30, 0x00, 0xF0, 0x20, 0x14, 0x20, 0xF0, 0x20, 0xF0, 0x25};
+  const char *path = "test_replay.log";
+  char *message = "test replay failed";
+  FILE *log = fopen(path, "w");
+  fputs("# test\n1 120\n5 121\n", log);
+  fclose(log);
+  struct vm *run = vm_create();
+  mu_assert(message, vm_load_image(run, program, sizeof(program)));
+  mu_assert(message, vm_replay_input(run, path));
+  remove(path);
+  // the second key is not due when the second GETC runs at count 3
+  mu_assert(message, vm_run(run, 100) == VM_STOP_INPUT);
+  mu_assert(message, vm_get_reg(run, 2) == 120 && vm_get_reg(run, R_PC) == 0x3002);
+  vm_destroy(run);
+  return NULL;
+}
+
+static char *test_cfg() {
+  // x3000: AND R0, R0, #0; loop: ADD R0, R0, #1; ADD R1, R0, #-5; BRn loop;
+  // JSR sub; HALT; sub: RET
+  const uint8_t program[] = {0x30, 0x00, 0x50, 0x20, 0x10, 0x21, 0x12, 0x3B, 0x09, 0xFD,
+                             0x48, 0x01, 0xF0, 0x25, 0xC1, 0xC0};
+  char *message = "test cfg failed";
+  struct vm *run = vm_create();
+  mu_assert(message, vm_load_image(run, program, sizeof(program)));
+  struct cfg *cfg = cfg_build(run, 0x3000);
+  mu_assert(message, cfg && cfg->block_count == 5 && cfg->edge_count == 5);
+  mu_assert(message, cfg->block_at[0x3002] == cfg->block_at[0x3001] && cfg->block_at[0x3007] == -1);
+  mu_assert(message, cfg->loop_count == 1 && cfg->blocks[cfg->loops[0].header].start == 0x3001);
+  mu_assert(message, cfg->loops[0].instructions == 3 && cfg->blocks[cfg->block_at[0x3004]].loop_depth == 0);
+  mu_assert(message, cfg->subroutine_count == 2 && cfg->subroutines[1].entry == 0x3006);
+  mu_assert(message, cfg->subroutines[1].returns && cfg->subroutines[0].call_sites == 1);
+  cfg_free(cfg);
+  vm_destroy(run);
+  return NULL;
+}
+
+static char *test_profile() {
+  // a HALT at x4000, then loop_program: the loop's weight must leave the
+  // HALT out although it ran in the same profile
+  const uint8_t halt[] = {0x40, 0x00, 0xF0, 0x25};
+  char *message = "test profile failed";
+  struct vm *run = vm_create();
+  vm_load_image(run, loop_program, sizeof(loop_program));
+  vm_load_image(run, halt, sizeof(halt));
+  mu_assert(message, profile_enable(run));
+  vm_set_reg(run, R_PC, 0x4000);
+  mu_assert(message, vm_run(run, 10) == VM_STOP_HALT);
+  vm_set_reg(run, R_PC, 0x3000);
+  mu_assert(message, vm_run(run, 1001) == VM_STOP_LIMIT);
+  struct profile *profile = run->profile;
+  mu_assert(message, profile->pc_count[0x3000] == 501 && profile->pc_count[0x3001] == 500);
+  mu_assert(message, profile->br_taken[0x3001] == 500 && profile->back_edges[0x3001] == 500);
+  mu_assert(message, profile->back_edge_target[0x3001] == 0x3000);
+  mu_assert(message, profile->op_count[OP_ADD] == 501 && profile->op_count[OP_TRAP] == 1);
+  FILE *out = tmpfile();
+  profile_report(run, out);
+  rewind(out);
+  char report[4096];
+  report[fread(report, 1, sizeof(report) - 1, out)] = 0;
+  fclose(out);
+  mu_assert(message, strstr(report, "profile: 1002 instructions\n"));
+  mu_assert(message, strstr(report, "\n           501  50.0%  x3000    ADD R0, R0, #1\n"));
+  mu_assert(message, strstr(report, "\n          1001  99.9%          500  x3000-x3001 (2 words"));
+  vm_destroy(run);
+
+  // x3000: GETC; HALT, on a backend with no key for the first three runs:
+  // the undone GETCs are not counted
+  const uint8_t getc[] = {0x30, 0x00, 0xF0, 0x20, 0xF0, 0x25};
+  struct polled_console console = {0, 0, 0};
+  struct vm_io io = {&console, polled_key_ready, polled_read_key, polled_write, polled_flush,
+                     NULL};
+  run = vm_create();
+  vm_set_io(run, &io);
+  vm_load_image(run, getc, sizeof(getc));
+  mu_assert(message, profile_enable(run));
+  for (int i = 0; i < 3; i++) {
+    mu_assert(message, vm_run(run, 100) == VM_STOP_INPUT);
+  }
+  profile = run->profile;
+  mu_assert(message, profile->pc_count[0x3000] == 0 && profile->op_count[OP_TRAP] == 0);
+  console.ready = 1;
+  mu_assert(message, vm_run(run, 100) == VM_STOP_HALT);
+  mu_assert(message, profile->pc_count[0x3000] == 1 && profile->op_count[OP_TRAP] == 2);
+  vm_destroy(run);
+  return NULL;
+}
+
+static char *test_smc() {
+  char *message = "test self-modifying code failed";
+  for (int engine = 0; engine < VM_ENGINE_COUNT; engine++) {
+    struct vm *run = vm_create();
+    vm_set_engine(run, engine);
+    mu_assert(message, vm_load_image(run, smc_program, sizeof(smc_program)));
+    vm_poke(run, 0x5000, 1); // before anything is cached: not code
+    mu_assert(message, vm_run(run, 100) == VM_STOP_HALT && vm_get_reg(run, 0) == 8);
+    mu_assert(message, run->code.stores == 2 && !smc_is_code(run, 0x5000));
+    if (engine != VM_ENGINE_SWITCH) {
+      mu_assert(message, run->code.line_stores == 1 && run->code.rewrites == 1);
+    }
+    vm_destroy(run);
+  }
+  return NULL;
+}
+
+static char *test_extended_traps() {
+  char *message = "test extended traps failed";
+  vm->reg[R_0] = 300;
+  vm->reg[R_1] = 300;
+  op_trap(vm, 0xF030); // MUL keeps the low 16 bits of 90000
+  mu_assert(message, vm->reg[R_0] == 24464 && get_cond_flag(vm) == F_P);
+  vm->reg[R_0] = -7;
+  vm->reg[R_1] = 2;
+  op_trap(vm, 0xF031); // DIVMOD rounds toward zero
+  mu_assert(message, vm->reg[R_0] == (uint16_t)-3 && vm->reg[R_1] == (uint16_t)-1);
+  mu_assert(message, get_cond_flag(vm) == F_N);
+  vm->reg[R_0] = 7;
+  vm->reg[R_1] = 0;
+  op_trap(vm, 0xF031); // by zero: R0 = -1, dividend left in R1
+  mu_assert(message, vm->reg[R_0] == 0xFFFF && vm->reg[R_1] == 7 && get_cond_flag(vm) == F_N);
+  vm->reg[R_0] = 0x8000;
+  vm->reg[R_1] = -1;
+  op_trap(vm, 0xF031); // x8000 / -1 wraps back to x8000
+  mu_assert(message, vm->reg[R_0] == 0x8000 && vm->reg[R_1] == 0 && get_cond_flag(vm) == F_N);
+  for (int i = 0; i < 5; i++) {
+    write_to_memory(vm, 0x4000 + i, i < 4 ? i + 1 : 0);
+  }
+  vm->reg[R_0] = 0x4001;
+  vm->reg[R_1] = 0x4000;
+  vm->reg[R_2] = 3;
+  op_trap(vm, 0xF032); // overlapping MEMCPY: 1 2 3 4 becomes 1 1 2 3
+  mu_assert(message, vm->memory[0x4001] == 1 && vm->memory[0x4003] == 3);
+  vm->reg[R_0] = 0x4000;
+  op_trap(vm, 0xF034);
+  mu_assert(message, vm->reg[R_0] == 4 && get_cond_flag(vm) == F_P);
+  vm->reg[R_0] = 0x4004;
+  op_trap(vm, 0xF034); // the empty string
+  mu_assert(message, vm->reg[R_0] == 0 && get_cond_flag(vm) == F_Z);
+  vm->reg[R_0] = 0x4000;
+  vm->reg[R_1] = 0x4001;
+  vm->reg[R_2] = 3;
+  op_trap(vm, 0xF032); // overlapping the other way: 1 1 2 3 becomes 1 2 3 3
+  mu_assert(message, vm->memory[0x4000] == 1 && vm->memory[0x4001] == 2);
+  mu_assert(message, vm->memory[0x4002] == 3 && vm->memory[0x4003] == 3);
+
+  // MEMSET "AAA" at x4010, then STRCMP it against x4020
+  write_to_memory(vm, 0x4013, 0);
+  vm->reg[R_0] = 0x4010;
+  vm->reg[R_1] = 'A';
+  vm->reg[R_2] = 3;
+  op_trap(vm, 0xF033);
+  mu_assert(message, vm->memory[0x4010] == 'A' && vm->memory[0x4012] == 'A');
+  mu_assert(message, vm->memory[0x4013] == 0);
+  const char *others[] = {"AAA", "AAB", "AA@", "AA", "AAAA"};
+  const uint16_t results[] = {0, 0xFFFF, 1, 1, 0xFFFF};
+  const int flags[] = {F_Z, F_N, F_P, F_P, F_N};
+  for (int i = 0; i < 5; i++) {
+    for (int j = 0; j <= (int)strlen(others[i]); j++) {
+      write_to_memory(vm, 0x4020 + j, others[i][j]);
+    }
+    vm->reg[R_0] = 0x4010;
+    vm->reg[R_1] = 0x4020;
+    op_trap(vm, 0xF035);
+    mu_assert(message, vm->reg[R_0] == results[i] && get_cond_flag(vm) == flags[i]);
+  }
+  vm->reg[R_0] = 4;
+  vm->strict = 1;
+  vm->stop = VM_STOP_NONE;
+  op_trap(vm, 0xF030);
+  mu_assert(message, vm->stop == VM_STOP_ILLEGAL && vm->reg[R_0] == 4);
+  mu_assert(message, vm_trap_calls(vm, 0x30) == 2);
+  vm->strict = 0;
+  vm->stop = VM_STOP_NONE;
+  return NULL;
+}
+
+/* console for test_sched: keys from a non-blocking pipe, output to a string */
+struct pipe_console {
+  int fd;
+  int key;
+  char output[64];
+  size_t output_len;
+};
+
+static int pipe_key_ready(void *ctx) {
+  struct pipe_console *console = ctx;
+  unsigned char c;
+  if (console->key < 0) {
+    ssize_t got = read(console->fd, &c, 1);
+    if (got == 0) {
+      return -1;
+    }
+    console->key = got == 1 ? c : -1;
+  }
+  return console->key >= 0;
+}
+
+static int pipe_read_key(void *ctx) {
+  struct pipe_console *console = ctx;
+  int key = console->key;
+  console->key = -1;
+  return key;
+}
+
+static void pipe_write(void *ctx, const char *buf, size_t len) {
+  struct pipe_console *console = ctx;
+  if (console->output_len + len <= sizeof(console->output)) {
+    memcpy(console->output + console->output_len, buf, len);
+    console->output_len += len;
+  }
+}
+
+static void pipe_flush(void *ctx) {
+}
+
+struct typist {
+  struct sched *sched;
+  int fd;
+};
+
+static void wait_for_parks(struct sched *sched, uint64_t parks) {
+  struct sched_stats stats;
+  do {
+    usleep(1000);
+    sched_get_stats(sched, &stats, NULL);
+  } while (stats.parks < parks || stats.parked == 0);
+}
+
+static void *type_slowly(void *arg) {
+  // each burst only once the guest is parked waiting for it
+  struct typist *typist = arg;
+  wait_for_parks(typist->sched, 1);
+  write(typist->fd, "ab", 2);
+  wait_for_parks(typist->sched, 2);
+  write(typist->fd, "c\n", 2);
+  close(typist->fd);
+  return NULL;
+}
+
+static char *test_trace() {
+  // smc_program, traced on an engine the tracer overrides
+  const char *path = "test_trace.bin";
+  char *message = "test trace failed";
+  struct vm *run = vm_create();
+  vm_set_engine(run, VM_ENGINE_JIT);
+  mu_assert(message, vm_load_image(run, smc_program, sizeof(smc_program)));
+  mu_assert(message, trace_open(run, path));
+  mu_assert(message, vm_run(run, 100) == VM_STOP_HALT && vm_get_reg(run, 0) == 8);
+  trace_close(run, NULL);
+  vm_destroy(run);
+
+  FILE *in = fopen(path, "rb");
+  FILE *text = tmpfile();
+  mu_assert(message, in && text && trace_decode(in, text));
+  fclose(in);
+  remove(path);
+  rewind(text);
+  char line[256];
+  int lines = 0, store = 0;
+  while (fgets(line, sizeof(line), text)) {
+    lines++;
+    store += strstr(line, "x3003  3202  ST R1, x3006") && strstr(line, "[x3006]=x1027");
+  }
+  fclose(text);
+  // a sync record, then the ten instructions
+  mu_assert(message, lines == 11 && store == 1);
+  return NULL;
+}
+
+static char *test_trace_stall() {
+  // x3000: GETC; HALT, traced on a backend that has no key for the first
+  // three runs: the undone GETCs must not show up as executed
+  const uint8_t program[] = {0x30, 0x00, 0xF0, 0x20, 0xF0, 0x25};
+  const char *path = "test_trace_stall.bin";
+  char *message = "test trace stall failed";
+  struct polled_console console = {0, 0, 0};
+  struct vm_io io = {&console, polled_key_ready, polled_read_key, polled_write, polled_flush,
+                     NULL};
+  struct vm *run = vm_create();
+  vm_set_io(run, &io);
+  mu_assert(message, vm_load_image(run, program, sizeof(program)));
+  mu_assert(message, trace_open(run, path));
+  for (int i = 0; i < 3; i++) {
+    mu_assert(message, vm_run(run, 100) == VM_STOP_INPUT);
+  }
+  console.ready = 1;
+  mu_assert(message, vm_run(run, 100) == VM_STOP_HALT);
+  trace_close(run, NULL);
+  vm_destroy(run);
+
+  FILE *in = fopen(path, "rb");
+  FILE *text = tmpfile();
+  mu_assert(message, in && text && trace_decode(in, text));
+  fclose(in);
+  remove(path);
+  rewind(text);
+  char line[256];
+  int lines = 0, getc = 0;
+  while (fgets(line, sizeof(line), text)) {
+    lines++;
+    getc += strstr(line, "GETC") != NULL;
+  }
+  fclose(text);
+  // a sync record per run, then GETC and HALT once each
+  mu_assert(message, lines == 6 && getc == 1);
+  return NULL;
+}
+
+static char *test_watch() {
+  // smc_program, with a watchpoint on the word it patches
+  char *message = "test watch failed";
+  struct vm *run = vm_create();
+  vm_set_engine(run, VM_ENGINE_THREADED);
+  mu_assert(message, vm_load_image(run, smc_program, sizeof(smc_program)));
+  mu_assert(message, watch_add(run, 0x3006));
+  mu_assert(message, vm_run(run, 100) == VM_STOP_WATCH && vm_get_reg(run, 0) == 1);
+  struct watch_hit hits[WATCH_MAX_HITS];
+  uint64_t missed;
+  mu_assert(message, watch_take_hits(run, hits, WATCH_MAX_HITS, &missed) == 1 && missed == 0);
+  mu_assert(message, hits[0].address == 0x3006 && hits[0].pc == 0x3003 && hits[0].instruction == 6);
+  mu_assert(message, hits[0].old_value == 0x1021 && hits[0].new_value == 0x1027);
+  vm_poke(run, 0x3100, 1); // same page, not watched
+  mu_assert(message, watch_take_hits(run, hits, WATCH_MAX_HITS, &missed) == 0);
+  watch_remove(run, 0x3006);
+  mu_assert(message, vm_run(run, 100) == VM_STOP_HALT && vm_get_reg(run, 0) == 8);
+  vm_destroy(run);
+  return NULL;
+}
+
+/* x3006 of smc_program as aot_emit compiles it: ADD R0, R0, #1; RET */
+static int aot_block_calls;
+static uint16_t aot_block_3006(struct vm *vm) {
+  uint16_t r0 = vm->reg[0];
+  aot_block_calls++;
+  r0 = r0 + 0x0001;
+  vm->remaining -= 2;
+  vm->reg[0] = r0;
+  vm->flag_result = r0;
+  return vm->reg[7];
+}
+
+static char *test_aot() {
+  // smc_program: it overwrites the block at x3006 between calls
+  const struct aot_entry blocks[] = {{0x3006, 2, aot_block_3006}};
+  const struct aot_program compiled = {"test", 0x3000, NULL, 0, blocks, 1};
+  char *message = "test aot failed";
+  struct vm *run = vm_create();
+  mu_assert(message, vm_load_image(run, smc_program, sizeof(smc_program)));
+  FILE *out = tmpfile();
+  mu_assert(message, out && aot_emit(run, "test", out));
+  rewind(out);
+  char line[256];
+  int found = 0;
+  while (fgets(line, sizeof(line), out)) {
+    found += strstr(line, "static uint16_t block_3006(") != NULL;
+    found += strstr(line, "if (aot_store(vm, 0x3006, r1)) {") != NULL;
+  }
+  fclose(out);
+  mu_assert(message, found == 2);
+
+  // the first call runs the block, the second the interpreter
+  mu_assert(message, aot_attach(run, &compiled));
+  mu_assert(message, vm_run(run, 100) == VM_STOP_HALT && vm_get_reg(run, 0) == 8);
+  mu_assert(message, aot_block_calls == 1 && vm_instructions(run) == 10);
+  vm_destroy(run);
+  return NULL;
+}
+
+/* loader for test_lockstep: the candidate, loaded second, gets another patch */
+static int load_patched(struct vm *vm, void *ctx) {
+  int *loads = ctx;
+  if (!vm_load_image(vm, smc_program, sizeof(smc_program))) {
+    return 0;
+  }
+  if (++*loads % 2 == 0) {
+    vm_poke(vm, 0x3009, 0x1026); // ADD R0, R0, #6
+  }
+  return 1;
+}
+
+static char *test_lockstep() {
+  char *message = "test lockstep failed";
+  struct lockstep_options options = {.limit = 100000};
+  struct lockstep_report report;
+  for (int engine = 0; engine < VM_ENGINE_COUNT; engine++) {
+    uint64_t seed = 4;
+    options.engine = engine;
+    mu_assert(message, lockstep_run(lockstep_random_program, &seed, &options, &report));
+    mu_assert(message, !report.diverged && report.instructions == options.limit);
+  }
+  // smc_program; the patch word differs from the start but
+  // only shows once LD reads it, the fifth instruction run
+  int loads = 0;
+  options.engine = VM_ENGINE_DECODED;
+  options.interval = 2;
+  mu_assert(message, lockstep_run(load_patched, &loads, &options, &report) && loads == 4);
+  mu_assert(message, report.diverged && report.exact && report.instructions == 5);
+  mu_assert(message, report.pc == 0x3002 && report.diff_count == 1);
+  mu_assert(message, report.diffs[0].field == LOCKSTEP_REGISTER && report.diffs[0].where == R_1);
+  mu_assert(message, report.diffs[0].reference == 0x1027 && report.diffs[0].candidate == 0x1026);
+  return NULL;
+}
+
+/* lane i of test_simd: x3000: ADD R0, R0, #-1; BRp #-2; HALT, counting down
+ * from a different R0 in each lane, and in lane 5 smc_program,
+ * whose first word differs */
+static int load_simd_lane(struct vm *run, int i) {
+  const uint8_t countdown[] = {0x30, 0x00, 0x10, 0x3F, 0x03, 0xFE, 0xF0, 0x25};
+  if (i == 5) {
+    return vm_load_image(run, smc_program, sizeof(smc_program));
+  }
+  vm_set_reg(run, R_0, i * 3);
+  return vm_load_image(run, countdown, sizeof(countdown));
+}
+
+static char *test_simd() {
+  char *message = "test simd failed";
+  struct vm *lanes[6], *alone[6];
+  enum vm_stop stops[6];
+  for (int i = 0; i < 6; i++) {
+    lanes[i] = vm_create();
+    alone[i] = vm_create();
+    vm_set_engine(alone[i], VM_ENGINE_SWITCH);
+    mu_assert(message, load_simd_lane(lanes[i], i) && load_simd_lane(alone[i], i));
+  }
+  mu_assert(message, simd_run(lanes, 6, 1000, stops));
+  for (int i = 0; i < 6; i++) {
+    mu_assert(message, stops[i] == VM_STOP_HALT && vm_run(alone[i], 1000) == VM_STOP_HALT);
+    mu_assert(message, vm_instructions(lanes[i]) == vm_instructions(alone[i]));
+    for (int r = R_0; r <= R_PC; r++) {
+      mu_assert(message, vm_get_reg(lanes[i], r) == vm_get_reg(alone[i], r));
+    }
+    vm_destroy(lanes[i]);
+    vm_destroy(alone[i]);
+  }
+  return NULL;
+}
+
+static char *test_share() {
+  // loop_program, mapped into two VMs
+  char *message = "test share failed";
+  mu_assert(message, !vm_image_create(loop_program, 3));
+  struct vm_image *image = vm_image_create(loop_program, sizeof(loop_program));
+  mu_assert(message, image);
+  struct vm *a = vm_create(), *b = vm_create();
+  mu_assert(message, vm_map_image(a, image) && vm_map_image(b, image));
+  vm_image_destroy(image);
+  vm_poke(a, 0x4000, 7);
+  mu_assert(message, vm_peek(a, 0x4000) == 7 && vm_peek(b, 0x4000) == 0);
+  mu_assert(message, vm_run(a, 1001) == VM_STOP_LIMIT && vm_get_reg(a, 0) == 501);
+  mu_assert(message, vm_run(b, 1001) == VM_STOP_LIMIT && vm_get_reg(b, 0) == 501);
+  // only a has stored anything, and only to one page
+  long dirty = vm_dirty_pages(b);
+  mu_assert(message, dirty == 0 || dirty == -1);
+  mu_assert(message, vm_dirty_pages(a) == (dirty < 0 ? -1 : 1));
+  vm_destroy(a);
+  vm_destroy(b);
+  return NULL;
+}
+
+static char *test_perf() {
+  // loop_program, profiled so the windows are charged to opcodes; without
+  // perf events the counters may not open at all
+  char *message = "test perf failed";
+  struct vm *run = vm_create();
+  vm_load_image(run, loop_program, sizeof(loop_program));
+  mu_assert(message, profile_enable(run));
+  struct perf perf;
+  if (!perf_open(&perf, run)) {
+    mu_assert(message, perf.error);
+    vm_destroy(run);
+    return NULL;
+  }
+  for (int i = 0; i < 10; i++) {
+    mu_assert(message, vm_run(run, 100) == VM_STOP_LIMIT);
+    perf_window(&perf, run);
+  }
+  perf_close(&perf);
+  mu_assert(message, perf.windows == 10);
+  mu_assert(message, perf.instructions + perf.lost * 100 == 1000);
+  mu_assert(message, perf.ops[OP_ADD] + perf.ops[OP_BR] == perf.instructions);
+  mu_assert(message, perf.ops[OP_ADD] == perf.instructions / 2);
+  vm_destroy(run);
+  return NULL;
+}
+
+static char *test_sched() {
+  // loop_program, and x3000: GETC; OUT; ADD R1, R0, #-10; BRnp #-4; HALT,
+  // which echoes up to a newline
+  const uint8_t echo[] = {0x30, 0x00, 0xF0, 0x20, 0xF0, 0x21, 0x12, 0x36, 0x0B, 0xFC,
+                          0xF0, 0x25};
+  char *message = "test sched failed";
+  struct sched *sched = sched_create(3, 1000);
+  struct sched_guest guests[7];
+  memset(guests, 0, sizeof(guests));
+  for (int i = 0; i < 6; i++) {
+    guests[i].vm = vm_create();
+    vm_load_image(guests[i].vm, loop_program, sizeof(loop_program));
+    guests[i].input_fd = -1;
+    guests[i].limit = 10000 + i * 777;
+    sched_add(sched, &guests[i]);
+  }
+  int fds[2];
+  mu_assert(message, sched && pipe(fds) == 0);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  struct pipe_console console = {fds[0], -1, {0}, 0};
+  struct vm_io io = {&console, pipe_key_ready, pipe_read_key, pipe_write, pipe_flush, NULL};
+  guests[6].vm = vm_create();
+  vm_load_image(guests[6].vm, echo, sizeof(echo));
+  vm_set_io(guests[6].vm, &io);
+  guests[6].input_fd = fds[0];
+  sched_add(sched, &guests[6]);
+  struct typist typist = {sched, fds[1]};
+  pthread_t thread;
+  pthread_create(&thread, NULL, type_slowly, &typist);
+  mu_assert(message, sched_run(sched));
+  pthread_join(thread, NULL);
+  for (int i = 0; i < 6; i++) {
+    mu_assert(message, guests[i].stop == VM_STOP_LIMIT && guests[i].instructions == guests[i].limit);
+    mu_assert(message, guests[i].slices == (guests[i].limit + 999) / 1000);
+    vm_destroy(guests[i].vm);
+  }
+  // it waited for "c\n" parked, not spinning, and echoed it before HALT
+  mu_assert(message, guests[6].stop == VM_STOP_HALT && guests[6].parks == 2);
+  mu_assert(message, guests[6].instructions == 17 && memcmp(console.output, "abc\n", 4) == 0);
+  struct sched_stats stats;
+  sched_get_stats(sched, &stats, NULL);
+  mu_assert(message, stats.finished == 7 && stats.live == 0 && stats.parked == 0);
+  mu_assert(message, stats.parks == 2 && stats.wakeups == 2);
+  vm_destroy(guests[6].vm);
+  close(fds[0]);
+  sched_destroy(sched);
+  return NULL;
+}
+
+static void drop_times(char *row) {
+  // cut the seconds and cpu_seconds columns out of a results row
+  char *start = row;
+  for (int field = 0; field < 4 && start; field++) {
+    start = strchr(start, '\t');
+    start = start ? start + 1 : NULL;
+  }
+  char *end = start ? strchr(start, '\t') : NULL;
+  end = end ? strchr(end + 1, '\t') : NULL;
+  if (end) {
+    memmove(start, end + 1, strlen(end + 1) + 1);
+  }
+}
+
+static char *test_batch() {
+  // x3000: GETC; OUT; ADD R1, R0, #-10; BRnp #-4; HALT, which echoes up to a newline
+  const uint8_t echo[] = {0x30, 0x00, 0xF0, 0x20, 0xF0, 0x21, 0x12, 0x36, 0x0B, 0xFC,
+                          0xF0, 0x25};
+  const char *image = "test_batch.obj", *script = "test_batch.keys";
+  const char *manifest = "test_batch.jobs", *results = "test_batch.out";
+  char *message = "test batch failed";
+  FILE *file = fopen(image, "wb");
+  fwrite(echo, 1, sizeof(echo), file);
+  fclose(file);
+  file = fopen(script, "w");
+  fputs("h\ti\n", file);
+  fclose(file);
+  file = fopen(manifest, "w");
+  fprintf(file, "# echo, no keys, missing image\n%s %s\n\n%s -\nmissing.obj %s 100\n", image,
+          script, image, script);
+  fclose(file);
+  // on the scheduler, then as simd groups: the echo jobs share an image and
+  // limit, so they run as lanes of one group
+  char runs[2][4][256] = {{{0}}};
+  int status[2];
+  for (int simd = 0; simd < 2; simd++) {
+    struct batch_options options = {2, VM_ENGINE_DECODED, 0, 1, 0, 0, simd};
+    status[simd] = run_batch(manifest, results, &options);
+    file = fopen(results, "r");
+    for (int i = 0; file && i < 4 && fgets(runs[simd][i], sizeof(runs[simd][i]), file); i++) {
+    }
+    if (file) {
+      fclose(file);
+    }
+  }
+  remove(image);
+  remove(script);
+  remove(manifest);
+  remove(results);
+  mu_assert(message, status[0] == 0 && status[1] == 0);
+  char (*rows)[256] = runs[0];
+  mu_assert(message, strcmp(rows[0], "# image\tscript\tstop\tinstructions\tseconds\tcpu_seconds"
+                                     "\toutput\n") == 0);
+  // what it echoed and printed on HALT is escaped to keep the row on one line
+  char stop[16], output[32];
+  unsigned long long instructions;
+  double seconds, cpu_seconds;
+  mu_assert(message, sscanf(rows[1], "test_batch.obj\ttest_batch.keys\t%15[^\t]\t%llu\t%lf\t%lf"
+                            "\t%31s", stop, &instructions, &seconds, &cpu_seconds, output) == 5);
+  mu_assert(message, strcmp(stop, "halt") == 0 && instructions == 17);
+  mu_assert(message, cpu_seconds >= 0 && seconds >= cpu_seconds);
+  mu_assert(message, strcmp(output, "h\\ti\\n\\nHALT\\n\\n") == 0);
+  // with no script it waits for a key that never comes
+  mu_assert(message, sscanf(rows[2], "test_batch.obj\t-\t%15[^\t]\t%llu\t", stop,
+                            &instructions) == 2);
+  mu_assert(message, strcmp(stop, "input") == 0 && instructions == 0);
+  mu_assert(message, strcmp(rows[3], "missing.obj\ttest_batch.keys\terror\t0\t0.000000"
+                                     "\t0.000000\t\n") == 0);
+  // simd gives the same rows but for the times
+  for (int i = 0; i < 4; i++) {
+    for (int simd = 0; simd < 2; simd++) {
+      drop_times(runs[simd][i]);
+    }
+    mu_assert(message, strcmp(runs[0][i], runs[1][i]) == 0);
+  }
   return NULL;
 }
 
@@ -209,12 +1184,38 @@ static char * all_tests() {
     mu_run_test(test_getc);
     mu_run_test(test_out);
     mu_run_test(test_puts);
-    // mu_run_test(test_halt);
+    mu_run_test(test_halt);
     mu_run_test(test_in);
+    mu_run_test(test_flags);
+    mu_run_test(test_output);
+    mu_run_test(test_decoded);
+    mu_run_test(test_fusion);
+    mu_run_test(test_fusion_stop);
+    mu_run_test(test_input_stall);
+    mu_run_test(test_idle);
+    mu_run_test(test_image);
+    mu_run_test(test_run);
+    mu_run_test(test_snapshot);
+    mu_run_test(test_replay);
+    mu_run_test(test_cfg);
+    mu_run_test(test_profile);
+    mu_run_test(test_smc);
+    mu_run_test(test_extended_traps);
+    mu_run_test(test_sched);
+    mu_run_test(test_batch);
+    mu_run_test(test_lockstep);
+    mu_run_test(test_trace);
+    mu_run_test(test_trace_stall);
+    mu_run_test(test_watch);
+    mu_run_test(test_aot);
+    mu_run_test(test_simd);
+    mu_run_test(test_share);
+    mu_run_test(test_perf);
     return NULL;
 }
 
 int main(int argc, char **argv) {
+    vm = vm_create();
     char *result = all_tests();
     if (result != NULL) {
         printf("%s\n", result);
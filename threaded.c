@@ -0,0 +1,245 @@
+/*
+ * Direct-threaded interpreter
+ *
+ * Every memory word gets a slot in threaded_code holding the address of the
+ * label that executes it (GCC labels-as-values). Each handler ends with its
+ * own copy of the dispatch jump, so the host branch predictor sees one
+ * indirect branch per handler instead of the single shared one behind the
+ * switch in main.c. Operands come from the pre-decoded records in decode.c.
+ *
+ * The PC, the remaining instruction budget and the lazy flag result are kept
+ * in locals and only written back to the VM before calling out to code that
+ * can observe them (traps and keyboard polls, which may also stop the run).
+ */
+
+#include "threaded.h"
+#include "decode.h"
+#include "opcode.h"
+#include "utils.h"
+
+/* label address per decoded_kind, NULL until run_threaded has started;
+ * the same for every VM */
+static const void *const *threaded_labels;
+
+static int threaded_invalidate(struct vm *vm, uint16_t address)
+/*
+ Code tracking callback: point the slot for address at the handler for its
+ record, which redecode has rebuilt (it was registered first).
+*/
+{
+  if (vm->threaded_code) {
+    vm->threaded_code[address] = threaded_labels[vm->decoded[address].kind];
+  }
+  return 0;
+}
+
+void run_threaded(struct vm *vm)
+{
+  static const void *const labels[K_COUNT] = {
+    [K_BR] = &&do_br,
+    [K_ADD_REG] = &&do_add_reg,
+    [K_ADD_IMM] = &&do_add_imm,
+    [K_AND_REG] = &&do_and_reg,
+    [K_AND_IMM] = &&do_and_imm,
+    [K_NOT] = &&do_not,
+    [K_LD] = &&do_ld,
+    [K_LDI] = &&do_ldi,
+    [K_LDR] = &&do_ldr,
+    [K_LEA] = &&do_lea,
+    [K_ST] = &&do_st,
+    [K_STI] = &&do_sti,
+    [K_STR] = &&do_str,
+    [K_JMP] = &&do_jmp,
+    [K_JSR] = &&do_jsr,
+    [K_JSRR] = &&do_jsrr,
+    [K_TRAP] = &&do_trap,
+    [K_NOP] = &&do_nop,
+    [K_DEVICE] = &&do_device,
+    [K_UNDECODED] = &&do_undecoded,
+  };
+
+  threaded_labels = labels;
+  if (!vm->threaded_code) {
+    if (!vm->decoded && !init_decoded_table(vm)) {
+      run_switch(vm);
+      return;
+    }
+    vm->threaded_code = malloc((UINT16_MAX + 1) * sizeof(*vm->threaded_code));
+    if (!vm->threaded_code) {
+      run_decoded(vm);
+      return;
+    }
+    for (uint32_t address = 0; address <= UINT16_MAX; address++) {
+      vm->threaded_code[address] = labels[vm->decoded[address].kind];
+    }
+    smc_watch(vm, threaded_invalidate);
+  }
+
+  uint16_t *const reg = vm->reg;
+  uint16_t *const memory = vm->memory;
+  const struct decoded *const decoded = vm->decoded;
+  const void **const threaded_code = vm->threaded_code;
+  uint16_t pc = reg[R_PC];
+  int64_t remaining = vm->remaining;
+  uint32_t cc = vm->flag_result;
+  const struct decoded *d;
+
+  /* write the cached state back before a call out, reload it after */
+#define SYNC_OUT() \
+  do { \
+    reg[R_PC] = pc; \
+    vm->remaining = remaining; \
+    vm->flag_result = cc; \
+  } while (0)
+#define SYNC_IN() \
+  do { \
+    pc = reg[R_PC]; \
+    remaining = vm->remaining; \
+    cc = vm->flag_result; \
+  } while (0)
+
+  /* only the keyboard status register needs the slow path, which looks at
+   * PC and flags for idle detection and may stop the run */
+#define READ(address) \
+  ({ \
+    uint16_t a_ = (address); \
+    uint16_t v_; \
+    if (a_ == M_KBSR) { \
+      SYNC_OUT(); \
+      v_ = read_from_memory(vm, a_); \
+      SYNC_IN(); \
+    } \
+    else { \
+      v_ = memory[a_]; \
+    } \
+    v_; \
+  })
+
+  /* fetch the next record, bump PC and jump straight to its handler */
+#define DISPATCH() \
+  do { \
+    if (remaining <= 0) { \
+      goto out; \
+    } \
+    remaining--; \
+    d = &decoded[pc]; \
+    goto *threaded_code[pc++]; \
+  } while (0)
+
+  DISPATCH();
+
+do_br:
+  if (d->DR & cond_flag_of(cc)) {
+    pc += d->imm;
+  }
+  DISPATCH();
+
+do_add_reg:
+  reg[d->DR] = reg[d->SR1] + reg[d->SR2];
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_add_imm:
+  reg[d->DR] = reg[d->SR1] + d->imm;
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_and_reg:
+  reg[d->DR] = reg[d->SR1] & reg[d->SR2];
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_and_imm:
+  reg[d->DR] = reg[d->SR1] & d->imm;
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_not:
+  reg[d->DR] = ~reg[d->SR1];
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_ld:
+  reg[d->DR] = READ(pc + d->imm);
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_ldi:
+  reg[d->DR] = READ(READ(pc + d->imm));
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_ldr:
+  reg[d->DR] = READ(reg[d->SR1] + d->imm);
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_lea:
+  reg[d->DR] = pc + d->imm;
+  cc = reg[d->DR];
+  DISPATCH();
+
+do_st:
+  write_to_memory(vm, pc + d->imm, reg[d->DR]);
+  DISPATCH();
+
+do_sti:
+  write_to_memory(vm, READ(pc + d->imm), reg[d->DR]);
+  DISPATCH();
+
+do_str:
+  write_to_memory(vm, reg[d->SR1] + d->imm, reg[d->DR]);
+  DISPATCH();
+
+do_jmp:
+  pc = reg[d->SR1];
+  DISPATCH();
+
+do_jsr:
+  reg[R_7] = pc;
+  pc += d->imm;
+  DISPATCH();
+
+do_jsrr:
+  {
+    uint16_t temp = pc;
+    pc = reg[d->SR1];
+    reg[R_7] = temp;
+  }
+  DISPATCH();
+
+do_trap:
+  SYNC_OUT();
+  op_trap(vm, d->bits);
+  SYNC_IN();
+  DISPATCH();
+
+do_nop:
+  DISPATCH();
+
+do_device:
+  SYNC_OUT();
+  d->handler(vm, d);
+  SYNC_IN();
+  DISPATCH();
+
+do_undecoded:
+  // first run of a word outside known code: decode its line, then run it
+  {
+    // pc has already moved past it, and wraps to 0 after xFFFF
+    uint16_t at = pc - 1;
+    decode_code_line(vm, at);
+    for (uint32_t a = at & ~(CODE_LINE_WORDS - 1), end = a + CODE_LINE_WORDS; a < end; a++) {
+      threaded_code[a] = labels[decoded[a].kind];
+    }
+    goto *threaded_code[at];
+  }
+
+out:
+  SYNC_OUT();
+
+#undef DISPATCH
+#undef READ
+#undef SYNC_IN
+#undef SYNC_OUT
+}
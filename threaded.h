@@ -0,0 +1,10 @@
+#ifndef THREADED_H_
+#define THREADED_H_
+
+#include <stdint.h>
+
+struct vm;
+
+void run_threaded(struct vm *vm);
+
+#endif
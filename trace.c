@@ -0,0 +1,561 @@
+/*
+ * Binary execution trace
+ *
+ * The VM side lives in trace.h: trace_instruction and trace_store append to
+ * the current block and call trace_next_block when it is nearly full. Here
+ * a compressor thread takes the full blocks in order, packs each one on its
+ * own and appends it to the file, and trace_decode reads the file back.
+ *
+ * File: "LC3TRACE", uint32_t version, uint32_t block size, then one chunk
+ * per block: uint32_t raw length, uint32_t packed length and the packed
+ * bytes, or the raw ones if packing did not make them smaller (the two
+ * lengths are then equal). Numbers are in host byte order, as in snapshots.
+ *
+ * Packing is a byte-oriented LZ77 in the style of LZ4: a token byte holds
+ * the literal count in its high nibble and the match length minus 4 in its
+ * low one, 15 in either meaning more length bytes follow (each 255 means
+ * add it and keep reading). Then come the literals, a uint16_t offset back
+ * into the block and the match length bytes. A block ends after literals.
+ * Trace records repeat the same few instruction words and register values,
+ * which such a matcher finds at several hundred MB/s.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "disasm.h"
+
+#define TRACE_MAGIC "LC3TRACE"
+#define TRACE_VERSION 1
+
+#define PACK_HASH_BITS 14
+#define PACK_MIN_MATCH 4
+#define PACK_MAX_OFFSET UINT16_MAX
+#define PACK_BOUND(len) ((len) + (len) / 255 + 16)
+
+struct trace_writer
+{
+  FILE *file;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;      /* a block was queued, or stopping */
+  pthread_cond_t space;     /* the compressor finished a block */
+  uint8_t *blocks[TRACE_BLOCKS];
+  size_t lengths[TRACE_BLOCKS];
+  uint64_t queued;          /* blocks handed over; the VM fills the next one */
+  uint64_t written;         /* ... and done with by the compressor */
+  int stopping;
+  int failed;               /* a write failed: later blocks are dropped */
+  uint8_t *packed;
+  uint32_t table[1 << PACK_HASH_BITS];
+
+  uint64_t start_instructions;
+  uint64_t raw_bytes;
+  uint64_t file_bytes;
+  uint64_t stalls;          /* times the VM waited for a free block */
+  uint64_t compress_ns;     /* compressor thread CPU time */
+};
+
+/*
+* Block Packing
+-----------------------------
+*/
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint8_t *put_length(uint8_t *out, size_t length)
+{
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = length;
+  return out;
+}
+
+static uint8_t *put_sequence(uint8_t *out, const uint8_t *literals, size_t literal_len,
+                             size_t offset, size_t match_len)
+/*
+ One token, its literals and, if match_len is not 0, the match.
+*/
+{
+  size_t extra = match_len ? match_len - PACK_MIN_MATCH : 0;
+  *out++ = (literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15);
+  if (literal_len >= 15) {
+    out = put_length(out, literal_len - 15);
+  }
+  memcpy(out, literals, literal_len);
+  out += literal_len;
+  if (match_len) {
+    uint16_t offset16 = offset;
+    memcpy(out, &offset16, sizeof(offset16));
+    out += sizeof(offset16);
+    if (extra >= 15) {
+      out = put_length(out, extra - 15);
+    }
+  }
+  return out;
+}
+
+static size_t pack(const uint8_t *in, size_t len, uint8_t *out, uint32_t *table)
+/*
+ Pack len bytes into out, which holds PACK_BOUND(len); returns the packed
+ size. table has 1 << PACK_HASH_BITS entries; the positions in it are only
+ hints, a match is checked before it is used.
+*/
+{
+  memset(table, 0, sizeof(uint32_t) << PACK_HASH_BITS);
+  uint8_t *start = out;
+  size_t pos = 0, anchor = 0;
+  // the last few bytes are always literals, so read32 stays inside in[]
+  while (pos + 12 <= len) {
+    uint32_t sequence = read32(in + pos);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - PACK_HASH_BITS);
+    size_t candidate = table[hash];
+    table[hash] = pos;
+    if (candidate >= pos || pos - candidate > PACK_MAX_OFFSET
+        || read32(in + candidate) != sequence) {
+      pos++;
+      continue;
+    }
+    size_t match = PACK_MIN_MATCH;
+    while (pos + match < len && in[candidate + match] == in[pos + match]) {
+      match++;
+    }
+    out = put_sequence(out, in + anchor, pos - anchor, pos - candidate, match);
+    pos += match;
+    anchor = pos;
+  }
+  if (anchor < len) {
+    out = put_sequence(out, in + anchor, len - anchor, 0, 0);
+  }
+  return out - start;
+}
+
+static int get_length(const uint8_t **in, const uint8_t *end, size_t *length)
+{
+  uint8_t byte;
+  do {
+    if (*in >= end) {
+      return 0;
+    }
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+static int unpack(const uint8_t *in, size_t len, uint8_t *out, size_t out_len)
+/*
+ Undo pack; returns 0 unless the input is well formed and fills out_len
+ bytes exactly.
+*/
+{
+  const uint8_t *end = in + len;
+  size_t pos = 0;
+  while (in < end) {
+    uint8_t token = *in++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !get_length(&in, end, &literals)) {
+      return 0;
+    }
+    if (literals > (size_t)(end - in) || literals > out_len - pos) {
+      return 0;
+    }
+    memcpy(out + pos, in, literals);
+    in += literals;
+    pos += literals;
+    if (in == end) {
+      break;
+    }
+
+    uint16_t offset;
+    if (end - in < (ptrdiff_t)sizeof(offset)) {
+      return 0;
+    }
+    memcpy(&offset, in, sizeof(offset));
+    in += sizeof(offset);
+    size_t match = token & 15;
+    if (match == 15 && !get_length(&in, end, &match)) {
+      return 0;
+    }
+    match += PACK_MIN_MATCH;
+    if (offset == 0 || offset > pos || match > out_len - pos) {
+      return 0;
+    }
+    // byte by byte: the match may overlap what it copies
+    for (size_t i = 0; i < match; i++, pos++) {
+      out[pos] = out[pos - offset];
+    }
+  }
+  return pos == out_len;
+}
+
+/*
+* Writing
+-----------------------------
+*/
+
+static uint64_t thread_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void write_block(struct trace_writer *writer, const uint8_t *block, size_t len)
+{
+  uint64_t start = thread_ns();
+  size_t packed = pack(block, len, writer->packed, writer->table);
+  const uint8_t *data = writer->packed;
+  if (packed >= len) {
+    packed = len;
+    data = block;
+  }
+  uint32_t header[2] = {len, packed};
+  if (!writer->failed && (fwrite(header, sizeof(header), 1, writer->file) != 1
+                          || fwrite(data, 1, packed, writer->file) != packed)) {
+    writer->failed = 1;
+  }
+  writer->raw_bytes += len;
+  writer->file_bytes += sizeof(header) + packed;
+  writer->compress_ns += thread_ns() - start;
+}
+
+static void *compressor_main(void *arg)
+{
+  struct trace_writer *writer = arg;
+  pthread_mutex_lock(&writer->lock);
+  while (1) {
+    while (writer->written == writer->queued && !writer->stopping) {
+      pthread_cond_wait(&writer->work, &writer->lock);
+    }
+    if (writer->written == writer->queued) {
+      break;
+    }
+    int index = writer->written % TRACE_BLOCKS;
+    pthread_mutex_unlock(&writer->lock);
+    // the VM does not touch a queued block, so no lock is needed to read it
+    write_block(writer, writer->blocks[index], writer->lengths[index]);
+    pthread_mutex_lock(&writer->lock);
+    writer->written++;
+    pthread_cond_signal(&writer->space);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+static void start_block(struct trace *trace)
+{
+  uint8_t *block = trace->writer->blocks[trace->writer->queued % TRACE_BLOCKS];
+  trace->at = block;
+  trace->end = block + TRACE_BLOCK_BYTES - TRACE_RECORD_MAX;
+}
+
+static void queue_block(struct trace *trace)
+/*
+ Called with the lock held.
+*/
+{
+  struct trace_writer *writer = trace->writer;
+  int index = writer->queued % TRACE_BLOCKS;
+  writer->lengths[index] = trace->at - writer->blocks[index];
+  writer->queued++;
+  pthread_cond_signal(&writer->work);
+}
+
+void trace_next_block(struct trace *trace)
+{
+  struct trace_writer *writer = trace->writer;
+  pthread_mutex_lock(&writer->lock);
+  queue_block(trace);
+  if (writer->queued - writer->written >= TRACE_BLOCKS) {
+    writer->stalls++;
+    do {
+      pthread_cond_wait(&writer->space, &writer->lock);
+    } while (writer->queued - writer->written >= TRACE_BLOCKS);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  start_block(trace);
+}
+
+void trace_sync(struct vm *vm)
+{
+  struct trace *trace = vm->trace;
+  uint8_t *at = trace->at;
+  uint64_t instructions = vm_icount(vm);
+  *at++ = TRACE_SYNC;
+  memcpy(at, &instructions, sizeof(instructions));
+  at += sizeof(instructions);
+  trace_put16(&at, vm->reg[R_PC]);
+  for (int r = 0; r < R_PC; r++) {
+    trace->regs[r] = vm->reg[r];
+    trace_put16(&at, vm->reg[r]);
+  }
+  trace->cond = cond_flag_of(vm->flag_result);
+  *at++ = trace->cond;
+  trace->next_pc = vm->reg[R_PC];
+  trace->at = at;
+  if (at > trace->end) {
+    trace_next_block(trace);
+  }
+}
+
+static void free_writer(struct trace_writer *writer)
+{
+  for (int i = 0; i < TRACE_BLOCKS; i++) {
+    free(writer->blocks[i]);
+  }
+  free(writer->packed);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->work);
+  pthread_cond_destroy(&writer->space);
+  free(writer);
+}
+
+int trace_open(struct vm *vm, const char *path)
+{
+  struct trace *trace = calloc(1, sizeof(*trace));
+  struct trace_writer *writer = calloc(1, sizeof(*writer));
+  if (!trace || !writer) {
+    free(trace);
+    free(writer);
+    return 0;
+  }
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->work, NULL);
+  pthread_cond_init(&writer->space, NULL);
+  int ok = (writer->packed = malloc(PACK_BOUND(TRACE_BLOCK_BYTES))) != NULL;
+  for (int i = 0; ok && i < TRACE_BLOCKS; i++) {
+    ok = (writer->blocks[i] = malloc(TRACE_BLOCK_BYTES)) != NULL;
+  }
+  if (ok) {
+    writer->file = fopen(path, "wb");
+    ok = writer->file != NULL;
+  }
+  uint32_t header[2] = {TRACE_VERSION, TRACE_BLOCK_BYTES};
+  if (ok && (fwrite(TRACE_MAGIC, 8, 1, writer->file) != 1
+             || fwrite(header, sizeof(header), 1, writer->file) != 1)) {
+    ok = 0;
+  }
+  if (ok && pthread_create(&writer->thread, NULL, compressor_main, writer) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    if (writer->file) {
+      fclose(writer->file);
+    }
+    free_writer(writer);
+    free(trace);
+    return 0;
+  }
+
+  trace_close(vm, NULL);
+  writer->start_instructions = vm_icount(vm);
+  trace->writer = writer;
+  start_block(trace);
+  vm->trace = trace;
+  return 1;
+}
+
+void trace_close(struct vm *vm, FILE *report)
+{
+  struct trace *trace = vm->trace;
+  if (!trace) {
+    return;
+  }
+  vm->trace = NULL;
+  struct trace_writer *writer = trace->writer;
+  pthread_mutex_lock(&writer->lock);
+  if (trace->at != writer->blocks[writer->queued % TRACE_BLOCKS]) {
+    queue_block(trace);
+  }
+  writer->stopping = 1;
+  pthread_cond_signal(&writer->work);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  if (fclose(writer->file) != 0) {
+    writer->failed = 1;
+  }
+
+  if (report) {
+    uint64_t instructions = vm_icount(vm) - writer->start_instructions;
+    fprintf(report, "trace: %llu instructions, %.1f MB recorded (%.1f bytes each), "
+            "%.1f MB written (%.1fx), compressor %.3f s, %llu waits for it%s\n",
+            (unsigned long long)instructions, writer->raw_bytes / 1e6,
+            instructions ? (double)writer->raw_bytes / instructions : 0.0,
+            writer->file_bytes / 1e6,
+            writer->file_bytes ? (double)writer->raw_bytes / writer->file_bytes : 0.0,
+            writer->compress_ns / 1e9, (unsigned long long)writer->stalls,
+            writer->failed ? "; writing the file failed" : "");
+  }
+  free_writer(writer);
+  free(trace);
+}
+
+/*
+* Decoding
+-----------------------------
+*/
+
+struct decoder
+{
+  uint64_t instructions;
+  uint16_t next_pc;
+  uint16_t regs[R_PC];
+  uint8_t cond;
+  uint16_t store[2];
+  uint16_t (*stores)[2];    /* made by the instruction still to come */
+  size_t store_count;
+  size_t store_cap;
+};
+
+static const char *cond_name(uint8_t cond)
+{
+  return cond == F_N ? "N" : cond == F_Z ? "Z" : cond == F_P ? "P" : "-";
+}
+
+static uint16_t get16(const uint8_t **at)
+{
+  uint16_t value;
+  memcpy(&value, *at, sizeof(value));
+  *at += sizeof(value);
+  return value;
+}
+
+static int decode_block(struct decoder *decoder, const uint8_t *at, const uint8_t *end,
+                        FILE *out)
+/*
+ Print the records in one block; returns 0 on a malformed one. A record
+ never spans blocks.
+*/
+{
+  while (at < end) {
+    uint8_t tag = *at++;
+    if (tag == TRACE_STORE) {
+      if (end - at < 4) {
+        return 0;
+      }
+      if (decoder->store_count == decoder->store_cap) {
+        size_t cap = decoder->store_cap ? decoder->store_cap * 2 : 64;
+        uint16_t (*grown)[2] = realloc(decoder->stores, cap * sizeof(*grown));
+        if (!grown) {
+          return 0;
+        }
+        decoder->stores = grown;
+        decoder->store_cap = cap;
+      }
+      decoder->store[0] ^= get16(&at);
+      decoder->store[1] ^= get16(&at);
+      memcpy(decoder->stores[decoder->store_count++], decoder->store, sizeof(decoder->store));
+      continue;
+    }
+    if (tag == TRACE_SYNC) {
+      if (end - at < 8 + 2 + 2 * R_PC + 1) {
+        return 0;
+      }
+      memcpy(&decoder->instructions, at, sizeof(decoder->instructions));
+      at += sizeof(decoder->instructions);
+      decoder->next_pc = get16(&at);
+      fprintf(out, "-- at instruction %llu: PC x%04X", (unsigned long long)decoder->instructions,
+              decoder->next_pc);
+      for (int r = 0; r < R_PC; r++) {
+        decoder->regs[r] = get16(&at);
+        fprintf(out, " R%d x%04X", r, decoder->regs[r]);
+      }
+      decoder->cond = *at++;
+      fprintf(out, " %s\n", cond_name(decoder->cond));
+      continue;
+    }
+    if (tag & ~(TRACE_PC | TRACE_REGS | TRACE_COND)) {
+      return 0;
+    }
+
+    if (end - at < 2 + 2 * !!(tag & TRACE_PC)) {
+      return 0;
+    }
+    uint16_t pc = tag & TRACE_PC ? get16(&at) : decoder->next_pc;
+    uint16_t bits = get16(&at);
+    char text[64];
+    disassemble(pc, bits, text, sizeof(text));
+    fprintf(out, "%12llu  x%04X  %04X  %-26s", (unsigned long long)decoder->instructions, pc,
+            bits, text);
+    if (tag & TRACE_REGS) {
+      if (at >= end) {
+        return 0;
+      }
+      uint8_t mask = *at++;
+      if (end - at < 2 * __builtin_popcount(mask)) {
+        return 0;
+      }
+      for (int r = 0; r < R_PC; r++) {
+        if (mask & (1 << r)) {
+          decoder->regs[r] ^= get16(&at);
+          fprintf(out, " R%d=x%04X", r, decoder->regs[r]);
+        }
+      }
+    }
+    if (tag & TRACE_COND) {
+      if (at >= end) {
+        return 0;
+      }
+      decoder->cond = *at++;
+      fprintf(out, " %s", cond_name(decoder->cond));
+    }
+    for (size_t i = 0; i < decoder->store_count; i++) {
+      fprintf(out, " [x%04X]=x%04X", decoder->stores[i][0], decoder->stores[i][1]);
+    }
+    fputc('\n', out);
+    decoder->store_count = 0;
+    decoder->next_pc = pc + 1;
+    decoder->instructions++;
+  }
+  return 1;
+}
+
+int trace_decode(FILE *in, FILE *out)
+{
+  char magic[8];
+  uint32_t header[2];
+  if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0
+      || fread(header, sizeof(header), 1, in) != 1 || header[0] != TRACE_VERSION) {
+    return 0;
+  }
+  size_t block_bytes = header[1];
+  uint8_t *packed = malloc(block_bytes);
+  uint8_t *raw = malloc(block_bytes);
+  struct decoder decoder = {0};
+  int ok = packed && raw;
+  uint32_t lengths[2];
+  while (ok && fread(lengths, sizeof(lengths), 1, in) == 1) {
+    if (lengths[0] > block_bytes || lengths[1] > lengths[0]
+        || fread(packed, 1, lengths[1], in) != lengths[1]) {
+      ok = 0;
+      break;
+    }
+    if (lengths[1] == lengths[0]) {
+      memcpy(raw, packed, lengths[0]);
+    }
+    else if (!unpack(packed, lengths[1], raw, lengths[0])) {
+      ok = 0;
+      break;
+    }
+    ok = decode_block(&decoder, raw, raw + lengths[0], out);
+  }
+  if (ok && ferror(in)) {
+    ok = 0;
+  }
+  free(decoder.stores);
+  free(packed);
+  free(raw);
+  return ok;
+}
@@ -0,0 +1,132 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+
+/** binary execution trace
+ * Filled by the switch engine while vm->trace is set (vm_run then ignores
+ * the selected engine, as with the profiler). Every instruction appends a
+ * record to the current block of the trace's ring: its bits, the registers
+ * and condition code it changed, and its PC only when it does not follow
+ * the previous instruction in memory. Its stores come as records of
+ * their own just before it, and each vm_run starts with a record of the
+ * whole register state.
+ * A full block goes to a compressor thread owned by the trace, which packs
+ * it and appends it to the file while the VM fills the next one; the VM
+ * waits only when every block is still queued. A trace belongs to one VM,
+ * so whichever thread runs it writes without taking a lock except once per
+ * block.
+ **/
+
+#define TRACE_BLOCK_BYTES (1 << 18)
+#define TRACE_BLOCKS 8
+#define TRACE_RECORD_MAX 32       /* any one record fits in this */
+
+/* first byte of a record: an instruction if below TRACE_STORE, made of
+ * these flags; the fields follow in this order */
+#define TRACE_PC 0x01             /* uint16_t PC, else one past the previous */
+                                  /* uint16_t instruction bits, always */
+#define TRACE_REGS 0x02           /* uint8_t mask of R0-R7, a uint16_t for each */
+#define TRACE_COND 0x04           /* uint8_t F_N, F_Z, F_P or 0 */
+#define TRACE_STORE 0x80          /* uint16_t address, uint16_t value */
+/* register values, and the address and value of a store, are XORed with the
+ * previous ones: loops then repeat the same bytes, which packs far better */
+#define TRACE_SYNC 0x81           /* uint64_t instructions, uint16_t PC, R0-R7,
+                                     uint8_t condition code */
+
+struct trace_writer;
+
+struct trace
+{
+  uint8_t *at;              /* next byte in the current block */
+  uint8_t *end;             /* last place a record may start */
+  uint16_t regs[R_PC];      /* R0-R7 as of the last record */
+  uint16_t store[2];        /* address and value of the last store */
+  uint16_t next_pc;         /* one past the last instruction */
+  uint8_t cond;
+  struct trace_writer *writer;
+};
+
+static inline void trace_put16(uint8_t **at, uint16_t value)
+{
+  memcpy(*at, &value, sizeof(value));
+  *at += sizeof(value);
+}
+
+/* hand the current block to the compressor and start the next one */
+void trace_next_block(struct trace *trace);
+
+static inline void trace_store(struct trace *trace, uint16_t address, uint16_t value)
+{
+  uint8_t *at = trace->at;
+  *at++ = TRACE_STORE;
+  trace_put16(&at, address ^ trace->store[0]);
+  trace_put16(&at, value ^ trace->store[1]);
+  trace->store[0] = address;
+  trace->store[1] = value;
+  trace->at = at;
+  if (at > trace->end) {
+    trace_next_block(trace);
+  }
+}
+
+static inline void trace_instruction(struct trace *trace, const struct vm *vm, uint16_t pc,
+                                     uint16_t instruction)
+/*
+ Record the instruction at pc after it executed.
+*/
+{
+  uint8_t *at = trace->at;
+  uint8_t *tag = at++;
+  uint8_t flags = 0;
+  if (pc != trace->next_pc) {
+    flags |= TRACE_PC;
+    trace_put16(&at, pc);
+  }
+  trace_put16(&at, instruction);
+  if (memcmp(trace->regs, vm->reg, sizeof(trace->regs)) != 0) {
+    uint8_t *mask = at++;
+    *mask = 0;
+    for (int r = 0; r < R_PC; r++) {
+      if (vm->reg[r] != trace->regs[r]) {
+        *mask |= 1 << r;
+        trace_put16(&at, vm->reg[r] ^ trace->regs[r]);
+        trace->regs[r] = vm->reg[r];
+      }
+    }
+    flags |= TRACE_REGS;
+  }
+  uint8_t cond = cond_flag_of(vm->flag_result);
+  if (cond != trace->cond) {
+    flags |= TRACE_COND;
+    *at++ = cond;
+    trace->cond = cond;
+  }
+  *tag = flags;
+  trace->next_pc = pc + 1;
+  trace->at = at;
+  if (at > trace->end) {
+    trace_next_block(trace);
+  }
+}
+
+/* write a TRACE_SYNC record; vm_run does this before every run */
+void trace_sync(struct vm *vm);
+
+/* start tracing vm into a new file at path; returns 0 if the file cannot be
+ * created or the compressor thread cannot start */
+int trace_open(struct vm *vm, const char *path);
+
+/* write out what is buffered, stop the thread and close the file. With
+ * report set, a line of totals goes to it: instructions, bytes recorded
+ * and written, and how often the VM had to wait for the compressor. */
+void trace_close(struct vm *vm, FILE *report);
+
+/* turn a trace file into text, one line per instruction; returns 0 if the
+ * file is not a trace or is cut short */
+int trace_decode(FILE *in, FILE *out);
+
+#endif
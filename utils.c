@@ -1,16 +1,45 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "utils.h"
+#include "output.h"
+#include "snapshot.h"
+#include "image.h"
+#include "trace.h"
+
+static int stdio_key_ready(void *ctx)
+{
+  return check_key();
+}
+
+static int stdio_read_key(void *ctx)
+{
+  // unbuffered, so check_key's select sees every byte not read yet
+  unsigned char key;
+  return read(STDIN_FILENO, &key, 1) == 1 ? key : EOF;
+}
 
-uint16_t reg[R_SIZE];
-uint16_t memory[65535];
+static void stdio_write(void *ctx, const char *buf, size_t len)
+{
+  output_write(buf, len);
+}
 
-/* memory-mapped I/O: memory addresses xFE00 through xFFFF have been allocated to designate each I/O device register. */
-enum mem_registers
+static void stdio_flush(void *ctx)
 {
-  M_KBSR = 0xFE00, // keyboard status register
-  M_KBDR = 0xFE02, // keyboard data register
-  M_DSR = 0xFE04,  // display status register
-  M_DDR = 0xFE06,  // display data register
-  M_MCR = 0xFFFE   // machine control register
+  output_flush();
+}
+
+static void stdio_wait_key(void *ctx)
+{
+  wait_for_key();
+}
+
+/* console I/O on the process's stdin/stdout, through output.c */
+const struct vm_io vm_stdio_io = {
+  NULL, stdio_key_ready, stdio_read_key, stdio_write, stdio_flush,
+  stdio_wait_key
 };
 
 /* General Helper Functions */
@@ -27,84 +56,299 @@ uint16_t get_sign_extension(uint16_t n, int num_bits)
   return n;
 }
 
-void update_flag(uint16_t value)
+uint16_t get_cond_flag(struct vm *vm)
 /*
- Update the condition flag register depending on the passed in value.
+ Materialize the condition flag register from the last flag-setting result.
 */
+{
+  vm->reg[R_F] = cond_flag_of(vm->flag_result);
+  return vm->reg[R_F];
+}
 
+void request_stop(struct vm *vm, enum vm_stop reason)
+/*
+ Make the running engine return from vm_run with reason. The budget is
+ zeroed (keeping the retired count unchanged), so every engine notices at
+ its next budget check without testing a separate flag per instruction.
+*/
 {
-    if (reg[value] == 0)
-    {
-        reg[R_F] = F_Z;
-    }
-    else if (reg[value] >> 15) // 1 in msb means it's negative
-    {
-        reg[R_F] = F_N;
+  vm->stop = reason;
+  vm->icount_base -= vm->remaining;
+  vm->remaining = 0;
+}
+
+/* Idle Detection */
+
+static int guest_is_spinning(struct vm *vm)
+/*
+ Called on every keyboard poll that found no key. If registers, PC, flags and
+ the side-effect counter are identical to the previous empty poll, the guest
+ is in a loop that does nothing but poll M_KBSR; after IDLE_SPIN_POLLS such
+ polls in a row it is safe to block until input arrives.
+*/
+{
+  if (vm->side_effects == vm->idle_effects && vm->flag_result == vm->idle_flags
+      && memcmp(vm->reg, vm->idle_regs, sizeof(vm->idle_regs)) == 0) {
+    return ++vm->idle_spins >= IDLE_SPIN_POLLS;
+  }
+  memcpy(vm->idle_regs, vm->reg, sizeof(vm->idle_regs));
+  vm->idle_flags = vm->flag_result;
+  vm->idle_effects = vm->side_effects;
+  vm->idle_spins = 0;
+  return 0;
+}
+
+void wait_for_key(void)
+/*
+ Block until stdin is readable. A signal ends the wait early so the VM can
+ stop at an instruction boundary (e.g. to save a snapshot).
+*/
+{
+  output_input_wait();
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  poll(&pfd, 1, -1);
+}
+
+/* Pending Input */
+
+int input_ready(struct vm *vm)
+{
+  if (vm->pending_pos < vm->pending_len) {
+    return 1;
+  }
+  return vm->io.key_ready(vm->io.ctx);
+}
+
+int input_read(struct vm *vm)
+/*
+ Every key the guest consumes, through a TRAP or M_KBDR, comes through here.
+*/
+{
+  int key;
+  if (vm->pending_pos < vm->pending_len) {
+    key = vm->pending_input[vm->pending_pos++];
+    if (vm->pending_pos == vm->pending_len) {
+      vm->pending_pos = vm->pending_len = 0;
     }
-    else
-    {
-        reg[R_F] = F_P;
+  }
+  else {
+    key = vm->io.read_key(vm->io.ctx);
+  }
+  if (vm->input_record) {
+    fprintf(vm->input_record, "%llu %d\n", (unsigned long long)vm_icount(vm), key);
+  }
+  return key;
+}
+
+int queue_input(struct vm *vm, const uint8_t *bytes, size_t len)
+/*
+ Append bytes to the input served before the I/O backend's. Returns 0 if out
+ of memory.
+*/
+{
+  if (len == 0) {
+    return 1;
+  }
+  uint8_t *queue = realloc(vm->pending_input, vm->pending_len + len);
+  if (!queue) {
+    return 0;
+  }
+  memcpy(queue + vm->pending_len, bytes, len);
+  vm->pending_input = queue;
+  vm->pending_len += len;
+  return 1;
+}
+
+static void set_device_register(struct vm *vm, uint16_t address, uint16_t value)
+/*
+ The keyboard registers change without a guest store, but an engine that ran
+ code from them has cached the old words all the same.
+*/
+{
+  if (vm->memory[address] != value) {
+    vm->memory[address] = value;
+    if (smc_page_has_code(&vm->code, address)) {
+      smc_page_store(vm, address);
     }
+  }
 }
 
-uint16_t read_from_memory(uint16_t address)
+uint16_t read_from_memory(struct vm *vm, uint16_t address)
 {
   if (address == M_KBSR) {
+    int ready = input_ready(vm);
+    int key_ready = ready > 0;
+    if (!key_ready) {
+      // the guest is waiting for a key, so let it see what it printed
+      vm->io.flush(vm->io.ctx);
+    }
+    if (ready < 0 && !vm->io.wait_key) {
+      // input is closed, so no key will ever arrive
+      request_stop(vm, VM_STOP_INPUT);
+    }
+    else if (!key_ready && vm->idle_detection && guest_is_spinning(vm)) {
+      vm->idle_spins = 0;
+      if (vm->io.wait_key) {
+        // nothing can change until a key arrives, so sleep instead of spinning
+        vm->io.wait_key(vm->io.ctx);
+        vm->idle_waits++;
+        key_ready = input_ready(vm) > 0;
+        if (!key_ready) {
+          // the wait was interrupted: the guest polls again after vm_run
+          request_stop(vm, VM_STOP_INPUT);
+        }
+      }
+      else {
+        // the backend cannot block: hand the wait back to the caller
+        request_stop(vm, VM_STOP_INPUT);
+      }
+    }
+
     // we check to see if the address is coming from keyboard status
-    if (check_key()) {
+    if (key_ready) {
       // keeping track of status
-      memory[M_KBSR] = (1 << 15);
+      set_device_register(vm, M_KBSR, 1 << 15);
       // accessing last char from keyboard data register because we know that we need the value,
       // as it just updated
-      memory[M_KBDR] = getchar();
+      set_device_register(vm, M_KBDR, input_read(vm));
     }
     else {
       // updating the value at keyboard status back to 0 because the hardware won't do it
-      memory[M_KBSR] = 0;
+      set_device_register(vm, M_KBSR, 0);
     }
   }
-  return memory[address];
+  return vm->memory[address];
 }
 
-void write_to_memory(uint16_t address, uint16_t value)
+void write_to_memory(struct vm *vm, uint16_t address, uint16_t value)
 {
-  memory[address] = value;
+  vm->memory[address] = value;
+  vm->side_effects++;
+  smc_note_store(&vm->code, address);
+  if (vm->trace) {
+    trace_store(vm->trace, address, value);
+  }
+  // engine caches only need to hear about stores into code
+  if (smc_page_has_code(&vm->code, address)) {
+    smc_page_store(vm, address);
+  }
 }
 
-int read_program_code_into_memory(const char *path_to_code)
+static uint8_t *read_whole_file(int fd, size_t max_size, size_t *size)
+/*
+ Fallback for files that cannot be mapped (pipes, /dev/stdin). Reads at most
+ max_size bytes; returns NULL if out of memory.
+*/
 {
-  FILE *code_file = fopen(path_to_code, "r");
+  uint8_t *data = malloc(max_size);
+  size_t len = 0;
+  while (data && len < max_size) {
+    ssize_t got = read(fd, data + len, max_size - len);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    len += got;
+  }
+  *size = len;
+  return data;
+}
+
+static int load_program(struct vm *vm, const char *path_to_code, struct image_span *span)
+/*
+ Load an LC-3 object file, or resume a snapshot (see snapshot.h) if the file
+ starts with the snapshot magic. The file is mapped rather than read, so the
+ byte swap copies straight from the page cache into memory. span is set to
+ where an object file loaded, and to no words for a snapshot.
+*/
+{
+  span->origin = span->words = 0;
+  int fd = open(path_to_code, O_RDONLY);
 
   /* Return error if we cannot read file */
-  if (!code_file)
+  if (fd < 0)
   {
     fprintf(stderr, "Error: Could not find file %s\n", path_to_code);
     return 0;
   }
 
-  /* The first 16 bits of the program file
-  specify the address in memory where the program should start. */
-  uint16_t program_start;
-  fread(&program_start, sizeof(uint16_t), 1, code_file);
-  // convert to little endian
-  program_start = (program_start << 8) | (program_start >> 8);
-
-  /* reading once because we are reading the entire file */
-  uint16_t max_space = 65535 - program_start; // 2^16 - program_start
+  struct stat st;
+  size_t size = 0;
+  uint8_t *image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    size = st.st_size;
+    image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  int mapped = image != MAP_FAILED;
+  if (!mapped) {
+    // one byte more than the largest image, so oversized input is caught
+    image = read_whole_file(fd, 2 * (UINT16_MAX + 2) + 1, &size);
+  }
+  close(fd);
+  if (!image) {
+    fprintf(stderr, "Error: out of memory loading %s\n", path_to_code);
+    return 0;
+  }
 
-  // memory defined earlier
-  uint16_t *point_to_mem = memory + program_start;
+  int loaded;
+  if (size >= sizeof(SNAPSHOT_MAGIC)
+      && memcmp(image, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0) {
+    loaded = vm_load_snapshot(vm, path_to_code);
+    if (!loaded) {
+      fprintf(stderr, "Error: %s is not a usable snapshot\n", path_to_code);
+    }
+  }
+  else {
+    const char *problem = image_problem(image, size);
+    loaded = !problem && vm_load_image(vm, image, size);
+    if (problem) {
+      fprintf(stderr, "Error: %s %s\n", path_to_code, problem);
+    }
+    if (loaded) {
+      *span = image_span(image, size);
+    }
+  }
 
-  // reading in 16-bit increments
-  size_t read_bits = fread(point_to_mem, sizeof(uint16_t), max_space, code_file);
-  while (read_bits-- > 0) {
-    // converting to little endian
-    *point_to_mem = (*point_to_mem << 8) | (*point_to_mem >> 8);
-    point_to_mem++;
+  if (mapped) {
+    munmap(image, size);
   }
+  else {
+    free(image);
+  }
+  return loaded;
+}
 
-  fclose(code_file);
-  return 1;
+int read_program_code_into_memory(struct vm *vm, const char *path_to_code)
+{
+  struct image_span span;
+  return load_program(vm, path_to_code, &span);
+}
+
+int read_program_images(struct vm *vm, const char **paths, int count)
+/*
+ Load the files in order, reporting every range of addresses a later image
+ overwrites of an earlier one. Returns the number of overlaps reported, or -1
+ if a file could not be loaded.
+*/
+{
+  struct image_span spans[count];
+  int overlaps = 0;
+  for (int i = 0; i < count; i++) {
+    if (!load_program(vm, paths[i], &spans[i])) {
+      return -1;
+    }
+    for (int j = 0; j < i; j++) {
+      struct image_span overlap = image_overlap(spans[j], spans[i]);
+      if (overlap.words) {
+        fprintf(stderr, "Warning: %s overwrites x%04X-x%04X of %s\n", paths[i],
+                overlap.origin, (unsigned)(overlap.origin + overlap.words - 1), paths[j]);
+        overlaps++;
+      }
+    }
+  }
+  return overlaps;
 }
 
 uint16_t check_key()
@@ -120,9 +364,11 @@ uint16_t check_key()
 }
 
 struct termios original_tio, new_tio;
+static int input_buffering_disabled;
 
 void disable_input_buffering()
 {
+    input_buffering_disabled = 1;
     tcgetattr(STDIN_FILENO, &original_tio);
     struct termios new_tio = original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
@@ -131,13 +377,38 @@ void disable_input_buffering()
 
 void restore_input_buffering()
 {
-  /* restore the old port settings */
+  /* restore the old port settings, if we changed them */
+  if (!input_buffering_disabled) {
+    return;
+  }
   tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
 }
 
+volatile sig_atomic_t interrupted;
+
 void handle_interrupt(int signal)
+/*
+ Only async-signal-safe work here: the VM thread may have been interrupted
+ inside the output ring's lock or in stdio.
+*/
+{
+  interrupted = 1;
+}
+
+void install_interrupt_handler(void)
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_interrupt;
+  sigemptyset(&action.sa_mask);
+  // no SA_RESTART: a blocked wait for input must return to the run loop
+  sigaction(SIGINT, &action, NULL);
+}
+
+void exit_interrupted(void)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+  output_shutdown();
+  restore_input_buffering();
+  printf("\n");
+  exit(-2);
 }
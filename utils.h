@@ -6,9 +6,20 @@
 #include <sys/termios.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <poll.h>
 #include "opcode.h"
+#include "garbageeater.h"
+#include "smc.h"
 
-extern uint16_t memory[65535];
+/* memory-mapped I/O: memory addresses xFE00 through xFFFF have been allocated to designate each I/O device register. */
+enum mem_registers
+{
+  M_KBSR = 0xFE00, // keyboard status register
+  M_KBDR = 0xFE02, // keyboard data register
+  M_DSR = 0xFE04,  // display status register
+  M_DDR = 0xFE06,  // display data register
+  M_MCR = 0xFFFE   // machine control register
+};
 
 /* registers: 8 general, 1 program counter (PC), 1 condition register */
 enum registers
@@ -34,17 +45,133 @@ enum cond_flag
     F_N = 1 << 2, // negative
 };
 
-extern uint16_t reg[R_SIZE];
+/* Lazy condition codes: flag-setting instructions only record their result
+ * in flag_result, and N/Z/P are worked out when a BR or anything else asks.
+ * COND_UNSET means no flag-setting instruction has run yet (no flag set). */
+#define COND_UNSET 0x10000
+
+/* Idle detection: a guest that polls M_KBSR with no change in machine state
+ * for IDLE_SPIN_POLLS polls in a row is blocked in io.wait_key until input
+ * arrives. side_effects is bumped by every store and trap so a polling loop
+ * that also writes memory or prints is never treated as idle. */
+#define IDLE_SPIN_POLLS 32
+
+#define MEMORY_BYTES ((UINT16_MAX + 1) * sizeof(uint16_t))
+
+struct decoded;
+struct fusion;
+struct jit;
+struct aot;
+struct profile;
+struct replay;
+struct trace;
+struct watch;
+
+/** VM context
+ * Everything one LC-3 machine needs. Engines count instructions down from
+ * the budget in remaining; the retired count is icount_base - remaining, so
+ * the hot loops only touch one counter. remaining may go negative by a few
+ * instructions when a run is stopped from inside a JIT block.
+ **/
+struct vm
+{
+  uint16_t reg[R_SIZE];     /* first member: the JIT addresses vm as reg[] */
+  uint32_t flag_result;     /* last flag-setting result, or COND_UNSET */
+  int64_t remaining;        /* instructions left in the current vm_run */
+  uint64_t icount_base;
+  enum vm_stop stop;
+  enum vm_engine engine;
+  int fuse;                 /* decoded engine: install superinstructions */
+
+  struct vm_io io;
+
+  uint64_t side_effects;
+  int strict;               /* no extended trap vectors */
+  uint64_t trap_calls[256]; /* per vector, unknown ones included */
+  int idle_detection;
+  uint64_t idle_waits;
+  uint16_t idle_regs[R_PC + 1]; /* machine state at the previous empty poll */
+  uint32_t idle_flags;
+  uint64_t idle_effects;
+  int idle_spins;
+
+  /* input taken from io but not yet read by the guest, served first
+   * (filled when a snapshot is saved or restored) */
+  uint8_t *pending_input;
+  size_t pending_len;
+  size_t pending_pos;
+
+  FILE *input_record;       /* --record: every key the guest reads */
+  struct replay *replay;    /* --replay: owns the wrapping I/O backend */
+
+  /* engine caches, allocated on first use and kept in sync through the
+   * code tracking callbacks */
+  struct code_tracking code;
+  struct decoded *decoded;
+  struct fusion *fusion;
+  const void **threaded_code;
+  struct jit *jit;
+  struct aot *aot;          /* precompiled blocks (aot.h): replace the engine */
+
+  struct profile *profile;  /* set while profiling: runs the switch engine */
+  struct trace *trace;      /* set while tracing: likewise */
+  struct watch *watch;      /* set while a watchpoint is armed: likewise */
+
+  /* UINT16_MAX + 1 words, either allocated or mapped from a snapshot */
+  uint16_t *memory;
+  int memory_mapped;
+};
+
+static inline uint16_t cond_flag_of(uint32_t result)
+{
+  if (result == COND_UNSET) {
+    return 0;
+  }
+  if (result == 0) {
+    return F_Z;
+  }
+  return (result >> 15) ? F_N : F_P;
+}
+
+static inline void update_flag(struct vm *vm, uint16_t value)
+/*
+ Record the register passed in as the last flag-setting result.
+*/
+{
+  vm->flag_result = vm->reg[value];
+}
+
+static inline uint64_t vm_icount(const struct vm *vm)
+{
+  return vm->icount_base - vm->remaining;
+}
+
+uint16_t get_cond_flag(struct vm *vm);
+void request_stop(struct vm *vm, enum vm_stop reason);
+void wait_for_key(void);
+int input_ready(struct vm *vm);
+int input_read(struct vm *vm);
+int queue_input(struct vm *vm, const uint8_t *bytes, size_t len);
+void free_engine_caches(struct vm *vm);
+void replace_memory(struct vm *vm, uint16_t *memory, int mapped);
+void replay_free(struct vm *vm);
 
 uint16_t get_sign_extension(uint16_t n, int num_bits);
-void update_flag(uint16_t value);
-uint16_t read_from_memory(uint16_t address);
-void write_to_memory(uint16_t address, uint16_t value);
-int read_program_code_into_memory(const char *path_to_code);
+uint16_t read_from_memory(struct vm *vm, uint16_t address);
+void write_to_memory(struct vm *vm, uint16_t address, uint16_t value);
+int read_program_code_into_memory(struct vm *vm, const char *path_to_code);
+int read_program_images(struct vm *vm, const char **paths, int count);
 
 uint16_t check_key();
 
+/* Ctrl-C: install_interrupt_handler makes SIGINT only set interrupted (and
+ * cut a wait for input short); the run loop calls vm_run in slices of at
+ * most RUN_SLICE instructions and calls exit_interrupted once it is set */
+#define RUN_SLICE (1 << 20)
+extern volatile sig_atomic_t interrupted;
 void handle_interrupt(int signal);
+void install_interrupt_handler(void);
+void exit_interrupted(void);
 void restore_input_buffering();
 void disable_input_buffering();
 
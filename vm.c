@@ -0,0 +1,217 @@
+/*
+ * Embedding API
+ *
+ * Thin layer over struct vm (utils.h) implementing garbageeater.h. vm_run
+ * hands the budget to the selected engine, which counts it down and returns
+ * when it runs out or a trap calls request_stop.
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "garbageeater.h"
+#include "utils.h"
+#include "decode.h"
+#include "threaded.h"
+#include "jit.h"
+#include "aot.h"
+#include "image.h"
+#include "trace.h"
+#include "watch.h"
+
+#define PC_INIT 0x3000
+
+static const char *stop_names[] = {"none", "halt", "limit", "input", "illegal", "watch"};
+static const char *engine_names[] = {"switch", "decoded", "threaded", "jit"};
+
+struct vm *vm_create(void)
+{
+  struct vm *vm = calloc(1, sizeof(struct vm));
+  if (!vm) {
+    return NULL;
+  }
+  // mapped rather than allocated so that watchpoints can protect its pages
+  vm->memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  if (vm->memory == MAP_FAILED) {
+    free(vm);
+    return NULL;
+  }
+  vm->memory_mapped = 1;
+  vm->reg[R_PC] = PC_INIT;
+  vm->flag_result = COND_UNSET;
+  vm->engine = VM_ENGINE_DECODED;
+  vm->idle_detection = 1;
+  vm->io = vm_stdio_io;
+  return vm;
+}
+
+void free_engine_caches(struct vm *vm)
+{
+  free(vm->decoded);
+  free_fusion(vm);
+  free(vm->threaded_code);
+  vm->decoded = NULL;
+  vm->threaded_code = NULL;
+  jit_free(vm);
+  aot_free(vm);
+  smc_reset(vm);
+}
+
+static void release_memory(struct vm *vm)
+{
+  if (vm->memory_mapped) {
+    munmap(vm->memory, MEMORY_BYTES);
+  }
+  else {
+    free(vm->memory);
+  }
+}
+
+void replace_memory(struct vm *vm, uint16_t *memory, int mapped)
+/*
+ Swap in a new 64K-word memory, either from malloc or a MEMORY_BYTES mmap,
+ and drop the engine caches built from the old one.
+*/
+{
+  release_memory(vm);
+  vm->memory = memory;
+  vm->memory_mapped = mapped;
+  watch_memory_replaced(vm);
+  free_engine_caches(vm);
+}
+
+void vm_destroy(struct vm *vm)
+{
+  if (!vm) {
+    return;
+  }
+  free_engine_caches(vm);
+  watch_clear(vm);
+  release_memory(vm);
+  free(vm->pending_input);
+  free(vm->profile);
+  trace_close(vm, NULL);
+  replay_free(vm);
+  free(vm);
+}
+
+void vm_set_io(struct vm *vm, const struct vm_io *io)
+{
+  vm->io = *io;
+}
+
+void vm_set_engine(struct vm *vm, enum vm_engine engine)
+{
+  vm->engine = engine < VM_ENGINE_COUNT ? engine : VM_ENGINE_DECODED;
+}
+
+void vm_set_strict(struct vm *vm, int strict)
+{
+  vm->strict = strict;
+}
+
+uint64_t vm_trap_calls(const struct vm *vm, uint8_t vector)
+{
+  return vm->trap_calls[vector];
+}
+
+int vm_load_image(struct vm *vm, const void *image, size_t size)
+/*
+ The first word of the image is the load address, the rest is copied to
+ consecutive addresses from there, both big-endian. Nothing is loaded from an
+ image that image_problem rejects.
+*/
+{
+  const uint8_t *bytes = image;
+  if (image_problem(bytes, size)) {
+    return 0;
+  }
+  uint16_t program_start = (bytes[0] << 8) | bytes[1];
+  load_big_endian_words(vm->memory + program_start, bytes + 2, (size - 2) / 2);
+
+  // the engine caches describe the old contents; rebuild them on next run
+  free_engine_caches(vm);
+  return 1;
+}
+
+enum vm_stop vm_run(struct vm *vm, uint64_t max_instructions)
+{
+  if (max_instructions > INT64_MAX) {
+    max_instructions = INT64_MAX;
+  }
+  vm->stop = VM_STOP_NONE;
+  vm->icount_base = vm_icount(vm) + max_instructions;
+  vm->remaining = max_instructions;
+
+  // the profiler and the tracer only live in the switch engine's loop, and
+  // only it keeps the PC in vm->reg for a watchpoint hit
+  int instrumented = vm->profile || vm->trace || vm->watch;
+  if (vm->aot && !instrumented) {
+    run_aot(vm);
+  }
+  else switch (instrumented ? VM_ENGINE_SWITCH : vm->engine) {
+    case VM_ENGINE_SWITCH:
+      run_switch(vm);
+      break;
+    case VM_ENGINE_THREADED:
+      run_threaded(vm);
+      break;
+    case VM_ENGINE_JIT:
+      run_jit(vm);
+      break;
+    default:
+      run_decoded(vm);
+      break;
+  }
+
+  if (vm->stop == VM_STOP_NONE) {
+    vm->stop = VM_STOP_LIMIT;
+  }
+  return vm->stop;
+}
+
+uint64_t vm_instructions(const struct vm *vm)
+{
+  return vm_icount(vm);
+}
+
+uint16_t vm_get_reg(const struct vm *vm, int index)
+{
+  if (index == R_F) {
+    return cond_flag_of(vm->flag_result);
+  }
+  return index >= 0 && index < R_SIZE ? vm->reg[index] : 0;
+}
+
+void vm_set_reg(struct vm *vm, int index, uint16_t value)
+{
+  if (index == R_F) {
+    // any result with the requested sign does, flags are derived lazily
+    vm->flag_result = value & F_N ? 0x8000 : value & F_Z ? 0 : value & F_P ? 1 : COND_UNSET;
+    vm->reg[R_F] = value;
+  }
+  else if (index >= 0 && index < R_SIZE) {
+    vm->reg[index] = value;
+  }
+}
+
+uint16_t vm_peek(const struct vm *vm, uint16_t address)
+{
+  return vm->memory[address];
+}
+
+void vm_poke(struct vm *vm, uint16_t address, uint16_t value)
+{
+  write_to_memory(vm, address, value);
+}
+
+const char *vm_stop_name(enum vm_stop stop)
+{
+  return stop <= VM_STOP_WATCH ? stop_names[stop] : "unknown";
+}
+
+const char *vm_engine_name(enum vm_engine engine)
+{
+  return engine < VM_ENGINE_COUNT ? engine_names[engine] : "unknown";
+}
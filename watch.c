@@ -0,0 +1,358 @@
+/*
+ * Memory watchpoints
+ *
+ * vm_create maps guest memory page-aligned, so each host page of it can be
+ * write-protected on its own. Arming the first watchpoint of a VM adds it
+ * to a small registry the signal handlers search by fault address; the
+ * handlers are installed once per process and pass on every fault that is
+ * not a store into a registered VM's memory.
+ *
+ * A store to a protected page: SIGSEGV copies the page as it is, makes it
+ * writable and sets the trap flag, so the store completes and raises
+ * SIGTRAP right after. That handler clears the flag, protects the page
+ * again and records a hit for every watched word on the page that the store
+ * hit or changed. The state in between is per thread, since each VM is run
+ * by one thread at a time but different VMs may fault concurrently.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "watch.h"
+#include "utils.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#define TRAP_FLAG 0x100
+#define WATCH_MAX_VMS 64
+#define WATCH_MIN_PAGE 4096
+#define WATCH_MAX_PAGES (MEMORY_BYTES / WATCH_MIN_PAGE)
+#define STEP_MAX_PAGES 2          /* one guest store touches one page; a host
+                                     copy may straddle two */
+
+struct watch
+{
+  uint64_t armed_words[(UINT16_MAX + 1) / 64];
+  uint32_t armed;
+  uint32_t page_armed[WATCH_MAX_PAGES];
+  uint16_t *before;         /* STEP_MAX_PAGES pages as they were */
+  struct watch_hit hits[WATCH_MAX_HITS];
+  size_t hit_count;
+  uint64_t missed;
+};
+
+static size_t page_bytes;
+static size_t page_words;
+static struct vm *registry[WATCH_MAX_VMS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t handlers_once = PTHREAD_ONCE_INIT;
+static int handlers_installed;
+static struct sigaction previous_segv, previous_trap;
+
+/* the store being single-stepped on this thread */
+static __thread struct
+{
+  struct vm *vm;
+  int count;
+  uint32_t pages[STEP_MAX_PAGES];
+  uint16_t word;            /* where the first fault was */
+} step __attribute__((tls_model("initial-exec")));
+
+static void *page_address(const struct vm *vm, uint32_t page)
+{
+  return (uint8_t *)vm->memory + (size_t)page * page_bytes;
+}
+
+static struct vm *vm_at(const void *address)
+/*
+ The registered VM whose memory holds address, or NULL. Runs in the
+ handler: no locks, only atomic loads of the registry.
+*/
+{
+  for (int i = 0; i < WATCH_MAX_VMS; i++) {
+    struct vm *vm = __atomic_load_n(&registry[i], __ATOMIC_ACQUIRE);
+    if (vm && (const uint8_t *)address >= (const uint8_t *)vm->memory
+        && (const uint8_t *)address < (const uint8_t *)vm->memory + MEMORY_BYTES) {
+      return vm;
+    }
+  }
+  return NULL;
+}
+
+static void pass_on(int sig, siginfo_t *info, void *context, const struct sigaction *previous)
+/*
+ Not ours: give it to the handler from before, or restore the default
+ action. A SIGSEGV then recurs as the instruction is retried; a SIGTRAP
+ would not, so it is raised again.
+*/
+{
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, context);
+    return;
+  }
+  if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(sig);
+    return;
+  }
+  signal(sig, SIG_DFL);
+  if (sig == SIGTRAP) {
+    raise(sig);
+  }
+}
+
+static void on_segv(int sig, siginfo_t *info, void *context)
+{
+  struct vm *vm = info->si_code == SEGV_ACCERR ? vm_at(info->si_addr) : NULL;
+  if (!vm || (step.vm && (step.vm != vm || step.count == STEP_MAX_PAGES))) {
+    pass_on(sig, info, context, &previous_segv);
+    return;
+  }
+  size_t offset = (uint8_t *)info->si_addr - (uint8_t *)vm->memory;
+  uint32_t page = offset / page_bytes;
+  if (!step.vm) {
+    step.vm = vm;
+    step.word = offset / sizeof(uint16_t);
+  }
+  memcpy(vm->watch->before + step.count * page_words, page_address(vm, page), page_bytes);
+  step.pages[step.count++] = page;
+  mprotect(page_address(vm, page), page_bytes, PROT_READ | PROT_WRITE);
+  ((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+static void record_hit(struct vm *vm, uint16_t address, uint16_t old_value,
+                       uint16_t new_value)
+{
+  struct watch *watch = vm->watch;
+  if (watch->hit_count < WATCH_MAX_HITS) {
+    struct watch_hit hit = {address, vm->reg[R_PC] - 1, old_value, new_value, vm_icount(vm)};
+    watch->hits[watch->hit_count++] = hit;
+  }
+  else {
+    watch->missed++;
+  }
+  request_stop(vm, VM_STOP_WATCH);
+}
+
+static void on_trap(int sig, siginfo_t *info, void *context)
+{
+  struct vm *vm = step.vm;
+  if (!vm) {
+    pass_on(sig, info, context, &previous_trap);
+    return;
+  }
+  ((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+  struct watch *watch = vm->watch;
+  for (int i = 0; i < step.count; i++) {
+    uint32_t first = step.pages[i] * page_words;
+    const uint16_t *before = watch->before + i * page_words;
+    for (uint32_t word = first; word < first + page_words; word += 64) {
+      uint64_t armed = watch->armed_words[word / 64];
+      while (armed) {
+        uint32_t address = word + __builtin_ctzll(armed);
+        armed &= armed - 1;
+        uint16_t old_value = before[address - first];
+        if (address == step.word || vm->memory[address] != old_value) {
+          record_hit(vm, address, old_value, vm->memory[address]);
+        }
+      }
+    }
+    mprotect(page_address(vm, step.pages[i]), page_bytes, PROT_READ);
+  }
+  step.vm = NULL;
+  step.count = 0;
+}
+
+static void install_handlers(void)
+{
+  page_bytes = sysconf(_SC_PAGESIZE);
+  if (page_bytes < WATCH_MIN_PAGE || page_bytes > MEMORY_BYTES) {
+    return;
+  }
+  page_words = page_bytes / sizeof(uint16_t);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO;
+  action.sa_sigaction = on_segv;
+  if (sigaction(SIGSEGV, &action, &previous_segv) != 0) {
+    return;
+  }
+  action.sa_sigaction = on_trap;
+  if (sigaction(SIGTRAP, &action, &previous_trap) != 0) {
+    sigaction(SIGSEGV, &previous_segv, NULL);
+    return;
+  }
+  handlers_installed = 1;
+}
+
+static int add_to_registry(struct vm *vm)
+{
+  int added = 0;
+  pthread_mutex_lock(&registry_lock);
+  for (int i = 0; i < WATCH_MAX_VMS && !added; i++) {
+    if (!registry[i]) {
+      __atomic_store_n(&registry[i], vm, __ATOMIC_RELEASE);
+      added = 1;
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return added;
+}
+
+static void remove_from_registry(struct vm *vm)
+{
+  pthread_mutex_lock(&registry_lock);
+  for (int i = 0; i < WATCH_MAX_VMS; i++) {
+    if (registry[i] == vm) {
+      __atomic_store_n(&registry[i], NULL, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static int protect_page(struct vm *vm, uint32_t page, int prot)
+{
+  return mprotect(page_address(vm, page), page_bytes, prot) == 0;
+}
+
+int watch_add(struct vm *vm, uint16_t address)
+{
+  pthread_once(&handlers_once, install_handlers);
+  if (!handlers_installed || !vm->memory_mapped) {
+    return 0;
+  }
+  struct watch *watch = vm->watch;
+  if (!watch) {
+    watch = calloc(1, sizeof(*watch));
+    if (!watch) {
+      return 0;
+    }
+    watch->before = malloc(STEP_MAX_PAGES * page_bytes);
+    if (!watch->before) {
+      free(watch);
+      return 0;
+    }
+    vm->watch = watch;
+    if (!add_to_registry(vm)) {
+      watch_clear(vm);
+      return 0;
+    }
+  }
+
+  uint64_t bit = 1ULL << (address % 64);
+  if (watch->armed_words[address / 64] & bit) {
+    return 1;
+  }
+  uint32_t page = address / page_words;
+  if (watch->page_armed[page] == 0 && !protect_page(vm, page, PROT_READ)) {
+    if (!watch->armed) {
+      watch_clear(vm);
+    }
+    return 0;
+  }
+  watch->page_armed[page]++;
+  watch->armed_words[address / 64] |= bit;
+  watch->armed++;
+  return 1;
+}
+
+void watch_remove(struct vm *vm, uint16_t address)
+{
+  struct watch *watch = vm->watch;
+  uint64_t bit = 1ULL << (address % 64);
+  if (!watch || !(watch->armed_words[address / 64] & bit)) {
+    return;
+  }
+  watch->armed_words[address / 64] &= ~bit;
+  uint32_t page = address / page_words;
+  if (--watch->page_armed[page] == 0) {
+    protect_page(vm, page, PROT_READ | PROT_WRITE);
+  }
+  if (--watch->armed == 0) {
+    watch_clear(vm);
+  }
+}
+
+void watch_clear(struct vm *vm)
+{
+  struct watch *watch = vm->watch;
+  if (!watch) {
+    return;
+  }
+  for (uint32_t page = 0; page < MEMORY_BYTES / page_bytes; page++) {
+    if (watch->page_armed[page]) {
+      protect_page(vm, page, PROT_READ | PROT_WRITE);
+    }
+  }
+  remove_from_registry(vm);
+  vm->watch = NULL;
+  free(watch->before);
+  free(watch);
+}
+
+void watch_memory_replaced(struct vm *vm)
+{
+  struct watch *watch = vm->watch;
+  if (!watch) {
+    return;
+  }
+  if (!vm->memory_mapped) {
+    // nothing to protect, and the old pages are gone already
+    memset(watch->page_armed, 0, sizeof(watch->page_armed));
+    watch_clear(vm);
+    return;
+  }
+  for (uint32_t page = 0; page < MEMORY_BYTES / page_bytes; page++) {
+    if (watch->page_armed[page]) {
+      protect_page(vm, page, PROT_READ);
+    }
+  }
+}
+
+size_t watch_take_hits(struct vm *vm, struct watch_hit *hits, size_t max, uint64_t *missed)
+{
+  struct watch *watch = vm->watch;
+  *missed = 0;
+  if (!watch) {
+    return 0;
+  }
+  size_t count = watch->hit_count < max ? watch->hit_count : max;
+  memcpy(hits, watch->hits, count * sizeof(*hits));
+  *missed = watch->missed + (watch->hit_count - count);
+  watch->hit_count = 0;
+  watch->missed = 0;
+  return count;
+}
+
+#else
+
+int watch_add(struct vm *vm, uint16_t address)
+{
+  return 0;
+}
+
+void watch_remove(struct vm *vm, uint16_t address)
+{
+}
+
+void watch_clear(struct vm *vm)
+{
+}
+
+void watch_memory_replaced(struct vm *vm)
+{
+}
+
+size_t watch_take_hits(struct vm *vm, struct watch_hit *hits, size_t max, uint64_t *missed)
+{
+  *missed = 0;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "garbageeater.h"
+
+/** memory watchpoints
+ * Guest memory is mapped with mmap, so a watchpoint write-protects the host
+ * page holding its word and costs nothing until that page is stored to;
+ * write_to_memory has no check for it. A store to a protected page faults:
+ * the SIGSEGV handler lets it through as a single step (x86-64 trap flag)
+ * and the SIGTRAP that follows protects the page again, compares the watched
+ * words on it with their old values and records a hit for each one stored
+ * to. A hit stops vm_run with VM_STOP_WATCH after the storing instruction.
+ * While any watchpoint is armed vm_run uses the switch engine, like the
+ * profiler, so the PC of a hit and the stop are exact; the other engines
+ * keep theirs in host registers. Faults outside guest memory go to the
+ * handlers that were installed before.
+ **/
+
+#define WATCH_MAX_HITS 16
+
+struct watch_hit
+{
+  uint16_t address;
+  uint16_t pc;              /* the instruction that stored */
+  uint16_t old_value;
+  uint16_t new_value;
+  uint64_t instruction;     /* its number in the run, counting from 1 */
+};
+
+/* returns 0 if watchpoints are not available: not x86-64 Linux, guest
+ * memory not page-mapped (a snapshot that had to be read), or no memory */
+int watch_add(struct vm *vm, uint16_t address);
+void watch_remove(struct vm *vm, uint16_t address);
+
+/* disarm every watchpoint; vm_destroy calls it */
+void watch_clear(struct vm *vm);
+
+/* guest memory was swapped (snapshot resume): protect the new pages, or
+ * drop the watchpoints if it is not mapped */
+void watch_memory_replaced(struct vm *vm);
+
+/* copy out and forget the hits recorded so far, oldest first; missed gets
+ * the number that did not fit in WATCH_MAX_HITS. Returns the count copied. */
+size_t watch_take_hits(struct vm *vm, struct watch_hit *hits, size_t max, uint64_t *missed);
+
+#endif